@@ -184,8 +184,8 @@ static int sendInitial(acctClient *a) {
 	for(struct resource *r = server.resTable; r; r = r->hh.next)
 		resourceToJSON(r, &a->response);
 
-	for(struct job *j = server.jobTable; j; j = j->hh.next)
-		jobToJSON(j, &a->response);
+	for(size_t i = 0; i < server.jobTable.count; i++)
+		jobToJSON(server.jobTable.jobs[i], &a->response);
 
 	/* Send a 'stream-start' message */
 	buff_t b;
@@ -209,6 +209,25 @@ static int sendInitial(acctClient *a) {
 	return 0;
 }
 
+/* Open the journal noting whether it's a binary journal */
+static FILE *openJournal(acctClient *a, const char *journal) {
+	FILE *f = fopen(journal, "rb");
+
+	if (f == NULL)
+		error_die("Failed to open journal file '%s': %s", journal, strerror(errno));
+
+	off_t header_size = journalReadHeader(fileno(f), NULL);
+
+	a->binary = header_size > 0;
+
+	if (header_size && fseek(f, header_size, SEEK_SET) != 0)
+		error_die("Failed to skip journal header in '%s': %s", journal, strerror(errno));
+
+	return f;
+}
+
+static int checkNextJournal(acctClient *a);
+
 /* Locate to 'id' */
 int locateJournal(acctClient *a, char *id) {
 	print_msg_debug("LOCATING Journal to : %s\n", id);
@@ -221,13 +240,13 @@ int locateJournal(acctClient *a, char *id) {
 	*sep = '\0';
 	sep++;
 
-	if (strlen(id) > 8) //YYYYMMDD
+	if (strlen(id) >= sizeof(a->datetime)) //YYYYMMDD[.NNN]
 		return 1;
 
 	strcpy(a->datetime, id);
 
 	while(*id) {
-		if (!isdigit(*id))
+		if (!isdigit(*id) && *id != '.')
 			return 1;
 
 		id++;
@@ -238,10 +257,19 @@ int locateJournal(acctClient *a, char *id) {
 	char journal[PATH_MAX];
 	sprintf(journal, "%s/journal.%s", server.state_dir, a->datetime);
 
-	a->journal = fopen(journal, "rb");
+	/* The journal might have been cleaned up after a checkpoint,
+	 * carry on from the oldest journal we still have after it */
+	if (access(journal, F_OK) != 0 && errno == ENOENT) {
+		print_msg(JERS_LOG_WARNING, "Journal %s is no longer available, resuming from the next journal", journal);
+		a->journal = NULL;
 
-	if (a->journal == NULL)
-		error_die("Failed to open journal file '%s': %s", journal, strerror(errno));
+		if (checkNextJournal(a) == 0)
+			return 1;
+
+		return 0;
+	}
+
+	a->journal = openJournal(a, journal);
 
 	/* Now locate to the requested record */
 	char *record = NULL;
@@ -250,12 +278,24 @@ int locateJournal(acctClient *a, char *id) {
 
 	off_t current = 0;
 
-	while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
-		if (*record == '\0' || *record == '$')
-			break;
+	if (a->binary) {
+		struct journalRecordInfo r;
+		off_t pos = ftell(a->journal);
 
-		if (++current == a->record)
-			break;
+		while (current < a->record && journalReadRecord(a->journal, &record, &record_size, &r) > 0 && r.type != JOURNAL_RECORD_END) {
+			pos = ftell(a->journal);
+			current++;
+		}
+
+		fseek(a->journal, pos, SEEK_SET);
+	} else {
+		while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
+			if (*record == '\0' || *record == '$')
+				break;
+
+			if (++current == a->record)
+				break;
+		}
 	}
 
 	free(record);
@@ -338,6 +378,53 @@ static void acctShutdownHandler(int signo) {
 	return;
 }
 
+/* Go back to the end of the last record read, discarding anything
+ * buffered past it so we read the next record once it's been written */
+static void rewindJournal(acctClient *a, off_t pos) {
+	fseek(a->journal, pos, SEEK_SET);
+	fflush(a->journal);
+}
+
+/* Check if we need to switch to a new journal file.
+ * Returns 1 if a new journal has been opened */
+static int checkNextJournal(acctClient *a) {
+	/* Get a list of all journal files, find the first one after the one we
+	 * currently have open. It might have been removed if it was cleaned up */
+	char current_journal[PATH_MAX];
+	int opened = 0;
+	sprintf(current_journal, "%s/journal.%s", server.state_dir, a->datetime);
+
+	glob_t glob_buff;
+
+	if (globJournals(&glob_buff) == 0) {
+		size_t i = 0;
+		for (i = 0; i < glob_buff.gl_pathc; i++) {
+			if (cmpJournalName(current_journal, glob_buff.gl_pathv[i]) < 0)
+				break;
+		}
+
+		if (i < glob_buff.gl_pathc) {
+			/* Have a new journal to open */
+			if (a->journal)
+				fclose(a->journal);
+
+			a->journal = openJournal(a, glob_buff.gl_pathv[i]);
+
+			/* Opened a new journal. Reset the current stats */
+			a->record = 0;
+			char *name = strrchr(glob_buff.gl_pathv[i], '/') + strlen("/journal.");
+			snprintf(a->datetime, sizeof(a->datetime), "%s", name);
+
+			print_msg_info("Switched to new journal %s\n", a->datetime);
+			opened = 1;
+		}
+
+		globfree(&glob_buff);
+	}
+
+	return opened;
+}
+
 /* Does not return */
 static void acctMain(acctClient *a) {
 	setproctitle("jersd_acct[%d]", a->connection.socket);
@@ -418,73 +505,71 @@ static void acctMain(acctClient *a) {
 
 		current_pos = ftell(a->journal);
 
-		while ((record_len = getline(&record, &record_size, a->journal)) != -1) {
-			if (*record == '\0' || *record == '$') {
-				fseek(a->journal, current_pos, SEEK_SET);
-
-				/* Check if we need to switch to a new journal file */
-				/* Get a list of all journal files, find the one we currently have open */
-				char glob_pattern[PATH_MAX];
-				char current_journal[PATH_MAX];
-				sprintf(glob_pattern, "%s/journal.*", server.state_dir);
-				sprintf(current_journal, "%s/journal.%s", server.state_dir, a->datetime);
-
-				glob_t glob_buff;
-
-				if (glob(glob_pattern, 0, NULL, &glob_buff) == 0) {
-					size_t i = 0;
-					for (i = 0; i < glob_buff.gl_pathc; i++) {
-						if (strcmp(current_journal, glob_buff.gl_pathv[i]) == 0) {
-							i++;
-							break;
-						}
-					}
-
-					if (i < glob_buff.gl_pathc) {
-						/* Have a new journal to open */
-						FILE *new_journal = fopen(glob_buff.gl_pathv[i], "rb");
-
-						if (new_journal == NULL)
-							error_die("Failed to open journal file '%s': %s", glob_buff.gl_pathv[i], strerror(errno));
-
-						/* Opened a new journal. Reset the current stats */
-						fclose(a->journal);
-						a->record = 0;
-						char *dot = strchr(glob_buff.gl_pathv[i], '.');
-						dot++;
-						strcpy(a->datetime, dot);
-
-						a->journal = new_journal;
-						current_pos = 0;
+		while (1) {
+			char timestamp[64];
+			char command[65];
+			uid_t uid;
+			jobid_t jobid;
+			const char *message;
+			size_t message_len;
+
+			if (a->binary) {
+				struct journalRecordInfo r;
+				int rc = journalReadRecord(a->journal, &record, &record_size, &r);
 
-						print_msg_info("Switched to new journal %s\n", a->datetime);
-					}
+				/* Caught up, or the next record hasn't been completely written yet */
+				if (rc <= 0 || r.type == JOURNAL_RECORD_END) {
+					rewindJournal(a, current_pos);
 
-					globfree(&glob_buff);
+					if (checkNextJournal(a))
+						current_pos = ftell(a->journal);
+
+					break;
 				}
 
-				break;
-			}
+				current_pos = ftell(a->journal);
 
-			current_pos = ftell(a->journal);
+				if (r.type != JOURNAL_RECORD_CMD)
+					continue;
 
-			if (record[record_len - 1] == '\n')
-				record[record_len - 1] = '\0';
+				snprintf(timestamp, sizeof(timestamp), "%ld.%03d", r.time, r.time_ms);
+				snprintf(command, sizeof(command), "%.*s", (int)r.cmd_len, r.cmd);
+				uid = r.uid;
+				jobid = r.jobid;
+				message = r.msg;
+				message_len = r.msg_len;
+			} else {
+				if ((record_len = getline(&record, &record_size, a->journal)) == -1)
+					break;
 
-			a->record++;
+				if (*record == '\0' || *record == '$') {
+					rewindJournal(a, current_pos);
 
-			/* Load this message */
-			char timestamp[64];
-			int64_t revision;
-			char command[64];
-			uid_t uid;
-			jobid_t jobid;
-			int msg_offset;
+					if (checkNextJournal(a))
+						current_pos = 0;
+
+					break;
+				}
 
-			int field_count = sscanf(record, "%*c%64s\t%d\t%64s\t%u\t%ld\t%n", timestamp, (int *)&uid, command, &jobid, &revision, &msg_offset);
+				current_pos = ftell(a->journal);
 
-			if (field_count != 5)
-				error_die("Failed to load 5 required fields from message");
+				if (record[record_len - 1] == '\n')
+					record[record_len - 1] = '\0';
+
+				/* Load this message */
+				int64_t revision;
+				int msg_offset;
+
+				int field_count = sscanf(record, "%*c%64s\t%d\t%64s\t%u\t%ld\t%n", timestamp, (int *)&uid, command, &jobid, &revision, &msg_offset);
+
+				if (field_count != 5)
+					error_die("Failed to load 5 required fields from message");
+
+				message = record + msg_offset;
+				message_len = strlen(message);
+			}
+
+			a->record++;
 
 			if (strcmp(command, "REPLAY_COMPLETE") == 0)
 				continue;
@@ -504,7 +589,7 @@ static void acctMain(acctClient *a) {
 				JSONAddInt(&b, JOBID, jobid);
 
 			buffAdd(&b, "\"MESSAGE\":", 10);
-			buffAdd(&b, record + msg_offset, strlen(record + msg_offset));
+			buffAdd(&b, message, message_len);
 
 			JSONEndObject(&b);
 			JSONEnd(&b);
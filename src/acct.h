@@ -56,8 +56,9 @@ typedef struct _acctClient {
 	char *id;
 
 	FILE *journal;
+	int binary; // The journal is in the binary format
 	off_t record;
-	char datetime[10]; // YYYYMMDD
+	char datetime[16]; // YYYYMMDD[.NNN]
 
 	int initalised;
 
@@ -36,10 +36,13 @@
 #include "agent.h"
 #include "logging.h"
 
+#include <utlist.h>
+
 void markJobsUnknown(agent *a);
 void markQueueStopped(agent *a);
 
 agent * agentList = NULL;
+agent * readyAgentList = NULL;
 
 void addAgent(agent * a) {
 	if (agentList) {
@@ -51,6 +54,8 @@ void addAgent(agent * a) {
 }
 
 void removeAgent(agent * a) {
+	clearAgentReady(a);
+
 	if (a->next)
 		a->next->prev = a->prev;
 
@@ -155,9 +160,28 @@ int handleAgentDisconnect(agent * a) {
 
 	buffFree(&a->requests);
 	buffFree(&a->responses);
+	free_message(&a->msg);
+	clearAgentReady(a);
 	return 0;
 }
 
+/* Add an agent to the list of agents that have data for us to look at */
+void markAgentReady(agent * a) {
+	if (a->ready)
+		return;
+
+	DL_APPEND2(readyAgentList, a, ready_prev, ready_next);
+	a->ready = 1;
+}
+
+void clearAgentReady(agent * a) {
+	if (!a->ready)
+		return;
+
+	DL_DELETE2(readyAgentList, a, ready_prev, ready_next);
+	a->ready = 0;
+}
+
 /* Handle read activity on a agent socket */
 int handleAgentRead(agent * a) {
 	int len = 0;
@@ -180,6 +204,7 @@ int handleAgentRead(agent * a) {
 	}
 
 	a->requests.used += len;
+	markAgentReady(a);
 
 	return 0;
 }
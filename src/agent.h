@@ -49,6 +49,7 @@ typedef struct _agent {
 	char * nonce;
 	int recon;
 	int logged_in;
+	int version; // Sent with the agent's login
 
 	/* Requests to send to this agent */
 	buff_t requests;
@@ -59,9 +60,15 @@ typedef struct _agent {
 
 	struct _agent * next;
 	struct _agent * prev;
+
+	/* Agents with data waiting to be processed */
+	int ready;
+	struct _agent * ready_next;
+	struct _agent * ready_prev;
 } agent;
 
 extern agent *agentList;
+extern agent *readyAgentList;
 
 int handleAgentConnection(struct connectionType * connection);
 int handleAgentDisconnect(agent *a);
@@ -71,4 +78,7 @@ int handleAgentWrite(agent *a);
 void addAgent(agent *a);
 void removeAgent(agent *a);
 
+void markAgentReady(agent *a);
+void clearAgentReady(agent *a);
+
 #endif
\ No newline at end of file
@@ -188,15 +188,11 @@ static int jersConnect(void) {
 }
 
 /* Block until the entire request is sent */
-static int sendRequest(buff_t *b) {
+static int sendRequestBuffer(buff_t *b) {
 	size_t total_sent = 0;
 	size_t length;
 	char *request;
 
-	JSONEndObject(b);
-	JSONEndObject(b);
-	JSONEnd(b);
-
 	length = b->used;
 	request = b->data;
 
@@ -218,12 +214,24 @@ static int sendRequest(buff_t *b) {
 	return 0;
 }
 
+static int sendRequest(buff_t *b) {
+	JSONEndObject(b);
+	JSONEndObject(b);
+	JSONEnd(b);
+
+	return sendRequestBuffer(b);
+}
+
 /* Block until we read a full response */
 static int readResponse(void) {
-	size_t checked = 0;
+	size_t checked = response.used;
 	char *nl = NULL;
 
-	while (1) {
+	/* A streamed response might have already delivered the next message */
+	if (response.used)
+		nl = memchr(response.data, '\n', response.used);
+
+	while (nl == NULL) {
 		/* Allocate more memory if we might need it */
 		if (buffResize(&response, 0) != 0) {
 			setJersErrno(JERS_ERR_MEM, NULL);
@@ -250,21 +258,11 @@ static int readResponse(void) {
 
 		/* Got a full message yet? */
 		nl = memchr(response.data + checked, '\n', bytes_read);
-
-		if (nl != NULL) {
-			*nl = '\0';
-			nl++;
-			break;
-		}
-
 		checked = response.used;
 	}
 
-	if (nl == NULL) {
-		setJersErrno(JERS_ERR_ERECV, NULL);
-		fprintf(stderr, "Failed to read response from jers daemon\n");
-		return 1;
-	}
+	*nl = '\0';
+	nl++;
 
 	if (load_message(response.data, &msg)) {
 		setJersErrno(JERS_ERR_INVRESP, NULL);
@@ -338,6 +336,7 @@ JERS_EXPORT void jersFreeJobInfo (jersJobInfo * info) {
 			free(job->envs[j]);
 
 		free(job->envs);
+		free(job->env_profile);
 	}
 
 	free(info->jobs);
@@ -433,6 +432,7 @@ static int deserialize_jersJob(msg_item * item, jersJob *j) {
 			case JOBPID    : j->pid = getNumberField(&item->fields[i]); break;
 			case REVISION  : j->revision = getNumberField(&item->fields[i]); break;
 			case ENVS      : j->env_count = getStringArrayField(&item->fields[i], &j->envs); break;
+			case ENVPROFILE: j->env_profile = getStringField(&item->fields[i]); break;
 
 			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[i].name); break;
 		}
@@ -441,6 +441,88 @@ static int deserialize_jersJob(msg_item * item, jersJob *j) {
 	return 0;
 }
 
+/* Read a response containing a list of jobs. If end is provided,
+ * it's set if this was the last chunk of a streamed response */
+
+static int readJobChunk(jersJobInfo *job_info, char *end) {
+	job_info->count = 0;
+	job_info->jobs = NULL;
+
+	if (readResponse())
+		return 1;
+
+	if (msg.item_count) {
+		job_info->jobs = calloc(sizeof(jersJob) *  msg.item_count, 1);
+
+		for (int64_t i = 0; i < msg.item_count; i++) {
+			deserialize_jersJob(&msg.items[i], &job_info->jobs[i]);
+		}
+	}
+
+	job_info->count = msg.item_count;
+
+	if (end)
+		*end = msg.stream_end;
+
+	free_message(&msg);
+
+	return 0;
+}
+
+static int readJobInfo(jersJobInfo *job_info) {
+	return readJobChunk(job_info, NULL);
+}
+
+/* Serialise the criteria of a job filter */
+
+static void serializeJobFilter(buff_t *b, const jersJobFilter *filter) {
+	if (filter->filter_fields == 0)
+		return;
+
+	if (filter->filter_fields & JERS_FILTER_JOBNAME)
+		JSONAddString(b, JOBNAME, filter->filters.job_name);
+
+	if (filter->filter_fields & JERS_FILTER_QUEUE)
+		JSONAddString(b, QUEUENAME, filter->filters.queue_name);
+
+	if (filter->filter_fields & JERS_FILTER_STATE)
+		JSONAddInt(b, STATE, filter->filters.state);
+
+	if (filter->filter_fields & JERS_FILTER_TAGS)
+		JSONAddMap(b, TAGS, filter->filters.tag_count, (key_val_t *)filter->filters.tags);
+
+	if (filter->filter_fields & JERS_FILTER_RESOURCES)
+		JSONAddStringArray(b, RESOURCES, filter->filters.res_count, filter->filters.resources);
+
+	if (filter->filter_fields & JERS_FILTER_UID)
+		JSONAddInt(b, UID, filter->filters.uid);
+
+	if (filter->filter_fields & JERS_FILTER_SUBMITTER)
+		JSONAddInt(b, SUBMITTER, filter->filters.submitter);
+
+	if (filter->filter_fields & JERS_FILTER_BEFORE) {
+		if (filter->filters.before.added)
+			JSONAddInt(b, BEFORE_ADDED, filter->filters.before.added);
+
+		if (filter->filters.before.started)
+			JSONAddInt(b, BEFORE_STARTED, filter->filters.before.started);
+
+		if (filter->filters.before.finished)
+			JSONAddInt(b, BEFORE_FINISHED, filter->filters.before.finished);
+	}
+
+	if (filter->filter_fields & JERS_FILTER_AFTER) {
+		if (filter->filters.after.added)
+			JSONAddInt(b, AFTER_ADDED, filter->filters.after.added);
+
+		if (filter->filters.after.started)
+			JSONAddInt(b, AFTER_STARTED, filter->filters.after.started);
+
+		if (filter->filters.after.finished)
+			JSONAddInt(b, AFTER_FINISHED, filter->filters.after.finished);
+	}
+}
+
 JERS_EXPORT int jersGetJob(jobid_t jobid, const jersJobFilter * filter, jersJobInfo * job_info) {
 	if (jersInitAPI(NULL))
 		return 1;
@@ -455,75 +537,130 @@ JERS_EXPORT int jersGetJob(jobid_t jobid, const jersJobFilter * filter, jersJobI
 	if (jobid) {
 		JSONAddInt(&b, JOBID, jobid);
 	} else if (filter) {
-		if (filter->filter_fields) {
+		serializeJobFilter(&b, filter);
+
+		if (filter->return_fields)
+			JSONAddInt(&b, RETFIELDS, filter->return_fields);
+	}
+
+	if (sendRequest(&b))
+		return 1;
+
+	return readJobInfo(job_info);
+}
+
+/* Get a page of up to limit jobs matching the filter, in jobid order, starting after the cursor.
+ * Pass the jobid of the last job returned as the cursor to get the next page */
+
+JERS_EXPORT int jersGetJobPage(const jersJobFilter *filter, jobid_t cursor, int64_t limit, jersJobInfo *job_info) {
+	if (jersInitAPI(NULL))
+		return 1;
 
-			if (filter->filter_fields & JERS_FILTER_JOBNAME)
-				JSONAddString(&b, JOBNAME, filter->filters.job_name);
+	job_info->count = 0;
+	job_info->jobs = NULL;
 
-			if (filter->filter_fields & JERS_FILTER_QUEUE)
-				JSONAddString(&b, QUEUENAME, filter->filters.queue_name);
+	if (limit <= 0) {
+		setJersErrno(JERS_ERR_INVARG, "Invalid limit provided");
+		return 1;
+	}
 
-			if (filter->filter_fields & JERS_FILTER_STATE)
-				JSONAddInt(&b, STATE, filter->filters.state);
+	buff_t b;
+	initRequest(&b, CMD_GET_JOB, 1);
 
-			if (filter->filter_fields & JERS_FILTER_TAGS)
-				JSONAddMap(&b, TAGS, filter->filters.tag_count, (key_val_t *)filter->filters.tags);
+	if (filter) {
+		serializeJobFilter(&b, filter);
 
-			if (filter->filter_fields & JERS_FILTER_RESOURCES)
-				JSONAddStringArray(&b, RESOURCES, filter->filters.res_count, filter->filters.resources);
+		if (filter->return_fields)
+			JSONAddInt(&b, RETFIELDS, filter->return_fields);
+	}
 
-			if (filter->filter_fields & JERS_FILTER_UID)
-				JSONAddInt(&b, UID, filter->filters.uid);
+	JSONAddInt(&b, LIMIT, limit);
+	JSONAddInt(&b, CURSOR, cursor);
 
-			if (filter->filter_fields & JERS_FILTER_SUBMITTER)
-				JSONAddInt(&b, SUBMITTER, filter->filters.submitter);
+	if (sendRequest(&b))
+		return 1;
 
-			if (filter->filter_fields & JERS_FILTER_BEFORE) {
-				if (filter->filters.before.added)
-					JSONAddInt(&b, BEFORE_ADDED, filter->filters.before.added);
+	return readJobInfo(job_info);
+}
 
-				if (filter->filters.before.started)
-					JSONAddInt(&b, BEFORE_STARTED, filter->filters.before.started);
+/* Stream all the jobs matching the filter, chunk_size jobs at a time, so neither
+ * the daemon or the caller need to hold the whole result at once.
+ * No other requests can be made until the iterator is freed */
 
-				if (filter->filters.before.finished)
-					JSONAddInt(&b, BEFORE_FINISHED, filter->filters.before.finished);
-			}
+JERS_EXPORT int jersGetJobIterator(const jersJobFilter *filter, int64_t chunk_size, jersJobIterator *it) {
+	memset(it, 0, sizeof(jersJobIterator));
 
-			if (filter->filter_fields & JERS_FILTER_AFTER) {
-				if (filter->filters.before.added)
-					JSONAddInt(&b, AFTER_ADDED, filter->filters.after.added);
+	if (jersInitAPI(NULL))
+		return 1;
 
-				if (filter->filters.before.started)
-					JSONAddInt(&b, AFTER_STARTED, filter->filters.after.started);
+	if (chunk_size < 0) {
+		setJersErrno(JERS_ERR_INVARG, "Invalid chunk size provided");
+		return 1;
+	}
 
-				if (filter->filters.before.finished)
-					JSONAddInt(&b, AFTER_FINISHED, filter->filters.after.finished);
-			}
-		}
+	buff_t b;
+	initRequest(&b, CMD_GET_JOB, 1);
+
+	if (filter) {
+		serializeJobFilter(&b, filter);
 
 		if (filter->return_fields)
 			JSONAddInt(&b, RETFIELDS, filter->return_fields);
 	}
 
-	if (sendRequest(&b))
-		return 1;
+	if (chunk_size)
+		JSONAddInt(&b, LIMIT, chunk_size);
 
-	if (readResponse())
+	JSONAddBool(&b, STREAM, 1);
+
+	if (sendRequest(&b)) {
+		it->done = 1;
 		return 1;
+	}
 
-	if (msg.item_count) {
-		job_info->jobs = calloc(sizeof(jersJob) *  msg.item_count, 1);
+	return 0;
+}
 
-		for (int64_t i = 0; i < msg.item_count; i++) {
-			deserialize_jersJob(&msg.items[i], &job_info->jobs[i]);
+/* Returns the next job, or NULL once all the jobs have been returned or on error,
+ * with jers_errno set to JERS_ERR_OK if there were no more jobs.
+ * The job is only valid until the next call */
+
+JERS_EXPORT jersJob * jersNextJob(jersJobIterator *it) {
+	while (it->pos >= it->info.count) {
+		char end = 0;
+
+		if (it->done) {
+			if (it->end)
+				setJersErrno(JERS_ERR_OK, NULL);
+
+			return NULL;
+		}
+
+		jersFreeJobInfo(&it->info);
+		it->pos = 0;
+
+		if (readJobChunk(&it->info, &end)) {
+			it->done = 1;
+			return NULL;
 		}
+
+		/* The last chunk is flagged, any other chunk might be empty
+		 * if the daemon had to yield before it found a match */
+		if (end)
+			it->done = it->end = 1;
 	}
 
-	job_info->count = msg.item_count;
+	return &it->info.jobs[it->pos++];
+}
 
-	free_message(&msg);
+JERS_EXPORT void jersFreeJobIterator(jersJobIterator *it) {
+	jersFreeJobInfo(&it->info);
 
-	return 0;
+	/* Drop the connection if the rest of the stream is still to come */
+	if (!it->done)
+		jersFinish();
+
+	memset(it, 0, sizeof(jersJobIterator));
 }
 
 
@@ -555,87 +692,101 @@ JERS_EXPORT void jersInitJobAdd(jersJobAdd * j) {
 	j->env_count = UNSET_64;
 }
 
-JERS_EXPORT jobid_t jersAddJob(const jersJobAdd * j) {
-	jobid_t new_jobid = 0;
-
-	if (jersInitAPI(NULL))
-		return 0;
-
-	/* Sanity Checks */
+static int checkJobAdd(const jersJobAdd *j) {
 	if (!j) {
 		setJersErrno(JERS_ERR_INVARG, NULL);
-		return 0;
+		return 1;
 	}
 
 	if (j->argc <=0 || j->argv == NULL) {
 		setJersErrno(JERS_ERR_INVARG, "argc/argv must be populated");
-		return 0;
+		return 1;
 	}
 
 	if (j->env_count > 0 && j->envs == NULL) {
 		setJersErrno(JERS_ERR_INVARG, "env_count populated, but env not passed");
-		return 0;
+		return 1;
 	}
 
-	buff_t b;
-	initRequest(&b, CMD_ADD_JOB, 1);
+	return 0;
+}
 
-	JSONAddStringArray(&b, ARGS, j->argc, j->argv);
+static void serializeJobAdd(buff_t *b, const jersJobAdd *j) {
+	JSONAddStringArray(b, ARGS, j->argc, j->argv);
 
 	if (j->name)
-		JSONAddString(&b, JOBNAME, j->name);
+		JSONAddString(b, JOBNAME, j->name);
 
 	if (j->queue)
-		JSONAddString(&b, QUEUENAME, j->queue);
+		JSONAddString(b, QUEUENAME, j->queue);
 
 	if (j->uid > 0)
-		JSONAddInt(&b, UID, j->uid);
+		JSONAddInt(b, UID, j->uid);
 
 	if (j->shell)
-		JSONAddString(&b, SHELL, j->shell);
+		JSONAddString(b, SHELL, j->shell);
 
 	if (j->priority != UNSET_32)
-		JSONAddInt(&b, PRIORITY, j->priority);
+		JSONAddInt(b, PRIORITY, j->priority);
 
 	if (j->hold)
-		JSONAddBool(&b, HOLD, 1);
+		JSONAddBool(b, HOLD, 1);
 
 	if (j->nice)
-		JSONAddInt(&b, NICE, j->nice);
+		JSONAddInt(b, NICE, j->nice);
 
 	if (j->tag_count)
-		JSONAddMap(&b, TAGS, j->tag_count, (key_val_t *)j->tags);
+		JSONAddMap(b, TAGS, j->tag_count, (key_val_t *)j->tags);
 
 	if (j->res_count)
-		JSONAddStringArray(&b, RESOURCES, j->res_count, j->resources);
+		JSONAddStringArray(b, RESOURCES, j->res_count, j->resources);
 
 	if (j->env_count != UNSET_64)
-		JSONAddStringArray(&b, ENVS, j->env_count, j->envs);
+		JSONAddStringArray(b, ENVS, j->env_count, j->envs);
+
+	if (j->env_profile)
+		JSONAddString(b, ENVPROFILE, j->env_profile);
 
 	if (j->jobid)
-		JSONAddInt(&b, JOBID, j->jobid);
+		JSONAddInt(b, JOBID, j->jobid);
 
 	if (j->wrapper) {
-		JSONAddString(&b, WRAPPER, j->wrapper);
+		JSONAddString(b, WRAPPER, j->wrapper);
 	} else {
 		if (j->pre_cmd)
-			JSONAddString(&b, PRECMD, j->pre_cmd);
+			JSONAddString(b, PRECMD, j->pre_cmd);
 
 		if (j->post_cmd)
-			JSONAddString(&b, POSTCMD, j->post_cmd);
+			JSONAddString(b, POSTCMD, j->post_cmd);
 	}
 
 	if (j->stdout)
-		JSONAddString(&b, STDOUT, j->stdout);
+		JSONAddString(b, STDOUT, j->stdout);
 
 	if (j->stderr)
-		JSONAddString(&b, STDERR, j->stderr);
+		JSONAddString(b, STDERR, j->stderr);
 
 	if (j->defer_time != -1)
-		JSONAddInt(&b, DEFERTIME, j->defer_time);
+		JSONAddInt(b, DEFERTIME, j->defer_time);
 
 	if (j->flags)
-		JSONAddInt(&b, FLAGS, j->flags);
+		JSONAddInt(b, FLAGS, j->flags);
+}
+
+JERS_EXPORT jobid_t jersAddJob(const jersJobAdd * j) {
+	jobid_t new_jobid = 0;
+
+	if (jersInitAPI(NULL))
+		return 0;
+
+	/* Sanity Checks */
+	if (checkJobAdd(j))
+		return 0;
+
+	buff_t b;
+	initRequest(&b, CMD_ADD_JOB, 1);
+
+	serializeJobAdd(&b, j);
 
 	if (sendRequest(&b))
 		return 0;
@@ -655,6 +806,63 @@ JERS_EXPORT jobid_t jersAddJob(const jersJobAdd * j) {
 	return new_jobid;
 }
 
+/* Submit count jobs in a single request. Either all the jobs are added, or none are.
+ * On success, the jobid of each job is returned in the jobids array, in the same order */
+
+JERS_EXPORT int jersAddJobs(int64_t count, const jersJobAdd *jobs, jobid_t *jobids) {
+	if (jersInitAPI(NULL))
+		return 1;
+
+	if (count <= 0 || jobs == NULL || jobids == NULL) {
+		setJersErrno(JERS_ERR_INVARG, NULL);
+		return 1;
+	}
+
+	for (int64_t i = 0; i < count; i++) {
+		if (checkJobAdd(&jobs[i]))
+			return 1;
+	}
+
+	buff_t b;
+	initNamedResponse(&b, CMD_ADD_JOBS, CONST_STRLEN(CMD_ADD_JOBS), 1, NULL);
+
+	for (int64_t i = 0; i < count; i++) {
+		JSONStartObject(&b, NULL, 0);
+		serializeJobAdd(&b, &jobs[i]);
+		JSONEndObject(&b);
+	}
+
+	JSONEndArray(&b);
+	JSONEndObject(&b);
+	JSONEnd(&b);
+
+	if (sendRequestBuffer(&b))
+		return 1;
+
+	if (readResponse())
+		return 1;
+
+	/* Should have a JOBID returned for each job */
+	if (msg.item_count != count) {
+		setJersErrno(JERS_ERR_INVRESP, NULL);
+		free_message(&msg);
+		return 1;
+	}
+
+	for (int64_t i = 0; i < count; i++) {
+		if (msg.items[i].field_count != 1 || msg.items[i].fields[0].number != JOBID) {
+			setJersErrno(JERS_ERR_INVRESP, NULL);
+			free_message(&msg);
+			return 1;
+		}
+
+		jobids[i] = getNumberField(&msg.items[i].fields[0]);
+	}
+
+	free_message(&msg);
+	return 0;
+}
+
 JERS_EXPORT void jersInitJobMod(jersJobMod *j) {
 	memset(j, 0, sizeof(jersJobMod));
 	j->nice = UNSET_32;
@@ -666,52 +874,60 @@ JERS_EXPORT void jersInitJobMod(jersJobMod *j) {
 	j->res_count = UNSET_64;
 }
 
-JERS_EXPORT int jersModJob(const jersJobMod *j) {
-	if (jersInitAPI(NULL))
-		return 1;
-
-	if (j->jobid == 0 ) {
-		setJersErrno(JERS_ERR_INVARG, "No jobid provided");
-		return 1;
-	}
-
-	buff_t b;
-	initRequest(&b, CMD_MOD_JOB, 1);
-
-	JSONAddInt(&b, JOBID, j->jobid);
+/* Serialise the fields being modified */
 
+static void serializeJobMod(buff_t *b, const jersJobMod *j) {
 	if (j->name)
-		JSONAddString(&b, JOBNAME, j->name);
+		JSONAddString(b, JOBNAME, j->name);
 
 	if (j->queue)
-		JSONAddString(&b, QUEUENAME, j->queue);
+		JSONAddString(b, QUEUENAME, j->queue);
 
 	if (j->defer_time != UNSET_TIME_T)
-		JSONAddInt(&b, DEFERTIME, j->defer_time);
+		JSONAddInt(b, DEFERTIME, j->defer_time);
 
 	if (j->restart)
-		JSONAddBool(&b, RESTART, 1);
+		JSONAddBool(b, RESTART, 1);
 
 	if (j->nice != UNSET_32)
-		JSONAddInt(&b, NICE, j->nice);
+		JSONAddInt(b, NICE, j->nice);
 
 	if (j->priority != UNSET_32)
-		JSONAddInt(&b, PRIORITY, j->priority);
+		JSONAddInt(b, PRIORITY, j->priority);
 
 	if (j->hold != UNSET_8)
-		JSONAddBool(&b, HOLD, j->hold);
+		JSONAddBool(b, HOLD, j->hold);
 
 	if (j->env_count != UNSET_64)
-		JSONAddStringArray(&b, ENVS, j->env_count, j->envs);
+		JSONAddStringArray(b, ENVS, j->env_count, j->envs);
+
+	if (j->env_profile)
+		JSONAddString(b, ENVPROFILE, j->env_profile);
 
 	if (j->tag_count != UNSET_64)
-		JSONAddMap(&b, TAGS, j->tag_count, (key_val_t *)j->tags);
+		JSONAddMap(b, TAGS, j->tag_count, (key_val_t *)j->tags);
 
 	if (j->res_count != UNSET_64)
-		JSONAddStringArray(&b, RESOURCES, j->res_count, j->resources);
+		JSONAddStringArray(b, RESOURCES, j->res_count, j->resources);
 
 	if (j->clear_resources)
-		JSONAddBool(&b, CLEARRES, 1);
+		JSONAddBool(b, CLEARRES, 1);
+}
+
+JERS_EXPORT int jersModJob(const jersJobMod *j) {
+	if (jersInitAPI(NULL))
+		return 1;
+
+	if (j->jobid == 0 ) {
+		setJersErrno(JERS_ERR_INVARG, "No jobid provided");
+		return 1;
+	}
+
+	buff_t b;
+	initRequest(&b, CMD_MOD_JOB, 1);
+
+	JSONAddInt(&b, JOBID, j->jobid);
+	serializeJobMod(&b, j);
 
 	if (sendRequest(&b)) {
 		return 1;
@@ -762,6 +978,92 @@ JERS_EXPORT int jersSignalJob(jobid_t id, int signum) {
 	return status;
 }
 
+/* The bulk job commands apply a change to every job matching a filter, in a single request.
+ * These return the number of jobs acted on, or -1 on error */
+
+static int64_t sendJobSelection(buff_t *b, const jersJobFilter *filter) {
+	int64_t count;
+
+	JSONEndObject(b);
+	JSONStartArray(b, "DATA", 4);
+
+	JSONStartObject(b, NULL, 0);
+	serializeJobFilter(b, filter);
+	JSONEndObject(b);
+
+	JSONEndArray(b);
+	JSONEndObject(b);
+	JSONEnd(b);
+
+	if (sendRequestBuffer(b))
+		return -1;
+
+	if (readResponse())
+		return -1;
+
+	count = msg.item_count;
+
+	free_message(&msg);
+	return count;
+}
+
+static int checkJobSelection(const jersJobFilter *filter) {
+	if (filter == NULL || filter->filter_fields == 0) {
+		setJersErrno(JERS_ERR_INVARG, "No filter provided");
+		return 1;
+	}
+
+	return 0;
+}
+
+JERS_EXPORT int64_t jersModJobs(const jersJobFilter *filter, const jersJobMod *j) {
+	if (jersInitAPI(NULL))
+		return -1;
+
+	if (checkJobSelection(filter))
+		return -1;
+
+	buff_t b;
+	initRequest(&b, CMD_MOD_JOB, 1);
+
+	serializeJobMod(&b, j);
+
+	return sendJobSelection(&b, filter);
+}
+
+JERS_EXPORT int64_t jersDelJobs(const jersJobFilter *filter) {
+	if (jersInitAPI(NULL))
+		return -1;
+
+	if (checkJobSelection(filter))
+		return -1;
+
+	buff_t b;
+	initRequest(&b, CMD_DEL_JOB, 1);
+
+	return sendJobSelection(&b, filter);
+}
+
+JERS_EXPORT int64_t jersSignalJobs(const jersJobFilter *filter, int signum) {
+	if (jersInitAPI(NULL))
+		return -1;
+
+	if (checkJobSelection(filter))
+		return -1;
+
+	if (signum < 0 || signum >= SIGRTMAX) {
+		setJersErrno(JERS_ERR_INVARG, "Invalid signum provided");
+		return -1;
+	}
+
+	buff_t b;
+	initRequest(&b, CMD_SIG_JOB, 1);
+
+	JSONAddInt(&b, SIGNAL, signum);
+
+	return sendJobSelection(&b, filter);
+}
+
 JERS_EXPORT int jersClearCache(void) {
 	if (jersInitAPI(NULL))
 		return 1;
@@ -1179,6 +1481,17 @@ JERS_EXPORT int jersGetStats(jersStats * s) {
 			case STATSTOTALDELETED   : s->total.deleted = getNumberField(&item->fields[i]); break;
 			case STATSTOTALUNKNOWN   : s->total.unknown = getNumberField(&item->fields[i]); break;
 
+			/* Returned by jersGetMemStats() */
+			case STATSRSS:
+			case STATSJOBSLABS:
+			case STATSJOBARENAS:
+			case STATSJOBARENABYTES:
+			case STATSJOBSFREED:
+			case STATSJOBFREETIME:
+			case STATSINTERNED:
+			case STATSINTERNEDBYTES:
+			case STATSINTERNREFS: break;
+
 			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",item->fields[i].name); break;
 		}
 	}
@@ -1188,6 +1501,47 @@ JERS_EXPORT int jersGetStats(jersStats * s) {
 	return 0;
 }
 
+JERS_EXPORT int jersGetMemStats(jersMemStats * s) {
+	int i;
+
+	if (jersInitAPI(NULL))
+		return 1;
+
+	memset(s, 0, sizeof(jersMemStats));
+
+	buff_t b;
+
+	initRequest(&b, CMD_STATS, 1);
+
+	if (sendRequest(&b))
+		return 1;
+
+	if (readResponse())
+		return 1;
+
+	msg_item * item = &msg.items[0];
+
+	for (i = 0; i < item->field_count; i++) {
+		switch(item->fields[i].number) {
+			case STATSRSS           : s->rss = getNumberField(&item->fields[i]); break;
+			case STATSJOBSLABS      : s->job_slabs = getNumberField(&item->fields[i]); break;
+			case STATSJOBARENAS     : s->arenas = getNumberField(&item->fields[i]); break;
+			case STATSJOBARENABYTES : s->arena_bytes = getNumberField(&item->fields[i]); break;
+			case STATSJOBSFREED     : s->freed = getNumberField(&item->fields[i]); break;
+			case STATSJOBFREETIME   : s->free_time = getNumberField(&item->fields[i]); break;
+			case STATSINTERNED      : s->interned = getNumberField(&item->fields[i]); break;
+			case STATSINTERNEDBYTES : s->interned_bytes = getNumberField(&item->fields[i]); break;
+			case STATSINTERNREFS    : s->intern_refs = getNumberField(&item->fields[i]); break;
+
+			default: break;
+		}
+	}
+
+	free_message(&msg);
+
+	return 0;
+}
+
 JERS_EXPORT int jersSetTag(jobid_t id, const char * key, const char * value) {
 	if (jersInitAPI(NULL))
 		return 1;
@@ -35,8 +35,14 @@
 
 #include "client.h"
 #include "logging.h"
+#include "commands.h"
+
+#include <utlist.h>
 
 client * clientList = NULL;
+client * readyClientList = NULL;
+client * streamClientList = NULL;
+client * commitClientList = NULL;
 
 void addClient(client * c) {
 	if (clientList) {
@@ -48,6 +54,8 @@ void addClient(client * c) {
 }
 
 void removeClient(client * c) {
+	clearClientReady(c);
+
 	if (c->next)
 		c->next->prev = c->prev;
 
@@ -58,6 +66,114 @@ void removeClient(client * c) {
 		clientList = c->next;
 }
 
+/* Add a client to the list of clients that have data for us to look at */
+void markClientReady(client * c) {
+	if (c->ready)
+		return;
+
+	DL_APPEND2(readyClientList, c, ready_prev, ready_next);
+	c->ready = 1;
+}
+
+void clearClientReady(client * c) {
+	if (!c->ready)
+		return;
+
+	DL_DELETE2(readyClientList, c, ready_prev, ready_next);
+	c->ready = 0;
+}
+
+/* Start streaming a response to a client. The callback is called from the event loop
+ * to send each chunk once the previous one has been written out to the client.
+ * Any further requests from the client are held until the stream is complete */
+void startClientStream(client *c, int (*callback)(client *, void *), void (*free_callback)(void *), void *data) {
+	c->stream.callback = callback;
+	c->stream.free_callback = free_callback;
+	c->stream.data = data;
+
+	DL_APPEND2(streamClientList, c, stream_prev, stream_next);
+}
+
+void stopClientStream(client *c) {
+	if (c->stream.callback == NULL)
+		return;
+
+	DL_DELETE2(streamClientList, c, stream_prev, stream_next);
+
+	if (c->stream.free_callback)
+		c->stream.free_callback(c->stream.data);
+
+	free(c->stream.data);
+
+	c->stream.callback = NULL;
+	c->stream.free_callback = NULL;
+	c->stream.data = NULL;
+
+	/* Pick up any requests that arrived while we were streaming */
+	if (c->request.used && memchr(c->request.data, '\n', c->request.used))
+		markClientReady(c);
+}
+
+/* Hold back any response sent to the client from here on until the journal
+ * has been committed to disk. Anything already queued can still be sent. */
+void waitClientCommit(client *c) {
+	if (c->commit_wait)
+		return;
+
+	c->commit_wait = 1;
+	c->commit_offset = c->response.used;
+	c->commit_seq = 0;
+
+	DL_APPEND2(commitClientList, c, commit_prev, commit_next);
+}
+
+static void clearClientCommit(client *c) {
+	if (!c->commit_wait)
+		return;
+
+	DL_DELETE2(commitClientList, c, commit_prev, commit_next);
+	c->commit_wait = 0;
+	c->commit_offset = 0;
+}
+
+/* Called as the journal is flushed. Send the responses to the waiting
+ * clients whose journal records have all been committed */
+void releaseCommitClients(int64_t synced) {
+	client *c = commitClientList;
+
+	while (c) {
+		client *next = c->commit_next;
+
+		if (c->commit_seq > synced) {
+			c = next;
+			continue;
+		}
+
+		clearClientCommit(c);
+
+		if (c->response_sent < c->response.used)
+			pollSetWritable(&c->connection);
+
+		c = next;
+	}
+}
+
+/* Called if the journal can't be flushed. Any response held back for an update
+ * that won't be committed is replaced with an error */
+void failCommitClients(int error, const char *err_msg) {
+	client *c = commitClientList;
+
+	while (c) {
+		client *next = c->commit_next;
+
+		c->response.used = c->commit_offset;
+		clearClientCommit(c);
+
+		sendError(c, error, err_msg);
+		c = next;
+	}
+}
+
 /* Accept a new client connection, adding to our existing list of clients and adding it
  * to our event polling */
 
@@ -115,8 +231,11 @@ int handleClientDisconnect(client * c) {
 		fprintf(stderr, "Failed to remove event for disconnected client");
 
 	close(c->connection.socket);
+	stopClientStream(c);
+	clearClientCommit(c);
 	buffFree(&c->response);
 	buffFree(&c->request);
+	free_message(&c->msg);
 
 	if (c->blocking.data) {
 		if (c->blocking.free_callback)
@@ -155,29 +274,40 @@ int handleClientRead(client * c) {
 	 * Update the buffer and length in the
 	 * reader, so we can try to parse this request */
 	c->request.used += len;
+	markClientReady(c);
 
 	return 0;
 }
 
 int handleClientWrite(client * c) {
 	int len = 0;
+	size_t end = c->commit_wait ? c->commit_offset : c->response.used;
 
-	len = _send(c->connection.socket, c->response.data + c->response_sent, c->response.used - c->response_sent);
+	if (c->response_sent < end) {
+		len = _send(c->connection.socket, c->response.data + c->response_sent, end - c->response_sent);
 
-	if (len == -1) {
-		print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
-		handleClientDisconnect(c);
-		return 1;
-	}
+		if (len == -1) {
+			print_msg(JERS_LOG_WARNING, "send to client failed: %s", strerror(errno));
+			handleClientDisconnect(c);
+			return 1;
+		}
 
-	c->response_sent += len;
+		c->response_sent += len;
+	}
 
 	/* If we have sent all our data, remove EPOLLOUT
 	 * from the event. Leave readable on, as we might read another request
-	 * from the client, or process their disconnect */
-	if (c->response_sent == c->response.used) {
+	 * from the client, or process their disconnect.
+	 * A response waiting on a journal commit is sent once it's released. */
+	if (c->response_sent == end) {
 		pollSetReadable(&c->connection);
-		c->response_sent = c->response.used = 0;
+
+		if (end == c->response.used) {
+			c->response_sent = c->response.used = 0;
+
+			if (c->commit_wait)
+				c->commit_offset = 0;
+		}
 	}
 
 	return 0;
@@ -60,11 +60,40 @@ typedef struct _client {
 		int64_t timeout;
 	} blocking;
 
+	/* A response being sent back a chunk at a time. The callback sends the next chunk,
+	 * returning 0 if there is more to send, 1 once it's complete or -1 on error */
+	struct {
+		int (*callback)(struct _client *, void *);
+		void (*free_callback)(void *);
+		void *data;
+	} stream;
+
 	struct _client * next;
 	struct _client * prev;
+
+	/* Clients with data waiting to be processed */
+	int ready;
+	struct _client * ready_next;
+	struct _client * ready_prev;
+
+	/* Clients with a response being streamed to them */
+	struct _client * stream_next;
+	struct _client * stream_prev;
+
+	/* Clients waiting for their journalled updates to be committed to disk.
+	 * Only the response data before commit_offset can be sent until
+	 * journal record commit_seq has been flushed */
+	int commit_wait;
+	size_t commit_offset;
+	int64_t commit_seq;
+	struct _client * commit_next;
+	struct _client * commit_prev;
 } client;
 
 extern client *clientList;
+extern client *readyClientList;
+extern client *streamClientList;
+extern client *commitClientList;
 
 int handleClientConnection(struct connectionType * connection);
 int handleClientDisconnect(client *c);
@@ -74,4 +103,14 @@ int handleClientWrite(client *c);
 void addClient(client *c);
 void removeClient(client *c);
 
+void markClientReady(client *c);
+void clearClientReady(client *c);
+
+void startClientStream(client *c, int (*callback)(client *, void *), void (*free_callback)(void *), void *data);
+void stopClientStream(client *c);
+
+void waitClientCommit(client *c);
+void releaseCommitClients(int64_t synced);
+void failCommitClients(int error, const char *err_msg);
+
 #endif
\ No newline at end of file
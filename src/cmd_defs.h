@@ -1,4 +1,5 @@
 #define CMD_ADD_JOB "JOB_ADD"
+#define CMD_ADD_JOBS "JOBS_ADD"
 #define CMD_GET_JOB "JOB_GET"
 #define CMD_MOD_JOB "JOB_MOD"
 #define CMD_DEL_JOB "JOB_DEL"
@@ -28,6 +29,12 @@
 #define AGENT_AUTH_RESP      "AUTH"
 #define AGENT_START_JOB      "START_JOB"
 #define AGENT_RECON_COMP     "RECON_COMPLETE"
+#define AGENT_ENVPROFILE_MISS "ENVPROFILE_MISS"
+
+/* Version an agent sends with its login. Agents that predate
+ * AGENT_VERSION_ENVPROFILE don't know about environment profiles */
+#define AGENT_VERSION            2
+#define AGENT_VERSION_ENVPROFILE 2
 
 #define AGENT_PROXY_CONN  "PROXY_CONN"
 #define AGENT_PROXY_DATA  "PROXY_DATA"
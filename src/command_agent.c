@@ -32,8 +32,8 @@
 #include <json.h>
 
 int command_agent_login(agent * a, msg_t * msg) {
-	UNUSED(msg);
-	print_msg(JERS_LOG_INFO, "Got login from agent on host %s", a->host);
+	a->version = msg->version;
+	print_msg(JERS_LOG_INFO, "Got login from agent on host %s (version %d)", a->host, a->version);
 
 	/* Check the queues and link this agent against queues matching this host */
 	for (struct queue *q = server.queueTable; q != NULL; q = q->hh.next) {
@@ -217,9 +217,6 @@ int command_agent_recon(agent * a, msg_t * msg) {
 		if (j == NULL)
 			error_die("Agent '%s' has sent recon for job %d, but we don't have it in memory.", a->host, jobid);
 
-		/* Remove the pending reason, we know the job is no longer pending */
-		j->pend_reason = 0;
-
 		if (start_time) {
 			j->start_time = start_time;
 		}
@@ -249,6 +246,9 @@ int command_agent_recon(agent * a, msg_t * msg) {
 
 	a->recon = 0;
 
+	/* The queues on this agent can now start jobs */
+	requestSchedule();
+
 	return 0;
 }
 
@@ -281,9 +281,9 @@ int command_agent_jobstart(agent * a, msg_t * msg) {
 	changeJobState(j, JERS_JOB_RUNNING, NULL, 1);
 
 	j->internal_state &= ~JERS_FLAG_JOB_STARTED;
-	j->pend_reason = 0;
 	j->pid = pid;
 	j->start_time = start_time;
+	updateJobHot(j);
 
 	if (server.recovery.in_progress && j->res_count)
 		allocateRes(j);
@@ -294,6 +294,40 @@ int command_agent_jobstart(agent * a, msg_t * msg) {
 	return 0;
 }
 
+/* The agent didn't have the environment profile of a job we asked it to start
+ * cached, so send the start again with the profile included. */
+
+int command_agent_envprofilemiss(agent * a, msg_t * msg) {
+	jobid_t jobid = 0;
+	char *hash = NULL;
+	struct job * j = NULL;
+
+	UNUSED(a);
+
+	for (int64_t i = 0; i < msg->items[0].field_count; i++) {
+		switch(msg->items[0].fields[i].number) {
+			case JOBID : jobid = getNumberField(&msg->items[0].fields[i]); break;
+			case ENVPROFILE: hash = getStringField(&msg->items[0].fields[i]); break;
+
+			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n", msg->items[0].fields[i].name); break;
+		}
+	}
+
+	j = findJob(jobid);
+
+	if (j == NULL || (j->internal_state & JERS_FLAG_JOB_STARTED) == 0 || j->env_profile == NULL || hash == NULL || strcmp(j->env_profile->hash, hash) != 0) {
+		print_msg(JERS_LOG_WARNING, "Got environment profile miss for job not being started: %d", jobid);
+		free(hash);
+		return 1;
+	}
+
+	print_msg(JERS_LOG_DEBUG, "JobID: %d resending start with environment profile %s", jobid, hash);
+	sendStartCmd(j, 1);
+	free(hash);
+
+	return 0;
+}
+
 int command_agent_jobcompleted(agent * a, msg_t * msg) {
 	jobid_t jobid = 0;
 	int exitcode = 0;
@@ -397,6 +431,7 @@ int command_agent_proxyconn(agent *a, msg_t *msg) {
 		print_msg(JERS_LOG_WARNING, "Had previous proxy client connected on agent %s pid:%d", ((agent *)c->connection.proxy.agent)->host, c->connection.proxy.pid);
 		buffFree(&c->response);
 		buffFree(&c->request);
+		free_message(&c->msg);
 		removeClient(c);
 		free(c);
 	}
@@ -452,6 +487,7 @@ int command_agent_proxydata(agent *a, msg_t *msg) {
 
 	/* Add the new data to the clients stream */
 	buffAdd(&c->request, data, strlen(data));
+	markClientReady(c);
 	free(data);
 
 	return 0;
@@ -485,6 +521,7 @@ int command_agent_proxyclose(agent *a, msg_t *msg) {
 
 	buffFree(&c->response);
 	buffFree(&c->request);
+	free_message(&c->msg);
 	removeClient(c);
 	free(c);
 
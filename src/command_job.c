@@ -37,6 +37,12 @@
 #include <time.h>
 #include <pwd.h>
 
+/* Jobs sent per chunk of a streamed job query, if the client doesn't specify */
+#define JOB_STREAM_CHUNK 1000
+
+/* Jobids looked at per chunk of a streamed job query, before yielding to other events */
+#define JOB_STREAM_SCAN 65536
+
 /* Convert a resource string and populate the passed in res structure */
 int resourceStringToResource(const char * string, struct jobResource * res) {
 	char * string_temp = strdup(string);
@@ -76,45 +82,62 @@ struct jobResource * convertResourceStrings(int res_count, char ** res_strings)
 	return resources;
 }
 
-void * deserialize_add_job(msg_t * t) {
-	jersJobAdd *s = calloc(sizeof(jersJobAdd), 1);
+static void freeJobAdd(jersJobAdd *ja);
+static void freeJobFilter(jersJobFilter *jf);
 
+static void deserializeJobAdd(msg_item *item, jersJobAdd *s) {
 	s->priority = JERS_JOB_DEFAULT_PRIORITY;
 	s->nice = UNSET_32;
 
-	for (int i = 0; i < t->items[0].field_count; i++) {
-		switch(t->items[0].fields[i].number) {
-			case JOBID    : s->jobid = getNumberField(&t->items[0].fields[i]); break;
-			case JOBNAME  : s->name = getStringField(&t->items[0].fields[i]); break;
-			case QUEUENAME: s->queue = getStringField(&t->items[0].fields[i]); break;
-			case UID      : s->uid = getNumberField(&t->items[0].fields[i]); break;
-			case SHELL    : s->shell = getStringField(&t->items[0].fields[i]); break;
-			case PRIORITY : s->priority = getNumberField(&t->items[0].fields[i]); break;
-			case HOLD     : s->hold = getBoolField(&t->items[0].fields[i]); break;
-			case ENVS     : s->env_count = getStringArrayField(&t->items[0].fields[i], &s->envs); break;
-			case ARGS     : s->argc = getStringArrayField(&t->items[0].fields[i], &s->argv); break;
-			case PRECMD   : s->pre_cmd = getStringField(&t->items[0].fields[i]); break;
-			case POSTCMD  : s->post_cmd = getStringField(&t->items[0].fields[i]); break;
-			case DEFERTIME: s->defer_time = getNumberField(&t->items[0].fields[i]); break;
-			case TAGS     : s->tag_count = getStringMapField(&t->items[0].fields[i], (key_val_t **)&s->tags); break;
-			case RESOURCES: s->res_count = getStringArrayField(&t->items[0].fields[i], &s->resources); break;
-			case STDOUT   : s->stdout = getStringField(&t->items[0].fields[i]); break;
-			case STDERR   : s->stderr = getStringField(&t->items[0].fields[i]); break;
-			case WRAPPER  : s->wrapper = getStringField(&t->items[0].fields[i]); break;
-			case NICE     : s->nice = getNumberField(&t->items[0].fields[i]); break;
-			case FLAGS    : s->flags = getNumberField(&t->items[0].fields[i]); break;
-
-			default: fprintf(stderr, "Unknown field %s encountered - Ignoring\n",t->items[0].fields[i].name); break;
+	for (int i = 0; i < item->field_count; i++) {
+		switch(item->fields[i].number) {
+			case JOBID    : s->jobid = getNumberField(&item->fields[i]); break;
+			case JOBNAME  : s->name = borrowStringField(&item->fields[i]); break;
+			case QUEUENAME: s->queue = borrowStringField(&item->fields[i]); break;
+			case UID      : s->uid = getNumberField(&item->fields[i]); break;
+			case SHELL    : s->shell = borrowStringField(&item->fields[i]); break;
+			case PRIORITY : s->priority = getNumberField(&item->fields[i]); break;
+			case HOLD     : s->hold = getBoolField(&item->fields[i]); break;
+			case ENVS     : s->env_count = borrowStringArrayField(&item->fields[i], &s->envs); break;
+			case ENVPROFILE: s->env_profile = getStringField(&item->fields[i]); break;
+			case ARGS     : s->argc = borrowStringArrayField(&item->fields[i], &s->argv); break;
+			case PRECMD   : s->pre_cmd = borrowStringField(&item->fields[i]); break;
+			case POSTCMD  : s->post_cmd = borrowStringField(&item->fields[i]); break;
+			case DEFERTIME: s->defer_time = getNumberField(&item->fields[i]); break;
+			case TAGS     : s->tag_count = borrowStringMapField(&item->fields[i], (key_val_t **)&s->tags); break;
+			case RESOURCES: s->res_count = borrowStringArrayField(&item->fields[i], &s->resources); break;
+			case STDOUT   : s->stdout = borrowStringField(&item->fields[i]); break;
+			case STDERR   : s->stderr = borrowStringField(&item->fields[i]); break;
+			case WRAPPER  : s->wrapper = borrowStringField(&item->fields[i]); break;
+			case NICE     : s->nice = getNumberField(&item->fields[i]); break;
+			case FLAGS    : s->flags = getNumberField(&item->fields[i]); break;
+
+			default: fprintf(stderr, "Unknown field %s encountered - Ignoring\n", item->fields[i].name); break;
 		}
 	}
+}
+
+void * deserialize_add_job(msg_t * t) {
+	jersJobAdd *s = calloc(sizeof(jersJobAdd), 1);
+
+	deserializeJobAdd(&t->items[0], s);
 
 	return s;
 }
 
-void * deserialize_get_job(msg_t * t) {
-	jersJobFilter * s = calloc(sizeof(jersJobFilter), 1);
-	msg_item * item = &t->items[0];
+void * deserialize_add_jobs(msg_t * t) {
+	jobAddBatch *b = calloc(sizeof(jobAddBatch), 1);
+
+	b->count = t->item_count;
+	b->jobs = calloc(sizeof(jersJobAdd), b->count ? b->count : 1);
+
+	for (int64_t i = 0; i < b->count; i++)
+		deserializeJobAdd(&t->items[i], &b->jobs[i]);
 
+	return b;
+}
+
+static void deserializeJobFilter(msg_item *item, jersJobFilter *s) {
 	for (int i = 0; i < item->field_count; i++) {
 		switch(item->fields[i].number) {
 			case JOBID    : s->jobid = getNumberField(&item->fields[i]); break;
@@ -136,7 +159,12 @@ void * deserialize_get_job(msg_t * t) {
 
 			case RETFIELDS: s->return_fields = getNumberField(&item->fields[i]); break;
 
-			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",t->items[0].fields[i].name); break;
+			/* Paging fields are only used by JOB_GET, see deserialize_get_job() */
+			case LIMIT    :
+			case CURSOR   :
+			case STREAM   : break;
+
+			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n", item->fields[i].name); break;
 		}
 
 		/* If a jobid was provided, we ignore everything else */
@@ -144,11 +172,76 @@ void * deserialize_get_job(msg_t * t) {
 			break;
 	}
 
-	return s;
+	/* Job tag keys are interned, so intern the keys being filtered on to compare them by pointer */
+	for (int i = 0; i < s->filters.tag_count; i++) {
+		char *key = internString(s->filters.tags[i].key);
+		free(s->filters.tags[i].key);
+		s->filters.tags[i].key = key;
+	}
+}
+
+void * deserialize_get_job(msg_t * t) {
+	jersJobGet * g = calloc(sizeof(jersJobGet), 1);
+	msg_item *item = &t->items[0];
+
+	deserializeJobFilter(item, &g->filter);
+
+	for (int i = 0; i < item->field_count; i++) {
+		switch(item->fields[i].number) {
+			case LIMIT : g->limit = getNumberField(&item->fields[i]); break;
+			case CURSOR: g->cursor = getNumberField(&item->fields[i]); break;
+			case STREAM: g->stream = getBoolField(&item->fields[i]); break;
+		}
+	}
+
+	return g;
+}
+
+/* The bulk job commands pass the jobs to act on as extra items after the command fields.
+ * This is either a filter to match jobs against, or when replaying the journal,
+ * the list of jobs that originally matched, with their revision after the change. */
+
+static void deserializeJobSelection(msg_t *t, jobSelection *sel) {
+	for (int64_t i = 1; i < t->item_count; i++) {
+		msg_item *item = &t->items[i];
+		jobid_t jobid = 0;
+		int64_t revision = 0;
+
+		for (int k = 0; k < item->field_count; k++) {
+			switch (item->fields[k].number) {
+				case JOBID   : jobid = getNumberField(&item->fields[k]); break;
+				case REVISION: revision = getNumberField(&item->fields[k]); break;
+			}
+		}
+
+		if (jobid == 0) {
+			if (sel->filter == NULL) {
+				sel->filter = calloc(sizeof(jersJobFilter), 1);
+				deserializeJobFilter(item, sel->filter);
+			}
+
+			continue;
+		}
+
+		if (sel->count == 0) {
+			sel->jobids = malloc(sizeof(jobid_t) * (t->item_count - 1));
+			sel->revisions = malloc(sizeof(int64_t) * (t->item_count - 1));
+
+			if (sel->jobids == NULL || sel->revisions == NULL)
+				error_die("Failed to allocate memory for job selection: %s", strerror(errno));
+		}
+
+		sel->jobids[sel->count] = jobid;
+		sel->revisions[sel->count] = revision;
+		sel->count++;
+	}
+
+	sel->selected = (sel->filter != NULL || sel->count != 0);
 }
 
 void * deserialize_mod_job(msg_t * t) {
-	jersJobMod *jm = calloc(sizeof(jersJobMod), 1);
+	jersJobModArgs *args = calloc(sizeof(jersJobModArgs), 1);
+	jersJobMod *jm = &args->mod;
 	msg_item *item = &t->items[0];
 
 	jm->hold = UNSET_8;
@@ -162,24 +255,28 @@ void * deserialize_mod_job(msg_t * t) {
 	for (int i = 0; i < item->field_count; i++) {
 		switch(item->fields[i].number) {
 			case JOBID    : jm->jobid = getNumberField(&item->fields[i]); break;
-			case JOBNAME  : jm->name = getStringField(&item->fields[i]); break;
-			case QUEUENAME: jm->queue = getStringField(&item->fields[i]); break;
+			case JOBNAME  : jm->name = borrowStringField(&item->fields[i]); break;
+			case QUEUENAME: jm->queue = borrowStringField(&item->fields[i]); break;
 			case DEFERTIME: jm->defer_time = getNumberField(&item->fields[i]); break;
 			case NICE     : jm->nice = getNumberField(&item->fields[i]); break;
 			case PRIORITY : jm->priority = getNumberField(&item->fields[i]); break;
 			case HOLD     : jm->hold = getBoolField(&item->fields[i]); break;
 			case RESTART  : jm->restart = getBoolField(&item->fields[i]); break;
 
-			case ENVS     : jm->env_count = getStringArrayField(&item->fields[i], &jm->envs); break;
-			case TAGS     : jm->tag_count = getStringMapField(&item->fields[i], (key_val_t **)&jm->tags); break;
-			case RESOURCES: jm->res_count = getStringArrayField(&item->fields[i], &jm->resources); break;
+			case ENVS     : jm->env_count = borrowStringArrayField(&item->fields[i], &jm->envs); break;
+			case ENVPROFILE: jm->env_profile = getStringField(&item->fields[i]); break;
+			case TAGS     : jm->tag_count = borrowStringMapField(&item->fields[i], (key_val_t **)&jm->tags); break;
+			case RESOURCES: jm->res_count = borrowStringArrayField(&item->fields[i], &jm->resources); break;
 
 			case CLEARRES : jm->clear_resources = getBoolField(&item->fields[i]); break;
 
 			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n",t->items[0].fields[i].name); break;
 		}
 	}
-	return jm;
+
+	deserializeJobSelection(t, &args->select);
+
+	return args;
 }
 
 void * deserialize_del_job(msg_t * t) {
@@ -195,6 +292,8 @@ void * deserialize_del_job(msg_t * t) {
 		}
 	}
 
+	deserializeJobSelection(t, &jd->select);
+
 	return jd;
 }
 
@@ -212,6 +311,8 @@ void * deserialize_sig_job(msg_t * t) {
 		}
 	}
 
+	deserializeJobSelection(t, &js->select);
+
 	return js;
 }
 
@@ -344,8 +445,21 @@ void serialize_jersJob(buff_t *b, struct job *j, int fields) {
 		free(res_strings);
 	}
 
-	if (j->env_count && (fields == 0 || fields & JERS_RET_ENV))
+	if (j->env_profile && (fields == 0 || fields & JERS_RET_ENV)) {
+		/* Return the environment the job will actually get */
+		char **envs = malloc(sizeof(char *) * (j->env_profile->env_count + j->env_count + 1));
+
+		if (envs == NULL)
+			error_die("Failed to allocate memory for job environment: %s", strerror(errno));
+
+		int64_t env_count = mergeEnv(j->env_profile->env_count, j->env_profile->envs, j->env_count, j->envs, envs);
+
+		JSONAddStringArray(b, ENVS, env_count, envs);
+		JSONAddString(b, ENVPROFILE, j->env_profile->hash);
+		free(envs);
+	} else if (j->env_count && (fields == 0 || fields & JERS_RET_ENV)) {
 		JSONAddStringArray(b, ENVS, j->env_count, j->envs);
+	}
 
 	if (j->pid && (fields == 0 || fields & JERS_RET_PID))
 		JSONAddInt(b, JOBPID, j->pid);
@@ -353,8 +467,10 @@ void serialize_jersJob(buff_t *b, struct job *j, int fields) {
 	JSONAddInt(b, EXITCODE, j->exitcode);
 	JSONAddInt(b, SIGNAL, j->signal);
 
-	if (j->pend_reason)
-		JSONAddInt(b, PENDREASON, j->pend_reason);
+	int pend_reason = getPendReason(j);
+
+	if (pend_reason)
+		JSONAddInt(b, PENDREASON, pend_reason);
 
 	if (j->fail_reason)
 		JSONAddInt(b, FAILREASON, j->fail_reason);
@@ -383,136 +499,140 @@ static inline int check_perm(client *c, uid_t job_uid, int required_perm) {
 	return 0;
 }
 
-int command_add_job(client *c, void *args) {
-	jersJobAdd * s = args;
-	struct job * j = NULL;
-	struct queue * q = NULL;
-	struct jobResource * resources = NULL;
-	struct user * u = NULL;
+/* Jobs refer to their environment through a profile, with the variables they pass
+ * overriding it. A job passing its whole environment instead has it replaced with
+ * the profile holding those variables, creating it if needed.
+ *
+ * This is done once the rest of the request has been validated, so a rejected
+ * request doesn't leave a profile behind. created is set to a new profile, as its
+ * variables need to be journaled with the request until it has been saved. */
+
+static int resolveEnvProfile(char **env_profile, int64_t *env_count, char ***envs, struct envProfile **created, const char **err_msg) {
+	static char msg[256];
+	struct envProfile *p;
+	int new_profile;
+
+	*created = NULL;
+
+	if (*env_profile) {
+		if (findEnvProfile(*env_profile) == NULL) {
+			snprintf(msg, sizeof(msg), "Environment profile '%s' not found", *env_profile);
+			*err_msg = msg;
+			return JERS_ERR_NOENVPROFILE;
+		}
 
-	if (unlikely(server.recovery.in_progress)) {
-		/* Have we already loaded this job? */
-		j = findJob(server.recovery.jobid);
+		return 0;
+	}
 
-		if (j)
-			return 0;
+	if (*env_count <= 0)
+		return 0;
 
-		print_msg(JERS_LOG_INFO, "Recovering jobid:%d\n", server.recovery.jobid);
-		s->jobid = server.recovery.jobid;
-		s->uid = server.recovery.uid;
-	}
+	p = addEnvProfile(*env_count, *envs, &new_profile);
+
+	if (new_profile)
+		*created = p;
+
+	/* The variables are borrowed from the request */
+	*envs = NULL;
+	*env_count = 0;
+
+	if ((*env_profile = strdup(p->hash)) == NULL)
+		error_die("Failed to allocate memory for environment profile: %s", strerror(errno));
+
+	return 0;
+}
+
+/* Validate a job submission, looking up the queue and resources it refers to.
+ * Returns 0 if the job can be added, otherwise the error code to send the client. */
+
+static int validateJobAdd(client *c, jersJobAdd *s, struct queue **queue, struct jobResource **resources, const char **err_msg) {
+	static char msg[256];
+	struct queue *q = NULL;
+
+	*err_msg = NULL;
 
 	if (s->uid <= 0)
-		s->uid = c->uid;
+		s->uid = c ? c->uid : server.recovery.uid;
 
 	if (s->uid == 0) {
-		sendError(c, JERS_ERR_INVARG, "Jobs not allowed to run as root");
-		return -1;
+		*err_msg = "Jobs not allowed to run as root";
+		return JERS_ERR_INVARG;
 	}
 
-	if (likely(server.recovery.in_progress == 0)) {
-		/* Validate the user has permission */
-		if (check_perm(c, s->uid, PERM_SETUID)) {
-			sendError(c, JERS_ERR_NOPERM, NULL);
-			return -1;
-		}
-	}
+	/* Validate the user has permission */
+	if (likely(server.recovery.in_progress == 0) && check_perm(c, s->uid, PERM_SETUID))
+		return JERS_ERR_NOPERM;
 
-	/* Validate the request first up */
 	if (s->queue == NULL) {
 		q = server.defaultQueue;
 
 		if (q == NULL) {
-			sendError(c, JERS_ERR_NOQUEUE, "No default queue");
-			return -1;
+			*err_msg = "No default queue";
+			return JERS_ERR_NOQUEUE;
 		}
 	} else {
 		q = findQueue(s->queue);
 
 		if (q == NULL || q->internal_state &JERS_FLAG_DELETED) {
-			sendErrorFmt(c, JERS_ERR_NOQUEUE, "Queue '%s' not found", s->queue);
-			return -1;
+			snprintf(msg, sizeof(msg), "Queue '%s' not found", s->queue);
+			*err_msg = msg;
+			return JERS_ERR_NOQUEUE;
 		}
 
 		if (!(q->state &JERS_QUEUE_FLAG_OPEN)) {
-			sendError(c, JERS_ERR_INVSTATE, "Queue is closed");
-			return -1;
+			*err_msg = "Queue is closed";
+			return JERS_ERR_INVSTATE;
 		}
 	}
 
-	/* Have they requested a particular jobid? */
+	/* Have they requested a particular jobid? If the job exists, but is deleted, it can be reused */
 	if (s->jobid) {
-		j = findJob(s->jobid);
-
-		if (j != NULL) {
-			/* If the job id requested exists, but is deleted, clean it up to reuse it */
-			if (j->internal_state &JERS_FLAG_DELETED) {
-				if (cleanupJob(j) != 0)
-				{
-					sendError(c, JERS_ERR_JOBEXISTS, NULL);
-					return -1;
-				}
+		struct job *j = findJob(s->jobid);
 
-				j = NULL;
-			}
-			else
-			{
-				sendError(c, JERS_ERR_JOBEXISTS, NULL);
-				return -1;
-			}
-		}
+		if (j != NULL && (!(j->internal_state &JERS_FLAG_DELETED) || j->obj.dirty || j->internal_state &JERS_FLAG_FLUSHING))
+			return JERS_ERR_JOBEXISTS;
 	}
 
-	u = lookup_user(s->uid, 0);
+	if (lookup_user(s->uid, 0) == NULL) {
+		*err_msg = "User not valid";
+		return JERS_ERR_INVARG;
+	}
 
-	if (u == NULL) {
-		sendError(c, JERS_ERR_INVARG, "User not valid");
-		return -1;
+	for (int i = 0; i < s->tag_count; i++) {
+		if (isprintable(s->tags[i].key) == 0)
+			return JERS_ERR_INVTAG;
 	}
 
 	if (s->res_count) {
-		resources = convertResourceStrings(s->res_count, s->resources);
+		*resources = convertResourceStrings(s->res_count, s->resources);
 
-		if (resources == NULL) {
-			sendError(c, JERS_ERR_NORES, NULL);
-			return -1;
-		}
+		if (*resources == NULL)
+			return JERS_ERR_NORES;
 	}
 
-	if (s->tag_count) {
-		for (int i = 0; i < s->tag_count; i++) {
-			if (isprintable(s->tags[i].key) == 0) {
-				free(resources);
-				sendError(c, JERS_ERR_INVTAG, NULL);
-				return -1;
-			}
+	*queue = q;
 
-		}
-	}
+	return 0;
+}
 
-	/* Request looks good. Allocate a new job structure and jobid */
-	j = calloc(sizeof(struct job), 1);
+/* Create and add a job from a validated request. s->jobid needs to be populated */
+static struct job * createJob(client *c, jersJobAdd *s, struct queue *q, struct jobResource *resources) {
+	struct job *j = findJob(s->jobid);
+	char *default_name = NULL;
 
-	if (s->jobid == 0)
-		j->jobid = getNextJobID();
-	else
-		j->jobid = s->jobid;
+	/* Reusing the jobid of a deleted job */
+	if (j != NULL && cleanupJob(j) != 0)
+		error_die("Failed to cleanup deleted job %d for reuse", s->jobid);
 
-	if (j->jobid == 0) {
-		sendError(c, JERS_ERR_NOJOB, "No available Job IDs");
-		free(j);
-		free(resources);
-		return -1;
-	}
+	j = allocJob();
+	j->jobid = s->jobid;
 
 	/* Default the job name if one was not provided */
 	if (s->name == NULL) {
-		if (asprintf(&s->name, "job_%u", j->jobid) < 0) {
-			free(j);
-			free(resources);
-			sendError(c, JERS_ERR_MEM, "Failed to allocated jobname");
-			return -1;
-		}
+		if (asprintf(&default_name, "job_%u", j->jobid) < 0)
+			error_die("Failed to allocate jobname: %s", strerror(errno));
+
+		s->name = default_name;
 	}
 
 	/* Fill out the job structure */
@@ -529,6 +649,12 @@ int command_add_job(client *c, void *args) {
 	j->env_count = s->env_count;
 	j->envs = s->envs;
 	j->uid = s->uid;
+
+	if (s->env_profile) {
+		j->env_profile = findEnvProfile(s->env_profile);
+		holdEnvProfile(j->env_profile);
+	}
+
 	j->submitter = c ? c->uid : server.recovery.uid;
 	j->defer_time = s->defer_time;
 	j->priority = s->priority;
@@ -554,9 +680,58 @@ int command_add_job(client *c, void *args) {
 	else
 		j->submit_time = time(NULL);
 
-	/* Add it to the hashtable */
+	/* The strings are still those parsed from the request, so copy them straight
+	 * into the jobs arena, or intern them, leaving the request untouched */
+	packJobCopy(j);
+
+	free(default_name);
+	free(resources);
+	s->name = j->jobname;
+
+	/* Add it to the job table */
 	addJob(j, 1);
 
+	return j;
+}
+
+int command_add_job(client *c, void *args) {
+	jersJobAdd * s = args;
+	struct job * j = NULL;
+	struct queue * q = NULL;
+	struct jobResource * resources = NULL;
+	struct envProfile * created = NULL;
+	const char *err_msg = NULL;
+	int error;
+
+	if (unlikely(server.recovery.in_progress)) {
+		/* Have we already loaded this job? */
+		j = findJob(server.recovery.jobid);
+
+		if (j)
+			return 0;
+
+		print_msg(JERS_LOG_INFO, "Recovering jobid:%d\n", server.recovery.jobid);
+		s->jobid = server.recovery.jobid;
+	}
+
+	/* Validate the request first up. The request is journaled as it was sent,
+	 * so it still has the variables of any profile created for it */
+	if ((error = validateJobAdd(c, s, &q, &resources, &err_msg)) != 0 ||
+		(error = resolveEnvProfile(&s->env_profile, &s->env_count, &s->envs, &created, &err_msg)) != 0) {
+		sendError(c, error, err_msg);
+		free(resources);
+		return -1;
+	}
+
+	/* Request looks good. Allocate a jobid and create the job */
+	if (s->jobid == 0 && (s->jobid = getNextJobID()) == 0) {
+		sendError(c, JERS_ERR_NOJOB, "No available Job IDs");
+		free(resources);
+		return -1;
+	}
+
+	j = createJob(c, s, q, resources);
+
 	/* Don't respond if we are replaying a command */
 	if (c == NULL)
 		return 0;
@@ -584,268 +759,809 @@ int command_add_job(client *c, void *args) {
 	return 0;
 }
 
-int command_get_job(client *c, void * args) {
-	jersJobFilter * s = args;
-	struct queue * q = NULL;
-	struct job * j = NULL;
-	struct indexed_tag *it = NULL;
-	int indexed_tag_index;
-	int read_all = (c->uid == 0 || c->user->permissions &PERM_READ);
-	int self = (server.permissions.self.count == 0 || c->uid == 0 || (c->user->permissions &PERM_SELF) == PERM_SELF);
+/* Swap in the rewritten request to be journaled */
 
-	int64_t count = 0;
+static void journalRequest(client *c, buff_t *journal) {
+	JSONEndArray(journal);
+	JSONEndObject(journal);
+	JSONEnd(journal);
+	journal->data[journal->used - 1] = '\0';
 
-	buff_t r;
+	free(c->msg.rewrite);
+	c->msg.msg_cpy = c->msg.rewrite = journal->data;
+}
 
-	/* JobId? Just look it up and return the result */
-	if (s->jobid) {
-		j = findJob(s->jobid);
+/* Write a validated job submission back out, with its jobid, uid and queue resolved.
+ * This is what gets written to the journal, so replaying it recreates the same jobs.
+ * A job that created its profile is written with the profile's variables instead */
+static void serializeJobAdd(buff_t *b, jersJobAdd *s, struct queue *q, struct envProfile *created) {
+	JSONStartObject(b, NULL, 0);
+	JSONAddInt(b, JOBID, s->jobid);
+	JSONAddString(b, JOBNAME, s->name);
+	JSONAddString(b, QUEUENAME, q->name);
+	JSONAddInt(b, UID, s->uid);
+	JSONAddInt(b, PRIORITY, s->priority);
+	JSONAddStringArray(b, ARGS, s->argc, s->argv);
 
-		/* Validate the user has permission
-		 * We use a bogus UID if the job doesn't exist, just to check their permissions */
-		if (check_perm(c, j ? j->uid : 0, PERM_READ)) {
-			sendError(c, JERS_ERR_NOPERM, NULL);
-			return -1;
-		}
+	if (s->shell)
+		JSONAddString(b, SHELL, s->shell);
 
-		if (j == NULL || (j->internal_state &JERS_FLAG_DELETED)) {
-			sendError(c, JERS_ERR_NOJOB, NULL);
-			return 1;
-		}
+	if (s->hold)
+		JSONAddBool(b, HOLD, 1);
 
-		initClientResponse(&r, 1);
-		serialize_jersJob(&r, j, 0);
-		count = 1;
-	} else {
-		/* If a queue filter has been provided, and its not a wildcard look it up first */
-		if (s->filter_fields & JERS_FILTER_QUEUE) {
+	if (s->nice != UNSET_32)
+		JSONAddInt(b, NICE, s->nice);
 
-			if (strchr(s->filters.queue_name, '*') == NULL && strchr(s->filters.queue_name, '?') == NULL)
-			{
-				q = findQueue(s->filters.queue_name);
+	if (created)
+		JSONAddStringArray(b, ENVS, created->env_count, created->envs);
+	else if (s->env_profile)
+		JSONAddString(b, ENVPROFILE, s->env_profile);
 
-				if (q == NULL) {
-					sendError(c, JERS_ERR_NOQUEUE, NULL);
-					return -1;
-				}
-			}
-		}
+	if (s->env_count)
+		JSONAddStringArray(b, ENVS, s->env_count, s->envs);
 
-		initClientResponse(&r, 1);
+	if (s->tag_count)
+		JSONAddMap(b, TAGS, s->tag_count, (key_val_t *)s->tags);
 
-		/* If the user is filtering on tags, check if one is the indexed tag.
-		 * This greatly speeds up the lookups */
-		if (server.index_tag && s->filter_fields &JERS_FILTER_TAGS && s->filters.tag_count) {
-			for (int i = 0; i < s->filters.tag_count; i++) {
-				if (strcmp(server.index_tag, s->filters.tags[i].key) == 0) {
-					/* Only attempt to use it if it's not wildcarded */
-					if (strchr(s->filters.tags[i].value, '*') == NULL && strchr(s->filters.tags[i].value, '?') == NULL) {
-						HASH_FIND_STR(server.index_tag_table, s->filters.tags[i].value, it);
-						indexed_tag_index = i;
-					}
-
-					break;
-				 }
-			}
-		}
+	if (s->res_count)
+		JSONAddStringArray(b, RESOURCES, s->res_count, s->resources);
 
-		/* Loop through all non-deleted jobs and match against the criteria provided
-		 * Add the jobs to the response as we go. We either drive though the main job
-		 * table, or the tag index table */
+	if (s->wrapper)
+		JSONAddString(b, WRAPPER, s->wrapper);
 
-		for (j = (it ? it->jobs : server.jobTable); j != NULL; j = (it ? j->tag_hh.next : j->hh.next)) {
-			if (j->internal_state &JERS_FLAG_DELETED)
-				continue;
+	if (s->pre_cmd)
+		JSONAddString(b, PRECMD, s->pre_cmd);
 
-			/* Try and filter on the easier criteria first */
+	if (s->post_cmd)
+		JSONAddString(b, POSTCMD, s->post_cmd);
 
-			if (s->filter_fields & JERS_FILTER_STATE) {
-				if (!(s->filters.state &j->state))
-					continue;
-			}
+	if (s->stdout)
+		JSONAddString(b, STDOUT, s->stdout);
 
-			if (s->filter_fields & JERS_FILTER_QUEUE) {
-				if (q && j->queue != q) {
-					continue;
-				} else {
-					if (matches(s->filters.queue_name, j->queue->name) != 0)
-						continue;
-				}
-			}
+	if (s->stderr)
+		JSONAddString(b, STDERR, s->stderr);
 
-			if (s->filter_fields & JERS_FILTER_UID) {
-				if (s->filters.uid != j->uid)
-					continue;
-			}
+	if (s->defer_time)
+		JSONAddInt(b, DEFERTIME, s->defer_time);
 
-			if (s->filter_fields & JERS_FILTER_JOBNAME) {
-				if (matches(s->filters.job_name, j->jobname) != 0)
-					continue;
-			}
+	if (s->flags)
+		JSONAddInt(b, FLAGS, s->flags);
 
-			/* Check that all the tag filters provided match the job */
-			if (s->filter_fields & JERS_FILTER_TAGS) {
-				int i;
-				int match = 1;
-				for (i = 0; i < s->filters.tag_count; i++) {
-					/* Skip the indexed tag */
-					if (it && i == indexed_tag_index)
-						continue;
-
-					int k;
-					for (k = 0; k < j->tag_count; k++) {
-						/* Match the tag first */
-						if (strcmp(j->tags[k].key, s->filters.tags[i].key) == 0) {
-							/* Match the value */
-							if (matches(s->filters.tags[i].value, j->tags[k].value) == 0)
-								break;
-						}
-					}
-
-					if (k == j->tag_count) {
-						match = 0;
-						break;
-					}
-				}
+	JSONEndObject(b);
+}
 
-				if (!match)
-					continue;
-			}
+/* Add a batch of jobs. The whole batch is validated before any jobs are created,
+ * so either all the jobs are added or none of them are. The jobids are returned
+ * in the same order the jobs were submitted.
+ *
+ * The request is rewritten with the allocated jobids before it is journaled,
+ * so the batch is a single journal record. */
+
+int command_add_jobs(client *c, void *args) {
+	jobAddBatch *batch = args;
+	struct queue **queues = calloc(sizeof(struct queue *), batch->count ? batch->count : 1);
+	struct jobResource **resources = calloc(sizeof(struct jobResource *), batch->count ? batch->count : 1);
+	struct envProfile **created = calloc(sizeof(struct envProfile *), batch->count ? batch->count : 1);
+	jobid_t *requested = malloc(sizeof(jobid_t) * (batch->count ? batch->count : 1));
+	jobid_t *allocated = NULL;
+	int64_t requested_count = 0;
+	int64_t allocate_count = 0;
+	int64_t next_id = 0;
+	int64_t i;
+	struct job *last = NULL;
+	buff_t journal;
+	buff_t response;
+	int status = -1;
 
-			/* Check before/after filtering */
-			if (s->filter_fields & JERS_FILTER_BEFORE) {
-				if (s->filters.before.added && j->submit_time > s->filters.before.added)
-					continue;
+	if (queues == NULL || resources == NULL || created == NULL || requested == NULL)
+		error_die("Failed to allocate memory for job batch: %s", strerror(errno));
 
-				if (s->filters.before.started && (j->start_time == 0 || j->start_time > s->filters.before.started))
-					continue;
+	if (batch->count == 0) {
+		sendError(c, JERS_ERR_INVARG, "No jobs provided");
+		goto end;
+	}
 
-				if (s->filters.before.finished && (j->finish_time == 0 || j->finish_time > s->filters.before.finished))
-					continue;
-			}
+	/* Validate all the jobs first */
+	for (i = 0; i < batch->count; i++) {
+		jersJobAdd *s = &batch->jobs[i];
+		const char *err_msg = NULL;
+		int error;
 
-			if (s->filter_fields & JERS_FILTER_AFTER) {
-				if (s->filters.after.added && j->submit_time < s->filters.after.added)
-					continue;
+		/* Jobs loaded from the state files don't need to be recreated */
+		if (unlikely(server.recovery.in_progress) && findJob(s->jobid))
+			continue;
 
-				if (s->filters.after.started && (j->start_time == 0 || j->start_time < s->filters.after.started))
-					continue;
+		if (s->argc <= 0) {
+			sendErrorFmt(c, JERS_ERR_INVARG, "Job %ld: argc/argv must be populated", i);
+			goto end;
+		}
 
-				if (s->filters.after.finished && (j->finish_time == 0 || j->finish_time < s->filters.after.finished))
-					continue;
-			}
+		if ((error = validateJobAdd(c, s, &queues[i], &resources[i], &err_msg)) != 0) {
+			sendErrorFmt(c, error, "Job %ld: %s", i, err_msg ? err_msg : "");
+			goto end;
+		}
+
+		if (s->jobid)
+			requested[requested_count++] = s->jobid;
+		else
+			allocate_count++;
+	}
 
+	/* The same jobid can't be requested twice */
+	qsort(requested, requested_count, sizeof(jobid_t), cmpJobID);
 
-			/* Made it here, add it to our response if the user has permission */
-			if (read_all || (self && j->uid == c->uid))
-			{
-				serialize_jersJob(&r, j, s->return_fields);
-				count++;
-			}
+	for (i = 1; i < requested_count; i++) {
+		if (requested[i] == requested[i - 1]) {
+			sendErrorFmt(c, JERS_ERR_JOBEXISTS, "Jobid %u requested more than once", requested[i]);
+			goto end;
 		}
 	}
 
-	return sendClientMessage(c, NULL, &r);
-}
+	/* Only look up or create the profiles once the whole batch is known to be good */
+	for (i = 0; i < batch->count; i++) {
+		jersJobAdd *s = &batch->jobs[i];
+		const char *err_msg = NULL;
+		int error;
 
-int command_mod_job(client *c, void *args) {
-	jersJobMod *mj = args;
-	struct job * j = NULL;
-	struct queue * q = NULL;
-	int state = 0;
-	int dirty = 0;
-	int hold = 0;
-	int completed = 0;
-	struct jobResource *new_resources = NULL;
+		if (queues[i] == NULL)
+			continue;
 
-	if (mj->jobid == 0) {
-		sendError(c, JERS_ERR_NOJOB, NULL);
-		return 0;
+		if ((error = resolveEnvProfile(&s->env_profile, &s->env_count, &s->envs, &created[i], &err_msg)) != 0) {
+			sendErrorFmt(c, error, "Job %ld: %s", i, err_msg ? err_msg : "");
+			goto end;
+		}
 	}
 
-	j = findJob(mj->jobid);
+	/* Allocate the remaining jobids in one go, skipping any that were requested */
+	if (allocate_count) {
+		allocated = malloc(sizeof(jobid_t) * allocate_count);
 
-	if (likely(server.recovery.in_progress == 0)) {
-		/* Validate the user has permission
-		 * We use a bogus ID if the job doesn't exist, just to check their permissions */
-		if (check_perm(c, j ? j->uid : 0, PERM_WRITE)) {
-			sendError(c, JERS_ERR_NOPERM, NULL);
-			return -1;
+		if (allocated == NULL)
+			error_die("Failed to allocate memory for jobids: %s", strerror(errno));
+
+		if (allocateJobIDs(allocate_count, allocated, requested, requested_count) != allocate_count) {
+			sendError(c, JERS_ERR_NOJOB, "No available Job IDs");
+			goto end;
 		}
 	}
 
-	if (j == NULL || j->internal_state &JERS_FLAG_DELETED) {
-		sendError(c, JERS_ERR_NOJOB, NULL);
-		return 0;
+	/* Everything checks out, create the jobs */
+	if (c) {
+		initNamedResponse(&journal, CMD_ADD_JOBS, CONST_STRLEN(CMD_ADD_JOBS), 1, NULL);
+		initClientResponse(&response, 1);
 	}
 
-	if (unlikely(server.recovery.in_progress)) {
-		if (j->obj.revision >= server.recovery.revision) {
-			print_msg(JERS_LOG_DEBUG, "Skipping recovery of job_mod job %d rev:%ld trans rev:%ld", j->jobid, j->obj.revision, server.recovery.revision);
-			return 0;
+	for (i = 0; i < batch->count; i++) {
+		jersJobAdd *s = &batch->jobs[i];
+
+		if (queues[i] == NULL)
+			continue;
+
+		if (s->jobid == 0)
+			s->jobid = allocated[next_id++];
+
+		last = createJob(c, s, queues[i], resources[i]);
+		resources[i] = NULL;
+
+		if (c) {
+			serializeJobAdd(&journal, s, queues[i], created[i]);
+
+			JSONStartObject(&response, NULL, 0);
+			JSONAddInt(&response, JOBID, last->jobid);
+			JSONEndObject(&response);
 		}
+
+		/* The job has its own copy of everything, so the request can be released */
+		freeJobAdd(s);
+		memset(s, 0, sizeof(jersJobAdd));
 	}
 
-	state = j->state;
-	hold = (j->state == JERS_JOB_HOLDING);
+	status = 0;
 
-	if ((j->state == JERS_JOB_COMPLETED || j->state == JERS_JOB_EXITED || j->state == JERS_JOB_UNKNOWN))
-		completed = 1;
+	/* Don't respond if we are replaying a command */
+	if (c == NULL)
+		goto end;
 
-	if (completed && mj->restart != 1) {
-		/* If a job is completed, we are allowed to run a subset of 'mod' actions.
-		 * Actions that are not allowed, unless the restart flag is set:
-		 *  - Hold
-		 *  - Defer
-		 */
-		if (mj->defer_time != UNSET_TIME_T || mj->hold != UNSET_8) {
-			sendError(c, JERS_ERR_INVARG, "Unable to modify a completed job without restart flag");
+	journalRequest(c, &journal);
+	c->msg.jobid = last ? last->jobid : 0;
+
+	sendClientMessage(c, last ? &last->obj : NULL, &response);
+
+	print_msg(JERS_LOG_INFO, "%ld jobs created. uid: %d", batch->count, c->uid);
+
+	server.stats.total.submitted += batch->count;
+
+end:
+	for (i = 0; i < batch->count; i++)
+		free(resources[i]);
+
+	free(resources);
+	free(created);
+	free(queues);
+	free(requested);
+	free(allocated);
+
+	return status;
+}
+
+/* Iterator over the jobs matching a filter, shared by the get job and bulk job commands */
+
+struct jobMatch {
+	jersJobFilter *filter;
+	struct queue *q;
+	struct indexed_tag *it;
+	int indexed_tag_index;
+	struct job *next;    // Next job in the tag index
+	size_t index;        // Otherwise the position in the job table
+
+	/* Paged queries walk the jobs in jobid order instead */
+	int ordered;
+	jobid_t cursor;
+
+	/* With an indexed tag, only the tagged jobs are walked, sorted by jobid */
+	jobid_t *jobids;
+	int64_t jobid_count;
+	int64_t jobid_pos;
+
+	int64_t scan_limit;  // Jobids to look at before yielding, 0 for no limit
+	int64_t scanned;
+	int done;            // Set once there are no more jobs to look at
+};
+
+/* Returns 0 if the iterator was setup, or JERS_ERR_NOQUEUE if the filter names a queue that doesn't exist */
+
+static int initJobMatch(struct jobMatch *m, jersJobFilter *s) {
+	memset(m, 0, sizeof(struct jobMatch));
+	m->filter = s;
+
+	/* If a queue filter has been provided, and its not a wildcard look it up first */
+	if (s->filter_fields & JERS_FILTER_QUEUE) {
+
+		if (strchr(s->filters.queue_name, '*') == NULL && strchr(s->filters.queue_name, '?') == NULL)
+		{
+			m->q = findQueue(s->filters.queue_name);
+
+			if (m->q == NULL)
+				return JERS_ERR_NOQUEUE;
+		}
+	}
+
+	/* If the user is filtering on tags, check if one is the indexed tag.
+	 * This greatly speeds up the lookups */
+	if (server.index_tag && s->filter_fields &JERS_FILTER_TAGS && s->filters.tag_count) {
+		for (int i = 0; i < s->filters.tag_count; i++) {
+			if (strcmp(server.index_tag, s->filters.tags[i].key) == 0) {
+				/* Only attempt to use it if it's not wildcarded */
+				if (strchr(s->filters.tags[i].value, '*') == NULL && strchr(s->filters.tags[i].value, '?') == NULL) {
+					HASH_FIND_STR(server.index_tag_table, s->filters.tags[i].value, m->it);
+					m->indexed_tag_index = i;
+				}
+
+				break;
+			 }
+		}
+	}
+
+	/* We either drive though the main job table, or the tag index table */
+	if (m->it)
+		m->next = m->it->jobs;
+
+	return 0;
+}
+
+/* Walk the jobs in jobid order, resuming after the cursor. With an indexed tag,
+ * the tagged jobs after the cursor are sorted by jobid, rather than walking
+ * every jobid. The caller frees m->jobids */
+
+static void orderJobMatch(struct jobMatch *m, jobid_t cursor) {
+	m->ordered = 1;
+	m->cursor = cursor;
+
+	if (m->it) {
+		m->jobids = malloc(sizeof(jobid_t) * HASH_CNT(tag_hh, m->it->jobs));
+
+		if (m->jobids == NULL)
+			error_die("Failed to allocate memory for job query: %s", strerror(errno));
+
+		for (struct job *j = m->it->jobs; j; j = j->tag_hh.next) {
+			if (j->jobid > cursor)
+				m->jobids[m->jobid_count++] = j->jobid;
+		}
+
+		qsort(m->jobids, m->jobid_count, sizeof(jobid_t), cmpJobID);
+	}
+
+	/* A job's tags might change while it's being walked, so check the indexed tag as well */
+	m->it = NULL;
+	m->next = NULL;
+}
+
+/* Check the criteria that only need the jobs hot record, see struct jobHot */
+static int jobMatchesHot(struct jobMatch *m, const struct jobHot *h) {
+	jersJobFilter *s = m->filter;
+
+	if (h->deleted)
+		return 0;
+
+	if (s->filter_fields & JERS_FILTER_STATE) {
+		if (!(s->filters.state &h->state))
 			return 0;
+	}
+
+	if (s->filter_fields & JERS_FILTER_QUEUE) {
+		if (m->q && h->queue != m->q) {
+			return 0;
+		} else {
+			if (matches(s->filters.queue_name, h->queue->name) != 0)
+				return 0;
 		}
 	}
 
-	if (j->state == JERS_JOB_RUNNING || j->internal_state &JERS_FLAG_JOB_STARTED) {
-		sendError(c, JERS_ERR_INVARG, "Unable to modify a running job");
+	if (s->filter_fields & JERS_FILTER_UID) {
+		if (s->filters.uid != h->uid)
+			return 0;
+	}
+
+	/* Check before/after filtering */
+	if (s->filter_fields & JERS_FILTER_BEFORE) {
+		if (s->filters.before.added && h->submit_time > s->filters.before.added)
+			return 0;
+
+		if (s->filters.before.started && (h->start_time == 0 || h->start_time > s->filters.before.started))
+			return 0;
+
+		if (s->filters.before.finished && (h->finish_time == 0 || h->finish_time > s->filters.before.finished))
+			return 0;
+	}
+
+	if (s->filter_fields & JERS_FILTER_AFTER) {
+		if (s->filters.after.added && h->submit_time < s->filters.after.added)
+			return 0;
+
+		if (s->filters.after.started && (h->start_time == 0 || h->start_time < s->filters.after.started))
+			return 0;
+
+		if (s->filters.after.finished && (h->finish_time == 0 || h->finish_time < s->filters.after.finished))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Check the remaining criteria, which need the job itself */
+static int jobMatchesCold(struct jobMatch *m, struct job *j) {
+	jersJobFilter *s = m->filter;
+
+	if (s->filter_fields & JERS_FILTER_JOBNAME) {
+		if (matches(s->filters.job_name, j->jobname) != 0)
+			return 0;
+	}
+
+	/* Check that all the tag filters provided match the job */
+	if (s->filter_fields & JERS_FILTER_TAGS) {
+		for (int i = 0; i < s->filters.tag_count; i++) {
+			/* Skip the indexed tag */
+			if (m->it && i == m->indexed_tag_index)
+				continue;
+
+			int k;
+			for (k = 0; k < j->tag_count; k++) {
+				/* Match the tag first, both keys are interned */
+				if (j->tags[k].key == s->filters.tags[i].key) {
+					/* Match the value */
+					if (matches(s->filters.tags[i].value, j->tags[k].value) == 0)
+						break;
+				}
+			}
+
+			if (k == j->tag_count)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static inline int jobMatches(struct jobMatch *m, struct job *j) {
+	return jobMatchesHot(m, &server.jobTable.hot[j->table_index]) && jobMatchesCold(m, j);
+}
+
+/* Returns the next matching job, or NULL once there are no more (setting done)
+ * or scan_limit jobids have been looked at, leaving the cursor where it got to */
+
+static struct job * nextJobMatch(struct jobMatch *m) {
+	struct jobTable *t = &server.jobTable;
+	struct job *j;
+
+	if (m->ordered && m->jobids) {
+		while (m->jobid_pos < m->jobid_count) {
+			if (m->scan_limit && m->scanned++ == m->scan_limit)
+				return NULL;
+
+			m->cursor = m->jobids[m->jobid_pos++];
+			j = findJob(m->cursor);
+
+			if (j && jobMatches(m, j))
+				return j;
+		}
+
+		m->done = 1;
+		return NULL;
+	}
+
+	if (m->ordered) {
+		while (m->cursor < server.high_jobid) {
+			if (m->scan_limit && m->scanned++ == m->scan_limit)
+				return NULL;
+
+			jobid_t jobid = m->cursor + 1;
+			size_t page = jobid >> JOBTABLE_PAGE_BITS;
+
+			/* Skip over the rest of an empty page in one go */
+			if (page >= t->page_count || t->pages[page] == NULL || t->pages[page]->count == 0) {
+				jobid_t last = ((page + 1) << JOBTABLE_PAGE_BITS) - 1;
+				m->cursor = last < server.high_jobid ? last : server.high_jobid;
+				continue;
+			}
+
+			m->cursor = jobid;
+			j = t->pages[page]->jobs[jobid & (JOBTABLE_PAGE_SIZE - 1)];
+
+			if (j == NULL || !jobMatchesHot(m, &t->hot[j->table_index]))
+				continue;
+
+			if (jobMatchesCold(m, j))
+				return j;
+		}
+
+		m->done = 1;
+		return NULL;
+	}
+
+	if (m->it) {
+		while ((j = m->next) != NULL) {
+			m->next = j->tag_hh.next;
+
+			if (jobMatches(m, j))
+				return j;
+		}
+
+		m->done = 1;
+		return NULL;
+	}
+
+	/* Only jobs that pass on their hot record are looked at */
+	while (m->index < server.jobTable.count) {
+		size_t i = m->index++;
+
+		if (!jobMatchesHot(m, &server.jobTable.hot[i]))
+			continue;
+
+		j = server.jobTable.jobs[i];
+
+		if (jobMatchesCold(m, j))
+			return j;
+	}
+
+	m->done = 1;
+	return NULL;
+}
+
+/* Add the matching jobs the client is allowed to see to a response,
+ * stopping once limit jobs have been added. Returns the number of jobs added */
+
+static int64_t serializeJobMatches(client *c, struct jobMatch *m, int64_t limit, buff_t *r) {
+	jersJobFilter *s = m->filter;
+	struct job *j;
+	int64_t count = 0;
+	int read_all = (c->uid == 0 || c->user->permissions &PERM_READ);
+	int self = (server.permissions.self.count == 0 || c->uid == 0 || (c->user->permissions &PERM_SELF) == PERM_SELF);
+
+	while ((limit <= 0 || count < limit) && (j = nextJobMatch(m)) != NULL) {
+		if (read_all || (self && j->uid == c->uid)) {
+			serialize_jersJob(r, j, s->return_fields);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Send the next chunk of a streamed job query. Each chunk looks at no more than
+ * JOB_STREAM_SCAN jobids, so a chunk may be empty without being the last one.
+ * The last chunk is flagged with STREAM_END */
+
+static int streamJobs(client *c, void *data) {
+	jersJobGet *g = data;
+	struct jobMatch m;
+	buff_t r;
+
+	/* The queue being filtered on might have been removed since the last chunk */
+	if (initJobMatch(&m, &g->filter) != 0) {
+		sendError(c, JERS_ERR_NOQUEUE, NULL);
+		return 1;
+	}
+
+	/* Carry on through the jobs the stream started with */
+	m.ordered = 1;
+	m.cursor = g->cursor;
+	m.it = NULL;
+	m.next = NULL;
+	m.jobids = g->jobids;
+	m.jobid_count = g->jobid_count;
+	m.jobid_pos = g->jobid_pos;
+	m.scan_limit = JOB_STREAM_SCAN;
+
+	initClientResponse(&r, 1);
+	serializeJobMatches(c, &m, g->limit, &r);
+	g->cursor = m.cursor;
+	g->jobid_pos = m.jobid_pos;
+
+	sendClientStreamChunk(c, &r, m.done);
+
+	return m.done;
+}
+
+static void freeJobStream(void *data) {
+	jersJobGet *g = data;
+	freeJobFilter(&g->filter);
+	free(g->jobids);
+}
+
+int command_get_job(client *c, void * args) {
+	jersJobGet * g = args;
+	jersJobFilter * s = &g->filter;
+	struct jobMatch m;
+	struct job * j = NULL;
+
+	buff_t r;
+
+	/* JobId? Just look it up and return the result */
+	if (s->jobid) {
+		j = findJob(s->jobid);
+
+		/* Validate the user has permission
+		 * We use a bogus UID if the job doesn't exist, just to check their permissions */
+		if (check_perm(c, j ? j->uid : 0, PERM_READ)) {
+			sendError(c, JERS_ERR_NOPERM, NULL);
+			return -1;
+		}
+
+		if (j == NULL || (j->internal_state &JERS_FLAG_DELETED)) {
+			sendError(c, JERS_ERR_NOJOB, NULL);
+			return 1;
+		}
+
+		initClientResponse(&r, 1);
+		serialize_jersJob(&r, j, 0);
+
+		return sendClientMessage(c, NULL, &r);
+	}
+
+	if (initJobMatch(&m, s) != 0) {
+		sendError(c, JERS_ERR_NOQUEUE, NULL);
+		return -1;
+	}
+
+	/* The stream takes ownership of the query, sending the jobs a chunk at a time */
+	if (g->stream) {
+		jersJobGet *stream;
+
+		if (g->limit <= 0)
+			g->limit = JOB_STREAM_CHUNK;
+
+		/* The tagged jobs are sorted once, then walked a chunk at a time */
+		orderJobMatch(&m, g->cursor);
+		g->jobids = m.jobids;
+		g->jobid_count = m.jobid_count;
+
+		stream = dup_mem(g, sizeof(jersJobGet), sizeof(jersJobGet));
+
+		if (stream == NULL)
+			error_die("Failed to allocate memory for job stream: %s", strerror(errno));
+
+		memset(g, 0, sizeof(jersJobGet));
+		startClientStream(c, streamJobs, freeJobStream, stream);
+
 		return 0;
 	}
 
+	if (g->limit > 0 || g->cursor)
+		orderJobMatch(&m, g->cursor);
+
+	initClientResponse(&r, 1);
+	serializeJobMatches(c, &m, g->limit, &r);
+	free(m.jobids);
+
+	return sendClientMessage(c, NULL, &r);
+}
+
+/* Build the list of jobs a bulk command should operate on. This is either the
+ * jobs matching the filter provided, or when replaying, the jobs recorded in the journal.
+ * The list is built up front, as the command may move the jobs around the job/tag tables.
+ * Returns the number of jobs selected, or -1 if an error was sent to the client */
+
+static int64_t selectJobs(client *c, jobSelection *sel, int perm, struct job ***jobs_out) {
+	struct job **jobs = NULL;
+	struct job *j;
+	int64_t count = 0;
+	int64_t size = 0;
+
+	*jobs_out = NULL;
+
+	if (sel->filter) {
+		struct jobMatch m;
+
+		/* Don't let a missing filter act on every job */
+		if (sel->filter->filter_fields == 0) {
+			sendError(c, JERS_ERR_INVARG, "No filter provided");
+			return -1;
+		}
+
+		if (initJobMatch(&m, sel->filter) != 0) {
+			sendError(c, JERS_ERR_NOQUEUE, NULL);
+			return -1;
+		}
+
+		while ((j = nextJobMatch(&m)) != NULL) {
+			/* Silently skip the jobs the user isn't allowed to touch */
+			if (c && check_perm(c, j->uid, perm))
+				continue;
+
+			if (count == size) {
+				size = size ? size * 2 : 64;
+				jobs = realloc(jobs, sizeof(struct job *) * size);
+
+				if (jobs == NULL)
+					error_die("Failed to allocate memory for job selection: %s", strerror(errno));
+			}
+
+			jobs[count++] = j;
+		}
+	} else {
+		jobs = malloc(sizeof(struct job *) * sel->count);
+
+		if (jobs == NULL)
+			error_die("Failed to allocate memory for job selection: %s", strerror(errno));
+
+		for (int64_t i = 0; i < sel->count; i++) {
+			j = findJob(sel->jobids[i]);
+
+			if (j == NULL || j->internal_state &JERS_FLAG_DELETED)
+				continue;
+
+			if (c && check_perm(c, j->uid, perm))
+				continue;
+
+			if (unlikely(server.recovery.in_progress)) {
+				if (j->obj.revision >= sel->revisions[i]) {
+					print_msg(JERS_LOG_DEBUG, "Skipping recovery of job %d rev:%ld trans rev:%ld", j->jobid, j->obj.revision, sel->revisions[i]);
+					continue;
+				}
+			}
+
+			jobs[count++] = j;
+		}
+	}
+
+	*jobs_out = jobs;
+
+	return count;
+}
+
+static char ** dupStringArray(int64_t count, char **array) {
+	char **copy = malloc(sizeof(char *) * (count ? count : 1));
+
+	if (copy == NULL)
+		error_die("Failed to allocate memory for string array: %s", strerror(errno));
+
+	for (int64_t i = 0; i < count; i++)
+		copy[i] = array[i] ? strdup(array[i]) : NULL;
+
+	return copy;
+}
+
+static key_val_t * dupStringMap(int64_t count, key_val_t *map) {
+	key_val_t *copy = malloc(sizeof(key_val_t) * (count ? count : 1));
+
+	if (copy == NULL)
+		error_die("Failed to allocate memory for string map: %s", strerror(errno));
+
+	for (int64_t i = 0; i < count; i++) {
+		copy[i].key = strdup(map[i].key);
+		copy[i].value = map[i].value ? strdup(map[i].value) : NULL;
+	}
+
+	return copy;
+}
+
+/* Validate the parts of a modification that don't depend on the job being modified.
+ * created is set to the environment profile the modification created, if any */
+
+static int validateJobMod(jersJobMod *mj, struct queue **queue, struct jobResource **resources, struct envProfile **created, const char **err_msg) {
+	*queue = NULL;
+	*created = NULL;
+	*resources = NULL;
+	*err_msg = NULL;
+
 	if (mj->priority != UNSET_32) {
 		if (mj->priority < JERS_JOB_MIN_PRIORITY || mj->priority > JERS_JOB_MAX_PRIORITY) {
-			sendError(c, JERS_ERR_INVARG, "Invalid priority specified");
-			return 0;
+			*err_msg = "Invalid priority specified";
+			return JERS_ERR_INVARG;
 		}
 	}
 
 	if (mj->queue) {
-		q = findQueue(mj->queue);
+		*queue = findQueue(mj->queue);
 
-		if (q == NULL) {
-			sendError(c, JERS_ERR_NOQUEUE, NULL);
-			return 0;
-		}
+		if (*queue == NULL)
+			return JERS_ERR_NOQUEUE;
 	}
 
 	if (mj->clear_resources == 0 && mj->res_count > 0) {
-		new_resources = convertResourceStrings(mj->res_count, mj->resources);
+		*resources = convertResourceStrings(mj->res_count, mj->resources);
 
-		if (new_resources == NULL) {
-			sendError(c, JERS_ERR_NORES, NULL);
-			return -1;
+		if (*resources == NULL)
+			return JERS_ERR_NORES;
+	}
+
+	if (mj->env_count != UNSET_64 || mj->env_profile) {
+		int error = resolveEnvProfile(&mj->env_profile, &mj->env_count, &mj->envs, created, err_msg);
+
+		if (error) {
+			free(*resources);
+			*resources = NULL;
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/* Apply a modification to a job. The queue and resources are those returned by validateJobMod().
+ * Returns 0 on success, otherwise the error code to send the client */
+
+static int modJob(struct job *j, jersJobMod *mj, struct queue *q, struct jobResource *new_resources, const char **err_msg) {
+	int state = j->state;
+	int hold = (j->state == JERS_JOB_HOLDING);
+	int completed = 0;
+	int dirty = 0;
+
+	*err_msg = NULL;
+
+	if ((j->state == JERS_JOB_COMPLETED || j->state == JERS_JOB_EXITED || j->state == JERS_JOB_UNKNOWN))
+		completed = 1;
+
+	if (completed && mj->restart != 1) {
+		/* If a job is completed, we are allowed to run a subset of 'mod' actions.
+		 * Actions that are not allowed, unless the restart flag is set:
+		 *  - Hold
+		 *  - Defer
+		 */
+		if (mj->defer_time != UNSET_TIME_T || mj->hold != UNSET_8) {
+			*err_msg = "Unable to modify a completed job without restart flag";
+			return JERS_ERR_INVARG;
 		}
 	}
 
+	if (j->state == JERS_JOB_RUNNING || j->internal_state &JERS_FLAG_JOB_STARTED) {
+		*err_msg = "Unable to modify a running job";
+		return JERS_ERR_INVARG;
+	}
+
 	/* If we are restarting an unknown job, we need to deallocate the used resources */
 	if (mj->restart && j->state == JERS_JOB_UNKNOWN)
 		deallocateRes(j);
 
 	if (mj->name) {
-		free(j->jobname);
-		j->jobname = mj->name;
+		freeJobString(j, j->jobname);
+		j->jobname = strdup(mj->name);
 		dirty = 1;
 	}
 
 	if (mj->priority != UNSET_32) {
 		j->priority = mj->priority;
+		updateCandidate(j);
 
 		dirty = 1;
 	}
@@ -877,25 +1593,43 @@ int command_mod_job(client *c, void *args) {
 		dirty = 1;
 	}
 
-	if (mj->env_count != UNSET_64) {
+	/* The new environment replaces all of the old one, including its profile */
+	if (mj->env_count != UNSET_64 || mj->env_profile) {
 		if (j->env_count)
-			freeStringArray(j->env_count, &j->envs);
+			freeJobStrings(j, j->env_count, &j->envs);
+
+		if (j->env_profile)
+			releaseEnvProfile(j->env_profile);
+
+		j->env_profile = NULL;
+		j->env_count = mj->env_count == UNSET_64 ? 0 : mj->env_count;
+		j->envs = dupStringArray(j->env_count, mj->envs);
+
+		if (mj->env_profile) {
+			j->env_profile = findEnvProfile(mj->env_profile);
+			holdEnvProfile(j->env_profile);
+		}
 
-		j->env_count = mj->env_count;
-		j->envs = mj->envs;
+		dirty = 1;
 	}
 
 	if (mj->tag_count != UNSET_64) {
 		if (j->tag_count)
-			freeStringMap(j->tag_count, &j->tags);
+			freeJobTags(j, j->tag_count, &j->tags);
 
 		j->tag_count = mj->tag_count;
-		j->tags = (key_val_t *)mj->tags;
+		j->tags = dupStringMap(mj->tag_count, (key_val_t *)mj->tags);
+
+		for (int i = 0; i < j->tag_count; i++) {
+			char *key = internString(j->tags[i].key);
+			free(j->tags[i].key);
+			j->tags[i].key = key;
+		}
 	}
 
 	if (mj->res_count != UNSET_64) {
 		if (j->res_count) {
-			free(j->req_resources);
+			freeJobMem(j, j->req_resources);
 			j->req_resources = NULL;
 			j->res_count = 0;
 
@@ -903,7 +1637,11 @@ int command_mod_job(client *c, void *args) {
 		}
 
 		if (new_resources) {
-			j->req_resources = new_resources;
+			j->req_resources = dup_mem(new_resources, sizeof(struct jobResource) * mj->res_count, sizeof(struct jobResource) * mj->res_count);
+
+			if (j->req_resources == NULL)
+				error_die("Failed to allocate memory for job resources: %s", strerror(errno));
+
 			j->res_count = mj->res_count;
 
 			dirty = 1;
@@ -912,7 +1650,7 @@ int command_mod_job(client *c, void *args) {
 
 	if (mj->clear_resources) {
 		if (j->res_count)
-			free(j->req_resources);
+			freeJobMem(j, j->req_resources);
 
 		j->req_resources = NULL;
 		j->res_count = mj->res_count;
@@ -920,6 +1658,10 @@ int command_mod_job(client *c, void *args) {
 		dirty = 1;
 	}
 
+	/* If the job was waiting on a resource, it might not need it anymore */
+	if (mj->res_count != UNSET_64 || mj->clear_resources)
+		wakeCandidate(j);
+
 	/* Need to clear some fields if this job has previously been completed */
 	if (completed) {
 		if (mj->restart == 1) {
@@ -947,13 +1689,245 @@ int command_mod_job(client *c, void *args) {
 
 	changeJobState(j, state, q, dirty);
 
+	return 0;
+}
+
+/* Serialise the fields of a modification, used to journal a bulk modification.
+ * A new environment profile is written as its variables, so replaying it recreates the profile */
+
+static void serializeJobMod(buff_t *b, jersJobMod *mj, struct envProfile *created) {
+	if (mj->name)
+		JSONAddString(b, JOBNAME, mj->name);
+
+	if (mj->queue)
+		JSONAddString(b, QUEUENAME, mj->queue);
+
+	if (mj->defer_time != UNSET_TIME_T)
+		JSONAddInt(b, DEFERTIME, mj->defer_time);
+
+	if (mj->restart)
+		JSONAddBool(b, RESTART, 1);
+
+	if (mj->nice != UNSET_32)
+		JSONAddInt(b, NICE, mj->nice);
+
+	if (mj->priority != UNSET_32)
+		JSONAddInt(b, PRIORITY, mj->priority);
+
+	if (mj->hold != UNSET_8)
+		JSONAddBool(b, HOLD, mj->hold);
+
+	if (created)
+		JSONAddStringArray(b, ENVS, created->env_count, created->envs);
+	else if (mj->env_count != UNSET_64)
+		JSONAddStringArray(b, ENVS, mj->env_count, mj->envs);
+
+	if (mj->env_profile && created == NULL)
+		JSONAddString(b, ENVPROFILE, mj->env_profile);
+
+	if (mj->tag_count != UNSET_64)
+		JSONAddMap(b, TAGS, mj->tag_count, (key_val_t *)mj->tags);
+
+	if (mj->res_count != UNSET_64)
+		JSONAddStringArray(b, RESOURCES, mj->res_count, mj->resources);
+
+	if (mj->clear_resources)
+		JSONAddBool(b, CLEARRES, 1);
+}
+
+/* Modify all the jobs matching a filter. Jobs that can't be modified, ie. running jobs, are skipped.
+ * The request is journaled with the list of jobs modified, rather than the filter,
+ * as the filter might match a different set of jobs when replayed. */
+
+static int modJobs(client *c, jersJobModArgs *ma) {
+	jersJobMod *mj = &ma->mod;
+	struct queue *q = NULL;
+	struct jobResource *resources = NULL;
+	struct envProfile *created = NULL;
+	struct job **jobs = NULL;
+	const char *err_msg = NULL;
+	int64_t count, modified = 0;
+	buff_t response, journal;
+	int error;
+
+	if ((count = selectJobs(c, &ma->select, PERM_WRITE, &jobs)) < 0)
+		return -1;
+
+	if ((error = validateJobMod(mj, &q, &resources, &created, &err_msg)) != 0) {
+		sendError(c, error, err_msg);
+		free(jobs);
+		return -1;
+	}
+
+	if (c) {
+		initClientResponse(&response, 1);
+
+		initRequest(&journal, CMD_MOD_JOB, 1);
+		serializeJobMod(&journal, mj, created);
+		JSONEndObject(&journal);
+		JSONStartArray(&journal, "DATA", 4);
+	}
+
+	for (int64_t i = 0; i < count; i++) {
+		struct job *j = jobs[i];
+
+		if (modJob(j, mj, q, resources, &err_msg) != 0)
+			continue;
+
+		modified++;
+
+		if (c) {
+			JSONStartObject(&response, NULL, 0);
+			JSONAddInt(&response, JOBID, j->jobid);
+			JSONEndObject(&response);
+
+			JSONStartObject(&journal, NULL, 0);
+			JSONAddInt(&journal, JOBID, j->jobid);
+			JSONAddInt(&journal, REVISION, j->obj.revision);
+			JSONEndObject(&journal);
+		}
+	}
+
+	free(resources);
+	free(jobs);
+
+	/* Don't respond if we are replaying a command */
+	if (c == NULL)
+		return 0;
+
+	print_msg(JERS_LOG_INFO, "%ld jobs modified. uid: %d", modified, c->uid);
+
+	sendClientMessage(c, NULL, &response);
+
+	/* Nothing to journal if no jobs were modified */
+	if (modified == 0) {
+		buffFree(&journal);
+		return 1;
+	}
+
+	journalRequest(c, &journal);
+
+	return 0;
+}
+
+int command_mod_job(client *c, void *args) {
+	jersJobModArgs *ma = args;
+	jersJobMod *mj = &ma->mod;
+	struct job * j = NULL;
+	struct queue * q = NULL;
+	struct jobResource *new_resources = NULL;
+	struct envProfile *created = NULL;
+	const char *err_msg = NULL;
+	int error;
+
+	if (ma->select.selected)
+		return modJobs(c, ma);
+
+	if (mj->jobid == 0) {
+		sendError(c, JERS_ERR_NOJOB, NULL);
+		return 0;
+	}
+
+	j = findJob(mj->jobid);
+
+	if (likely(server.recovery.in_progress == 0)) {
+		/* Validate the user has permission
+		 * We use a bogus ID if the job doesn't exist, just to check their permissions */
+		if (check_perm(c, j ? j->uid : 0, PERM_WRITE)) {
+			sendError(c, JERS_ERR_NOPERM, NULL);
+			return -1;
+		}
+	}
+
+	if (j == NULL || j->internal_state &JERS_FLAG_DELETED) {
+		sendError(c, JERS_ERR_NOJOB, NULL);
+		return 0;
+	}
+
+	if (unlikely(server.recovery.in_progress)) {
+		if (j->obj.revision >= server.recovery.revision) {
+			print_msg(JERS_LOG_DEBUG, "Skipping recovery of job_mod job %d rev:%ld trans rev:%ld", j->jobid, j->obj.revision, server.recovery.revision);
+			return 0;
+		}
+	}
+
+	/* The request is journaled as it was sent, so it has the variables of a new profile */
+	if ((error = validateJobMod(mj, &q, &new_resources, &created, &err_msg)) == 0)
+		error = modJob(j, mj, q, new_resources, &err_msg);
+
+	free(new_resources);
+
+	if (error) {
+		sendError(c, error, err_msg);
+		return error == JERS_ERR_NORES ? -1 : 0;
+	}
+
 	return sendClientReturnCode(c, &j->obj, "0");
 }
 
+/* Delete all the jobs matching a filter, journaling the list of jobs deleted */
+
+static int delJobs(client *c, jersJobDel *jd) {
+	struct job **jobs = NULL;
+	int64_t count;
+	buff_t response, journal;
+
+	if ((count = selectJobs(c, &jd->select, PERM_WRITE, &jobs)) < 0)
+		return -1;
+
+	if (c) {
+		initClientResponse(&response, 1);
+
+		initRequest(&journal, CMD_DEL_JOB, 1);
+		JSONEndObject(&journal);
+		JSONStartArray(&journal, "DATA", 4);
+	}
+
+	for (int64_t i = 0; i < count; i++) {
+		struct job *j = jobs[i];
+
+		deleteJob(j);
+
+		if (c) {
+			JSONStartObject(&response, NULL, 0);
+			JSONAddInt(&response, JOBID, j->jobid);
+			JSONEndObject(&response);
+
+			JSONStartObject(&journal, NULL, 0);
+			JSONAddInt(&journal, JOBID, j->jobid);
+			JSONAddInt(&journal, REVISION, j->obj.revision);
+			JSONEndObject(&journal);
+		}
+	}
+
+	free(jobs);
+
+	/* Don't respond if we are replaying a command */
+	if (c == NULL)
+		return 0;
+
+	print_msg(JERS_LOG_INFO, "%ld jobs deleted. uid: %d", count, c->uid);
+
+	sendClientMessage(c, NULL, &response);
+
+	/* Nothing to journal if no jobs were deleted */
+	if (count == 0) {
+		buffFree(&journal);
+		return 1;
+	}
+
+	journalRequest(c, &journal);
+
+	return 0;
+}
+
 int command_del_job(client * c, void * args) {
 	jersJobDel * jd = args;
 	struct job * j = NULL;
 
+	if (jd->select.selected)
+		return delJobs(c, jd);
+
 	j = findJob(jd->jobid);
 
 	if (likely(server.recovery.in_progress == 0)) {
@@ -980,57 +1954,107 @@ int command_del_job(client * c, void * args) {
 	return sendClientReturnCode(c, NULL, "0");
 }
 
-int command_sig_job(client * c, void * args) {
-	jersJobSig * js = args;
-	struct job * j = NULL;
-
-	j = findJob(js->jobid);
+/* Signal a job, or just check it's running if signum is 0.
+ * Returns 0 on success, otherwise the error code to send the client */
 
-	/* Validate the user has permission
-	 * We use a bogus ID if the job doesn't exist, just to check their permissions */
-	if (check_perm(c, j ? j->uid : 0, (js->signum == 0 ? PERM_READ : PERM_WRITE))) {
-		sendError(c, JERS_ERR_NOPERM, NULL);
-		return -1;
-	}
-
-	if (!j || j->internal_state &JERS_FLAG_DELETED) {
-		sendError(c, JERS_ERR_NOJOB, NULL);
-		return 1;
-	}
+static int sigJob(client *c, struct job *j, int signum, const char **err_msg) {
+	*err_msg = NULL;
 
 	if (j->state != JERS_JOB_RUNNING) {
 		/* If the job state is unknown, we will set this job state to the signal provided
 		 * We also need to deallocate the resources assigned to this job */
-		if (j->state == JERS_JOB_UNKNOWN && js->signum != 0) {
+		if (j->state == JERS_JOB_UNKNOWN && signum != 0) {
 			j->pid = -1;
 			j->finish_time = time(NULL);
-			j->signal = js->signum;
+			j->signal = signum;
 			j->exitcode = 128 + j->signal;
 
 			changeJobState(j, JERS_JOB_EXITED, NULL, 1);
 			deallocateRes(j);
 
-			return sendClientReturnCode(c, NULL, "0");
+			return 0;
 		}
 
-		sendError(c, JERS_ERR_INVSTATE, "Job is not running");
-		return 1;
+		*err_msg = "Job is not running";
+		return JERS_ERR_INVSTATE;
 	}
 
 	/* signo == 0 wants to just test the job is running */
-	if (js->signum == 0)
-		return sendClientReturnCode(c, NULL, "0");
+	if (signum == 0)
+		return 0;
 
 	/* Send the requested signal to the job (via the agent) */
 	buff_t sig_message;
 	initRequest(&sig_message, CMD_SIG_JOB, 1);
 
-	JSONAddInt(&sig_message, JOBID, js->jobid);
-	JSONAddInt(&sig_message, SIGNAL, js->signum);
+	JSONAddInt(&sig_message, JOBID, j->jobid);
+	JSONAddInt(&sig_message, SIGNAL, signum);
 	JSONAddInt(&sig_message, UID, c->uid);
 
 	sendAgentMessage(j->queue->agent, &sig_message);
 
+	return 0;
+}
+
+/* Signal all the jobs matching a filter, jobs that aren't running are skipped */
+
+static int sigJobs(client *c, jersJobSig *js) {
+	struct job **jobs = NULL;
+	const char *err_msg = NULL;
+	int64_t count, signalled = 0;
+	buff_t response;
+
+	if ((count = selectJobs(c, &js->select, (js->signum == 0 ? PERM_READ : PERM_WRITE), &jobs)) < 0)
+		return -1;
+
+	initClientResponse(&response, 1);
+
+	for (int64_t i = 0; i < count; i++) {
+		if (sigJob(c, jobs[i], js->signum, &err_msg) != 0)
+			continue;
+
+		JSONStartObject(&response, NULL, 0);
+		JSONAddInt(&response, JOBID, jobs[i]->jobid);
+		JSONEndObject(&response);
+
+		signalled++;
+	}
+
+	free(jobs);
+
+	print_msg(JERS_LOG_INFO, "%ld jobs signalled with %d. uid: %d", signalled, js->signum, c->uid);
+
+	return sendClientMessage(c, NULL, &response);
+}
+
+int command_sig_job(client * c, void * args) {
+	jersJobSig * js = args;
+	struct job * j = NULL;
+	const char *err_msg = NULL;
+	int error;
+
+	if (js->select.selected)
+		return sigJobs(c, js);
+
+	j = findJob(js->jobid);
+
+	/* Validate the user has permission
+	 * We use a bogus ID if the job doesn't exist, just to check their permissions */
+	if (check_perm(c, j ? j->uid : 0, (js->signum == 0 ? PERM_READ : PERM_WRITE))) {
+		sendError(c, JERS_ERR_NOPERM, NULL);
+		return -1;
+	}
+
+	if (!j || j->internal_state &JERS_FLAG_DELETED) {
+		sendError(c, JERS_ERR_NOJOB, NULL);
+		return 1;
+	}
+
+	if ((error = sigJob(c, j, js->signum, &err_msg)) != 0) {
+		sendError(c, error, err_msg);
+		return 1;
+	}
+
 	return sendClientReturnCode(c, NULL, "0");
 }
 
@@ -1137,7 +2161,7 @@ int command_set_tag(client * c, void * args) {
 			if (indexed)
 				delIndexTag(j);
 
-			free(j->tags[i].value);
+			freeJobString(j, j->tags[i].value);
 			free(ts->key);
 			j->tags[i].value = ts->value;
 			break;
@@ -1145,10 +2169,21 @@ int command_set_tag(client * c, void * args) {
 	}
 
 	if (i == j->tag_count) {
-		/* Does not have the tag, need to add it */
-		j->tags = realloc(j->tags, ++j->tag_count * sizeof(key_val_t));
-		j->tags[i].key = ts->key;
+		/* Does not have the tag, need to add it. Tags packed into the jobs arena can't be grown in place */
+		if (jobArenaOwns(j, j->tags)) {
+			key_val_t *tags = malloc(sizeof(key_val_t) * (j->tag_count + 1));
+
+			if (tags == NULL)
+				error_die("Failed to allocate memory for job tags: %s", strerror(errno));
+
+			j->tags = memcpy(tags, j->tags, sizeof(key_val_t) * j->tag_count++);
+		} else {
+			j->tags = realloc(j->tags, ++j->tag_count * sizeof(key_val_t));
+		}
+
+		j->tags[i].key = internString(ts->key);
 		j->tags[i].value = ts->value;
+		free(ts->key);
 	}
 
 	if (indexed)
@@ -1190,8 +2225,8 @@ int command_del_tag(client * c, void * args) {
 			if (indexed)
 				delIndexTag(j);
 
-			free(j->tags[i].key);
-			free(j->tags[i].value);
+			freeJobString(j, j->tags[i].key);
+			freeJobString(j, j->tags[i].value);
 
 			memmove(&j->tags[i], &j->tags[i + 1], sizeof(key_val_t) * (j->tag_count - i - 1));
 			break;
@@ -1210,63 +2245,88 @@ int command_del_tag(client * c, void * args) {
 	return sendClientReturnCode(c, &j->obj, "0");
 }
 
+/* Everything but the environment profile is borrowed from the request */
+static void freeJobAdd(jersJobAdd *ja) {
+	free(ja->env_profile);
+}
+
 void free_add_job(void * args, int status) {
-	jersJobAdd * ja = args;
+	UNUSED(status);
 
-	if (status) {
-		free(ja->name);
-		free(ja->shell);
-		free(ja->stdout);
-		free(ja->stderr);
-		free(ja->wrapper);
-		free(ja->pre_cmd);
-		free(ja->post_cmd);
-
-		freeStringArray(ja->argc, &ja->argv);
-		freeStringArray(ja->env_count, &ja->envs);
-		freeStringMap(ja->tag_count, (key_val_t **)&ja->tags);
-	}
-
-	free(ja->queue);
-	freeStringArray(ja->res_count, &ja->resources);
-	free(ja);
+	freeJobAdd(args);
+	free(args);
 }
 
-void free_get_job(void * args, int status) {
-	jersJobFilter * jf = args;
+void free_add_jobs(void * args, int status) {
+	jobAddBatch *b = args;
 
 	UNUSED(status);
 
+	/* Jobs that were created have already been cleared out */
+	for (int64_t i = 0; i < b->count; i++)
+		freeJobAdd(&b->jobs[i]);
+
+	free(b->jobs);
+	free(b);
+}
+
+static void freeJobFilter(jersJobFilter *jf) {
 	free(jf->filters.job_name);
 	free(jf->filters.queue_name);
+
+	for (int i = 0; i < jf->filters.tag_count; i++) {
+		if (jf->filters.tags[i].key)
+			releaseString(jf->filters.tags[i].key);
+
+		jf->filters.tags[i].key = NULL;
+	}
+
 	freeStringMap(jf->filters.tag_count, (key_val_t **)&jf->filters.tags);
 	freeStringArray(jf->filters.res_count, &jf->filters.resources);
-	free(jf);
 }
 
-void free_mod_job(void * args, int status) {
-	jersJobMod * jm = args;
+void free_get_job(void * args, int status) {
+	jersJobGet * g = args;
 
-	if (status) {
-		free(jm->name);
-		freeStringArray(jm->env_count, &jm->envs);
-		freeStringMap(jm->tag_count, (key_val_t **)&jm->tags);
+	UNUSED(status);
+
+	freeJobFilter(&g->filter);
+	free(g);
+}
+
+static void freeJobSelection(jobSelection *sel) {
+	if (sel->filter) {
+		freeJobFilter(sel->filter);
+		free(sel->filter);
 	}
 
-	freeStringArray(jm->res_count, &jm->resources);
-	free(jm->queue);
-	free(jm);
+	free(sel->jobids);
+	free(sel->revisions);
+}
+
+void free_mod_job(void * args, int status) {
+	jersJobModArgs * ma = args;
+	jersJobMod * jm = &ma->mod;
+
+	UNUSED(status);
+
+	/* Only the environment profile is owned, the rest is borrowed from the request */
+	free(jm->env_profile);
+	freeJobSelection(&ma->select);
+	free(ma);
 }
 
 void free_del_job(void * args, int status) {
 	jersJobDel * jd = args;
 	UNUSED(status);
+	freeJobSelection(&jd->select);
 	free(jd);
 }
 
 void free_sig_job(void * args, int status) {
 	jersJobSig * js = args;
 	UNUSED(status);
+	freeJobSelection(&js->select);
 	free(js);
 }
 
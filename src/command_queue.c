@@ -146,6 +146,7 @@ int command_add_queue(client * c, void * args) {
 		} else {
 			/* Asked to create a queue which has just been deleted.
 			 * It's easier to remove it from the hashtable, then re-add it. */
+			undeleteQueue(q);
 			HASH_DEL(server.queueTable, q);
 
 			free(q->name);
@@ -349,6 +350,7 @@ int command_mod_queue(client *c, void * args) {
 
 	if (qm->priority != UNSET_32 && q->priority != qm->priority) {
 		q->priority = qm->priority;
+		reorderResourceWaiters(q);
 		dirty = 1;
 	}
 
@@ -369,13 +371,17 @@ int command_mod_queue(client *c, void * args) {
 
 	updateObject(&q->obj, dirty);
 
+	/* The queue might have been started or had its limit raised */
+	if (dirty)
+		requestSchedule();
+
 	return sendClientReturnCode(c, &q->obj, "0");
 }
 
 int command_del_queue(client *c, void *args) {
 	jersQueueDel *qd = args;
 	struct queue *q = NULL;
-	struct job *j = NULL;
+	size_t i;
 
 	if (qd->name == NULL) {
 		sendError(c, JERS_ERR_INVARG, "No queue provided");
@@ -395,17 +401,19 @@ int command_del_queue(client *c, void *args) {
 	}
 
 	/* We can only delete a queue if there are no active jobs on it. Deleted jobs are ok. */
-	for (j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->queue == q && !(j->internal_state &JERS_FLAG_DELETED))
+	for (i = 0; i < server.jobTable.count; i++) {
+		struct jobHot *h = &server.jobTable.hot[i];
+
+		if (h->queue == q && !h->deleted)
 			break;
 	}
 
-	if (j != NULL) {
+	if (i < server.jobTable.count) {
 		sendError(c, JERS_ERR_NOTEMPTY, NULL);
 		return 1;
 	}
 
-	q->internal_state |= JERS_FLAG_DELETED;
+	deleteQueue(q);
 
 	return sendClientReturnCode(c, NULL, "0");
 }
@@ -129,9 +129,9 @@ int command_add_resource(client *c, void *args) {
 		}
 
 		/* We have a deleted version of this resource. Free the old name and reuse the resource */
+		undeleteRes(r);
 		HASH_DEL(server.resTable, r);
 		free(r->name);
-		r->internal_state &= ~JERS_FLAG_DELETED;
 	} else {
 		r = calloc(sizeof(struct resource), 1);
 	}
@@ -210,6 +210,9 @@ int command_mod_resource(client *c, void *args) {
 	r->count = rm->count;
 	updateObject(&r->obj, 1);
 
+	wakeResourceWaiters(r);
+	requestSchedule();
+
 	return sendClientReturnCode(c, &r->obj, "0");
 }
 
@@ -231,10 +234,14 @@ int command_del_resource(client *c, void *args) {
 	}
 
 	/* Check that it's not in use. */
-	for (struct job * j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->res_count == 0 || j->internal_state & JERS_FLAG_DELETED)
+	for (size_t k = 0; k < server.jobTable.count; k++) {
+		struct jobHot *h = &server.jobTable.hot[k];
+
+		if (h->res_count == 0 || h->deleted)
 			continue;
 
+		struct job * j = server.jobTable.jobs[k];
+
 		for (int i = 0; i < j->res_count; i++) {
 			if (j->req_resources[i].res == r) {
 				in_use = 1;
@@ -249,7 +256,7 @@ int command_del_resource(client *c, void *args) {
 	}
 
 	/* Mark it as deleted and dirty. It will be cleaned up later */
-	r->internal_state |= JERS_FLAG_DELETED;
+	deleteRes(r);
 
 	return sendClientReturnCode(c, NULL, "0");
 }
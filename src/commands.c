@@ -51,6 +51,7 @@ void runComplexCommand(client * c);
 
 command_t commands[] = {
 	{CMD_ADD_JOB,      0,                     CMDFLG_REPLAY, command_add_job,      deserialize_add_job,   free_add_job},
+	{CMD_ADD_JOBS,     0,                     CMDFLG_REPLAY, command_add_jobs,     deserialize_add_jobs,  free_add_jobs},
 	{CMD_GET_JOB,      0,                     0,             command_get_job,      deserialize_get_job,   free_get_job},
 	{CMD_MOD_JOB,      0,                     CMDFLG_REPLAY, command_mod_job,      deserialize_mod_job,   free_mod_job},
 	{CMD_DEL_JOB,      0,                     CMDFLG_REPLAY, command_del_job,      deserialize_del_job,   free_del_job},
@@ -80,6 +81,7 @@ agent_command_t agent_commands[] = {
 	{AGENT_PROXY_CONN,    0,             command_agent_proxyconn},
 	{AGENT_PROXY_DATA,    0,             command_agent_proxydata},
 	{AGENT_PROXY_CLOSE,   0,             command_agent_proxyclose},
+	{AGENT_ENVPROFILE_MISS, 0,           command_agent_envprofilemiss},
 };
 
 command_t * sorted_commands = NULL;
@@ -171,6 +173,7 @@ int runCommand(client *c) {
 			switch (server.readonly) {
 				case READONLY_ENOSPACE: errmsg = "JERS is in READONLY mode. - Check disk space"; break;
 				case READONLY_BGSAVE: errmsg = "JERS is in READONLY mode. - Check jersd logfile - Save failed"; break;
+				case READONLY_JOURNAL: errmsg = "JERS is in READONLY mode. - Check jersd logfile - Journal write failed"; break;
 			}
 
 			sendError(c, JERS_ERR_READONLY, errmsg);
@@ -188,11 +191,23 @@ int runCommand(client *c) {
 		}
 	}
 
+	/* Unless flushes are deferred, hold the reply to an update until the journal has been flushed.
+	 * Proxied clients are replied to via their agent, so they wait for the flush here */
+	int commit_wait = server.flush.defer != FLUSH_DEFER && command_to_run->flags &CMDFLG_REPLAY;
+
+	if (commit_wait && c->connection.proxy.agent == NULL)
+		waitClientCommit(c);
+
 	int status = command_to_run->cmd_func(c, args);
 
 	/* Write to the journal if the transaction was an update and successful */
 	if (command_to_run->flags &CMDFLG_REPLAY && status == 0) {
 		stateSaveCmd(c->uid, c->msg.command, c->msg.msg_cpy, c->msg.jobid, c->msg.revision);
+
+		if (c->commit_wait)
+			c->commit_seq = journalQueued();
+		else if (commit_wait)
+			flush_journal(1);
 	}
 
 	if (likely(command_to_run->free_func != NULL))
@@ -207,7 +222,7 @@ int runCommand(client *c) {
 			logSlowRequest(c->msg.command, c->uid, duration, c->msg.msg_cpy);
 	}
 
-	free_message(&c->msg);
+	reset_message(&c->msg);
 	return status;
 }
 
@@ -241,7 +256,7 @@ int runAgentCommand(agent * a) {
 	if (status == 0 && command_to_run->flags &CMDFLG_REPLAY)
 		stateSaveCmd(0, a->msg.command, a->msg.msg_cpy, 0, 0);
 
-	free_message(&a->msg);
+	reset_message(&a->msg);
 
 	/* Always a good return for agent commands */
 	return 0;
@@ -266,7 +281,10 @@ static int _sendMessage(struct connectionType *connection, buff_t *b, buff_t *me
 
 	} else {
 		buffAddBuff(b, message);
-		pollSetWritable(connection);
+
+		/* Responses waiting on a group commit are sent once the journal is flushed */
+		if (connection->type != CLIENT || ((client *)connection->ptr)->commit_wait == 0)
+			pollSetWritable(connection);
 	}
 	buffFree(message);
 
@@ -359,6 +377,13 @@ int sendClientMessage(client *c, jers_object *obj, buff_t *msg) {
 	return _sendMessage(&c->connection, &c->response, msg);
 }
 
+/* Send a chunk of a streamed response, flagging if it's the last one */
+int sendClientStreamChunk(client *c, buff_t *msg, int end) {
+	closeStreamResponse(msg, end);
+
+	return _sendMessage(&c->connection, &c->response, msg);
+}
+
 void sendAgentMessage(agent * a, buff_t *msg) {
 	/* Close the request */
 	closeRequest(msg);
@@ -456,6 +481,22 @@ void free_get_agent(void *args, int status) {
 	free(f->host);
 }
 
+/* Resident set size of the daemon in bytes, or -1 if it can't be read */
+static int64_t getRSS(void) {
+	FILE *f = fopen("/proc/self/statm", "r");
+	long pages = -1;
+
+	if (f == NULL)
+		return -1;
+
+	if (fscanf(f, "%*s %ld", &pages) != 1)
+		pages = -1;
+
+	fclose(f);
+
+	return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
 int command_stats(client * c, void * args) {
 	UNUSED(args);
 	buff_t b;
@@ -479,6 +520,16 @@ int command_stats(client * c, void * args) {
 	JSONAddInt(&b, STATSTOTALDELETED, server.stats.total.deleted);
 	JSONAddInt(&b, STATSTOTALUNKNOWN, server.stats.total.unknown);
 
+	JSONAddInt(&b, STATSRSS, getRSS());
+	JSONAddInt(&b, STATSJOBSLABS, server.stats.memory.job_slabs);
+	JSONAddInt(&b, STATSJOBARENAS, server.stats.memory.arenas);
+	JSONAddInt(&b, STATSJOBARENABYTES, server.stats.memory.arena_bytes);
+	JSONAddInt(&b, STATSJOBSFREED, server.stats.memory.freed);
+	JSONAddInt(&b, STATSJOBFREETIME, server.stats.memory.free_ns / 1000);
+	JSONAddInt(&b, STATSINTERNED, server.stats.memory.interned);
+	JSONAddInt(&b, STATSINTERNEDBYTES, server.stats.memory.interned_bytes);
+	JSONAddInt(&b, STATSINTERNREFS, server.stats.memory.intern_refs);
+
 	JSONEndObject(&b);
 
 	return sendClientMessage(c, NULL, &b);
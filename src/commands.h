@@ -32,6 +32,7 @@
 
 int sendClientReturnCode(client *c, jers_object * obj, const char *ret);
 int sendClientMessage(client *c, jers_object *obj, buff_t *b);
+int sendClientStreamChunk(client *c, buff_t *b, int end);
 void sendAgentMessage(agent * a, buff_t *b);
 void sendError(client * c, int error, const char * msg);
 void sendErrorFmt(client *c, int error, const char *fmt, ...) __attribute__((format(printf,3,4)));
@@ -40,6 +41,12 @@ int initClientResponse(buff_t *b, int version);
 
 void replayCommand(msg_t * msg);
 
+/* A batch of job submissions */
+typedef struct {
+	int64_t count;
+	jersJobAdd *jobs;
+} jobAddBatch;
+
 typedef struct command {
 	char * name;
 	int perm;     // Bitmask of required permissions
@@ -58,6 +65,7 @@ typedef struct {
 int command_agent_login(agent * a, msg_t * msg);
 int command_agent_jobstart(agent * a, msg_t * msg);
 int command_agent_jobcompleted(agent * a, msg_t * msg);
+int command_agent_envprofilemiss(agent * a, msg_t * msg);
 int command_agent_recon(agent * a, msg_t * msg);
 int command_agent_authresp(agent * a, msg_t * msg);
 int command_agent_proxyconn(agent * a, msg_t * msg);
@@ -67,6 +75,7 @@ int command_agent_proxyclose(agent * a, msg_t * msg);
 int command_stats(client *, void *);
 
 int command_add_job(client *, void *);
+int command_add_jobs(client *, void *);
 int command_get_job(client *, void *);
 int command_mod_job(client *, void *);
 int command_del_job(client *, void *);
@@ -90,6 +99,7 @@ int command_clearcache(client *, void *);
 
 
 void* deserialize_add_job(msg_t *);
+void* deserialize_add_jobs(msg_t *);
 void* deserialize_get_job(msg_t *);
 void* deserialize_mod_job(msg_t *);
 void* deserialize_del_job(msg_t *);
@@ -109,6 +119,7 @@ void* deserialize_del_tag(msg_t *);
 void* deserialize_get_agent(msg_t *);
 
 void free_add_job(void *, int);
+void free_add_jobs(void *, int);
 void free_get_job(void *, int);
 void free_mod_job(void *, int);
 void free_del_job(void *, int);
@@ -149,13 +160,46 @@ void free_get_agent(void *, int);
 
 /* Internal command structures */
 
+/* A job query. If a limit or cursor is provided, up to limit jobs are returned
+ * in jobid order, starting after the cursor. If stream is set, all the matching jobs
+ * are sent back in chunks of limit jobs, between other events */
+typedef struct {
+	jersJobFilter filter;
+	int64_t limit;
+	jobid_t cursor;
+	int stream;
+
+	/* A stream filtering on the indexed tag walks the tagged jobs in jobid order */
+	jobid_t *jobids;
+	int64_t jobid_count;
+	int64_t jobid_pos;
+} jersJobGet;
+
+/* The jobs a bulk job command applies to. Either the jobs matching a filter,
+ * or an explicit list of jobs when replaying the journal */
+typedef struct {
+	int selected;
+	jersJobFilter *filter;
+
+	int64_t count;
+	jobid_t *jobids;
+	int64_t *revisions;
+} jobSelection;
+
+typedef struct {
+	jersJobMod mod;
+	jobSelection select;
+} jersJobModArgs;
+
 typedef struct {
 	jobid_t jobid;
 	int signum;
+	jobSelection select;
 } jersJobSig;
 
 typedef struct {
 	jobid_t jobid;
+	jobSelection select;
 } jersJobDel;
 
 typedef struct {
@@ -141,6 +141,12 @@ int64_t getTimeMS(void) {
 	return (tp.tv_sec * 1000) + (tp.tv_nsec / 1000000);
 }
 
+int64_t getTimeNS(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (tp.tv_sec * 1000000000) + tp.tv_nsec;
+}
+
 /* Return a formated timespec as a static string
  *  - If elapsed is zero, print as year-month-day hour:minute:second.milliseconds
  *	Otherwise print an elapsed time as hours minutes seconds milliseconds
@@ -692,6 +698,67 @@ char * hexEncode(const unsigned char *input, int input_len, char *output) {
 	return ret;
 }
 
+/* CRC32C (Castagnoli), used to check journal records.
+ * Uses the SSE4.2 crc32 instruction when the CPU supports it */
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t len) {
+	if (crc32c_table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+
+			crc32c_table[i] = c;
+		}
+	}
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len) {
+	uint64_t crc64 = crc;
+
+	while (len >= 8) {
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		crc64 = __builtin_ia32_crc32di(crc64, value);
+		data += 8;
+		len -= 8;
+	}
+
+	crc = crc64;
+
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+	crc = ~crc;
+
+#if defined(__x86_64__)
+	static int hw = -1;
+
+	if (hw == -1)
+		hw = __builtin_cpu_supports("sse4.2");
+
+	if (hw)
+		return ~crc32c_hw(crc, data, len);
+#endif
+
+	return ~crc32c_sw(crc, data, len);
+}
+
 /* Split a line from a config file into key/value. */
 
 int splitConfigLine(char *line, char **key, char **value) {
@@ -854,6 +921,33 @@ void listSort(struct item_list *list, int (*compar)(const void *, const void *,
 	qsort_r(list->items, list->count, list->item_size, compar, arg);
 }
 
+/* Combine an environment with the variables overriding it. The overrides come
+ * first, followed by the variables from envs that weren't overridden.
+ * merged needs room for both lists, the strings themselves aren't copied.
+ * Returns the number of variables in merged */
+
+int64_t mergeEnv(int64_t env_count, char **envs, int64_t override_count, char **overrides, char **merged) {
+	int64_t count = 0;
+
+	for (int64_t i = 0; i < override_count; i++)
+		merged[count++] = overrides[i];
+
+	for (int64_t i = 0; i < env_count; i++) {
+		size_t name_len = strcspn(envs[i], "=");
+		int64_t k;
+
+		for (k = 0; k < override_count; k++) {
+			if (strncmp(overrides[k], envs[i], name_len) == 0 && (overrides[k][name_len] == '=' || overrides[k][name_len] == '\0'))
+				break;
+		}
+
+		if (k == override_count)
+			merged[count++] = envs[i];
+	}
+
+	return count;
+}
+
 /* Return a key/value from the provided line
  * 'line' is modified and the pointers returned should not be freed */
 
@@ -94,6 +94,7 @@ struct user {
 #define CACHE_EXPIRY 900 // 15 minutes
 
 int64_t getTimeMS(void);
+int64_t getTimeNS(void);
 
 char * escapeString(const char * string, size_t * length);
 void unescapeString(char * string);
@@ -120,6 +121,7 @@ char *skipChars(char *str, const char *skip);
 } while (0);
 
 int isprintable(const char * str);
+int64_t mergeEnv(int64_t env_count, char **envs, int64_t override_count, char **overrides, char **merged);
 void * dup_mem(void * src, size_t len, size_t size);
 
 int int64tostr(char * dest, int64_t num);
@@ -143,6 +145,7 @@ void clearCacheHandler(int signum);
 
 void setup_handlers(void(*shutdownHandler)(int));
 char * hexEncode(const unsigned char *input, int input_len, char *output);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
 int splitConfigLine(char *line, char **key, char **value);
 char *getArg(char **string);
 char **seperateTokens(char *string, char sep);
@@ -47,7 +47,8 @@ enum connectionTypes {
 	ACCT_CONN,
 	ACCT_CLIENT,
 	JOB_ADOPT_CONN,
-	JOB_ADOPT
+	JOB_ADOPT,
+	JOURNAL
 };
 
 struct connectionType {
@@ -188,6 +188,7 @@ void loadQueueACL(char *in_acl) {
 
 void freeConfig(void) {
 	free(server.state_dir);
+	free(server.journal.archive_dir);
 	free(server.socket_path);
 	free(server.agent_socket_path);
 
@@ -220,17 +221,23 @@ void loadConfig(char * config) {
 	server.event_freq = DEFAULT_CONFIG_EVENTFREQ;
 	server.sched_freq = DEFAULT_CONFIG_SCHEDFREQ;
 	server.sched_max = DEFAULT_CONFIG_SCHEDMAX;
+	server.sched_min_interval = DEFAULT_CONFIG_SCHEDMININTERVAL;
 	server.max_run_jobs = DEFAULT_CONFIG_MAXJOBS;
 	server.max_cleanup = DEFAULT_CONFIG_MAXCLEAN;
+	server.client_budget = DEFAULT_CONFIG_CLIENTBUDGET;
 	server.max_jobid = DEFAULT_CONFIG_MAXJOBID;
 	server.socket_path = strdup(DEFAULT_CONFIG_SOCKETPATH);
 	server.agent_socket_path = strdup(DEFAULT_CONFIG_AGENTSOCKETPATH);
 	server.acct_socket_path = strdup(DEFAULT_CONFIG_ACCTSOCKETPATH);
 
 	server.journal.extend_block_size = JOURNAL_EXTEND_DEFAULT;
+	server.journal.max_size = DEFAULT_CONFIG_JOURNALMAXSIZE;
+	server.journal.cleanup = DEFAULT_CONFIG_JOURNALCLEANUP;
 
 	server.flush.defer = DEFAULT_CONFIG_FLUSHDEFER;
 	server.flush.defer_ms = DEFAULT_CONFIG_FLUSHDEFERMS;
+	server.flush.group_ms = DEFAULT_CONFIG_FLUSHGROUPMS;
+	server.flush.group_bytes = DEFAULT_CONFIG_FLUSHGROUPBYTES;
 
 	server.email_freq_ms = DEFAULT_CONFIG_EMAIL_FREQ;
 
@@ -258,11 +265,38 @@ void loadConfig(char * config) {
 			server.state_dir = strdup(value);
 		} else if (strcmp(key, "flush_defer") == 0) {
 			if (strcasecmp(value, "yes") == 0)
-				server.flush.defer = 1;
+				server.flush.defer = FLUSH_DEFER;
+			else if (strcasecmp(value, "group") == 0)
+				server.flush.defer = FLUSH_GROUP;
 			else
-				server.flush.defer = 0;
+				server.flush.defer = FLUSH_SYNC;
 		} else if (strcmp(key, "flush_defer_ms") == 0) {
 			server.flush.defer_ms = atoi(value);
+		} else if (strcmp(key, "journal_format") == 0) {
+			if (strcasecmp(value, "binary") == 0)
+				server.journal.new_binary = 1;
+			else if (strcasecmp(value, "text") == 0)
+				server.journal.new_binary = 0;
+			else
+				error_die("Invalid journal_format '%s' - Expected 'text' or 'binary'", value);
+		} else if (strcmp(key, "journal_max_size") == 0) {
+			server.journal.max_size = atoll(value);
+		} else if (strcmp(key, "journal_cleanup") == 0) {
+			if (strcasecmp(value, "none") == 0)
+				server.journal.cleanup = JOURNAL_CLEANUP_NONE;
+			else if (strcasecmp(value, "delete") == 0)
+				server.journal.cleanup = JOURNAL_CLEANUP_DELETE;
+			else if (strcasecmp(value, "archive") == 0)
+				server.journal.cleanup = JOURNAL_CLEANUP_ARCHIVE;
+			else
+				error_die("Invalid journal_cleanup '%s' - Expected 'none', 'delete' or 'archive'", value);
+		} else if (strcmp(key, "journal_archive_dir") == 0) {
+			free(server.journal.archive_dir);
+			server.journal.archive_dir = strdup(value);
+		} else if (strcmp(key, "flush_group_ms") == 0) {
+			server.flush.group_ms = atoi(value);
+		} else if (strcmp(key, "flush_group_bytes") == 0) {
+			server.flush.group_bytes = atoll(value);
 		} else if (strcmp(key, "background_save_ms") == 0) {
 			server.background_save_ms = atoi(value);
 		} else if (strcmp(key, "event_freq") == 0) {
@@ -271,12 +305,21 @@ void loadConfig(char * config) {
 			server.sched_freq = atoi(value);
 		} else if (strcmp(key, "sched_max") == 0) {
 			server.sched_max = atoi(value);
+		} else if (strcmp(key, "sched_min_interval") == 0) {
+			server.sched_min_interval = atoi(value);
 		} else if (strcmp(key, "max_system_jobs") == 0) {
 			server.max_run_jobs = atoi(value);
 		} else if (strcmp(key, "max_jobid") == 0) {
 			server.max_jobid = atoi(value);
 		} else if (strcmp(key, "max_clean_job") == 0) {
 			server.max_cleanup = atoi(value);
+		} else if (strcmp(key, "client_request_budget") == 0) {
+			server.client_budget = atoi(value);
+
+			if (server.client_budget <= 0) {
+				print_msg(JERS_LOG_WARNING, "Invalid client_request_budget '%s' specified in config file. Using default of %d", value, DEFAULT_CONFIG_CLIENTBUDGET);
+				server.client_budget = DEFAULT_CONFIG_CLIENTBUDGET;
+			}
 		} else if (strcmp(key, "client_listen_socket") == 0) {
 			free(server.socket_path);
 			server.socket_path = strdup(value);
@@ -360,6 +403,9 @@ void loadConfig(char * config) {
 
 	fclose(f);
 
+	if (server.journal.archive_dir == NULL)
+		asprintf(&server.journal.archive_dir, "%s/archive", server.state_dir);
+
 	if (agentList == NULL) {
 		/* No allowed agents specified in the config file,
 		 * only allow an agent connection from localhost */
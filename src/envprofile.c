@@ -0,0 +1,244 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <pthread.h>
+#include <utlist.h>
+#include <ctype.h>
+#include <openssl/evp.h>
+
+/* Jobs are often submitted with the same, fairly large, environment. Rather
+ * than each job carrying its own copy, the environment is kept once as a
+ * profile, named by the SHA-256 hash of its contents. Jobs hold a reference to
+ * their profile, along with a list of any variables they override.
+ *
+ * A new profile is written to the state directory by the next background
+ * save, so saved jobs only need to record its hash. Until then the journal
+ * record that created it carries the variables, so replaying the journal
+ * recreates it. Once no job refers to a profile, it is kept until a save
+ * started after that has completed, as the journal being replayed from the
+ * previous checkpoint might still need it. That also keeps new profiles
+ * around until they have been saved.
+ *
+ * The loader threads look up profiles while loading jobs, so the table is
+ * protected by a mutex. */
+
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+
+void envProfileHash(int64_t count, char **envs, char *hash) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0;
+	size_t len = 0;
+	char *buf, *next;
+
+	/* Each variable is hashed with its terminator, so the boundaries between them count */
+	for (int64_t i = 0; i < count; i++)
+		len += strlen(envs[i]) + 1;
+
+	buf = next = malloc(len ? len : 1);
+
+	if (buf == NULL)
+		error_die("Failed to allocate memory to hash environment: %s", strerror(errno));
+
+	for (int64_t i = 0; i < count; i++)
+		next = stpcpy(next, envs[i]) + 1;
+
+	if (EVP_Digest(buf, len, md, &md_len, EVP_sha256(), NULL) != 1)
+		error_die("Failed to hash environment");
+
+	hexEncode(md, md_len, hash);
+	free(buf);
+}
+
+/* Hashes come from clients and are used to build file names, so only accept what envProfileHash() generates */
+static int validHash(const char *hash) {
+	size_t len = 0;
+
+	for (; hash[len]; len++) {
+		if (!isxdigit((unsigned char)hash[len]) || islower((unsigned char)hash[len]))
+			return 0;
+	}
+
+	return len == ENVPROFILE_HASH_SIZE - 1;
+}
+
+/* A profile without any references goes on the unused list, to be cleaned up later */
+static void unusedEnvProfile(struct envProfile *p) {
+	p->unused_seq = server.flush.save_seq;
+	DL_APPEND2(server.unusedEnvProfiles, p, unused_prev, unused_next);
+}
+
+static struct envProfile * lookupEnvProfile(const char *hash) {
+	struct envProfile *p = NULL;
+
+	HASH_FIND_STR(server.envProfiles, hash, p);
+
+	if (p)
+		return p;
+
+	/* Profiles are only read from disk when a job refers to them */
+	if (server.nosave || (p = stateLoadEnvProfile(hash)) == NULL)
+		return NULL;
+
+	HASH_ADD_STR(server.envProfiles, hash, p);
+	unusedEnvProfile(p);
+
+	return p;
+}
+
+/* Find the profile with this hash. Returns NULL if it doesn't exist */
+struct envProfile * findEnvProfile(const char *hash) {
+	struct envProfile *p;
+
+	if (!validHash(hash))
+		return NULL;
+
+	pthread_mutex_lock(&profileLock);
+	p = lookupEnvProfile(hash);
+	pthread_mutex_unlock(&profileLock);
+
+	return p;
+}
+
+/* Return the profile for these variables, creating it if it doesn't exist.
+ * The variables are copied. created, if provided, is set if the profile is new */
+struct envProfile * addEnvProfile(int64_t count, char **envs, int *created) {
+	char hash[ENVPROFILE_HASH_SIZE];
+	struct envProfile *p;
+
+	envProfileHash(count, envs, hash);
+
+	if (created)
+		*created = 0;
+
+	pthread_mutex_lock(&profileLock);
+
+	if ((p = lookupEnvProfile(hash)) != NULL) {
+		pthread_mutex_unlock(&profileLock);
+		return p;
+	}
+
+	p = calloc(1, sizeof(struct envProfile));
+
+	if (p == NULL)
+		error_die("Failed to allocate memory for environment profile: %s", strerror(errno));
+
+	strcpy(p->hash, hash);
+	p->env_count = count;
+	p->envs = malloc(sizeof(char *) * (count ? count : 1));
+
+	if (p->envs == NULL)
+		error_die("Failed to allocate memory for environment profile: %s", strerror(errno));
+
+	for (int64_t i = 0; i < count; i++) {
+		if ((p->envs[i] = strdup(envs[i])) == NULL)
+			error_die("Failed to allocate memory for environment profile: %s", strerror(errno));
+	}
+
+	p->dirty = 1;
+	server.dirty_envprofiles = 1;
+
+	HASH_ADD_STR(server.envProfiles, hash, p);
+	unusedEnvProfile(p);
+
+	pthread_mutex_unlock(&profileLock);
+
+	if (created)
+		*created = 1;
+
+	print_msg(JERS_LOG_DEBUG, "Created environment profile %s with %ld variables", p->hash, count);
+
+	return p;
+}
+
+void holdEnvProfile(struct envProfile *p) {
+	pthread_mutex_lock(&profileLock);
+
+	if (p->refs++ == 0)
+		DL_DELETE2(server.unusedEnvProfiles, p, unused_prev, unused_next);
+
+	pthread_mutex_unlock(&profileLock);
+}
+
+void releaseEnvProfile(struct envProfile *p) {
+	pthread_mutex_lock(&profileLock);
+
+	if (--p->refs == 0)
+		unusedEnvProfile(p);
+
+	pthread_mutex_unlock(&profileLock);
+}
+
+static void freeEnvProfile(struct envProfile *p) {
+	freeStringArray(p->env_count, &p->envs);
+	free(p);
+}
+
+/* Remove profiles that haven't been used since before the last successful save started.
+ * The unused list is in the order they were released, so stop at the first one that is too recent */
+int cleanupEnvProfiles(uint32_t max_clean) {
+	uint32_t cleaned_up = 0;
+
+	if (max_clean == 0)
+		max_clean = 10;
+
+	pthread_mutex_lock(&profileLock);
+
+	while (server.unusedEnvProfiles && cleaned_up < max_clean) {
+		struct envProfile *p = server.unusedEnvProfiles;
+
+		if (server.nosave == 0) {
+			if (p->unused_seq >= server.flush.saved_seq)
+				break;
+
+			stateDelEnvProfile(p);
+		}
+
+		DL_DELETE2(server.unusedEnvProfiles, p, unused_prev, unused_next);
+		HASH_DEL(server.envProfiles, p);
+		freeEnvProfile(p);
+
+		cleaned_up++;
+	}
+
+	pthread_mutex_unlock(&profileLock);
+
+	return cleaned_up;
+}
+
+void freeEnvProfiles(void) {
+	struct envProfile *p, *tmp;
+
+	HASH_ITER(hh, server.envProfiles, p, tmp) {
+		HASH_DEL(server.envProfiles, p);
+		freeEnvProfile(p);
+	}
+
+	server.unusedEnvProfiles = NULL;
+}
@@ -64,6 +64,7 @@ const struct jers_err jers_errors[] = {
 	{"JERS_ERR_READONLY",    "JERS is in readonly mode"},
 	{"JERS_ERR_NOTCONN",     "Not connected"},
 	{"JERS_ERR_TIMEOUT",     "Timed out"},
+	{"JERS_ERR_NOENVPROFILE", "Environment profile not found"},
 
 	{"JERS_ERR_UNKNOWN",     "Unknown error occurred"}
 };
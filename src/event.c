@@ -42,32 +42,70 @@
 struct event {
 	void (*func)(void);
 	int interval;    // Milliseconds between event triggering
-	int64_t last_fire;
-	struct event * next;
+	int64_t next_fire;
 };
 
-struct event * eventList = NULL;
+/* Timed events are kept in a min-heap ordered by when they next need to fire */
+static struct event ** eventHeap = NULL;
+static int eventCount = 0;
+static int eventSize = 0;
+
+static void eventSiftDown(int i) {
+	while (1) {
+		int child = i * 2 + 1;
+
+		if (child >= eventCount)
+			break;
+
+		if (child + 1 < eventCount && eventHeap[child + 1]->next_fire < eventHeap[child]->next_fire)
+			child++;
+
+		if (eventHeap[i]->next_fire <= eventHeap[child]->next_fire)
+			break;
+
+		struct event *tmp = eventHeap[i];
+		eventHeap[i] = eventHeap[child];
+		eventHeap[child] = tmp;
+		i = child;
+	}
+}
+
+static void eventSiftUp(int i) {
+	while (i > 0 && eventHeap[i]->next_fire < eventHeap[(i - 1) / 2]->next_fire) {
+		struct event *tmp = eventHeap[i];
+		eventHeap[i] = eventHeap[(i - 1) / 2];
+		eventHeap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
 
 void registerEvent(void(*func)(void), int interval) {
 	struct event * e = calloc(sizeof(struct event), 1);
 
 	e->func = func;
 	e->interval = interval;
+	e->next_fire = getTimeMS();
+
+	if (eventCount >= eventSize) {
+		eventSize = eventSize ? eventSize * 2 : 16;
+		eventHeap = realloc(eventHeap, sizeof(struct event *) * eventSize);
 
-	/* Add it to the linked list of events */
-	e->next = eventList;
-	eventList = e;
+		if (eventHeap == NULL)
+			error_die("Failed to allocate memory for events: %s", strerror(errno));
+	}
+
+	eventHeap[eventCount] = e;
+	eventSiftUp(eventCount++);
 	return;
 }
 
 void freeEvents(void) {
-	struct event *e = eventList;
+	for (int i = 0; i < eventCount; i++)
+		free(eventHeap[i]);
 
-	while (e) {
-		struct event *next = e->next;
-		free(e);
-		e = next;
-	}
+	free(eventHeap);
+	eventHeap = NULL;
+	eventCount = eventSize = 0;
 }
 
 void checkBlockingClientEvent(void) {
@@ -92,51 +130,98 @@ void checkBlockingClientEvent(void) {
 	}
 }
 
-void checkClientEvent(void) {
-	client * c = clientList;
+/* Send the next chunk to each client being streamed a response,
+ * once they have received the previous chunk */
 
-	/* Check the connected clients for commands to action,
-	 * we can limit the amount of time we spend running command here. */
+void checkStreamClientEvent(void) {
+	client *c = streamClientList;
 
 	while (c) {
-		if (c->request.used == 0) {
-			c = c->next;
-			continue;
-		}
+		client *next = c->stream_next;
 
-		/* Check if the client has a full request to process */
-		char *nl = memchr(c->request.data, '\n', c->request.used);
+		if (c->response.used == 0) {
+			int rc = (c->stream.callback)(c, c->stream.data);
 
-		if (nl == NULL) {
-			c = c->next;
-			continue;
+			if (rc < 0)
+				handleClientDisconnect(c);
+			else if (rc > 0)
+				stopClientStream(c);
 		}
 
-		*nl = '\0';
-		nl++;
+		c = next;
+	}
+}
+
+static int streamClientReady(void) {
+	for (client *c = streamClientList; c != NULL; c = c->stream_next) {
+		if (c->response.used == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+void checkClientEvent(void) {
+	client * c = readyClientList;
 
-		if (load_message(c->request.data, &c->msg)) {
-			client * c_next = c->next;
-			print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
-			handleClientDisconnect(c);
+	/* Check the clients that have sent us data for commands to action.
+	 * Each client gets to run up to client_budget requests per call,
+	 * so a client pipelining lots of requests can't starve the others. */
+
+	while (c) {
+		client * c_next = c->ready_next;
+		size_t consumed = 0;
+		char *p = c->request.data;
+		int processed = 0;
+
+		while (processed < server.client_budget && consumed < c->request.used) {
+			char *nl = memchr(p, '\n', c->request.used - consumed);
+
+			if (nl == NULL)
+				break;
+
+			*nl = '\0';
+			nl++;
+
+			if (load_message(p, &c->msg)) {
+				print_msg(JERS_LOG_WARNING, "Failed to load client request, disconnecting them.");
+				handleClientDisconnect(c);
+				c = NULL;
+				break;
+			}
+
+			runCommand(c);
+
+			consumed += nl - p;
+			p = nl;
+			processed++;
+
+			/* Hold any other requests until a streamed response has been sent */
+			if (c->stream.callback)
+				break;
+		}
+
+		if (c == NULL) {
 			c = c_next;
 			continue;
 		}
 
-		runCommand(c);
+		/* Remove all the requests we ran from the clients request stream in one go */
+		buffRemove(&c->request, consumed, 0);
 
-		/* Remove the used data from the clients request stream */
-		buffRemove(&c->request, (size_t)(nl - c->request.data), 0);
+		/* Leave the client on the ready list if it has another request waiting */
+		if (c->stream.callback || c->request.used == 0 || memchr(c->request.data, '\n', c->request.used) == NULL)
+			clearClientReady(c);
 
-		c = c->next;
+		c = c_next;
 	}
 }
 
 void checkAgentEvent(void) {
-	agent * a = agentList;
+	agent * a = readyAgentList;
 
 	while (a) {
-		agent * a_next = a->next;
+		agent * a_next = a->ready_next;
 		size_t consumed = 0;
 		char *p = a->requests.data;
 
@@ -167,6 +252,9 @@ void checkAgentEvent(void) {
 		if (consumed)
 			buffRemove(&a->requests, consumed, 0);
 
+		/* Anything left is a partial message, wait for the rest of it to be read */
+		clearAgentReady(a);
+
 		a = a_next;
 	}
 }
@@ -216,7 +304,7 @@ void cleanupEvent(void) {
 	uint32_t max_clean = server.max_cleanup;
 
 	/* If we are busy, don't try and clean up as many deleted items */
-	if (server.candidate_pool_jobs || server.candidate_recalc)
+	if (server.stats.jobs.pending)
 		max_clean = (max_clean + 1) / 2;
 
 	cleaned += cleanupJobs(max_clean);
@@ -229,7 +317,12 @@ void cleanupEvent(void) {
 	if (cleaned >= max_clean)
 		return;
 
-	cleanupResources(max_clean - cleaned);
+	cleaned += cleanupResources(max_clean - cleaned);
+
+	if (cleaned >= max_clean)
+		return;
+
+	cleanupEnvProfiles(max_clean - cleaned);
 }
 
 void cleanupIndexTag(void) {
@@ -257,12 +350,14 @@ void checkEmails(void) {
 void autoCleanup(void) {
 	time_t target_time = time(NULL) - (server.auto_cleanup * 60 * 60);
 
-	for (struct job *j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->internal_state &JERS_FLAG_DELETED || j->state != JERS_JOB_COMPLETED)
+	for (size_t i = 0; i < server.jobTable.count; i++) {
+		struct jobHot *h = &server.jobTable.hot[i];
+
+		if (h->deleted || h->state != JERS_JOB_COMPLETED)
 			continue;
 
-		if (j->finish_time <= target_time)
-			deleteJob(j);
+		if (h->finish_time <= target_time)
+			deleteJob(server.jobTable.jobs[i]);
 	}
 }
 
@@ -271,15 +366,13 @@ void initEvents(void) {
 	registerEvent(cleanupEvent, 1000);
 	registerEvent(backgroundSaveEvent, server.background_save_ms);
 
-	if (server.flush.defer)
+	if (server.flush.defer == FLUSH_DEFER)
 		registerEvent(flushEvent, server.flush.defer_ms);
 
 	registerEvent(checkDeferEvent, 750);
 
 	registerEvent(checkEmails, server.email_freq_ms);
 
-	registerEvent(checkAgentEvent, 0);
-	registerEvent(checkClientEvent, 0);
 	registerEvent(checkBlockingClientEvent, 500);
 	registerEvent(checkAcctEvent, 1000);
 
@@ -290,19 +383,75 @@ void initEvents(void) {
 		registerEvent(autoCleanup, MINUTE_MS(5));
 }
 
-/* Check for any timed events to expire */
+/* Return the number of milliseconds until the next timed event is due,
+ * capped at the configured event_freq. If there are clients or agents
+ * with requests waiting to be processed, or a client ready for the next
+ * chunk of a streamed response, we shouldn't wait at all. */
+int nextEventTimeout(void) {
+	int64_t timeout;
+
+	if (readyClientList || readyAgentList || streamClientReady())
+		return 0;
+
+	timeout = eventCount ? eventHeap[0]->next_fire - getTimeMS() : server.event_freq;
+
+	/* Wake up in time to commit the pending journal writes */
+	if (server.flush.defer == FLUSH_GROUP && server.flush.dirty) {
+		int64_t commit_timeout = server.flush.pending_since + server.flush.group_ms - getTimeMS();
+
+		if (commit_timeout < timeout)
+			timeout = commit_timeout;
+	}
+
+	if (timeout < 0)
+		timeout = 0;
+
+	if (timeout > server.event_freq)
+		timeout = server.event_freq;
+
+	/* A scheduling pass has been requested, wake up once the rate limit allows it */
+	if (server.sched_pending) {
+		int64_t sched_timeout = server.sched_last + server.sched_min_interval - getTimeMS();
+
+		if (sched_timeout < timeout)
+			timeout = sched_timeout < 0 ? 0 : sched_timeout;
+	}
+
+	return timeout;
+}
+
+/* Process any clients or agents that have sent us data,
+ * then fire any timed events that have expired */
 
 void checkEvents(void) {
-	struct event * e = eventList;
+	if (readyAgentList)
+		checkAgentEvent();
+
+	if (readyClientList)
+		checkClientEvent();
+
+	if (streamClientList)
+		checkStreamClientEvent();
+
+	if (server.flush.defer != FLUSH_DEFER && (server.flush.dirty || commitClientList))
+		checkJournalCommit();
+
+	/* Carry on building the full snapshot for a background save, starting the save once it's built */
+	if (server.snapshot.building && snapshotBuildFull(0) == 0)
+		stateSaveToDisk(0);
 
 	int64_t now = getTimeMS();
 
-	while (e) {
-		if (now >= e->last_fire + e->interval) {
-			e->func();
-			e->last_fire = getTimeMS();
-		}
+	/* Run a single scheduling pass for everything that has requested one since the last pass */
+	if (server.sched_pending && now - server.sched_last >= server.sched_min_interval)
+		checkJobs();
+
+	/* Each event fires at most once per call */
+	for (int fired = 0; fired < eventCount && eventHeap[0]->next_fire <= now; fired++) {
+		struct event *e = eventHeap[0];
 
-		e = e->next;
+		e->func();
+		e->next_fire = getTimeMS() + e->interval;
+		eventSiftDown(0);
 	}
 }
@@ -146,6 +146,25 @@ const field fields[] = {
 
 	{FLAGS, FIELD_TYPE_NUM, FIELDNAME("FLAGS")},
 
+	{LIMIT,  FIELD_TYPE_NUM,  FIELDNAME("LIMIT")},
+	{CURSOR, FIELD_TYPE_NUM,  FIELDNAME("CURSOR")},
+	{STREAM, FIELD_TYPE_BOOL, FIELDNAME("STREAM")},
+
+	{STATSRSS,           FIELD_TYPE_NUM, FIELDNAME("STATSRSS")},
+	{STATSJOBSLABS,      FIELD_TYPE_NUM, FIELDNAME("STATSJOBSLABS")},
+	{STATSJOBARENAS,     FIELD_TYPE_NUM, FIELDNAME("STATSJOBARENAS")},
+	{STATSJOBARENABYTES, FIELD_TYPE_NUM, FIELDNAME("STATSJOBARENABYTES")},
+	{STATSJOBSFREED,     FIELD_TYPE_NUM, FIELDNAME("STATSJOBSFREED")},
+	{STATSJOBFREETIME,   FIELD_TYPE_NUM, FIELDNAME("STATSJOBFREETIME")},
+	{STATSINTERNED,      FIELD_TYPE_NUM, FIELDNAME("STATSINTERNED")},
+	{STATSINTERNEDBYTES, FIELD_TYPE_NUM, FIELDNAME("STATSINTERNEDBYTES")},
+	{STATSINTERNREFS,    FIELD_TYPE_NUM, FIELDNAME("STATSINTERNREFS")},
+
+	{ENVPROFILE,  FIELD_TYPE_STRING,      FIELDNAME("ENVPROFILE")},
+	{PROFILEENVS, FIELD_TYPE_STRINGARRAY, FIELDNAME("PROFILEENVS")},
+
+	{STREAMEND, FIELD_TYPE_BOOL, FIELDNAME("STREAM_END")},
+
 	{ENDOFFIELDS, FIELD_TYPE_NUM, FIELDNAME("ENDOFFIELDS")}
 };
 
@@ -234,6 +253,24 @@ int64_t getStringMapField(field *f, key_val_t ** array) {
 	return key_count;
 }
 
+/* The borrow variants return the values held in the message itself, rather than a copy.
+ * They are only valid until the message is reset and must not be freed */
+
+char * borrowStringField(field *f) {
+	static char empty[] = "";
+	return f->value.string ? f->value.string : empty;
+}
+
+int64_t borrowStringArrayField(field *f, char *** array) {
+	*array = f->value.string_array.strings;
+	return f->value.string_array.count;
+}
+
+int64_t borrowStringMapField(field *f, key_val_t ** array) {
+	*array = f->value.map.keys;
+	return f->value.map.count;
+}
+
 static int compfield(const void * _a, const void * _b) {
 	const field * a = _a;
 	const field * b = _b;
@@ -305,44 +342,128 @@ const char * getFieldName(int field_no, size_t *len) {
 	return fields[field_no].name;
 }
 
-void free_message(msg_t * msg) {
-	int i,j;
+/* Messages are parsed into an arena owned by the msg_t. A block of up to MSG_ARENA_RETAIN
+ * bytes is kept when the message is reset, so a connection reuses the same memory for
+ * each request it sends. If a message overflowed into more than one block, they are
+ * replaced by a single block of the combined size when the next message is loaded. */
 
-	for (j = 0; j < msg->item_count; j++) {
+#define MSG_ARENA_BLOCK  4096
+#define MSG_ARENA_RETAIN (64 * 1024)
+#define MSG_ARENA_ALIGN  sizeof(void *)
 
-		for (i = 0; i < msg->items[j].field_count; i++) {
-			if (fields[msg->items[j].fields[i].number].type == FIELD_TYPE_STRINGARRAY) {
-				free(msg->items[j].fields[i].value.string_array.strings);
-			} else if (fields[msg->items[j].fields[i].number].type == FIELD_TYPE_MAP) {
-				free(msg->items[j].fields[i].value.map.keys);
-			}
-		}
+void * msgArenaAlloc(struct msgArena *arena, size_t size) {
+	struct msgArenaBlock *b = arena->head;
+	size_t offset = b ? (b->used + MSG_ARENA_ALIGN - 1) & ~(MSG_ARENA_ALIGN - 1) : 0;
+
+	if (b == NULL || offset + size > b->size) {
+		size_t block_size = arena->block_size > MSG_ARENA_BLOCK ? arena->block_size : MSG_ARENA_BLOCK;
+
+		if (size > block_size)
+			block_size = size;
+
+		b = malloc(sizeof(struct msgArenaBlock) + block_size);
+
+		if (b == NULL)
+			return NULL;
+
+		b->next = arena->head;
+		b->size = block_size;
+		b->used = 0;
+
+		arena->head = b;
+		arena->block_size = block_size * 2;
+		offset = 0;
+	}
+
+	b->used = offset + size;
+	arena->last = offset;
+
+	return b->data + offset;
+}
+
+/* Grow an allocation, in place if it was the last one made from the arena */
+void * msgArenaRealloc(struct msgArena *arena, void *ptr, size_t old_size, size_t size) {
+	struct msgArenaBlock *b = arena->head;
+	void *new_ptr;
+
+	if (ptr && b && ptr == b->data + arena->last && arena->last + size <= b->size) {
+		b->used = arena->last + size;
+		return ptr;
+	}
+
+	new_ptr = msgArenaAlloc(arena, size);
+
+	if (new_ptr && ptr)
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+
+	return new_ptr;
+}
+
+void msgArenaReset(struct msgArena *arena) {
+	struct msgArenaBlock *b = arena->head;
+	size_t total = 0;
+
+	if (b == NULL)
+		return;
+
+	if (b->next == NULL && b->size <= MSG_ARENA_RETAIN) {
+		b->used = 0;
+		arena->last = 0;
+		return;
+	}
+
+	for (; b; b = b->next)
+		total += b->size;
 
-		free(msg->items[j].fields);
-		msg->items[j].field_count = 0;
-		msg->items[j].fields = NULL;
+	msgArenaFree(arena);
+	arena->block_size = total <= MSG_ARENA_RETAIN ? total : 0;
+}
+
+void msgArenaFree(struct msgArena *arena) {
+	struct msgArenaBlock *b = arena->head;
+
+	while (b) {
+		struct msgArenaBlock *next = b->next;
+		free(b);
+		b = next;
 	}
 
-	free(msg->msg_cpy);
-	free(msg->items);
-	free(msg->error);
+	memset(arena, 0, sizeof(struct msgArena));
+}
+
+/* Clear out a message, keeping its arena for the next message loaded into it */
+void reset_message(msg_t * msg) {
+	struct msgArena arena = msg->arena;
+
+	free(msg->rewrite);
+	msgArenaReset(&arena);
 
-	msg->items = NULL;
-	msg->item_count = 0;
-	msg->command = NULL;
-	msg->version = 0;
-	msg->error = NULL;
-	msg->msg_cpy = NULL;
+	memset(msg, 0, sizeof(msg_t));
+	msg->arena = arena;
 }
 
+void free_message(msg_t * msg) {
+	free(msg->rewrite);
+	msgArenaFree(&msg->arena);
+
+	memset(msg, 0, sizeof(msg_t));
+}
 
 /* Load a message, based on a passed in JSON object.
- * The input json string is modified by this routine */
+ * The input json string is modified by this routine, with the strings in the
+ * message pointing into it, so it needs to outlive the message.
+ * The msg_t needs to be zeroed before it is first used */
 int load_message(char *json, msg_t *m)
 {
 	char *object;
-	memset(m, 0, sizeof(msg_t));
-	m->msg_cpy = strdup(json);
+	size_t len = strlen(json) + 1;
+
+	reset_message(m);
+
+	if ((m->msg_cpy = msgArenaAlloc(&m->arena, len)) == NULL)
+		return 1;
+
+	memcpy(m->msg_cpy, json, len);
 
 	object = JSONGetObject(&json);
 
@@ -371,7 +492,10 @@ int load_message(char *json, msg_t *m)
 			return 1;
 		}
 
-		m->error = strdup(err_msg);
+		if ((m->error = msgArenaAlloc(&m->arena, strlen(err_msg) + 1)) == NULL)
+			return 1;
+
+		strcpy(m->error, err_msg);
 		return 0;
 	}
 
@@ -412,6 +536,9 @@ int load_message(char *json, msg_t *m)
 					return 1;
 
 				setenv(JERS_ALERT, alert, 1);
+			} else if (strcmp(name, "STREAM_END") == 0) {
+				if (JSONGetBool(&cmd_object, &m->stream_end))
+					return 1;
 			}
 		}
 	} else {
@@ -452,7 +579,7 @@ static int loadFields(char *obj, msg_t *m) {
 	/* Allocate a new item structure if needed */
 	if (m->item_count == m->item_max) {
 		int64_t new_max = m->item_max ? m->item_max * 2 : 8;
-		m->items = realloc(m->items, sizeof(msg_item) * new_max);
+		m->items = msgArenaRealloc(&m->arena, m->items, sizeof(msg_item) * m->item_max, sizeof(msg_item) * new_max);
 
 		if (m->items == NULL)
 			return 1;
@@ -461,16 +588,14 @@ static int loadFields(char *obj, msg_t *m) {
 	}
 
 	item = &m->items[m->item_count];
-	item->field_max = 0;
-	item->field_count = 0;
-	item->fields = NULL;
+	memset(item, 0, sizeof(msg_item));
 
 	/* Load the fields in the item */
 	while ((name = JSONGetName(&obj)) != NULL) {
 		/* Allocate room for more fields if needed */
 		if (item->field_count == item->field_max) {
 			int64_t new_max = item->field_max ? item->field_max * 2 : 8;
-			item->fields = realloc (item->fields, sizeof(field) * new_max);
+			item->fields = msgArenaRealloc(&m->arena, item->fields, sizeof(field) * item->field_max, sizeof(field) * new_max);
 
 			if (item->fields == NULL)
 				return 1;
@@ -510,13 +635,13 @@ static int loadFields(char *obj, msg_t *m) {
 				break;
 
 			case FIELD_TYPE_STRINGARRAY:
-				if ((f->value.string_array.count = JSONGetStringArray(&obj, &f->value.string_array.strings)) < 0)
+				if ((f->value.string_array.count = JSONGetStringArrayArena(&obj, &f->value.string_array.strings, &m->arena)) < 0)
 					return 1;
 
 				break;
 
 			case FIELD_TYPE_MAP:
-				if ((f->value.map.count = JSONGetMap(&obj, &f->value.map.keys)) < 0)
+				if ((f->value.map.count = JSONGetMapArena(&obj, &f->value.map.keys, &m->arena)) < 0)
 					return 1;
 
 				break;
@@ -622,3 +747,13 @@ int closeResponse(buff_t *b) {
 
 	return 0;
 }
+
+/* Close a chunk of a streamed response, flagging whether it is the last chunk */
+int closeStreamResponse(buff_t *b, int end) {
+	JSONEndArray(b);  /* Data array */
+	JSONAddBool(b, STREAMEND, end);
+	JSONEndObject(b); /* Response object */
+	JSONEnd(b);
+
+	return 0;
+}
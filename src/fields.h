@@ -190,9 +190,43 @@ enum field_type {
 
 	FLAGS,
 
+	LIMIT,
+	CURSOR,
+	STREAM,
+
+	STATSRSS,
+	STATSJOBSLABS,
+	STATSJOBARENAS,
+	STATSJOBARENABYTES,
+	STATSJOBSFREED,
+	STATSJOBFREETIME,
+	STATSINTERNED,
+	STATSINTERNEDBYTES,
+	STATSINTERNREFS,
+
+	ENVPROFILE,
+	PROFILEENVS,
+
+	STREAMEND,
+
 	ENDOFFIELDS
 };
 
+/* Per message arena. Everything parsed out of a message is allocated from here,
+ * so releasing a message is just a matter of rewinding its arena */
+struct msgArenaBlock {
+	struct msgArenaBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct msgArena {
+	struct msgArenaBlock *head;
+	size_t last;       // Offset of the last allocation in the head block, so it can be grown in place
+	size_t block_size; // Size of the next block to allocate
+};
+
 typedef struct {
 	unsigned char bitmap[64];	/* Bitmap of fields that have been set */
 	int64_t field_count;		/* Number of fields set in 'fields' */
@@ -208,7 +242,12 @@ typedef struct {
 	int64_t item_max;
 	msg_item *items;
 
-	char *msg_cpy;
+	char stream_end; /* Set on the last chunk of a streamed response */
+
+	char *msg_cpy;  /* Unmodified copy of the message, held in the arena */
+	char *rewrite;  /* Replacement for msg_cpy to journal, allocated separately */
+
+	struct msgArena arena;
 
 	/* These fields are filled in by a command so that it can be saved in the transaction journal */
 	jobid_t jobid;
@@ -220,7 +259,13 @@ void freeSortedFields(void);
 
 const char *getFieldName(int field_no, size_t *len);
 
+void * msgArenaAlloc(struct msgArena *arena, size_t size);
+void * msgArenaRealloc(struct msgArena *arena, void *ptr, size_t old_size, size_t size);
+void msgArenaReset(struct msgArena *arena);
+void msgArenaFree(struct msgArena *arena);
+
 int load_message(char *json, msg_t *m);
+void reset_message(msg_t * msg);
 void free_message(msg_t * msg);
 int fieldtonum(const char * in);
 
@@ -236,6 +281,10 @@ char getBoolField(field *f);
 int64_t getStringArrayField(field *f, char *** array);
 int64_t getStringMapField(field * f, key_val_t ** array);
 
+char * borrowStringField(field * f);
+int64_t borrowStringArrayField(field *f, char *** array);
+int64_t borrowStringMapField(field * f, key_val_t ** array);
+
 #define initRequest(b, n, v) _initRequest(b, n, CONST_STRLEN(n), v)
 int _initRequest(buff_t *b, const char *resp_name, size_t resp_name_len, int version);
 int initResponse(buff_t *b, int version);
@@ -243,5 +292,6 @@ int initResponseAlert(buff_t *b, int version, const char *alert);
 int initNamedResponse(buff_t *b, const char *name, size_t name_len, int version, const char *alert);
 int closeRequest(buff_t *b);
 int closeResponse(buff_t *b);
+int closeStreamResponse(buff_t *b, int end);
 
 #endif
@@ -0,0 +1,139 @@
+/* Copyright (c) 2020 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <server.h>
+#include <pthread.h>
+
+/* Strings repeated across many jobs are interned, with each job holding a
+ * reference to a single shared copy. The loader threads intern strings while
+ * building jobs, so the table and the server.stats.memory counts are protected
+ * by a mutex. Code interning several strings at once, ie. packing a job, takes
+ * the lock once with lockInternTable() and uses internStringLocked(). */
+
+struct internedString {
+	int64_t refs;
+	UT_hash_handle hh;
+	char str[];
+};
+
+static struct internedString *internTable = NULL;
+static pthread_mutex_t internLock = PTHREAD_MUTEX_INITIALIZER;
+
+void lockInternTable(void) {
+	pthread_mutex_lock(&internLock);
+}
+
+void unlockInternTable(void) {
+	pthread_mutex_unlock(&internLock);
+}
+
+/* Return the interned copy of str, taking a reference to it */
+char * internString(const char *str) {
+	char *interned;
+
+	pthread_mutex_lock(&internLock);
+	interned = internStringLocked(str);
+	pthread_mutex_unlock(&internLock);
+
+	return interned;
+}
+
+/* internString(), with the lock already held by the caller */
+char * internStringLocked(const char *str) {
+	struct internedString *s;
+	size_t len;
+
+	if (str == NULL)
+		return NULL;
+
+	len = strlen(str);
+
+	HASH_FIND(hh, internTable, str, len, s);
+
+	if (s == NULL) {
+		s = malloc(sizeof(struct internedString) + len + 1);
+
+		if (s == NULL)
+			error_die("Failed to allocate memory for interned string: %s", strerror(errno));
+
+		s->refs = 0;
+		memcpy(s->str, str, len + 1);
+		HASH_ADD_KEYPTR(hh, internTable, s->str, len, s);
+
+		server.stats.memory.interned++;
+		server.stats.memory.interned_bytes += len + 1;
+	}
+
+	s->refs++;
+	server.stats.memory.intern_refs++;
+
+	return s->str;
+}
+
+/* Release a reference to an interned string, freeing it with the last reference.
+ * Returns 1 if str isn't an interned string */
+int releaseString(const char *str) {
+	struct internedString *s;
+	size_t len = strlen(str);
+
+	pthread_mutex_lock(&internLock);
+
+	HASH_FIND(hh, internTable, str, len, s);
+
+	if (s == NULL || s->str != str) {
+		pthread_mutex_unlock(&internLock);
+		return 1;
+	}
+
+	server.stats.memory.intern_refs--;
+
+	if (--s->refs == 0) {
+		HASH_DEL(internTable, s);
+		server.stats.memory.interned--;
+		server.stats.memory.interned_bytes -= len + 1;
+		free(s);
+	}
+
+	pthread_mutex_unlock(&internLock);
+
+	return 0;
+}
+
+void freeInternTable(void) {
+	struct internedString *s, *tmp;
+
+	HASH_ITER(hh, internTable, s, tmp) {
+		HASH_DEL(internTable, s);
+		free(s);
+	}
+
+	server.stats.memory.interned = 0;
+	server.stats.memory.interned_bytes = 0;
+	server.stats.memory.intern_refs = 0;
+}
@@ -39,6 +39,8 @@
 #include <jers.h>
 #include <common.h>
 
+#define SHOW_JOB_PAGE_SIZE 10000
+
 /* Commands + objects */
 
 struct cmd objects[] = {
@@ -470,6 +472,42 @@ static int jobSort(const void *_a, const void *_b) {
 	return a->jobid - b->jobid;
 }
 
+/* Get all the jobs a page at a time, so the daemon doesn't have to build one huge response */
+static int getAllJobs(jersJobInfo *job_info) {
+	jersJobInfo page;
+	jobid_t cursor = 0;
+
+	job_info->count = 0;
+	job_info->jobs = NULL;
+
+	do {
+		if (jersGetJobPage(NULL, cursor, SHOW_JOB_PAGE_SIZE, &page) != 0) {
+			jersFreeJobInfo(job_info);
+			return 1;
+		}
+
+		if (page.count) {
+			jersJob *jobs = realloc(job_info->jobs, sizeof(jersJob) * (job_info->count + page.count));
+
+			if (jobs == NULL) {
+				fprintf(stderr, "Failed to allocate memory for job list: %s\n", strerror(errno));
+				jersFreeJobInfo(&page);
+				jersFreeJobInfo(job_info);
+				return 1;
+			}
+
+			/* The strings now belong to the combined list */
+			memcpy(jobs + job_info->count, page.jobs, sizeof(jersJob) * page.count);
+			job_info->jobs = jobs;
+			job_info->count += page.count;
+			cursor = page.jobs[page.count - 1].jobid;
+			free(page.jobs);
+		}
+	} while (page.count == SHOW_JOB_PAGE_SIZE);
+
+	return 0;
+}
+
 int show_job(int argc, char *argv[]) {
 	struct show_job_args args;
 	jersJobInfo job_info;
@@ -490,7 +528,7 @@ int show_job(int argc, char *argv[]) {
 		if (args.verbose)
 			fprintf(stderr, "Getting info for job %d \n", id);
 
-		if (jersGetJob(id, NULL, &job_info) != 0) {
+		if ((all_jobs ? getAllJobs(&job_info) : jersGetJob(id, NULL, &job_info)) != 0) {
 			fprintf(stderr, "Failed to get job info for job %d: %s\n", id, jersGetErrStr(jers_errno));
 			rc = 1;
 			goto show_job_cleanup;
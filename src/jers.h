@@ -163,6 +163,7 @@ enum jers_error_codes {
 	JERS_ERR_READONLY,
 	JERS_ERR_NOTCONN,
 	JERS_ERR_TIMEOUT,
+	JERS_ERR_NOENVPROFILE,
 
 	JERS_ERR_UNKNOWN
 };
@@ -237,7 +238,9 @@ typedef struct {
 
 	int64_t flags;
 
-	char filler[95];
+	char * env_profile; // Hash of an environment profile, envs then override variables in it
+
+	char filler[87];
 } jersJobAdd;
 
 typedef struct {
@@ -265,7 +268,9 @@ typedef struct {
 	int64_t res_count;
 	char ** resources;
 
-	char filler2[164];
+	char * env_profile; // Replaces the job's environment, envs then being the overrides
+
+	char filler2[156];
 } jersJobMod;
 
 typedef struct {
@@ -313,7 +318,9 @@ typedef struct {
 	int env_count;
 	char **envs;
 
-	char filler[56];
+	char *env_profile;
+
+	char filler[48];
 } jersJob;
 
 typedef struct {
@@ -357,6 +364,16 @@ typedef struct {
 	} filters;
 } jersJobFilter;
 
+/* Iterator over a streamed job query. The jobs are returned in jobid order */
+typedef struct {
+	jersJobInfo info;	// Jobs received in the current chunk
+	int64_t pos;		// Next job to return from the current chunk
+	int done;
+	int end;		// The last chunk has been received
+
+	char filler[32];
+} jersJobIterator;
+
 typedef struct {
 	char *host;
 } jersAgentFilter;
@@ -488,6 +505,19 @@ typedef struct {
 	} total;
 } jersStats;
 
+/* Memory used by the daemon for its jobs */
+typedef struct {
+	int64_t rss;         // Resident set size of the daemon in bytes
+	int64_t job_slabs;   // Allocations holding the job structures
+	int64_t arenas;      // Allocations holding job strings, one per job
+	int64_t arena_bytes;
+	int64_t freed;       // Jobs freed since the daemon started
+	int64_t free_time;   // Microseconds spent freeing them
+	int64_t interned;    // Unique strings shared between jobs
+	int64_t interned_bytes;
+	int64_t intern_refs; // References held to them
+} jersMemStats;
+
 #pragma pack(pop)
 
 void jersInitJobAdd(jersJobAdd *j);
@@ -500,12 +530,22 @@ void jersInitResourceAdd(jersResourceAdd *r);
 void jersInitResourceMod(jersResourceMod *r);
 
 jobid_t jersAddJob(const jersJobAdd *s);
+int jersAddJobs(int64_t count, const jersJobAdd *jobs, jobid_t *jobids);
 int jersModJob(const jersJobMod *j);
 int jersGetJob(jobid_t id, const jersJobFilter *filter, jersJobInfo *info);
 int jersDelJob(jobid_t id);
 int jersSignalJob(jobid_t id, int signo);
+int jersGetJobPage(const jersJobFilter *filter, jobid_t cursor, int64_t limit, jersJobInfo *info);
 void jersFreeJobInfo (jersJobInfo *info);
 
+int64_t jersModJobs(const jersJobFilter *filter, const jersJobMod *j);
+int64_t jersDelJobs(const jersJobFilter *filter);
+int64_t jersSignalJobs(const jersJobFilter *filter, int signo);
+
+int jersGetJobIterator(const jersJobFilter *filter, int64_t chunk_size, jersJobIterator *it);
+jersJob * jersNextJob(jersJobIterator *it);
+void jersFreeJobIterator(jersJobIterator *it);
+
 int jersWaitJob(jobid_t id, int64_t revision, int timeout);
 
 int jersSetTag(jobid_t id, const char * key, const char * value);
@@ -525,6 +565,7 @@ void jersFreeResourceInfo(jersResourceInfo *info);
 
 int jersGetAgents(const char *name, jersAgentInfo *info);
 int jersGetStats(jersStats * s);
+int jersGetMemStats(jersMemStats * s);
 
 int jersClearCache(void);
 
@@ -144,6 +144,19 @@ struct runningJob {
 	struct runningJob *prev;
 };
 
+/* Environment profiles sent by the daemon, keyed by their hash.
+ * The hash table keeps insertion order, so the oldest is evicted first. */
+
+#define MAX_CACHED_PROFILES 256
+
+struct envProfile {
+	char * hash;
+	int64_t env_count;
+	char ** envs;
+
+	UT_hash_handle hh;
+};
+
 struct adoptJob {
 	jobid_t jobid;
 	pid_t pid;
@@ -183,6 +196,8 @@ struct agent {
 
 	struct runningJob *jobs;
 	int64_t running_jobs;
+
+	struct envProfile *profiles;
 };
 
 struct jersJobSpawn {
@@ -1167,7 +1182,7 @@ int send_login(void) {
 
 	print_msg(JERS_LOG_INFO, "Sending login");
 
-	initRequest(&b, AGENT_LOGIN, 1);
+	initRequest(&b, AGENT_LOGIN, AGENT_VERSION);
 	sendRequest(&b);
 	return 0;
 }
@@ -1360,9 +1375,65 @@ struct runningJob * spawn_job(struct jersJobSpawn * j, int * fail_status) {
 	return job;
 }
 
+static void freeProfile(struct envProfile *p) {
+	HASH_DEL(agent.profiles, p);
+	free(p->hash);
+	freeStringArray(p->env_count, &p->envs);
+	free(p);
+}
+
+static void clearProfiles(void) {
+	while (agent.profiles)
+		freeProfile(agent.profiles);
+}
+
+/* Takes ownership of the hash and variables */
+static struct envProfile * cacheProfile(char *hash, int64_t env_count, char **envs) {
+	struct envProfile *p = NULL;
+
+	HASH_FIND_STR(agent.profiles, hash, p);
+
+	if (p)
+		freeProfile(p);
+	else if (HASH_COUNT(agent.profiles) >= MAX_CACHED_PROFILES)
+		freeProfile(agent.profiles);
+
+	p = malloc(sizeof(struct envProfile));
+
+	if (p == NULL)
+		error_die("Failed to allocate memory for environment profile: %s", strerror(errno));
+
+	p->hash = hash;
+	p->env_count = env_count;
+	p->envs = envs;
+
+	HASH_ADD_KEYPTR(hh, agent.profiles, p->hash, strlen(p->hash), p);
+
+	return p;
+}
+
+/* Ask the daemon to resend the start request with the profile included */
+static void send_profile_miss(jobid_t jobid, const char *hash) {
+	buff_t b;
+
+	print_msg(JERS_LOG_DEBUG, "JOBID %d environment profile %s not cached", jobid, hash);
+
+	initRequest(&b, AGENT_ENVPROFILE_MISS, 1);
+	JSONAddInt(&b, JOBID, jobid);
+	JSONAddString(&b, ENVPROFILE, hash);
+
+	sendRequest(&b);
+}
+
 int start_command(msg_t * m) {
 	struct jersJobSpawn j = {0};
 	struct runningJob * started = NULL;
+	struct envProfile *profile = NULL;
+	char * profile_hash = NULL;
+	int64_t profile_env_count = -1;
+	char ** profile_envs = NULL;
+	int64_t override_count = 0;
+	char ** overrides = NULL;
 	int i, status = 0;
 
 	msg_item * item = &m->items[0];
@@ -1384,11 +1455,39 @@ int start_command(msg_t * m) {
 			case WRAPPER  : j.wrapper = getStringField(&item->fields[i]) ; break;
 			case RESOURCES: j.res_count = getStringArrayField(&item->fields[i], &j.resources); break;
 			case FLAGS    : j.flags = getNumberField(&item->fields[i]); break;
+			case ENVPROFILE: profile_hash = getStringField(&item->fields[i]); break;
+			case PROFILEENVS: profile_env_count = getStringArrayField(&item->fields[i], &profile_envs); break;
 
 			default: fprintf(stderr, "Unknown field '%s' encountered - Ignoring\n", item->fields[i].name); break;
 		}
 	}
 
+	if (profile_hash && profile_env_count >= 0) {
+		profile = cacheProfile(profile_hash, profile_env_count, profile_envs);
+		profile_hash = NULL;
+	} else if (profile_hash) {
+		HASH_FIND_STR(agent.profiles, profile_hash, profile);
+
+		if (profile == NULL) {
+			/* Not an initialisation failure, the daemon will send the start again */
+			send_profile_miss(j.jobid, profile_hash);
+			goto start_exit;
+		}
+	}
+
+	/* The job gets its overrides followed by the rest of the profile */
+	if (profile) {
+		override_count = j.env_count;
+		overrides = j.envs;
+
+		j.envs = malloc(sizeof(char *) * (profile->env_count + override_count + 1));
+
+		if (j.envs == NULL)
+			error_die("Failed to allocate memory for job environment: %s", strerror(errno));
+
+		j.env_count = mergeEnv(profile->env_count, profile->envs, override_count, overrides, j.envs);
+	}
+
 	/* Lookup the user from our cache */
 	j.u = lookup_user(j.uid, 1);
 
@@ -1408,6 +1507,7 @@ int start_command(msg_t * m) {
 		send_job_initfail(j.jobid, status);
 	}
 
+start_exit:
 	free(j.name);
 	free(j.queue);
 	free(j.shell);
@@ -1417,7 +1517,15 @@ int start_command(msg_t * m) {
 	free(j.stderr);
 	free(j.wrapper);
 	freeStringArray(j.argc, &j.argv);
-	freeStringArray(j.env_count, &j.envs);
+	free(profile_hash);
+
+	/* The merged environment only points to the strings in the overrides and profile */
+	if (profile) {
+		free(j.envs);
+		freeStringArray(override_count, &overrides);
+	} else {
+		freeStringArray(j.env_count, &j.envs);
+	}
 
 	return 0;
 }
@@ -1426,6 +1534,7 @@ int clearcache_command(msg_t *m) {
 	UNUSED(m);
 
 	clearCacheHandler(0);
+	clearProfiles();
 	print_msg_info("Flagged cache clear");
 
 	return 0;
@@ -1728,7 +1837,7 @@ int process_message(msg_t * m) {
 
 	if (m->command == NULL) {
 		print_msg(JERS_LOG_WARNING, "Got a command message");
-		free_message(m);
+		reset_message(m);
 		return 1;
 	}
 
@@ -1753,7 +1862,7 @@ int process_message(msg_t * m) {
 		status = 1;
 	}
 
-	free_message(m);
+	reset_message(m);
 
 	return status;
 }
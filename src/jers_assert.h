@@ -5,6 +5,7 @@
 CHECK_SIZE(jersJob, 256);
 CHECK_SIZE(jersJobInfo, 16);
 CHECK_SIZE(jersJobFilter, 136);
+CHECK_SIZE(jersJobIterator, 64);
 CHECK_SIZE(jersJobAdd, 256);
 CHECK_SIZE(jersJobMod, 256);
 
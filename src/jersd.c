@@ -61,7 +61,13 @@ int parseOpts(int argc, char * argv[]) {
 }
 
 void serverShutdown(void) {
+	/* Let a running background save finish writing */
+	if (server.flush.saving)
+		stateSaveToDisk(1);
+
 	/* Lets do a final flush of our state file before we try anything else*/
+	journalWriterStop();
+
 	if (server.journal.fd >= 0) {
 		print_msg(JERS_LOG_INFO, "Performing final flush of state file");
 		fdatasync(server.journal.fd);
@@ -89,11 +95,11 @@ void serverShutdown(void) {
 	unlink(server.agent_socket_path);
 
 	/* Free jobs */
-	struct job * j, *job_tmp;
-	HASH_ITER(hh, server.jobTable, j, job_tmp) {
-		HASH_DEL(server.jobTable, j);
-		freeJob(j);
-	}
+	freeJobTable();
+	freeJobSlabs();
+	freeInternTable();
+	freeEnvProfiles();
+	freeJobIDs();
 
 	/* Free resources */
 	struct resource * r, *res_tmp;
@@ -112,8 +118,9 @@ void serverShutdown(void) {
 	/* User cache */
 	freeUserCache();
 
-	/* Scheduling candidate pool */
-	free(server.candidate_pool);
+	/* Scheduling candidate frontier */
+	free(server.candidate_frontier);
+	free(server.candidate_blocked);
 
 	/* Clients and agents */
 	client *c = clientList;
@@ -123,6 +130,7 @@ void serverShutdown(void) {
 		close(c->connection.socket);
 		buffFree(&c->response);
 		buffFree(&c->request);
+		free_message(&c->msg);
 		removeClient(c);
 		free(c);
 
@@ -136,6 +144,7 @@ void serverShutdown(void) {
 		close(a->connection.socket);
 		buffFree(&a->requests);
 		buffFree(&a->responses);
+		free_message(&a->msg);
 		free(a->host);
 		free(a->nonce);
 		removeAgent(a);
@@ -231,6 +240,7 @@ void handleReadable(struct epoll_event *e) {
 		case ACCT_CONN:         status = handleAcctClientConnection(connection); break;
 		case CLIENT:            status = handleClientRead(connection->ptr); break;
 		case AGENT:             status = handleAgentRead(connection->ptr); break;
+		case JOURNAL:           journalWriterComplete(); break;
 		default:                print_msg(JERS_LOG_WARNING, "Unexpected read event - Ignoring"); break;
 	}
 
@@ -295,6 +305,8 @@ int main (int argc, char * argv[]) {
 	sortAgentCommands();
 	sortCommands();
 
+	int64_t load_start = getTimeMS();
+
 	stateInit();
 
 	/* Load and initialise the queues */
@@ -304,14 +316,23 @@ int main (int argc, char * argv[]) {
 	if (stateLoadResources())
 		error_die("init: failed to load resources from file");
 
+	int64_t load_jobs = getTimeMS();
+
 	/* Load jobs from file */
 
 	if (stateLoadJobs())
 		error_die("init: failed to load jobs from file");
 
+	int64_t load_journal = getTimeMS();
+
 	/* Replay commands from the journal/s */
 	stateReplayJournal();
 
+	int64_t load_end = getTimeMS();
+
+	print_msg(JERS_LOG_INFO, "Startup state loaded in %ldms - Queues/Resources: %ldms Jobs: %ldms Journal: %ldms",
+		load_end - load_start, load_jobs - load_start, load_journal - load_jobs, load_end - load_journal);
+
 	print_msg(JERS_LOG_DEBUG, "Initialising sockets\n");
 
 	/* Add server fd to epoll event list */
@@ -325,11 +346,13 @@ int main (int argc, char * argv[]) {
 
 	setup_listening_sockets();
 
+	/* Journal writes are handed off to the writer thread from here on */
+	journalWriterStart();
+
 	/* Start out event polling */
 	print_msg(JERS_LOG_DEBUG, "Initialising events\n");
 	initEvents();
 
-	server.candidate_recalc = 1;
 	server.initalising = 0;
 
 	print_msg(JERS_LOG_INFO, "* JERSD entering main loop...\n");
@@ -352,7 +375,7 @@ int main (int argc, char * argv[]) {
 		}
 
 		/* Poll for any events on our sockets */
-		int status = epoll_wait(server.event_fd, events, MAX_EVENTS, server.event_freq);
+		int status = epoll_wait(server.event_fd, events, MAX_EVENTS, nextEventTimeout());
 
 		for (int i = 0; i < status; i++) {
 			struct epoll_event * e = &events[i];
@@ -37,21 +37,120 @@
 /* Return the next free jobid.
  * 0 is returned if no ids are available */
 
-jobid_t getNextJobID(void) {
-	jobid_t id = server.start_jobid;
-	jobid_t i;
-	struct job * tmp_job = NULL;
+/* Jobids in use are tracked in a bitmap, with a second bitmap flagging the
+ * words that are full. Finding a free jobid only needs to look at one word of
+ * the first and a scan of the second, which is max_jobid / 4096 bits long. */
+
+static void initJobIDs(void) {
+	struct jobidMap *m = &server.jobids;
+
+	freeJobIDs();
+
+	m->max_jobid = server.max_jobid;
+	m->words = m->max_jobid / 64 + 1;
+	m->used = calloc(m->words, sizeof(uint64_t));
+	m->full = calloc(m->words / 64 + 1, sizeof(uint64_t));
+
+	if (m->used == NULL || m->full == NULL)
+		error_die("Failed to allocate jobid map: %s", strerror(errno));
+
+	/* Jobid 0 is never allocated */
+	m->used[0] = 1;
+
+	for (size_t i = 0; i < server.jobTable.count; i++)
+		reserveJobID(server.jobTable.jobs[i]->jobid);
+}
+
+static inline struct jobidMap * getJobIDs(void) {
+	if (unlikely(server.jobids.used == NULL || server.jobids.max_jobid != server.max_jobid))
+		initJobIDs();
+
+	return &server.jobids;
+}
+
+void freeJobIDs(void) {
+	free(server.jobids.used);
+	free(server.jobids.full);
+	memset(&server.jobids, 0, sizeof(struct jobidMap));
+}
+
+void reserveJobID(jobid_t jobid) {
+	struct jobidMap *m = getJobIDs();
+	size_t word = jobid / 64;
+
+	if (jobid > m->max_jobid)
+		return;
+
+	m->used[word] |= 1ULL << (jobid % 64);
+
+	if (m->used[word] == UINT64_MAX)
+		m->full[word / 64] |= 1ULL << (word % 64);
+}
+
+void releaseJobID(jobid_t jobid) {
+	struct jobidMap *m = getJobIDs();
+	size_t word = jobid / 64;
+
+	if (jobid == 0 || jobid > m->max_jobid)
+		return;
+
+	m->used[word] &= ~(1ULL << (jobid % 64));
+	m->full[word / 64] &= ~(1ULL << (word % 64));
+}
+
+/* Returns the lowest free jobid >= from, or 0 if there isn't one */
+static jobid_t findFreeJobID(jobid_t from) {
+	struct jobidMap *m = getJobIDs();
+	size_t word = from / 64;
+	uint64_t free_bits;
+
+	if (from == 0 || from > m->max_jobid)
+		return 0;
 
-	for (i = 0; i < server.max_jobid; i++) {
-		if (++id > server.max_jobid)
-			id = 1;
+	/* Check the rest of the word 'from' is in first */
+	free_bits = ~m->used[word] & (UINT64_MAX << (from % 64));
 
-		tmp_job = findJob(id);
+	if (free_bits == 0) {
+		/* Find the next word that isn't full */
+		size_t i = (word + 1) / 64;
+		uint64_t not_full = (word + 1) % 64 ? ~m->full[i] & (UINT64_MAX << ((word + 1) % 64)) : ~m->full[i];
 
-		if (!tmp_job) {
-			server.start_jobid = id;
-			return id;
+		while (not_full == 0) {
+			if (++i > m->words / 64)
+				return 0;
+
+			not_full = ~m->full[i];
 		}
+
+		word = i * 64 + __builtin_ctzll(not_full);
+
+		if (word >= m->words)
+			return 0;
+
+		free_bits = ~m->used[word];
+	}
+
+	jobid_t jobid = word * 64 + __builtin_ctzll(free_bits);
+
+	return jobid <= m->max_jobid ? jobid : 0;
+}
+
+/* Returns the first free jobid after 'after', wrapping around to 1 */
+static jobid_t nextFreeJobID(jobid_t after) {
+	jobid_t jobid = findFreeJobID(after + 1);
+
+	if (jobid == 0)
+		jobid = findFreeJobID(1);
+
+	return jobid;
+}
+
+jobid_t getNextJobID(void) {
+	jobid_t id = nextFreeJobID(server.start_jobid);
+
+	if (id) {
+		server.start_jobid = id;
+		return id;
 	}
 
 	/* No ids available, try cleaning up some deleted jobs and try again
@@ -65,46 +164,412 @@ jobid_t getNextJobID(void) {
 	return 0;
 }
 
-/* Free a struct job entry, freeing all associated memory */
+/* qsort()/bsearch() comparator for arrays of jobids */
+int cmpJobID(const void *a, const void *b) {
+	jobid_t id_a = *(const jobid_t *)a;
+	jobid_t id_b = *(const jobid_t *)b;
 
-void freeJob (struct job * j) {
-	for (int i = 0; i < j->tag_count; i++) {
-		free(j->tags[i].key);
-		free(j->tags[i].value);
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+/* Allocate up to count unused jobids in a single pass, skipping any in the sorted
+ * exclude array. Returns the number of jobids allocated. */
+
+jobid_t allocateJobIDs(jobid_t count, jobid_t *ids, const jobid_t *exclude, jobid_t exclude_count) {
+	jobid_t id = server.start_jobid;
+	jobid_t allocated = 0;
+	int64_t distance = 0;
+
+	while (allocated < count) {
+		jobid_t next = nextFreeJobID(id);
+
+		if (next == 0)
+			break;
+
+		/* Stop once we have been all the way around */
+		distance += next > id ? next - id : (int64_t)server.max_jobid - id + next;
+
+		if (distance > server.max_jobid)
+			break;
+
+		id = next;
+
+		if (exclude_count && bsearch(&id, exclude, exclude_count, sizeof(jobid_t), cmpJobID))
+			continue;
+
+		ids[allocated++] = id;
+	}
+
+	if (allocated)
+		server.start_jobid = ids[allocated - 1];
+
+	return allocated;
+}
+
+/* Jobs are allocated from slabs of JOB_SLAB_SIZE, with freed jobs kept on a
+ * free list linked through deleted_next for reuse. Slabs are never released.
+ * Only the main thread allocates and frees jobs. */
+
+struct jobSlab {
+	struct jobSlab *next;
+	struct job jobs[JOB_SLAB_SIZE];
+};
+
+struct job * allocJob(void) {
+	struct job *j;
+
+	if (server.jobSlabs.free == NULL) {
+		struct jobSlab *slab = malloc(sizeof(struct jobSlab));
+
+		if (slab == NULL)
+			error_die("Failed to allocate memory for jobs: %s", strerror(errno));
+
+		for (int i = JOB_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->jobs[i].deleted_next = server.jobSlabs.free;
+			server.jobSlabs.free = &slab->jobs[i];
+		}
+
+		slab->next = server.jobSlabs.slabs;
+		server.jobSlabs.slabs = slab;
+		server.stats.memory.job_slabs++;
+	}
+
+	j = server.jobSlabs.free;
+	server.jobSlabs.free = j->deleted_next;
+
+	memset(j, 0, sizeof(struct job));
+
+	return j;
+}
+
+void freeJobSlabs(void) {
+	while (server.jobSlabs.slabs) {
+		struct jobSlab *next = server.jobSlabs.slabs->next;
+		free(server.jobSlabs.slabs);
+		server.jobSlabs.slabs = next;
+	}
+
+	server.jobSlabs.free = NULL;
+	server.stats.memory.job_slabs = 0;
+}
+
+/* Free memory owned by a job, unless it was packed into the jobs string arena.
+ * freeJobString() also releases the reference to interned strings */
+
+int jobArenaOwns(struct job *j, const void *p) {
+	return j->arena && (const char *)p >= j->arena && (const char *)p < j->arena + j->arena_size;
+}
+
+void freeJobMem(struct job *j, void *p) {
+	if (!jobArenaOwns(j, p))
+		free(p);
+}
+
+void freeJobString(struct job *j, char *str) {
+	if (str == NULL || jobArenaOwns(j, str))
+		return;
+
+	if (releaseString(str) != 0)
+		free(str);
+}
+
+void freeJobStrings(struct job *j, int count, char ***array) {
+	for (int i = 0; i < count; i++)
+		freeJobString(j, (*array)[i]);
+
+	freeJobMem(j, *array);
+	*array = NULL;
+}
+
+void freeJobTags(struct job *j, int count, key_val_t **tags) {
+	for (int i = 0; i < count; i++) {
+		freeJobString(j, (*tags)[i].key);
+		freeJobString(j, (*tags)[i].value);
 	}
 
-	free(j->tags);
+	freeJobMem(j, *tags);
+	*tags = NULL;
+}
+
+/* Pack the strings and arrays owned by a job into a single allocation,
+ * freeing the originals. Anything modified afterwards is allocated on its own
+ * again, so it needs to be released with freeJobMem() or freeJobString().
+ * packJobCopy() is used when the job's strings are borrowed from elsewhere,
+ * ie. a request, copying them without freeing the originals.
+ *
+ * Strings that tend to be the same across jobs (shell, wrapper, pre/post
+ * commands, stdout/stderr, environment variables and tag keys) are interned
+ * rather than packed. Tag keys are always interned, so they can be compared by pointer.
+ *
+ * The loader threads call this. The intern table and its server.stats.memory counts are
+ * the only shared state touched, with the intern lock held once for all of a job's strings.
+ * Releasing the originals looks each one up in the intern table too, so the snapshot
+ * loader packs strings borrowed from the snapshot with packJobCopy() instead. */
+
+static inline size_t arenaString(const char *str) {
+	return str ? strlen(str) + 1 : 0;
+}
+
+static inline char * packString(char **next, const char *str) {
+	char *packed;
+	size_t len;
+
+	if (str == NULL)
+		return NULL;
+
+	len = strlen(str) + 1;
+	packed = memcpy(*next, str, len);
+	*next += len;
+
+	return packed;
+}
+
+static void packJobStrings(struct job *j, int release) {
+	char *old_arena = j->arena;
+	size_t size = 0;
+	char *arena = NULL, *next;
+
+	/* Arrays first, so they stay pointer aligned */
+	size += sizeof(char *) * j->argc;
+	size += sizeof(char *) * j->env_count;
+	size += sizeof(key_val_t) * j->tag_count;
+	size += sizeof(struct jobResource) * j->res_count;
 
 	for (int i = 0; i < j->argc; i++)
-		free(j->argv[i]);
+		size += arenaString(j->argv[i]);
 
-	free(j->argv);
+	for (int i = 0; i < j->tag_count; i++)
+		size += arenaString(j->tags[i].value);
 
-	for (int i = 0; i < j->env_count; i++)
-		free(j->envs[i]);
+	size += arenaString(j->jobname);
+
+	if (size) {
+		arena = malloc(size);
+
+		if (arena == NULL)
+			error_die("Failed to allocate memory for job %d: %s", j->jobid, strerror(errno));
+	}
 
-	free(j->envs);
+	next = arena;
+
+	char **argv = (char **)next;
+	next += sizeof(char *) * j->argc;
+	char **envs = (char **)next;
+	next += sizeof(char *) * j->env_count;
+	key_val_t *tags = (key_val_t *)next;
+	next += sizeof(key_val_t) * j->tag_count;
+	struct jobResource *res = (struct jobResource *)next;
+	next += sizeof(struct jobResource) * j->res_count;
+
+	for (int i = 0; i < j->argc; i++)
+		argv[i] = packString(&next, j->argv[i]);
 
-	if (j->res_count) {
-		free(j->req_resources);
+	for (int i = 0; i < j->tag_count; i++)
+		tags[i].value = packString(&next, j->tags[i].value);
+
+	if (j->res_count)
+		memcpy(res, j->req_resources, sizeof(struct jobResource) * j->res_count);
+
+	char *jobname = packString(&next, j->jobname);
+
+	lockInternTable();
+
+	for (int i = 0; i < j->env_count; i++)
+		envs[i] = internStringLocked(j->envs[i]);
+
+	for (int i = 0; i < j->tag_count; i++)
+		tags[i].key = internStringLocked(j->tags[i].key);
+
+	char *shell = internStringLocked(j->shell);
+	char *wrapper = internStringLocked(j->wrapper);
+	char *pre_cmd = internStringLocked(j->pre_cmd);
+	char *post_cmd = internStringLocked(j->post_cmd);
+	char *out = internStringLocked(j->stdout);
+	char *err = internStringLocked(j->stderr);
+
+	unlockInternTable();
+
+	/* Release the originals, including the previous arena if this job was already packed */
+	if (release) {
+		freeJobStrings(j, j->argc, &j->argv);
+		freeJobStrings(j, j->env_count, &j->envs);
+		freeJobTags(j, j->tag_count, &j->tags);
+		freeJobMem(j, j->req_resources);
+		freeJobString(j, j->jobname);
+		freeJobString(j, j->shell);
+		freeJobString(j, j->wrapper);
+		freeJobString(j, j->pre_cmd);
+		freeJobString(j, j->post_cmd);
+		freeJobString(j, j->stdout);
+		freeJobString(j, j->stderr);
 	}
 
-	free(j->jobname);
-	free(j->shell);
-	free(j->pre_cmd);
-	free(j->post_cmd);
-	free(j->wrapper);
-	free(j->stdout);
-	free(j->stderr);
+	free(old_arena);
+
+	j->argv = j->argc ? argv : NULL;
+	j->envs = j->env_count ? envs : NULL;
+	j->tags = j->tag_count ? tags : NULL;
+	j->req_resources = j->res_count ? res : NULL;
+	j->jobname = jobname;
+	j->shell = shell;
+	j->wrapper = wrapper;
+	j->pre_cmd = pre_cmd;
+	j->post_cmd = post_cmd;
+	j->stdout = out;
+	j->stderr = err;
+
+	j->arena = arena;
+	j->arena_size = size;
+}
+
+void packJob(struct job *j) {
+	packJobStrings(j, 1);
+}
 
-	free(j);
+void packJobCopy(struct job *j) {
+	packJobStrings(j, 0);
 }
 
-/* Locate the requested jobid from the job hash table */
+/* Free a struct job entry, freeing all associated memory */
+
+void freeJob (struct job * j) {
+	freeJobTags(j, j->tag_count, &j->tags);
+	freeJobStrings(j, j->argc, &j->argv);
+	freeJobStrings(j, j->env_count, &j->envs);
+
+	if (j->env_profile)
+		releaseEnvProfile(j->env_profile);
+
+	freeJobMem(j, j->req_resources);
+	freeJobString(j, j->jobname);
+	freeJobString(j, j->shell);
+	freeJobString(j, j->pre_cmd);
+	freeJobString(j, j->post_cmd);
+	freeJobString(j, j->wrapper);
+	freeJobString(j, j->stdout);
+	freeJobString(j, j->stderr);
+
+	free(j->arena);
+
+	j->deleted_next = server.jobSlabs.free;
+	server.jobSlabs.free = j;
+}
+
+/* Locate the requested jobid from the job table */
 struct job * findJob(jobid_t jobid) {
-	struct job * j = NULL;
-	HASH_FIND_INT(server.jobTable, &jobid, j);
-	return j;
+	struct jobTable *t = &server.jobTable;
+	size_t page = jobid >> JOBTABLE_PAGE_BITS;
+
+	if (unlikely(page >= t->page_count || t->pages[page] == NULL))
+		return NULL;
+
+	return t->pages[page]->jobs[jobid & (JOBTABLE_PAGE_SIZE - 1)];
+}
+
+/* Insert a job into the job table. The caller has already checked the jobid isn't in use */
+void jobTableAdd(struct job *j) {
+	struct jobTable *t = &server.jobTable;
+	size_t page = j->jobid >> JOBTABLE_PAGE_BITS;
+
+	if (page >= t->page_count) {
+		size_t new_count = page + 1;
+
+		/* Size the page directory for max_jobid up front, rather than growing it a page at a time */
+		if (new_count < ((size_t)server.max_jobid >> JOBTABLE_PAGE_BITS) + 1)
+			new_count = ((size_t)server.max_jobid >> JOBTABLE_PAGE_BITS) + 1;
+
+		struct jobPage **pages = realloc(t->pages, sizeof(struct jobPage *) * new_count);
+
+		if (pages == NULL)
+			error_die("Failed to grow job table: %s", strerror(errno));
+
+		memset(pages + t->page_count, 0, sizeof(struct jobPage *) * (new_count - t->page_count));
+		t->pages = pages;
+		t->page_count = new_count;
+	}
+
+	if (t->pages[page] == NULL) {
+		t->pages[page] = calloc(1, sizeof(struct jobPage));
+
+		if (t->pages[page] == NULL)
+			error_die("Failed to allocate job table page: %s", strerror(errno));
+	}
+
+	if (t->count == t->size) {
+		size_t new_size = t->size ? t->size * 2 : 1024;
+		struct job **jobs = realloc(t->jobs, sizeof(struct job *) * new_size);
+
+		if (jobs == NULL)
+			error_die("Failed to grow job table: %s", strerror(errno));
+
+		t->jobs = jobs;
+
+		struct jobHot *hot = realloc(t->hot, sizeof(struct jobHot) * new_size);
+
+		if (hot == NULL)
+			error_die("Failed to grow job table: %s", strerror(errno));
+
+		t->hot = hot;
+		t->size = new_size;
+	}
+
+	t->pages[page]->jobs[j->jobid & (JOBTABLE_PAGE_SIZE - 1)] = j;
+	t->pages[page]->count++;
+
+	j->table_index = t->count;
+	t->jobs[t->count++] = j;
+	updateJobHot(j);
+}
+
+/* Copy the fields used for filtering into the jobs hot record.
+ * Needed whenever one of them changes, which changeJobState() does for most changes */
+void updateJobHot(struct job *j) {
+	struct jobHot *h = &server.jobTable.hot[j->table_index];
+
+	h->jobid = j->jobid;
+	h->state = j->state;
+	h->priority = j->priority;
+	h->uid = j->uid;
+	h->deleted = j->internal_state & JERS_FLAG_DELETED;
+	h->res_count = j->res_count;
+	h->queue = j->queue;
+	h->submit_time = j->submit_time;
+	h->start_time = j->start_time;
+	h->finish_time = j->finish_time;
+}
+
+/* Remove a job from the job table, freeing its page once it's empty */
+void jobTableDel(struct job *j) {
+	struct jobTable *t = &server.jobTable;
+	size_t page = j->jobid >> JOBTABLE_PAGE_BITS;
+	struct job *last = t->jobs[--t->count];
+
+	t->jobs[j->table_index] = last;
+	t->hot[j->table_index] = t->hot[t->count];
+	last->table_index = j->table_index;
+
+	t->pages[page]->jobs[j->jobid & (JOBTABLE_PAGE_SIZE - 1)] = NULL;
+
+	if (--t->pages[page]->count == 0) {
+		free(t->pages[page]);
+		t->pages[page] = NULL;
+	}
+}
+
+/* Free the job table and every job in it */
+void freeJobTable(void) {
+	struct jobTable *t = &server.jobTable;
+
+	for (size_t i = 0; i < t->count; i++)
+		freeJob(t->jobs[i]);
+
+	for (size_t i = 0; i < t->page_count; i++)
+		free(t->pages[i]);
+
+	free(t->pages);
+	free(t->jobs);
+	free(t->hot);
+	memset(t, 0, sizeof(struct jobTable));
 }
 
 int cleanupJob(struct job *j) {
@@ -114,22 +579,26 @@ int cleanupJob(struct job *j) {
 	if (j->obj.dirty || j->internal_state &JERS_FLAG_FLUSHING)
 		return 1;
 
-	stateDelJob(j);
-	HASH_DEL(server.jobTable, j);
+	jobTableDel(j);
+	DL_DELETE2(server.deletedJobs, j, deleted_prev, deleted_next);
+	releaseJobID(j->jobid);
 
-	/* If the job was a candidate for execution, clear it out of the pool */
-	for (int i = 0; i < server.candidate_pool_jobs; i++) {
-		if (server.candidate_pool[i] == j) {
-			server.candidate_pool[i] = NULL;
-			break;
-		}
-	}
+	/* If the job was a candidate for execution, clear it out of the queues heap */
+	removeCandidate(j);
 
 	/* Remove the job from the indexed tag table */
 	if (server.index_tag)
 		delIndexTag(j);
 
+	if (j->arena) {
+		server.stats.memory.arenas--;
+		server.stats.memory.arena_bytes -= j->arena_size;
+	}
+
+	int64_t start = getTimeNS();
 	freeJob(j);
+	server.stats.memory.free_ns += getTimeNS() - start;
+	server.stats.memory.freed++;
 
 	server.deleted--;
 
@@ -137,11 +606,12 @@ int cleanupJob(struct job *j) {
 }
 
 /* Cleanup jobs that are marked as deleted, returning the number of jobs cleaned up
- * - Only cleanup jobs until the max_clean threshold is reached. */
+ * - Only cleanup jobs until the max_clean threshold is reached.
+ * - Deleted jobs are listed in the order they were deleted, so once we hit one
+ *   that hasn't been saved yet, the jobs after it won't have been either. */
 
 int cleanupJobs(uint32_t max_clean) {
 	jobid_t cleaned_up = 0;
-	struct job *j, *tmp;
 
 	if (server.deleted == 0)
 		return 0;
@@ -149,15 +619,11 @@ int cleanupJobs(uint32_t max_clean) {
 	if (max_clean == 0)
 		max_clean = 10;
 
-	HASH_ITER(hh, server.jobTable, j, tmp) {
-		if (!(j->internal_state &JERS_FLAG_DELETED))
-			continue;
-
-		/* Got a job to remove */
-		cleanupJob(j);
-
-		if (++cleaned_up >= max_clean)
+	while (server.deletedJobs && cleaned_up < max_clean) {
+		if (cleanupJob(server.deletedJobs))
 			break;
+
+		cleaned_up++;
 	}
 
 	return cleaned_up;
@@ -177,7 +643,16 @@ int addJob(struct job * j, int dirty) {
 		return 1;
 	}
 
-	HASH_ADD_INT(server.jobTable, jobid, j);
+	jobTableAdd(j);
+	reserveJobID(j->jobid);
+
+	if (j->arena) {
+		server.stats.memory.arenas++;
+		server.stats.memory.arena_bytes += j->arena_size;
+	}
+
+	if (j->jobid > server.high_jobid)
+		server.high_jobid = j->jobid;
 
 	/* Add the job to the indexed tag table, if it has the indexed tag */
 	if (server.index_tag && j->tag_count) {
@@ -199,8 +674,11 @@ int addJob(struct job * j, int dirty) {
 }
 
 void deleteJob(struct job *j) {
+	/* Flag it dirty, so the deletion is saved before the job is cleaned up */
 	j->internal_state |= JERS_FLAG_DELETED;
-	changeJobState(j, 0, NULL, 0);
+	changeJobState(j, 0, NULL, 1);
+
+	DL_APPEND2(server.deletedJobs, j, deleted_prev, deleted_next);
 
 	if (j->defer_time)
 		removeDeferredJob(j);
@@ -210,7 +688,9 @@ void deleteJob(struct job *j) {
 }
 
 void markJobsUnknown(agent *a) {
-	for (struct job *j = server.jobTable; j != NULL; j = j->hh.next) {
+	for (size_t i = 0; i < server.jobTable.count; i++) {
+		struct job *j = server.jobTable.jobs[i];
+
 		if (j->queue->agent == a && (j->state & JERS_JOB_RUNNING || j->internal_state & JERS_FLAG_JOB_STARTED)) {
 			print_msg(JERS_LOG_WARNING, "Job %d is now unknown", j->jobid);
 			j->internal_state = 0;
@@ -279,8 +759,10 @@ int jobToJSON(struct job *j, buff_t *buff)
 	JSONAddInt(buff, EXITCODE, j->exitcode);
 	JSONAddInt(buff, SIGNAL, j->signal);
 
-	if (j->pend_reason)
-		JSONAddInt(buff, PENDREASON, j->pend_reason);
+	int pend_reason = getPendReason(j);
+
+	if (pend_reason)
+		JSONAddInt(buff, PENDREASON, pend_reason);
 
 	if (j->fail_reason)
 		JSONAddInt(buff, FAILREASON, j->fail_reason);
@@ -291,16 +773,107 @@ int jobToJSON(struct job *j, buff_t *buff)
 	return 0;
 }
 
-/* Maintain the deferred job linked list */
+/* Maintain the deferred job timer wheel */
+
+/* 'next' is the first second the wheel has yet to walk. That's the current second
+ * when cascading, as its slot is walked straight after */
+static void insertDeferredJob(struct deferWheel *w, struct job *j, time_t next) {
+	time_t delta = j->defer_time - w->now;
+	struct job **slot;
+
+	if (j->defer_time <= next) {
+		/* Already due, release it on the next tick */
+		slot = &w->slots[0][next & DEFER_WHEEL_MASK];
+	} else if (delta < DEFER_WHEEL_SLOTS) {
+		slot = &w->slots[0][j->defer_time & DEFER_WHEEL_MASK];
+	} else if (delta < (time_t)1 << (DEFER_WHEEL_BITS * 2)) {
+		slot = &w->slots[1][(j->defer_time >> DEFER_WHEEL_BITS) & DEFER_WHEEL_MASK];
+	} else if (delta < (time_t)1 << (DEFER_WHEEL_BITS * 3)) {
+		slot = &w->slots[2][(j->defer_time >> (DEFER_WHEEL_BITS * 2)) & DEFER_WHEEL_MASK];
+	} else {
+		slot = &w->overflow;
+	}
 
-static inline time_t deferCmp(const struct job *a, const struct job *b) {
-	return a->defer_time - b->defer_time;
+	DL_APPEND2(*slot, j, deferred_prev, deferred_next);
+	j->deferred_slot = slot;
 }
 
 void addDeferredJob(struct job *j) {
-	DL_INSERT_INORDER2(server.deferred_list, j, deferCmp, deferred_prev, deferred_next);
+	struct deferWheel *w = &server.deferred;
+
+	/* Start the wheel from the current time, so jobs due this second are released on the next check */
+	if (w->count == 0)
+		w->now = time(NULL) - 1;
+
+	insertDeferredJob(w, j, w->now + 1);
+	w->count++;
 }
 
 void removeDeferredJob(struct job *j) {
-	DL_DELETE2(server.deferred_list, j, deferred_prev, deferred_next);
+	if (j->deferred_slot == NULL)
+		return;
+
+	DL_DELETE2(*j->deferred_slot, j, deferred_prev, deferred_next);
+	j->deferred_slot = NULL;
+	server.deferred.count--;
+}
+
+/* Move every job in a slot of a higher level down the wheel */
+static void cascadeDeferredSlot(struct deferWheel *w, struct job **slot) {
+	struct job *list = *slot;
+	struct job *j, *tmp;
+
+	*slot = NULL;
+
+	DL_FOREACH_SAFE2(list, j, tmp, deferred_next) {
+		DL_DELETE2(list, j, deferred_prev, deferred_next);
+		insertDeferredJob(w, j, w->now);
+	}
+}
+
+/* Advance the wheel to 'now', removing and returning a list of the jobs that are due.
+ * Only the slots that have expired since the last call are looked at. */
+struct job *expireDeferredJobs(time_t now) {
+	struct deferWheel *w = &server.deferred;
+	struct job *expired = NULL;
+
+	/* Nothing to walk over if the wheel is empty */
+	if (w->count == 0) {
+		w->now = now;
+		return NULL;
+	}
+
+	while (w->now < now) {
+		time_t t = ++w->now;
+		struct job **slot = &w->slots[0][t & DEFER_WHEEL_MASK];
+
+		if ((t & DEFER_WHEEL_MASK) == 0) {
+			if (((t >> DEFER_WHEEL_BITS) & DEFER_WHEEL_MASK) == 0) {
+				if (((t >> (DEFER_WHEEL_BITS * 2)) & DEFER_WHEEL_MASK) == 0)
+					cascadeDeferredSlot(w, &w->overflow);
+
+				cascadeDeferredSlot(w, &w->slots[2][(t >> (DEFER_WHEEL_BITS * 2)) & DEFER_WHEEL_MASK]);
+			}
+
+			cascadeDeferredSlot(w, &w->slots[1][(t >> DEFER_WHEEL_BITS) & DEFER_WHEEL_MASK]);
+		}
+
+		if (*slot == NULL)
+			continue;
+
+		for (struct job *j = *slot; j != NULL; j = j->deferred_next) {
+			j->deferred_slot = NULL;
+			w->count--;
+		}
+
+		DL_CONCAT2(expired, *slot, deferred_prev, deferred_next);
+		*slot = NULL;
+
+		if (w->count == 0) {
+			w->now = now;
+			break;
+		}
+	}
+
+	return expired;
 }
@@ -0,0 +1,721 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Binary journal format
+ *
+ * Journals are either the original tab separated text lines (see stateSaveCmd)
+ * or, with 'journal_format binary', a binary file of length prefixed records:
+ *   [file header][record][record]...
+ *
+ * Each record is a fixed header, followed by the command name and the JSON
+ * message, padded to a multiple of 8 bytes. The CRC32C covers the header
+ * (with the crc field zeroed), the command and the message, so a record that
+ * was only partially written can be detected.
+ *
+ * The preallocated space at the end of a journal is zero filled, so a record
+ * header of zeros marks the end of the records written so far.
+ *
+ * Instead of marking the last record saved to disk with a '*', the background
+ * save writes the offset to replay from into the file header. */
+
+#define JOURNAL_MAGIC   0x4c4e524a // "JRNL"
+#define JOURNAL_VERSION 1
+
+#define JOURNAL_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+struct journalHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_header_size;
+	int64_t created;
+	int64_t commit; // Offset of the first record not yet saved to disk, 0 if none
+	int64_t reserved[4];
+};
+
+struct journalRecord {
+	uint32_t length;  // Length of the JSON message
+	uint32_t crc;
+	uint16_t type;
+	uint16_t cmd_len;
+	uint32_t uid;
+	int64_t time_ms;  // Milliseconds since the epoch
+	uint32_t jobid;
+	uint32_t reserved;
+	int64_t revision;
+};
+
+/* Returns a new file header for a binary journal */
+char *journalEncodeHeader(size_t *len) {
+	struct journalHeader *h = calloc(1, sizeof(struct journalHeader));
+
+	if (h == NULL)
+		error_die("Failed to allocate journal header: %s", strerror(errno));
+
+	h->magic = JOURNAL_MAGIC;
+	h->version = JOURNAL_VERSION;
+	h->header_size = sizeof(struct journalHeader);
+	h->record_header_size = sizeof(struct journalRecord);
+	h->created = time(NULL);
+
+	*len = sizeof(struct journalHeader);
+	return (char *)h;
+}
+
+/* Read the file header of a journal. Returns the size of the header if this
+ * is a binary journal, setting commit to the offset to replay from (0 if none)
+ * Returns 0 for a text journal */
+off_t journalReadHeader(int fd, off_t *commit) {
+	struct journalHeader h;
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != JOURNAL_MAGIC)
+		return 0;
+
+	if (h.version != JOURNAL_VERSION || h.record_header_size != sizeof(struct journalRecord))
+		error_die("Unsupported binary journal version %u", h.version);
+
+	if (commit)
+		*commit = h.commit;
+
+	return h.header_size;
+}
+
+/* Record the offset to replay from, once the records before it have been saved to disk */
+int journalMarkCommit(int fd, off_t offset) {
+	int64_t commit = offset;
+
+	if (pwrite(fd, &commit, sizeof(commit), offsetof(struct journalHeader, commit)) != sizeof(commit))
+		return 1;
+
+	return 0;
+}
+
+/* Encode a record, returning a buffer to be written to the journal */
+char *journalEncodeRecord(int type, int64_t time_ms, uid_t uid, const char *cmd, jobid_t jobid, int64_t revision, const char *msg, size_t *len) {
+	size_t cmd_len = cmd ? strlen(cmd) : 0;
+	size_t msg_len = msg ? strlen(msg) : 0;
+	size_t size = JOURNAL_ALIGN(sizeof(struct journalRecord) + cmd_len + msg_len);
+	char *buf = calloc(1, size);
+
+	if (buf == NULL)
+		error_die("Failed to allocate memory for journal record: %s", strerror(errno));
+
+	struct journalRecord *r = (struct journalRecord *)buf;
+	r->length = msg_len;
+	r->type = type;
+	r->cmd_len = cmd_len;
+	r->uid = uid;
+	r->time_ms = time_ms;
+	r->jobid = jobid;
+	r->revision = revision;
+
+	memcpy(buf + sizeof(struct journalRecord), cmd, cmd_len);
+	memcpy(buf + sizeof(struct journalRecord) + cmd_len, msg, msg_len);
+
+	r->crc = crc32c(0, buf, sizeof(struct journalRecord) + cmd_len + msg_len);
+
+	*len = size;
+	return buf;
+}
+
+/* Decode the record at the start of data, with avail bytes available.
+ * Returns 1 for a valid record, 0 at the end of the records written,
+ * or -1 for a partially written or corrupt record */
+int journalDecodeRecord(const char *data, size_t avail, struct journalRecordInfo *info) {
+	struct journalRecord r;
+	static const struct journalRecord empty = {0};
+
+	if (avail < sizeof(struct journalRecord))
+		return avail == 0 ? 0 : -1;
+
+	memcpy(&r, data, sizeof(r));
+
+	if (memcmp(&r, &empty, sizeof(r)) == 0)
+		return 0;
+
+	size_t len = sizeof(struct journalRecord) + r.cmd_len + r.length;
+
+	if (len > avail)
+		return -1;
+
+	uint32_t crc = r.crc;
+	r.crc = 0;
+
+	if (crc32c(crc32c(0, &r, sizeof(r)), data + sizeof(r), r.cmd_len + r.length) != crc)
+		return -1;
+
+	info->type = r.type;
+	info->time = r.time_ms / 1000;
+	info->time_ms = r.time_ms % 1000;
+	info->uid = r.uid;
+	info->jobid = r.jobid;
+	info->revision = r.revision;
+	info->cmd = data + sizeof(r);
+	info->cmd_len = r.cmd_len;
+	info->msg = info->cmd + r.cmd_len;
+	info->msg_len = r.length;
+	info->size = JOURNAL_ALIGN(len);
+
+	if (info->size > avail)
+		info->size = avail;
+
+	return 1;
+}
+
+/* Read the next record from a journal stream. The record is read into buf,
+ * which is resized as needed. Returns the same as journalDecodeRecord() */
+int journalReadRecord(FILE *f, char **buf, size_t *size, struct journalRecordInfo *info) {
+	struct journalRecord r;
+	size_t len = fread(&r, 1, sizeof(r), f);
+
+	if (len < sizeof(r))
+		return len == 0 ? 0 : -1;
+
+	size_t record_size = JOURNAL_ALIGN(sizeof(r) + r.cmd_len + r.length);
+
+	if (*size < record_size) {
+		char *tmp = realloc(*buf, record_size);
+
+		if (tmp == NULL)
+			return -1;
+
+		*buf = tmp;
+		*size = record_size;
+	}
+
+	memcpy(*buf, &r, sizeof(r));
+
+	if (r.type != 0 && fread(*buf + sizeof(r), 1, record_size - sizeof(r), f) != record_size - sizeof(r))
+		return -1;
+
+	return journalDecodeRecord(*buf, record_size, info);
+}
+
+/* Journal writes are performed by a dedicated writer thread, so a slow disk
+ * doesn't hold up the main event loop.
+ *
+ * The main thread formats each journal record and keeps track of where it will
+ * be written, then queues the write for the writer thread on a single producer,
+ * single consumer ring. The writer works through everything queued, combining
+ * consecutive writes into a single pwritev() and consecutive flushes into
+ * a single fdatasync().
+ *
+ * As the writer finishes each batch, it updates the number of records written
+ * and flushed, then signals an eventfd that is polled by the main event loop.
+ *
+ * If the writer isn't running (ie. during startup) the operations are performed
+ * straight away by the calling thread. */
+
+#define JOURNAL_QUEUE_SIZE 16384 // Must be a power of 2
+#define JOURNAL_MAX_IOV    256
+
+enum journalOpType {
+	JOURNAL_OP_WRITE = 1,
+	JOURNAL_OP_EXTEND,
+	JOURNAL_OP_SYNC,
+	JOURNAL_OP_CLOSE
+};
+
+struct journalOp {
+	int type;
+	int fd;
+	off_t offset;
+	size_t len;
+	char *data;
+	int64_t seq;
+};
+
+static struct {
+	struct journalOp ops[JOURNAL_QUEUE_SIZE];
+
+	_Atomic uint64_t head; // Next op to be queued, only updated by the main thread
+	_Atomic uint64_t tail; // Next op to be processed, only updated by the writer
+
+	_Atomic int64_t written; // Records written
+	_Atomic int64_t synced;  // Records flushed to disk
+	_Atomic off_t allocated; // Journal size after the last successful extend
+	_Atomic int enospc;      // An extend failed with ENOSPC
+	_Atomic int error;       // errno of the first write or flush to fail
+	_Atomic int extended;    // An extend succeeded
+	_Atomic int sleeping;
+	_Atomic int stop;
+
+	int64_t seq; // Records queued, only used by the main thread
+
+	int running;
+	int wake_fd; // Wakes the writer thread up when work is queued
+	int done_fd; // Signalled by the writer thread as it completes work
+	pthread_t thread;
+	struct connectionType connection;
+} writer = {.wake_fd = -1, .done_fd = -1};
+
+/* Record the first write or flush to fail. Nothing else is written or flushed
+ * after it, so the records written and synced never move past the failed one */
+static void journalSetError(const char *action, int err) {
+	int expected = 0;
+
+	print_msg(JERS_LOG_CRITICAL, "Failed to %s journal file: %s", action, strerror(err));
+	atomic_compare_exchange_strong(&writer.error, &expected, err);
+}
+
+/* Write all the data in the iovec out, handling any short writes.
+ * Returns 0 on success or the errno of the failed write */
+static int journalWritev(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+	while (iovcnt) {
+		ssize_t len = pwritev(fd, iov, iovcnt, offset);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno;
+		}
+
+		offset += len;
+
+		while (iovcnt && (size_t)len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+
+	return 0;
+}
+
+/* Write out a batch of consecutive writes, seq being the last record in it */
+static void journalWriteBatch(int fd, struct iovec *iov, int iovcnt, off_t offset, int64_t seq, int64_t *written) {
+	int rc;
+
+	if (atomic_load(&writer.error))
+		return;
+
+	if ((rc = journalWritev(fd, iov, iovcnt, offset)) != 0)
+		journalSetError("write to", rc);
+	else if (seq)
+		*written = seq;
+}
+
+/* Flush everything written to fd, marking the records up to seq as synced */
+static void journalFlush(int fd, int64_t seq) {
+	if (atomic_load(&writer.error))
+		return;
+
+	if (fdatasync(fd) != 0) {
+		journalSetError("flush", errno);
+		return;
+	}
+
+	if (seq)
+		atomic_store(&writer.synced, seq);
+}
+
+/* Zero fill the end of the journal to allocate the space for new records */
+static void journalExtend(struct journalOp *op) {
+	static char *data = NULL;
+	static size_t data_size = 0;
+	size_t fill_size = op->len;
+	off_t offset = op->offset;
+
+	if (data_size < fill_size) {
+		free(data);
+		data = calloc(1, fill_size);
+
+		if (data == NULL)
+			error_die("Failed to allocate memory to extend journal: %s", strerror(errno));
+
+		data_size = fill_size;
+	}
+
+	while (fill_size) {
+		ssize_t written = pwrite(op->fd, data, fill_size, offset);
+
+		if (written == -1) {
+			if (errno == ENOSPC) {
+				/* The main thread will switch into readonly mode */
+				atomic_store(&writer.enospc, 1);
+				return;
+			} else if (errno != EINTR) {
+				/* Another error occurred trying to fill in the file */
+				error_die("Failed to extend journal file: %s", strerror(errno));
+			}
+
+			continue;
+		}
+
+		fill_size -= written;
+		offset += written;
+	}
+
+	if (fsync(op->fd) != 0) {
+		journalSetError("flush", errno);
+		return;
+	}
+
+	atomic_store(&writer.allocated, op->offset + op->len);
+	atomic_store(&writer.extended, 1);
+}
+
+/* Perform a batch of queued operations */
+static void journalProcess(struct journalOp *ops, uint64_t first, uint64_t count) {
+	struct iovec iov[JOURNAL_MAX_IOV];
+	int iovcnt = 0;
+	int iov_fd = -1;
+	off_t iov_start = 0;
+	off_t iov_end = 0;
+	int sync_fd = -1;
+	int64_t sync_seq = 0;
+	int64_t iov_seq = 0;
+	int64_t written = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		struct journalOp *op = &ops[(first + i) & (JOURNAL_QUEUE_SIZE - 1)];
+
+		/* Write out the pending writes unless this one carries on from them */
+		if (iovcnt && (op->type != JOURNAL_OP_WRITE || op->fd != iov_fd || op->offset != iov_end || iovcnt == JOURNAL_MAX_IOV)) {
+			journalWriteBatch(iov_fd, iov, iovcnt, iov_start, iov_seq, &written);
+
+			for (int k = 0; k < iovcnt; k++)
+				free(ops[(first + i - iovcnt + k) & (JOURNAL_QUEUE_SIZE - 1)].data);
+
+			iovcnt = 0;
+			iov_seq = 0;
+		}
+
+		/* A flush covers everything written before it, so only
+		 * flush when something other than a write is done next */
+		if (sync_fd >= 0 && op->type != JOURNAL_OP_WRITE && op->type != JOURNAL_OP_SYNC) {
+			journalFlush(sync_fd, sync_seq);
+			sync_fd = -1;
+		}
+
+		switch (op->type) {
+			case JOURNAL_OP_WRITE:
+				if (iovcnt == 0) {
+					iov_fd = op->fd;
+					iov_start = iov_end = op->offset;
+				}
+
+				iov[iovcnt].iov_base = op->data;
+				iov[iovcnt].iov_len = op->len;
+				iovcnt++;
+				iov_end += op->len;
+
+				if (op->seq)
+					iov_seq = op->seq;
+				break;
+
+			case JOURNAL_OP_SYNC:
+				if (sync_fd >= 0 && sync_fd != op->fd)
+					journalFlush(sync_fd, 0);
+
+				sync_fd = op->fd;
+				sync_seq = op->seq;
+				break;
+
+			case JOURNAL_OP_EXTEND:
+				journalExtend(op);
+				break;
+
+			case JOURNAL_OP_CLOSE:
+				close(op->fd);
+				break;
+		}
+	}
+
+	if (iovcnt) {
+		journalWriteBatch(iov_fd, iov, iovcnt, iov_start, iov_seq, &written);
+
+		for (int k = 0; k < iovcnt; k++)
+			free(ops[(first + count - iovcnt + k) & (JOURNAL_QUEUE_SIZE - 1)].data);
+	}
+
+	if (written)
+		atomic_store(&writer.written, written);
+
+	if (sync_fd >= 0)
+		journalFlush(sync_fd, sync_seq);
+}
+
+static void journalSignal(int fd) {
+	uint64_t value = 1;
+
+	if (write(fd, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to signal journal eventfd: %s", strerror(errno));
+}
+
+static void *journalWriterThread(void *arg) {
+	UNUSED(arg);
+
+	while (1) {
+		uint64_t tail = atomic_load_explicit(&writer.tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&writer.head, memory_order_acquire);
+
+		if (head == tail) {
+			if (atomic_load(&writer.stop))
+				break;
+
+			/* Nothing to do. Let the main thread know we are going to sleep,
+			 * then check again in case something was queued in the meantime */
+			atomic_store(&writer.sleeping, 1);
+
+			if (atomic_load(&writer.head) != tail || atomic_load(&writer.stop)) {
+				atomic_store(&writer.sleeping, 0);
+				continue;
+			}
+
+			uint64_t value;
+			if (read(writer.wake_fd, &value, sizeof(value)) < 0 && errno != EINTR)
+				error_die("Journal writer failed to read eventfd: %s", strerror(errno));
+
+			continue;
+		}
+
+		journalProcess(writer.ops, tail, head - tail);
+		atomic_store_explicit(&writer.tail, head, memory_order_release);
+
+		journalSignal(writer.done_fd);
+	}
+
+	return NULL;
+}
+
+/* Queue an operation for the writer thread, or perform it now if it isn't running */
+static void journalQueue(int type, int fd, off_t offset, char *data, size_t len, int64_t seq) {
+	struct journalOp *op;
+
+	if (!writer.running) {
+		struct journalOp now = {type, fd, offset, len, data, seq};
+		journalProcess(&now, 0, 1);
+		journalWriterComplete();
+		return;
+	}
+
+	uint64_t head = atomic_load_explicit(&writer.head, memory_order_relaxed);
+
+	/* Wait for the writer to make some room */
+	while (head - atomic_load_explicit(&writer.tail, memory_order_acquire) == JOURNAL_QUEUE_SIZE) {
+		struct pollfd pfd = {writer.done_fd, POLLIN, 0};
+
+		if (atomic_exchange(&writer.sleeping, 0))
+			journalSignal(writer.wake_fd);
+
+		poll(&pfd, 1, 10);
+	}
+
+	op = &writer.ops[head & (JOURNAL_QUEUE_SIZE - 1)];
+	op->type = type;
+	op->fd = fd;
+	op->offset = offset;
+	op->data = data;
+	op->len = len;
+	op->seq = seq;
+
+	atomic_store(&writer.head, head + 1);
+
+	if (atomic_exchange(&writer.sleeping, 0))
+		journalSignal(writer.wake_fd);
+}
+
+/* Queue a journal record to be written at offset. The writer takes ownership of data.
+ * Returns the sequence number of the record */
+int64_t journalWrite(int fd, off_t offset, char *data, size_t len) {
+	journalQueue(JOURNAL_OP_WRITE, fd, offset, data, len, ++writer.seq);
+	return writer.seq;
+}
+
+/* Queue a write that isn't a journal record, such as the end of journal marker.
+ * The writer takes ownership of data */
+void journalWriteMarker(int fd, off_t offset, char *data, size_t len) {
+	journalQueue(JOURNAL_OP_WRITE, fd, offset, data, len, 0);
+}
+
+void journalExtendFile(int fd, off_t offset, size_t len) {
+	journalQueue(JOURNAL_OP_EXTEND, fd, offset, NULL, len, 0);
+}
+
+/* Queue a flush of all the records written so far */
+void journalSync(int fd) {
+	journalQueue(JOURNAL_OP_SYNC, fd, 0, NULL, 0, writer.seq);
+}
+
+void journalClose(int fd) {
+	journalQueue(JOURNAL_OP_CLOSE, fd, 0, NULL, 0, 0);
+}
+
+/* Number of journal records queued */
+int64_t journalQueued(void) {
+	return writer.seq;
+}
+
+/* Number of journal records flushed to disk */
+int64_t journalSynced(void) {
+	return atomic_load(&writer.synced);
+}
+
+/* Handle the work completed by the writer thread. */
+void journalWriterComplete(void) {
+	uint64_t value;
+
+	if (writer.running && read(writer.done_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		print_msg(JERS_LOG_WARNING, "Failed to read journal eventfd: %s", strerror(errno));
+
+	if (atomic_exchange(&writer.enospc, 0)) {
+		/* No space is left on the device, we need to switch into a read only mode */
+		if (server.readonly == 0) {
+			print_msg(JERS_LOG_CRITICAL, "*********************************************");
+			print_msg(JERS_LOG_CRITICAL, "* Failed to extend journal - Device is full *");
+			print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
+			print_msg(JERS_LOG_CRITICAL, "*********************************************");
+			server.readonly = READONLY_ENOSPACE;
+		}
+
+		/* Go back to the last size we managed to allocate, so the next record tries again */
+		server.journal.size = atomic_load(&writer.allocated);
+		server.journal.limit = server.journal.size - server.journal.extend_block_size;
+	} else if (atomic_exchange(&writer.extended, 0) && server.readonly == READONLY_ENOSPACE) {
+		print_msg(JERS_LOG_INFO, "Turning off readonly mode - journal extended.");
+		server.readonly = 0;
+	}
+
+	if (atomic_load(&writer.error) && server.readonly != READONLY_JOURNAL) {
+		/* The records after the failed one might never reach the disk */
+		print_msg(JERS_LOG_CRITICAL, "*********************************************");
+		print_msg(JERS_LOG_CRITICAL, "*   Failed to write or flush the journal    *");
+		print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
+		print_msg(JERS_LOG_CRITICAL, "*********************************************");
+		server.readonly = READONLY_JOURNAL;
+	}
+
+	/* Send the replies to any clients waiting for their updates to be flushed,
+	 * failing those whose updates can no longer be flushed */
+	if (commitClientList) {
+		releaseCommitClients(journalSynced());
+
+		if (atomic_load(&writer.error))
+			failCommitClients(JERS_ERR_READONLY, "JERS is in READONLY mode. - Check jersd logfile - Journal write failed");
+	}
+}
+
+/* Block until all the queued records have been written, and flushed if requested */
+void journalWait(int synced) {
+	int64_t target = writer.seq;
+
+	while (writer.running) {
+		int64_t done = synced ? atomic_load(&writer.synced) : atomic_load(&writer.written);
+
+		if (done >= target && atomic_load(&writer.tail) == atomic_load(&writer.head))
+			break;
+
+		/* Nothing past a failed write will be written or synced */
+		if (atomic_load(&writer.error) && atomic_load(&writer.tail) == atomic_load(&writer.head))
+			break;
+
+		struct pollfd pfd = {writer.done_fd, POLLIN, 0};
+		uint64_t value;
+
+		if (poll(&pfd, 1, 100) > 0 && read(writer.done_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			print_msg(JERS_LOG_WARNING, "Failed to read journal eventfd: %s", strerror(errno));
+	}
+
+	journalWriterComplete();
+}
+
+int journalWriterStart(void) {
+	int rc;
+
+	writer.wake_fd = eventfd(0, EFD_CLOEXEC);
+	writer.done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (writer.wake_fd < 0 || writer.done_fd < 0)
+		error_die("Failed to create journal eventfd: %s", strerror(errno));
+
+	/* Anything performed so far has already been done */
+	atomic_store(&writer.written, writer.seq);
+	atomic_store(&writer.synced, writer.seq);
+	atomic_store(&writer.allocated, server.journal.size);
+
+	if ((rc = pthread_create(&writer.thread, NULL, journalWriterThread, NULL)) != 0)
+		error_die("Failed to start journal writer thread: %s", strerror(rc));
+
+	writer.running = 1;
+
+	/* Get notified of completed work in the main event loop */
+	writer.connection.type = JOURNAL;
+	writer.connection.socket = writer.done_fd;
+	writer.connection.event_fd = server.event_fd;
+	writer.connection.ptr = NULL;
+
+	if (pollSetReadable(&writer.connection) != 0)
+		error_die("Failed to add journal eventfd to epoll: %s", strerror(errno));
+
+	print_msg(JERS_LOG_DEBUG, "Journal writer thread started");
+
+	return 0;
+}
+
+/* Write out everything queued then stop the writer thread */
+void journalWriterStop(void) {
+	if (!writer.running)
+		return;
+
+	journalWait(0);
+
+	atomic_store(&writer.stop, 1);
+	journalSignal(writer.wake_fd);
+	pthread_join(writer.thread, NULL);
+
+	writer.running = 0;
+
+	pollRemoveSocket(&writer.connection);
+	writer.connection.events = 0;
+	atomic_store(&writer.stop, 0);
+	close(writer.wake_fd);
+	close(writer.done_fd);
+	writer.wake_fd = writer.done_fd = -1;
+}
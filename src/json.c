@@ -267,7 +267,7 @@ int JSONAddMap(buff_t *buff, int field_no, int64_t count, key_val_t *values)
 int JSONStartObject(buff_t *buff, const char *name, size_t name_len)
 {
 	size_t required;
-	char *p = buff->data + buff->used;
+	char *p;
 	int len = 0;
 
 	if (name && name_len == 0)
@@ -276,6 +276,7 @@ int JSONStartObject(buff_t *buff, const char *name, size_t name_len)
 	required = name_len + 4;
 
 	buffResize(buff, required);
+	p = buff->data + buff->used;
 
 	if (name) {
 		p[len++] = '"';
@@ -309,10 +310,11 @@ int JSONEndObject(buff_t *buff)
 int JSONStartArray(buff_t *buff, const char *name, size_t name_len)
 {
 	size_t required = name_len + 4;
-	char *p = buff->data + buff->used;
+	char *p;
 	int len = 0;
 
 	buffResize(buff, required);
+	p = buff->data + buff->used;
 	p[len++] = '"';
 	memcpy(p + len, name, name_len);
 	len += name_len;
@@ -568,7 +570,18 @@ int JSONGetBool(char **json, char *value) {
 	return 0;
 }
 
-int64_t JSONGetStringArray(char **json, char ***strings) {
+/* The string arrays and maps are allocated from the message arena if one is
+ * provided, otherwise they are malloc'd and need to be freed by the caller.
+ * The strings themselves always point into the json string */
+
+static void * growArray(struct msgArena *arena, void *ptr, size_t old_size, size_t size) {
+	if (arena)
+		return msgArenaRealloc(arena, ptr, old_size, size);
+
+	return realloc(ptr, size);
+}
+
+static int64_t getStringArray(char **json, char ***strings, struct msgArena *arena) {
 	int64_t count = 0;
 	int64_t max_strings = 0;
 	char *pos = *json;
@@ -587,10 +600,13 @@ int64_t JSONGetStringArray(char **json, char ***strings) {
 	while (JSONGetString(&pos, &str) == 0) {
 		/* Resize if needed */
 		if (count >= max_strings) {
-			*strings = realloc(*strings, sizeof(char *) * ( max_strings == 0 ? (max_strings = 8) : (max_strings *= 2)));
+			int64_t new_max = max_strings == 0 ? 8 : max_strings * 2;
+			*strings = growArray(arena, *strings, sizeof(char *) * max_strings, sizeof(char *) * new_max);
 
 			if (*strings == NULL)
 				return -1;
+
+			max_strings = new_max;
 		}
 
 		(*strings)[count++] = str;
@@ -606,7 +622,9 @@ int64_t JSONGetStringArray(char **json, char ***strings) {
 	}
 
 	if (*pos != ']') {
-		free(*strings);
+		if (arena == NULL)
+			free(*strings);
+
 		*strings = NULL;
 		return -1;
 	}
@@ -617,7 +635,7 @@ int64_t JSONGetStringArray(char **json, char ***strings) {
 	return count;
 }
 
-int64_t JSONGetMap(char **json, key_val_t **map) {
+static int64_t getMap(char **json, key_val_t **map, struct msgArena *arena) {
 	char *map_object;
 	char *pos = *json;
 	char *name;
@@ -639,10 +657,13 @@ int64_t JSONGetMap(char **json, key_val_t **map) {
 			return -1;
 
 		if (count >= max_keys) {
-			*map = realloc(*map, sizeof(key_val_t) * (max_keys == 0 ? (max_keys = 8) : (max_keys *= 2)));
+			int64_t new_max = max_keys == 0 ? 8 : max_keys * 2;
+			*map = growArray(arena, *map, sizeof(key_val_t) * max_keys, sizeof(key_val_t) * new_max);
 
 			if (*map == NULL)
 				return -1;
+
+			max_keys = new_max;
 		}
 
 		(*map)[count].key = name;
@@ -655,3 +676,19 @@ int64_t JSONGetMap(char **json, key_val_t **map) {
 
 	return count;
 }
+
+int64_t JSONGetStringArray(char **json, char ***strings) {
+	return getStringArray(json, strings, NULL);
+}
+
+int64_t JSONGetMap(char **json, key_val_t **map) {
+	return getMap(json, map, NULL);
+}
+
+int64_t JSONGetStringArrayArena(char **json, char ***strings, struct msgArena *arena) {
+	return getStringArray(json, strings, arena);
+}
+
+int64_t JSONGetMapArena(char **json, key_val_t **map, struct msgArena *arena) {
+	return getMap(json, map, arena);
+}
@@ -54,5 +54,7 @@ int JSONGetNum(char **json, int64_t *value);
 int JSONGetBool(char **json, char *value);
 int64_t JSONGetStringArray(char **json, char ***strings);
 int64_t JSONGetMap(char **json, key_val_t **map);
+int64_t JSONGetStringArrayArena(char **json, char ***strings, struct msgArena *arena);
+int64_t JSONGetMapArena(char **json, key_val_t **map, struct msgArena *arena);
 
 #endif
\ No newline at end of file
@@ -25,7 +25,7 @@ static void _logMessage(const char * whom, int level, const char * message) {
 	const char * levels[] = {"DEBUG", "INFO", "WARNING", "CRITICAL"};
 	char currentTime[64];
 	struct timespec tp;
-	struct tm * tm;
+	struct tm tm;
 	time_t t;
 
 	if (logfile_name && reopen_logfile) {
@@ -38,9 +38,9 @@ static void _logMessage(const char * whom, int level, const char * message) {
 
 	clock_gettime(CLOCK_REALTIME_COARSE, &tp);
 	t = tp.tv_sec;
-	tm = localtime(&t);
+	localtime_r(&t, &tm); // Can be called from the state loading threads
 
-	strftime(currentTime, sizeof(currentTime), "%d %b %H:%M:%S", tm);
+	strftime(currentTime, sizeof(currentTime), "%d %b %H:%M:%S", &tm);
 	fprintf(stdout, "%d-%s %s.%03d [%8s] %s", (int)getpid(), whom, currentTime, (int)tp.tv_nsec/1000000, levels[level], message);
 
 	if (message[strlen(message)-1] != '\n')
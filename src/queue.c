@@ -36,6 +36,7 @@
 #include <jers.h>
 
 #include <json.h>
+#include <utlist.h>
 
 /* Create, validate and add a queue
  * Return: 0 = Success
@@ -119,15 +120,31 @@ void freeQueue(struct queue * q) {
 	free(q->name);
 	free(q->desc);
 	free(q->host);
+	free(q->candidates.jobs);
 
 	free(q);
 }
 
 void removeQueue(struct queue * q) {
+	if (q->internal_state &JERS_FLAG_DELETED)
+		DL_DELETE2(server.deletedQueues, q, deleted_prev, deleted_next);
+
 	HASH_DEL(server.queueTable, q);
 	freeQueue(q);
 }
 
+/* Mark a queue as deleted, it's cleaned up once it has been saved */
+void deleteQueue(struct queue * q) {
+	q->internal_state |= JERS_FLAG_DELETED;
+	DL_APPEND2(server.deletedQueues, q, deleted_prev, deleted_next);
+}
+
+/* A deleted queue is being reused before it was cleaned up */
+void undeleteQueue(struct queue * q) {
+	DL_DELETE2(server.deletedQueues, q, deleted_prev, deleted_next);
+	q->internal_state &= ~JERS_FLAG_DELETED;
+}
+
 struct queue * findQueue(char * name) {
 	struct queue * q = NULL;
 	HASH_FIND_STR(server.queueTable, name, q);
@@ -144,10 +161,7 @@ int cleanupQueues(uint32_t max_clean) {
 	if (max_clean == 0)
 		max_clean = 10;
 
-	HASH_ITER(hh, server.queueTable, q, tmp) {
-		if (!(q->internal_state &JERS_FLAG_DELETED))
-			continue;
-
+	DL_FOREACH_SAFE2(server.deletedQueues, q, tmp, deleted_next) {
 		/* Don't clean up queues flagged dirty or as being flushed */
 		if (q->obj.dirty || q->internal_state &JERS_FLAG_FLUSHING)
 			continue;
@@ -156,8 +170,7 @@ int cleanupQueues(uint32_t max_clean) {
 		print_msg(JERS_LOG_DEBUG, "Removing deleted queue: %s", q->name);
 
 		stateDelQueue(q);
-		HASH_DEL(server.queueTable, q);
-		freeQueue(q);
+		removeQueue(q);
 
 		if (++cleaned_up >= max_clean)
 			break;
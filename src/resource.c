@@ -31,6 +31,7 @@
 #include <server.h>
 
 #include <json.h>
+#include <utlist.h>
 
 int addRes(struct resource * r, int dirty) {
 	HASH_ADD_STR(server.resTable, name, r);
@@ -42,6 +43,14 @@ int addRes(struct resource * r, int dirty) {
 
 void freeRes(struct resource * r) {
 	free(r->name);
+
+	while (r->waiters) {
+		struct resWaitList *next = r->waiters->next;
+		free(r->waiters->jobs.jobs);
+		free(r->waiters);
+		r->waiters = next;
+	}
+
 	free(r);
 }
 
@@ -68,16 +77,30 @@ void allocateRes(struct job *j) {
 		j->req_resources[i].res->in_use += j->req_resources[i].needed;
 }
 
-/* Deallocate all the resources assigned to the job */
+/* Deallocate all the resources assigned to the job, waking any jobs waiting on them */
 void deallocateRes(struct job *j) {
 	for (int i = 0; i < j->res_count; i++) {
 		j->req_resources[i].res->in_use -= j->req_resources[i].needed;
 
 		if (unlikely(j->req_resources[i].res->in_use < 0))
 			j->req_resources[i].res->in_use = 0;
+
+		wakeResourceWaiters(j->req_resources[i].res);
 	}
 }
 
+/* Mark a resource as deleted, it's cleaned up once it has been saved */
+void deleteRes(struct resource *r) {
+	r->internal_state |= JERS_FLAG_DELETED;
+	DL_APPEND2(server.deletedResources, r, deleted_prev, deleted_next);
+}
+
+/* A deleted resource is being reused before it was cleaned up */
+void undeleteRes(struct resource *r) {
+	DL_DELETE2(server.deletedResources, r, deleted_prev, deleted_next);
+	r->internal_state &= ~JERS_FLAG_DELETED;
+}
+
 /* Cleanup resources that are marked as deleted, returning the number of resources cleaned up
  * - Only cleanup resources until the max_clean threshold is reached. */
 
@@ -88,10 +111,7 @@ int cleanupResources(uint32_t max_clean) {
 	if (max_clean == 0)
 		max_clean = 10;
 
-	HASH_ITER(hh, server.resTable, r, tmp) {
-		if (!(r->internal_state &JERS_FLAG_DELETED))
-			continue;
-
+	DL_FOREACH_SAFE2(server.deletedResources, r, tmp, deleted_next) {
 		/* Don't clean up resources flagged dirty or as being flushed */
 		if (r->obj.dirty || r->internal_state &JERS_FLAG_FLUSHING)
 			continue;
@@ -100,6 +120,7 @@ int cleanupResources(uint32_t max_clean) {
 		print_msg(JERS_LOG_DEBUG, "Removing deleted resource: %s", r->name);
 
 		stateDelResource(r);
+		DL_DELETE2(server.deletedResources, r, deleted_prev, deleted_next);
 		HASH_DEL(server.resTable, r);
 		freeRes(r);
 
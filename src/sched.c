@@ -36,12 +36,11 @@
 
 #include <utlist.h>
 
-int __comp(const void * a_, const void * b_) {
-	const struct job * a = *((struct job **) a_);
-	const struct job * b = *((struct job **) b_);
+/* Returns < 0 if candidate a should be scheduled before candidate b */
+static inline int candidateCmp(const struct candidate *a, const struct candidate *b) {
 	int32_t r;
 
-	r = b->queue->priority - a->queue->priority;
+	r = b->queue_priority - a->queue_priority;
 
 	if (r)
 		return r;
@@ -51,10 +50,387 @@ int __comp(const void * a_, const void * b_) {
 	if (r)
 		return r;
 
-	return (a->jobid - b->jobid);
+	return (a->jobid > b->jobid) - (a->jobid < b->jobid);
 }
 
-void sendStartCmd(struct job * j) {
+static inline struct candidate candidateKey(struct job *j) {
+	struct candidate c = {j->queue->priority, j->priority, j->jobid, j};
+	return c;
+}
+
+static void heapSwap(struct candidate *jobs, int64_t a, int64_t b) {
+	struct candidate tmp = jobs[a];
+
+	jobs[a] = jobs[b];
+	jobs[b] = tmp;
+
+	jobs[a].job->candidate_index = a;
+	jobs[b].job->candidate_index = b;
+}
+
+static void heapSiftUp(struct candidateHeap *h, int64_t i) {
+	while (i > 1 && candidateCmp(&h->jobs[i], &h->jobs[i / 2]) < 0) {
+		heapSwap(h->jobs, i, i / 2);
+		i /= 2;
+	}
+}
+
+static void heapSiftDown(struct candidateHeap *h, int64_t i) {
+	while (1) {
+		int64_t child = i * 2;
+
+		if (child > h->count)
+			break;
+
+		if (child + 1 <= h->count && candidateCmp(&h->jobs[child + 1], &h->jobs[child]) < 0)
+			child++;
+
+		if (candidateCmp(&h->jobs[child], &h->jobs[i]) >= 0)
+			break;
+
+		heapSwap(h->jobs, i, child);
+		i = child;
+	}
+}
+
+static void heapInsert(struct candidateHeap *h, struct job *j) {
+	if (h->count + 1 >= h->size) {
+		h->size = h->size ? h->size * 2 : 64;
+		h->jobs = realloc(h->jobs, sizeof(struct candidate) * h->size);
+
+		if (h->jobs == NULL)
+			error_die("Failed to allocate memory for candidate heap: %s", strerror(errno));
+	}
+
+	h->jobs[++h->count] = candidateKey(j);
+	j->candidate_index = h->count;
+	heapSiftUp(h, h->count);
+}
+
+static void heapRemove(struct candidateHeap *h, struct job *j) {
+	int64_t i = j->candidate_index;
+
+	j->candidate_index = 0;
+
+	if (i == h->count) {
+		h->count--;
+		return;
+	}
+
+	h->jobs[i] = h->jobs[h->count--];
+	h->jobs[i].job->candidate_index = i;
+
+	heapSiftDown(h, i);
+	heapSiftUp(h, i);
+}
+
+/* A candidate is either in its queues heap, or parked on the wait list of a resource */
+static inline struct candidateHeap *getCandidateHeap(struct job *j) {
+	return j->waiting ? &j->waiting->jobs : &j->queue->candidates;
+}
+
+/* Add a pending job to its queues candidate heap */
+void addCandidate(struct job *j) {
+	if (j->candidate_index)
+		return;
+
+	heapInsert(&j->queue->candidates, j);
+}
+
+/* Remove a job from its queues candidate heap, or the resource wait list it is parked on */
+void removeCandidate(struct job *j) {
+	if (j->candidate_index == 0)
+		return;
+
+	heapRemove(getCandidateHeap(j), j);
+	j->waiting = NULL;
+}
+
+/* Restore the heap order after a candidates priority has been changed */
+void updateCandidate(struct job *j) {
+	if (j->candidate_index == 0)
+		return;
+
+	getCandidateHeap(j)->jobs[j->candidate_index] = candidateKey(j);
+	heapSiftUp(getCandidateHeap(j), j->candidate_index);
+	heapSiftDown(getCandidateHeap(j), j->candidate_index);
+}
+
+/* Find or create the wait list on a resource for jobs needing a given amount */
+static struct resWaitList *getResWaitList(struct resource *r, int32_t needed) {
+	struct resWaitList **prev = &r->waiters;
+	struct resWaitList *w;
+
+	for (w = r->waiters; w != NULL && w->needed < needed; w = w->next)
+		prev = &w->next;
+
+	if (w != NULL && w->needed == needed)
+		return w;
+
+	w = calloc(1, sizeof(struct resWaitList));
+
+	if (w == NULL)
+		error_die("Failed to allocate memory for resource wait list: %s", strerror(errno));
+
+	w->needed = needed;
+	w->next = *prev;
+	*prev = w;
+
+	return w;
+}
+
+/* Return the reason no job can currently be started from this queue, or 0 if one could be */
+static int queuePendReason(struct queue *q) {
+	if (q->stats.running + q->stats.start_pending >= q->job_limit)
+		return JERS_PEND_QUEUEFULL;
+
+	if (!(q->state &JERS_QUEUE_FLAG_STARTED))
+		return JERS_PEND_QUEUESTOPPED;
+
+	if (q->agent == NULL || q->agent->logged_in == 0)
+		return JERS_PEND_AGENTDOWN;
+
+	if (q->agent->recon)
+		return JERS_PEND_RECON;
+
+	return 0;
+}
+
+/* Move a job from its queues heap onto the wait list of the first resource
+ * it doesn't have enough of. It won't be looked at by the scheduler again
+ * until some of that resource is released. */
+static void parkCandidate(struct job *j) {
+	struct jobResource *res = NULL;
+
+	if (j->waiting)
+		return;
+
+	for (int i = 0; i < j->res_count; i++) {
+		if (j->req_resources[i].needed > j->req_resources[i].res->count - j->req_resources[i].res->in_use) {
+			res = &j->req_resources[i];
+			break;
+		}
+	}
+
+	if (res == NULL)
+		return;
+
+	removeCandidate(j);
+	j->waiting = getResWaitList(res->res, res->needed);
+	heapInsert(&j->waiting->jobs, j);
+}
+
+/* Move a parked job back onto its queues heap */
+void wakeCandidate(struct job *j) {
+	if (j->waiting == NULL)
+		return;
+
+	removeCandidate(j);
+	addCandidate(j);
+	requestSchedule();
+}
+
+/* Wake the highest priority jobs waiting on a resource that fit in the amount available.
+ * Each wait list is only looked at while its jobs could fit, so this is bounded by
+ * the amount available rather than by the number of jobs waiting.
+ *
+ * The scheduler skips queues that can't start a job, so a job woken into one of those
+ * doesn't use up any of the amount available. It stays on its queues heap, and is
+ * parked again if it's still short once its queue can start jobs. */
+void wakeResourceWaiters(struct resource *r) {
+	int32_t available = r->count - r->in_use;
+
+	while (available > 0) {
+		struct resWaitList *best = NULL;
+
+		for (struct resWaitList *w = r->waiters; w != NULL && w->needed <= available; w = w->next) {
+			if (w->jobs.count == 0)
+				continue;
+
+			if (best == NULL || candidateCmp(&w->jobs.jobs[1], &best->jobs.jobs[1]) < 0)
+				best = w;
+		}
+
+		if (best == NULL)
+			break;
+
+		struct job *j = best->jobs.jobs[1].job;
+
+		if (queuePendReason(j->queue) == 0)
+			available -= best->needed;
+
+		wakeCandidate(j);
+	}
+}
+
+/* Update the queue priority held by its candidates. The queues own heap stays in order,
+ * but the wait lists are ordered by queue priority, so need reordering */
+void reorderResourceWaiters(struct queue *q) {
+	for (int64_t i = 1; i <= q->candidates.count; i++)
+		q->candidates.jobs[i].queue_priority = q->priority;
+
+	for (struct resource *r = server.resTable; r != NULL; r = r->hh.next) {
+		for (struct resWaitList *w = r->waiters; w != NULL; w = w->next) {
+			for (int64_t i = 1; i <= w->jobs.count; i++) {
+				if (w->jobs.jobs[i].job->queue == q)
+					w->jobs.jobs[i].queue_priority = q->priority;
+			}
+
+			for (int64_t i = w->jobs.count / 2; i > 0; i--)
+				heapSiftDown(&w->jobs, i);
+		}
+	}
+}
+
+/* The frontier is a heap of the next possible candidate from each queue.
+ * Popping a job from it pushes that jobs children from the queue heap,
+ * which lets us visit the candidates in order without modifying the queue heaps. */
+
+static void frontierPush(const struct candidate *c) {
+	struct candidate *f;
+	int64_t i;
+
+	if (server.candidate_frontier_count + 1 >= server.candidate_frontier_size) {
+		server.candidate_frontier_size = server.candidate_frontier_size ? server.candidate_frontier_size * 2 : 64;
+		server.candidate_frontier = realloc(server.candidate_frontier, sizeof(struct candidate) * server.candidate_frontier_size);
+
+		if (server.candidate_frontier == NULL)
+			error_die("Failed to allocate memory for candidate frontier: %s", strerror(errno));
+	}
+
+	f = server.candidate_frontier;
+	i = ++server.candidate_frontier_count;
+
+	while (i > 1 && candidateCmp(c, &f[i / 2]) < 0) {
+		f[i] = f[i / 2];
+		i /= 2;
+	}
+
+	f[i] = *c;
+}
+
+static struct job *frontierPop(void) {
+	struct candidate *f = server.candidate_frontier;
+	struct candidate last;
+	struct job *top;
+	int64_t i = 1;
+
+	if (server.candidate_frontier_count == 0)
+		return NULL;
+
+	top = f[1].job;
+	last = f[server.candidate_frontier_count--];
+
+	while (1) {
+		int64_t child = i * 2;
+
+		if (child > server.candidate_frontier_count)
+			break;
+
+		if (child + 1 <= server.candidate_frontier_count && candidateCmp(&f[child + 1], &f[child]) < 0)
+			child++;
+
+		if (candidateCmp(&f[child], &last) >= 0)
+			break;
+
+		f[i] = f[child];
+		i = child;
+	}
+
+	f[i] = last;
+
+	return top;
+}
+
+static inline int systemFull(void) {
+	return server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running + server.stats.jobs.start_pending > server.max_run_jobs;
+}
+
+/* Work out why a job is still pending. This is only done when a client asks for it,
+ * rather than the scheduler updating every pending job on each pass. */
+int getPendReason(struct job *j) {
+	int reason;
+
+	if (j->state != JERS_JOB_PENDING)
+		return JERS_PEND_NOREASON;
+
+	if (j->internal_state &JERS_FLAG_JOB_STARTED)
+		return JERS_PEND_AGENT;
+
+	if (unlikely(server.readonly))
+		return JERS_PEND_READONLY;
+
+	if (systemFull())
+		return JERS_PEND_SYSTEMFULL;
+
+	reason = queuePendReason(j->queue);
+
+	if (reason)
+		return reason;
+
+	if (j->res_count && checkRes(j))
+		return JERS_PEND_NORES;
+
+	return JERS_PEND_NOREASON;
+}
+
+/* Return the best candidate across all queues, resetting the iteration.
+ * If runnable_only is set, queues that can't start a job are skipped entirely,
+ * including queues that become full part way through the iteration.
+ * The candidate heaps must not be modified until the iteration has finished. */
+struct job *firstCandidate(int runnable_only) {
+	server.candidate_frontier_count = 0;
+	server.candidate_runnable_only = runnable_only;
+
+	for (struct queue *q = server.queueTable; q != NULL; q = q->hh.next) {
+		if (q->candidates.count == 0)
+			continue;
+
+		if (runnable_only && queuePendReason(q))
+			continue;
+
+		frontierPush(&q->candidates.jobs[1]);
+	}
+
+	return nextCandidate();
+}
+
+/* Return the next candidate in scheduling order, or NULL if there are none left */
+struct job *nextCandidate(void) {
+	struct job *j;
+	struct candidateHeap *h;
+	int64_t child;
+
+	while (1) {
+		j = frontierPop();
+
+		if (j == NULL)
+			return NULL;
+
+		/* Dropping the job without pushing its children prunes the rest of the queue */
+		if (server.candidate_runnable_only && queuePendReason(j->queue))
+			continue;
+
+		break;
+	}
+
+	h = &j->queue->candidates;
+	child = j->candidate_index * 2;
+
+	if (child <= h->count)
+		frontierPush(&h->jobs[child]);
+
+	if (child + 1 <= h->count)
+		frontierPush(&h->jobs[child + 1]);
+
+	return j;
+}
+
+/* Agents cache environment profiles by hash, so only the hash is normally sent.
+ * send_profile includes the variables, for an agent that reported a miss.
+ * Older agents only understand a plain environment, so they get the merged one. */
+
+void sendStartCmd(struct job * j, int send_profile) {
 	buff_t b;
 
 	print_msg(JERS_LOG_INFO, "Sending start message for JobID:%-7d Queue:%s QueuePriority:%d Priority:%d", j->jobid, j->queue->name, j->queue->priority, j->priority);
@@ -94,8 +470,27 @@ void sendStartCmd(struct job * j) {
 
 	JSONAddStringArray(&b, ARGS, j->argc, j->argv);
 
-	if (j->env_count)
-		JSONAddStringArray(&b, ENVS, j->env_count, j->envs);
+	if (j->env_profile && j->queue->agent->version < AGENT_VERSION_ENVPROFILE) {
+		char **envs = malloc(sizeof(char *) * (j->env_profile->env_count + j->env_count + 1));
+
+		if (envs == NULL)
+			error_die("Failed to allocate memory for job environment: %s", strerror(errno));
+
+		int64_t env_count = mergeEnv(j->env_profile->env_count, j->env_profile->envs, j->env_count, j->envs, envs);
+
+		JSONAddStringArray(&b, ENVS, env_count, envs);
+		free(envs);
+	} else {
+		if (j->env_profile) {
+			JSONAddString(&b, ENVPROFILE, j->env_profile->hash);
+
+			if (send_profile)
+				JSONAddStringArray(&b, PROFILEENVS, j->env_profile->env_count, j->env_profile->envs);
+		}
+
+		if (j->env_count)
+			JSONAddStringArray(&b, ENVS, j->env_count, j->envs);
+	}
 
 	if (j->stdout)
 		JSONAddString(&b, STDOUT, j->stdout);
@@ -120,164 +515,92 @@ void sendStartCmd(struct job * j) {
 /* Check for any deferred jobs that need to be released */
 
 void releaseDeferred(void) {
-	int64_t released = 0;
-	struct job *j, *tmp;
-	time_t now = time(NULL);
+	struct job *j, *next;
 
-	DL_FOREACH_SAFE2(server.deferred_list, j, tmp, deferred_next) {
-		if (now < j->defer_time)
-			break;
+	for (j = expireDeferredJobs(time(NULL)); j != NULL; j = next) {
+		next = j->deferred_next;
+		j->deferred_next = j->deferred_prev = NULL;
 
 		j->defer_time = 0;
 		changeJobState(j, JERS_JOB_PENDING, NULL, 0);
-		removeDeferredJob(j);
-		released++;
 	}
-
-	if (released)
-		server.candidate_recalc = 1;
 }
 
-/* Generate a sorted array of jobs that can be started. */
-
-int64_t generateCandidatePool(void) {
-	int64_t total_job_count = server.stats.jobs.pending + server.stats.jobs.deferred + server.stats.jobs.holding;
-	int64_t candidate_count = 0;
-	struct job * j;
-	int64_t start, end;
-
-	start = getTimeMS();
-
-	print_msg(JERS_LOG_DEBUG, "Regenerating job candidate pool");
-
-	/* Assume we will need to add every non-completed job into this pool at some point.
-	 * We add some additional room so we don't need to realloc constantly */
-
-	if (server.candidate_pool_size < total_job_count) {
-		server.candidate_pool_size = total_job_count * 1.5;
-		server.candidate_pool = realloc(server.candidate_pool, sizeof(struct job *) * server.candidate_pool_size);
-	}
+static void addBlockedCandidate(struct job *j) {
+	if (server.candidate_blocked_count >= server.candidate_blocked_size) {
+		server.candidate_blocked_size = server.candidate_blocked_size ? server.candidate_blocked_size * 2 : 64;
+		server.candidate_blocked = realloc(server.candidate_blocked, sizeof(struct job *) * server.candidate_blocked_size);
 
-	if (server.stats.jobs.pending == 0) {
-		server.candidate_pool_jobs = 0;
-		server.candidate_recalc = 0;
-		return server.candidate_pool_jobs;
+		if (server.candidate_blocked == NULL)
+			error_die("Failed to allocate memory for blocked candidates: %s", strerror(errno));
 	}
 
-	/* Check each job for it's eligibility */
-
-	for (j = server.jobTable; j != NULL; j = j->hh.next) {
-		if (j->internal_state &JERS_FLAG_DELETED)
-			continue;
-
-		if (j->state != JERS_JOB_PENDING)
-			continue;
+	server.candidate_blocked[server.candidate_blocked_count++] = j;
+}
 
-		server.candidate_pool[candidate_count++] = j;
-	}
+/* Flag that something has changed that might allow a job to start.
+ * The event loop coalesces these requests into a single scheduling pass,
+ * running at most once every server.sched_min_interval milliseconds. */
 
-	qsort(server.candidate_pool, candidate_count, sizeof(struct job *), __comp);
-	server.candidate_pool_jobs = candidate_count;
-	server.candidate_recalc = 0;
-	end = getTimeMS();
-	print_msg(JERS_LOG_DEBUG, "Regenerated job candidate pool. Took %ldms", end - start);
-	return server.candidate_pool_jobs;
+void requestSchedule(void) {
+	server.sched_pending = 1;
 }
 
 /* Main scheduling function
- * - This is started via an event, every server.schedfreq milliseconds.
+ * - This is started when requested via requestSchedule(), with a fallback
+ *   event every server.sched_freq milliseconds.
  *   We will only attempt to release server.sched_max jobs per attempt, to
  *   avoid becoming unresponsive. */
 
 void checkJobs(void) {
-	int64_t i = 0;
-	jobid_t checked = 0;
 	jobid_t started = 0;
-	jobid_t jobs_to_start = server.sched_max;
+	int64_t jobs_to_start;
 	struct job * j;
 
+	server.sched_last = getTimeMS();
+	server.sched_pending = 0;
+
 	/* Don't need to do anything if we are at maximum capacity */
 	if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running >= server.max_run_jobs)
 		return;
 
-	if (server.candidate_recalc)
-		generateCandidatePool();
-
-	jobs_to_start = server.candidate_pool_jobs;
+	jobs_to_start = server.stats.jobs.pending;
 
 	if (server.max_run_jobs != UNLIMITED_JOBS &&
 		jobs_to_start > server.max_run_jobs - server.stats.jobs.running) {
 		jobs_to_start = server.max_run_jobs - server.stats.jobs.running;
 	}
 
-	/* If we are in readonly mode, tag all jobs that would have been eligble to run
-	 * with a readonly pend reason */
-
-	if (unlikely(server.readonly)) {
-		for (i = 0; i < server.candidate_pool_jobs; i++) {
-			checked++;
-			j = server.candidate_pool[i];
-
-			if (j == NULL)
-				continue;
-
-			if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
-				continue;
-
-			j->pend_reason = JERS_PEND_READONLY;
-			continue;
-		}
+	if (server.sched_max > 0 && jobs_to_start > server.sched_max)
+		jobs_to_start = server.sched_max;
 
+	/* Pend reasons are worked out on request, so there is nothing to do in readonly mode */
+	if (unlikely(server.readonly))
 		return;
-	}
 
-	for (i = 0; i < server.candidate_pool_jobs; i++) {
-		checked++;
-		j = server.candidate_pool[i];
-
-		/* We can have gaps in the pool if we've removed a job */
-		if (j == NULL)
-			continue;
-
-		if (j->state != JERS_JOB_PENDING || j->internal_state &JERS_FLAG_JOB_STARTED)
-			continue;
-
-		j->pend_reason = 0;
-
-		if (server.max_run_jobs != UNLIMITED_JOBS && server.stats.jobs.running + server.stats.jobs.start_pending > server.max_run_jobs) {
-			j->pend_reason = JERS_PEND_SYSTEMFULL;
-			continue;
-		}
+	/* A resource can be left with some available while jobs wait on it, ie. a woken job
+	 * that was parked on another resource it was short of. Let the next waiters have a go. */
+	for (struct resource *r = server.resTable; r != NULL; r = r->hh.next) {
+		if (r->waiters && r->in_use < r->count)
+			wakeResourceWaiters(r);
+	}
 
-		/* Check the queue limit */
-		if (j->queue->stats.running + j->queue->stats.start_pending >= j->queue->job_limit) {
-			j->pend_reason = JERS_PEND_QUEUEFULL;
-			continue;
-		}
+	/* Anything woken above is picked up by this pass */
+	server.sched_pending = 0;
 
-		/* Resources available? */
-		if (j->res_count) {
-			if (checkRes(j)) {
-				/* Not enough of the required resources are available */
-				j->pend_reason = JERS_PEND_NORES;
-				continue;
-			}
-		}
+	server.candidate_blocked_count = 0;
 
-		/* Queue stopped? */
-		if (!(j->queue->state &JERS_QUEUE_FLAG_STARTED)) {
-			j->pend_reason = JERS_PEND_QUEUESTOPPED;
+	for (j = firstCandidate(1); j != NULL; j = nextCandidate()) {
+		if (j->internal_state &JERS_FLAG_JOB_STARTED)
 			continue;
-		}
 
-		/* Agent not connected? */
-		if (j->queue->agent == NULL || j->queue->agent->logged_in == 0) {
-			j->pend_reason = JERS_PEND_AGENTDOWN;
-			continue;
-		}
+		/* Every remaining candidate would also be blocked */
+		if (systemFull())
+			break;
 
-		if (j->queue->agent->recon) {
-			j->pend_reason = JERS_PEND_RECON;
+		/* Resources available? If not, park it once we've finished walking the heaps */
+		if (j->res_count && checkRes(j)) {
+			addBlockedCandidate(j);
 			continue;
 		}
 
@@ -287,18 +610,24 @@ void checkJobs(void) {
 		if (j->res_count)
 			allocateRes(j);
 
-		sendStartCmd(j);
+		sendStartCmd(j, 0);
 		j->internal_state |= JERS_FLAG_JOB_STARTED;
-		j->pend_reason = JERS_PEND_AGENT;
 
 		/* Keep track of the jobs we have attempted to start */
 		j->queue->stats.start_pending++;
 		server.stats.jobs.start_pending++;
 
-		/* Started enough jobs for this iteration? */
-		if (++started >= jobs_to_start)
+		/* Started enough jobs for this iteration? Come back for the rest */
+		if (++started >= jobs_to_start) {
+			if (jobs_to_start == server.sched_max)
+				requestSchedule();
+
 			break;
+		}
 	}
 
+	for (int64_t i = 0; i < server.candidate_blocked_count; i++)
+		parkCandidate(server.candidate_blocked[i]);
+
 	return;
 }
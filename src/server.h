@@ -39,6 +39,7 @@
 #include <time.h>
 #include <signal.h>
 #include <sys/resource.h>
+#include <glob.h>
 
 #include <uthash.h>
 
@@ -67,25 +68,39 @@
 #define DEFAULT_CONFIG_STATEDIR "/var/spool/jers/state"
 #define DEFAULT_CONFIG_BACKGROUNDSAVEMS 30000
 #define DEFAULT_CONFIG_LOGGINGMODE JERS_LOG_DEBUG
-#define DEFAULT_CONFIG_EVENTFREQ 10
-#define DEFAULT_CONFIG_SCHEDFREQ 25
-#define DEFAULT_CONFIG_SCHEDMAX 250
+#define DEFAULT_CONFIG_EVENTFREQ 1000
+#define DEFAULT_CONFIG_SCHEDFREQ 250
+#define DEFAULT_CONFIG_SCHEDMAX 500
+#define DEFAULT_CONFIG_SCHEDMININTERVAL 5
 #define DEFAULT_CONFIG_MAXJOBS UNLIMITED_JOBS
 #define DEFAULT_CONFIG_MAXCLEAN 50
+#define DEFAULT_CONFIG_CLIENTBUDGET 256
 #define DEFAULT_CONFIG_MAXJOBID 9999999
 #define DEFAULT_CONFIG_SOCKETPATH "/var/run/jers/jers.socket"
 #define DEFAULT_CONFIG_AGENTSOCKETPATH "/var/run/jers/agent.socket"
 #define DEFAULT_CONFIG_ACCTSOCKETPATH "/var/run/jers/accounting.socket"
 #define DEFAULT_CONFIG_FLUSHDEFER 1
 #define DEFAULT_CONFIG_FLUSHDEFERMS 5000
+#define DEFAULT_CONFIG_FLUSHGROUPMS 0
+#define DEFAULT_CONFIG_FLUSHGROUPBYTES (1024 * 1024)
+#define DEFAULT_CONFIG_JOURNALMAXSIZE (256 * 1024 * 1024)
+#define DEFAULT_CONFIG_JOURNALCLEANUP JOURNAL_CLEANUP_NONE
 #define DEFAULT_CONFIG_EMAIL_FREQ 5000
 #define DEFAULT_SLOWLOG 50 // Milliseconds
 
 #define GROUP_LIMIT 32
 
+/* Journal flush modes - flush_defer in the config file */
+enum flush_modes {
+	FLUSH_SYNC = 0,  // Flush after every journal write
+	FLUSH_DEFER,     // Flush every flush_defer_ms, clients are replied to straight away
+	FLUSH_GROUP      // Flush pending writes together, clients are replied to after the flush
+};
+
 enum readonly_modes {
 	READONLY_ENOSPACE = 1,
-	READONLY_BGSAVE
+	READONLY_BGSAVE,
+	READONLY_JOURNAL
 };
 
 enum jers_object_type {
@@ -106,6 +121,23 @@ struct gid_perm {
 	UT_hash_handle hh;
 };
 
+/* A binary heap of jobs, ordered by priority then jobid.
+ * Index 0 is unused so that the children of jobs[i] are jobs[i*2] and jobs[i*2+1] */
+/* Heap entries carry the keys they are ordered by, so maintaining and walking
+ * the heaps doesn't touch the jobs themselves. See candidateKey() */
+struct candidate {
+	int32_t queue_priority;
+	int32_t priority;
+	jobid_t jobid;
+	struct job *job;
+};
+
+struct candidateHeap {
+	int64_t count;
+	int64_t size;
+	struct candidate *jobs;
+};
+
 struct queue {
 	jers_object obj;
 	char *name;
@@ -124,11 +156,24 @@ struct queue {
 
 	struct jobStats stats;
 
+	/* Pending jobs that can be scheduled from this queue */
+	struct candidateHeap candidates;
+
 	struct gid_perm *permissions;
 
+	/* Deleted queues waiting to be cleaned up */
+	struct queue *deleted_next;
+	struct queue *deleted_prev;
+
 	UT_hash_handle hh;
 };
 
+struct resWaitList {
+	int32_t needed;
+	struct candidateHeap jobs;
+	struct resWaitList *next;
+};
+
 struct resource {
 	jers_object obj;
 
@@ -137,6 +182,14 @@ struct resource {
 	int32_t in_use;
 	int32_t internal_state;
 
+	/* Pending jobs waiting for some of this resource to be released,
+	 * grouped by the amount they need, smallest first */
+	struct resWaitList *waiters;
+
+	/* Deleted resources waiting to be cleaned up */
+	struct resource *deleted_next;
+	struct resource *deleted_prev;
+
 	UT_hash_handle hh;
 };
 
@@ -166,6 +219,8 @@ struct job {
 	int argc;
 	char ** argv;
 
+	/* Environment, as a shared profile and the variables overriding it */
+	struct envProfile *env_profile;
 	int env_count;
 	char ** envs;
 
@@ -189,7 +244,6 @@ struct job {
 
 	int32_t state;
 
-	int pend_reason;
 	int fail_reason;
 
 	int32_t priority;
@@ -208,14 +262,109 @@ struct job {
 
 	struct indexed_tag *index_table;
 
-	UT_hash_handle hh;
+	/* Position in the queues candidate heap, 0 if the job is not a candidate.
+	 * If waiting is set, this is the position in that resource wait list instead */
+	int64_t candidate_index;
+	struct resWaitList *waiting;
+
+	/* Position in the job tables dense array of jobs */
+	size_t table_index;
+
 	UT_hash_handle tag_hh;
 
-	/* We keep a sorted linked list of jobs in a deferred state,
-	 * sorted by the defer time. This helps efficiently release
-	 * deferred jobs */
+	/* Jobs in a deferred state are kept in a timer wheel, in an unsorted
+	 * list per slot. deferred_slot points to the head of the list the job is in */
 	struct job *deferred_next;
 	struct job *deferred_prev;
+	struct job **deferred_slot;
+
+	/* Deleted jobs waiting to be cleaned up */
+	struct job *deleted_next;
+	struct job *deleted_prev;
+
+	/* Strings and arrays packed into a single allocation by packJob() */
+	char *arena;
+	size_t arena_size;
+};
+
+/* Environment variables shared between jobs, named by the hash of their contents. See envprofile.c */
+#define ENVPROFILE_HASH_SIZE 65 // Hex encoded SHA-256, plus the terminator
+
+struct envProfile {
+	char hash[ENVPROFILE_HASH_SIZE];
+	int64_t refs;
+
+	int env_count;
+	char **envs;
+
+	/* New profiles are written out by the next background save, until then
+	 * the journal record that created them carries the variables */
+	int dirty;
+
+	/* Profiles no job refers to anymore, waiting to be cleaned up.
+	 * unused_seq is the save_seq when it was last released */
+	int64_t unused_seq;
+	struct envProfile *unused_next;
+	struct envProfile *unused_prev;
+
+	UT_hash_handle hh;
+};
+
+/* Number of jobs allocated at a time by allocJob() */
+#define JOB_SLAB_SIZE 1024
+
+/* Jobids are dense and bounded by max_jobid, so jobs are indexed directly by
+ * jobid in pages of JOBTABLE_PAGE_SIZE pointers, allocated as they are needed.
+ * Every job is also kept in a dense array, so walking all the jobs doesn't
+ * have to touch the pages. Removing a job moves the last job into its place. */
+#define JOBTABLE_PAGE_BITS 12
+#define JOBTABLE_PAGE_SIZE (1 << JOBTABLE_PAGE_BITS)
+
+struct jobPage {
+	uint32_t count;
+	struct job *jobs[JOBTABLE_PAGE_SIZE];
+};
+
+/* The fields looked at when filtering every job, copied out of struct job into
+ * an array parallel to the dense jobs array. A scan reads these contiguously,
+ * only touching the job itself for the ones that pass. Refreshed by updateJobHot() */
+struct jobHot {
+	jobid_t jobid;
+	int32_t state;
+	int32_t priority;
+	uid_t uid;
+	int32_t deleted;
+	int32_t res_count;
+	struct queue *queue;
+	time_t submit_time;
+	time_t start_time;
+	time_t finish_time;
+};
+
+struct jobTable {
+	struct jobPage **pages;
+	size_t page_count;
+
+	struct job **jobs;
+	struct jobHot *hot;
+	size_t count;
+	size_t size;
+};
+
+/* A hierarchical timer wheel with one second resolution.
+ * Level 0 covers the next 256 seconds, level 1 the next 256 * 256 seconds
+ * and level 2 the next 256^3 seconds. Anything further out sits in overflow.
+ * Slots in the higher levels are cascaded down as time reaches them. */
+#define DEFER_WHEEL_BITS   8
+#define DEFER_WHEEL_SLOTS  (1 << DEFER_WHEEL_BITS)
+#define DEFER_WHEEL_MASK   (DEFER_WHEEL_SLOTS - 1)
+#define DEFER_WHEEL_LEVELS 3
+
+struct deferWheel {
+	time_t now;      // All slots up to and including this time have been released
+	int64_t count;   // Number of jobs in the wheel
+	struct job *slots[DEFER_WHEEL_LEVELS][DEFER_WHEEL_SLOTS];
+	struct job *overflow;
 };
 
 struct gid_array {
@@ -244,10 +393,12 @@ struct jersServer {
 	int64_t dirty_jobs;
 	int64_t dirty_queues;
 	int64_t dirty_resources;
+	int64_t dirty_envprofiles;
 
 	int64_t flush_jobs;
 	int64_t flush_queues;
 	int64_t flush_resources;
+	int64_t flush_envprofiles;
 
 	int background_save_ms;
 
@@ -261,9 +412,13 @@ struct jersServer {
 	volatile sig_atomic_t shutdown;
 
 	int event_freq;
+	int client_budget; // Maximum requests to process from one client per loop
 
 	int sched_freq;
 	int sched_max;
+	int sched_min_interval; // Minimum milliseconds between triggered scheduling passes
+	int sched_pending;      // Something has changed that might let a job start
+	int64_t sched_last;     // Time the last scheduling pass ran
 	int max_run_jobs;
 
 	uint32_t max_cleanup; // Maximum deleted objects to cleanup per cycle
@@ -273,10 +428,32 @@ struct jersServer {
 
 	struct queue * defaultQueue;
 
+	struct jobTable jobTable;
+
+	/* Job allocator, see allocJob() */
+	struct {
+		struct jobSlab *slabs;
+		struct job *free;
+	} jobSlabs;
+
 	/* Hash Tables */
-	struct job * jobTable;
 	struct queue * queueTable;
 	struct resource * resTable;
+	struct envProfile * envProfiles;
+
+	/* Jobids in use, see jobs.c */
+	struct jobidMap {
+		uint64_t *used;    // A bit per jobid
+		uint64_t *full;    // A bit per word of used, set once every jobid in it is in use
+		size_t words;
+		jobid_t max_jobid; // max_jobid the map was sized for
+	} jobids;
+
+	/* Deleted objects waiting to be cleaned up, oldest first */
+	struct job * deletedJobs;
+	struct queue * deletedQueues;
+	struct resource * deletedResources;
+	struct envProfile * unusedEnvProfiles;
 
 	struct {
 		struct jobStats jobs;
@@ -288,6 +465,16 @@ struct jersServer {
 				int64_t deleted;
 				int64_t unknown;
 		} total;
+		struct {
+				int64_t job_slabs;   // Slabs of JOB_SLAB_SIZE jobs allocated
+				int64_t arenas;      // String arenas held by jobs in the job table
+				int64_t arena_bytes;
+				int64_t freed;       // Jobs freed by cleanupJob()
+				int64_t free_ns;     // Time spent freeing them
+				int64_t interned;    // Unique interned strings, see intern.c
+				int64_t interned_bytes;
+				int64_t intern_refs; // References held to them
+		} memory;
 	} stats;
 
 	/* Describes the groups required to run commands */
@@ -310,11 +497,16 @@ struct jersServer {
 	} recovery;
 	int initalising;
 
-	int candidate_recalc;
+	/* Used to walk the queue candidate heaps in scheduling order */
+	int64_t candidate_frontier_size;
+	int64_t candidate_frontier_count;
+	struct candidate * candidate_frontier;
+	int candidate_runnable_only;
 
-	int64_t candidate_pool_size;
-	int64_t candidate_pool_jobs;
-	struct job ** candidate_pool;
+	/* Candidates that were blocked on a resource during a scheduling pass */
+	int64_t candidate_blocked_size;
+	int64_t candidate_blocked_count;
+	struct job ** candidate_blocked;
 
 	int default_job_nice;
 
@@ -325,6 +517,7 @@ struct jersServer {
 
 	jobid_t max_jobid;		// Max jobID possible
 	jobid_t start_jobid;	// Jobid to start allocating from
+	jobid_t high_jobid;		// Highest jobID added, used to bound scans in jobid order
 
 	int event_fd;
 
@@ -340,22 +533,48 @@ struct jersServer {
 	struct connectionType acct_connection;
 
 	struct flush {
-		pid_t pid;
-		char defer;		// 0 == flush after every write. 1 == flush every defer_ms milliseconds
+		int saving;     // A background save thread is running
+		int64_t save_seq;  // Incremented as each background save starts
+		int64_t saved_seq; // save_seq of the last successful save
+		char defer;		// One of the flush_modes above
 		int defer_ms;	// milliseconds between state file flushes
+		int group_ms;	// Max milliseconds a group commit waits for more writes
+		int64_t group_bytes;	// Commit the group once this much has been written
 		int dirty;
+		int64_t pending_bytes;	// Journal bytes written since the last flush
+		int64_t pending_since;	// Time (ms) of the first write since the last flush
 		time_t lastflush;
 	} flush;
 
+	/* Job state snapshot segments, see snapshot.c */
+	struct {
+		int64_t seq;        // Sequence number of the last segment written
+		int64_t segments;   // Delta segments written since the last full snapshot
+		int64_t delta_jobs; // Job records in those delta segments
+		int full;           // The next save needs to write a full snapshot
+		int saving_full;    // The save in progress is writing a full snapshot
+		int building;       // A full snapshot is being encoded a slice at a time, see snapshotBuildFull()
+		int migrate;        // Jobs were loaded from legacy per-job state files
+	} snapshot;
+
 	struct journal {
 		int fd;
+		int binary;       // The open journal is in the binary format
+		int new_binary;   // New journals are created in the binary format
 		off_t len;
 		off_t limit;
 		off_t size;
 		off_t extend_block_size;
 		off_t last_commit;
 		off_t record;
-		char datetime[10]; // YYYYMMDD
+		off_t max_size;   // Roll over to a new journal once it reaches this size, 0 to only roll daily
+		int part;         // Number of size rollovers today
+		char datetime[16]; // YYYYMMDD[.NNN]
+
+		/* Checkpoints record where replay needs to start from after a successful save */
+		int cleanup;        // What to do with journals before the checkpoint
+		char *archive_dir;
+		char checkpoint[16];      // Journal of the last successful checkpoint
 	} journal;
 
 	/* A tag can be designated an 'index' tag, which adds jobs to a
@@ -363,8 +582,8 @@ struct jersServer {
 	char *index_tag;
 	struct indexed_tag *index_tag_table;
 
-	/* Sorted linked list of deferred jobs */
-	struct job *deferred_list;
+	/* Timer wheel of deferred jobs */
+	struct deferWheel deferred;
 
 	struct item_list queue_acls;
 };
@@ -373,6 +592,12 @@ struct jersServer {
 
 #define JOURNAL_EXTEND_DEFAULT 524288 // 512kb
 
+enum journal_cleanup_modes {
+	JOURNAL_CLEANUP_NONE = 0,
+	JOURNAL_CLEANUP_DELETE,
+	JOURNAL_CLEANUP_ARCHIVE
+};
+
 /* The internal_state field is a bitmap of flags */
 #define JERS_FLAG_DELETED  0x0001  // Job has been deleted and will be cleaned up
 #define JERS_FLAG_FLUSHING 0x0002  // Job state is being flushed to disk
@@ -387,15 +612,51 @@ struct jersServer {
 extern struct jersServer server;
 
 jobid_t getNextJobID(void);
+void reserveJobID(jobid_t jobid);
+void releaseJobID(jobid_t jobid);
+void freeJobIDs(void);
+jobid_t allocateJobIDs(jobid_t count, jobid_t *ids, const jobid_t *exclude, jobid_t exclude_count);
+int cmpJobID(const void *a, const void *b);
 int addJob(struct job * j, int dirty);
 void deleteJob(struct job * j);
 void freeJob(struct job * j);
+struct job * allocJob(void);
+void freeJobSlabs(void);
+void packJob(struct job *j);
+void packJobCopy(struct job *j);
+int jobArenaOwns(struct job *j, const void *p);
+void freeJobMem(struct job *j, void *p);
+void freeJobString(struct job *j, char *str);
+void freeJobStrings(struct job *j, int count, char ***array);
+void freeJobTags(struct job *j, int count, key_val_t **tags);
 struct job * findJob(jobid_t jobid);
+void jobTableAdd(struct job *j);
+void jobTableDel(struct job *j);
+void updateJobHot(struct job *j);
+void freeJobTable(void);
+
+char * internString(const char *str);
+char * internStringLocked(const char *str);
+void lockInternTable(void);
+void unlockInternTable(void);
+int releaseString(const char *str);
+void freeInternTable(void);
+
+void envProfileHash(int64_t count, char **envs, char *hash);
+struct envProfile * findEnvProfile(const char *hash);
+struct envProfile * addEnvProfile(int64_t count, char **envs, int *created);
+void holdEnvProfile(struct envProfile *p);
+void releaseEnvProfile(struct envProfile *p);
+int cleanupEnvProfiles(uint32_t max_clean);
+void freeEnvProfiles(void);
 
 void addDeferredJob(struct job *j);
 void removeDeferredJob(struct job *j);
+struct job *expireDeferredJobs(time_t now);
 
 int addRes(struct resource * r, int dirty);
+void deleteRes(struct resource *r);
+void undeleteRes(struct resource *r);
 void freeRes(struct resource *r);
 struct resource * findResource(char * name);
 int checkRes(struct job *j);
@@ -403,6 +664,8 @@ void allocateRes(struct job *j);
 void deallocateRes(struct job *j);
 
 int addQueue(struct queue * q, int dirty);
+void deleteQueue(struct queue * q);
+void undeleteQueue(struct queue * q);
 void freeQueue(struct queue * q);
 struct queue * findQueue(char * name);
 void setDefaultQueue(struct queue *q);
@@ -419,14 +682,112 @@ int stateLoadQueues(void);
 struct queue * stateLoadQueue(const char *filename);
 int stateLoadResources(void);
 struct resource * stateLoadResource(const char *filename);
+struct envProfile * stateLoadEnvProfile(const char *hash);
+int stateDelEnvProfile(struct envProfile *p);
 void stateReplayJournal(void);
+int cmpJournalName(const char *a, const char *b);
+int globJournals(glob_t *journalGlob);
+void loadParallel(int64_t count, void (*load)(int64_t index, void *data), void *data);
 void stateSaveToDisk(int block);
 void flush_journal(int force);
+void checkJournalCommit(void);
+
+/* A snapshot segment mapped into memory */
+/* A snapshot segment serialized in memory by snapshotEncode() */
+struct snapshotSegment {
+	int64_t seq;
+	int full;
+	int migrate;     // Legacy job state files can be removed once written
+	int compact;     // Merge with the previous segments into a full segment when written
+	struct snapshotSegment *base; // Full segment built in memory to merge with, instead of those on disk
+
+	buff_t records;  // Header and job records
+	buff_t data;
+};
+
+struct snapshot {
+	void *map;
+	size_t map_size;
+
+	int64_t seq;
+	int full;
+	int64_t count;
+
+	uint32_t record_size;
+	const void *jobs;
+	const char *data;
+	uint64_t data_size;
+};
+
+/* Binary journal record types */
+enum journal_record_types {
+	JOURNAL_RECORD_CMD = 1, // A command to replay
+	JOURNAL_RECORD_END      // End of journal marker
+};
+
+/* A decoded binary journal record. The strings point into the record and aren't NULL terminated */
+struct journalRecordInfo {
+	int type;
+	time_t time;
+	int time_ms;
+	uid_t uid;
+	jobid_t jobid;
+	int64_t revision;
+	const char *cmd;
+	size_t cmd_len;
+	const char *msg;
+	size_t msg_len;
+	size_t size; // Size of the record in the journal
+};
+
+char *journalEncodeHeader(size_t *len);
+off_t journalReadHeader(int fd, off_t *commit);
+int journalMarkCommit(int fd, off_t offset);
+char *journalEncodeRecord(int type, int64_t time_ms, uid_t uid, const char *cmd, jobid_t jobid, int64_t revision, const char *msg, size_t *len);
+int journalDecodeRecord(const char *data, size_t avail, struct journalRecordInfo *info);
+int journalReadRecord(FILE *f, char **buf, size_t *size, struct journalRecordInfo *info);
+
+int64_t journalWrite(int fd, off_t offset, char *data, size_t len);
+void journalWriteMarker(int fd, off_t offset, char *data, size_t len);
+void journalExtendFile(int fd, off_t offset, size_t len);
+void journalSync(int fd);
+void journalClose(int fd);
+int64_t journalQueued(void);
+int64_t journalSynced(void);
+void journalWait(int synced);
+void journalWriterComplete(void);
+int journalWriterStart(void);
+void journalWriterStop(void);
+
+int snapshotWrite(const char *filename, int64_t seq, int full, struct job **jobs, int64_t count);
+int snapshotOpen(const char *filename, struct snapshot *s);
+void snapshotClose(struct snapshot *s);
+struct job * snapshotLoadJob(const struct snapshot *s, int64_t index);
+int snapshotLoad(void);
+int snapshotEncode(struct snapshotSegment *s, int64_t seq, int full, struct job **jobs, int64_t count);
+int snapshotWriteSegment(const char *filename, struct snapshotSegment *s);
+void snapshotFreeSegment(struct snapshotSegment *s);
+int snapshotStartSave(int64_t dirty_jobs);
+int snapshotBuildFull(int all);
+int snapshotPrepareSave(struct snapshotSegment *s, struct job **jobs, int64_t count);
+int snapshotSave(struct snapshotSegment *s);
+void snapshotSaveComplete(int64_t dirty_jobs, int status);
 
 void checkJobs(void);
+void requestSchedule(void);
 void releaseDeferred(void);
+void sendStartCmd(struct job * j, int send_profile);
+
+void addCandidate(struct job *j);
+void removeCandidate(struct job *j);
+void updateCandidate(struct job *j);
+struct job *firstCandidate(int runnable_only);
+struct job *nextCandidate(void);
+int getPendReason(struct job *j);
+void wakeCandidate(struct job *j);
+void wakeResourceWaiters(struct resource *r);
+void reorderResourceWaiters(struct queue *q);
 
-int stateDelJob(struct job * j);
 int stateDelQueue(struct queue * q);
 int stateDelResource(struct resource * r);
 
@@ -439,6 +800,7 @@ int runCommand(client * c);
 int runAgentCommand(agent * a);
 
 void checkEvents(void);
+int nextEventTimeout(void);
 void freeEvents(void);
 
 void initEvents(void);
@@ -0,0 +1,1165 @@
+/* Copyright (c) 2018 Evan Wyatt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors may
+ *    be used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <errno.h>
+#include <glob.h>
+
+int flushDir(char *path);
+
+/* Job state is saved to disk as a series of snapshot segments.
+ *
+ * A full segment contains every job, while a delta segment only contains the jobs
+ * that changed since the previous segment was written, including a tombstone record
+ * for each deleted job. A full segment supersedes any segment written before it.
+ *
+ * Each segment is a single file, written sequentially then flushed with one fsync:
+ *   [header][job records][data]
+ *
+ * Job records are fixed size. Strings and arrays are stored in the data section and
+ * referenced by their offset from the start of it, 0 being a NULL reference.
+ * Arrays are 8 byte aligned arrays of uint64_t, so they can be read straight from
+ * the mapped file. */
+
+#define SNAPSHOT_MAGIC   0x4a534e50 // "JSNP"
+#define SNAPSHOT_VERSION 2
+
+#define SNAPSHOT_FLAG_FULL    0x0001 // Segment contains every job
+
+#define SNAPSHOT_JOB_DELETED  0x0001 // Job has been deleted
+
+#define SNAPSHOT_DATA_SIZE    0x100000 // Initial size of the serialized data buffer
+#define SNAPSHOT_MAX_SEGMENTS 64       // Delta segments allowed before compacting
+
+#define SNAPSHOT_SLICE_JOBS   8192     // Jobs encoded per pass while building a full snapshot
+#define SNAPSHOT_SLICE_IDS    65536    // Jobids looked at per pass while building one
+
+struct snapshotHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t record_size;
+
+	int64_t seq;
+	int64_t save_time;
+	int64_t job_count;
+
+	int64_t job_offset;
+	int64_t data_offset;
+	int64_t data_size;
+	int64_t file_size;
+};
+
+struct snapshotJob {
+	jobid_t jobid;
+	uint32_t flags;
+	int64_t revision;
+
+	uint64_t jobname;
+	uint64_t queue;
+	uint64_t shell;
+	uint64_t pre_cmd;
+	uint64_t post_cmd;
+	uint64_t stdout;
+	uint64_t stderr;
+
+	uint64_t argv;      // argc string references
+	uint64_t envs;      // env_count string references
+	uint64_t tags;      // tag_count key/value string references
+	uint64_t resources; // res_count name reference/needed pairs
+
+	int32_t argc;
+	int32_t env_count;
+	int32_t tag_count;
+	int32_t res_count;
+
+	uint32_t uid;
+	uint32_t submitter;
+	int32_t nice;
+	int32_t state;
+	int32_t priority;
+	int32_t exitcode;
+	int32_t signal;
+	int32_t reserved;
+
+	int64_t job_flags;
+	int64_t submit_time;
+	int64_t defer_time;
+	int64_t start_time;
+	int64_t finish_time;
+
+	int64_t usage[11];
+
+	/* Added in version 2 */
+	uint64_t env_profile;
+};
+
+/* Version 1 records end before env_profile */
+#define SNAPSHOT_V1_RECORD_SIZE offsetof(struct snapshotJob, env_profile)
+
+struct snapshotWriter {
+	struct snapshotSegment *s;
+	uint64_t data_size;
+
+	uint64_t *refs;
+	int64_t refs_size;
+};
+
+static void snapshotName(char *filename, int64_t seq) {
+	sprintf(filename, "%s/snapshot/jobs.%012ld", server.state_dir, seq);
+}
+
+static int64_t snapshotSeq(const char *filename) {
+	const char *p = strrchr(filename, '.');
+	return p ? atol(p + 1) : 0;
+}
+
+static int writeAt(int fd, const char *data, size_t len, off_t pos) {
+	while (len) {
+		ssize_t rc = pwrite(fd, data, len, pos);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return 1;
+		}
+
+		data += rc;
+		pos += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+static int addData(struct snapshotWriter *w, const void *data, size_t len, uint64_t *offset) {
+	*offset = w->data_size;
+
+	if (buffAdd(&w->s->data, data, len))
+		return 1;
+
+	w->data_size += len;
+
+	return 0;
+}
+
+static int addString(struct snapshotWriter *w, const char *str, uint64_t *offset) {
+	if (str == NULL) {
+		*offset = 0;
+		return 0;
+	}
+
+	return addData(w, str, strlen(str) + 1, offset);
+}
+
+static int addArray(struct snapshotWriter *w, int64_t count, uint64_t *offset) {
+	static const char padding[sizeof(uint64_t)] = {0};
+	uint64_t unused;
+
+	if (count == 0) {
+		*offset = 0;
+		return 0;
+	}
+
+	if (w->data_size % sizeof(uint64_t) && addData(w, padding, sizeof(uint64_t) - w->data_size % sizeof(uint64_t), &unused))
+		return 1;
+
+	return addData(w, w->refs, sizeof(uint64_t) * count, offset);
+}
+
+/* Make sure there is room to build an array of count references */
+static void reserveRefs(struct snapshotWriter *w, int64_t count) {
+	if (count <= w->refs_size)
+		return;
+
+	w->refs_size = count;
+	w->refs = realloc(w->refs, sizeof(uint64_t) * count);
+
+	if (w->refs == NULL)
+		error_die("snapshot: Failed to allocate memory: %s", strerror(errno));
+}
+
+static int addStringArray(struct snapshotWriter *w, int count, char **strings, uint64_t *offset) {
+	reserveRefs(w, count);
+
+	for (int i = 0; i < count; i++) {
+		if (addString(w, strings[i], &w->refs[i]))
+			return 1;
+	}
+
+	return addArray(w, count, offset);
+}
+
+static int fillJobRecord(struct snapshotWriter *w, struct job *j, struct snapshotJob *r) {
+	if (addString(w, j->jobname, &r->jobname) || addString(w, j->queue->name, &r->queue) ||
+		addString(w, j->shell, &r->shell) || addString(w, j->pre_cmd, &r->pre_cmd) ||
+		addString(w, j->post_cmd, &r->post_cmd) || addString(w, j->stdout, &r->stdout) ||
+		addString(w, j->stderr, &r->stderr) ||
+		addString(w, j->env_profile ? j->env_profile->hash : NULL, &r->env_profile))
+		return 1;
+
+	r->argc = j->argc;
+	r->env_count = j->env_count;
+	r->tag_count = j->tag_count;
+	r->res_count = j->res_count;
+
+	if (addStringArray(w, j->argc, j->argv, &r->argv) || addStringArray(w, j->env_count, j->envs, &r->envs))
+		return 1;
+
+	reserveRefs(w, j->tag_count * 2);
+
+	for (int i = 0; i < j->tag_count; i++) {
+		if (addString(w, j->tags[i].key, &w->refs[i * 2]) || addString(w, j->tags[i].value, &w->refs[i * 2 + 1]))
+			return 1;
+	}
+
+	if (addArray(w, j->tag_count * 2, &r->tags))
+		return 1;
+
+	reserveRefs(w, j->res_count * 2);
+
+	for (int i = 0; i < j->res_count; i++) {
+		if (addString(w, j->req_resources[i].res->name, &w->refs[i * 2]))
+			return 1;
+
+		w->refs[i * 2 + 1] = j->req_resources[i].needed;
+	}
+
+	if (addArray(w, j->res_count * 2, &r->resources))
+		return 1;
+
+	r->uid = j->uid;
+	r->submitter = j->submitter;
+	r->nice = j->nice;
+	r->state = j->state;
+	r->priority = j->priority;
+	r->exitcode = j->exitcode;
+	r->signal = j->signal;
+
+	r->job_flags = j->flags;
+	r->submit_time = j->submit_time;
+	r->defer_time = j->defer_time;
+	r->start_time = j->start_time;
+	r->finish_time = j->finish_time;
+
+	r->usage[0] = j->usage.ru_utime.tv_sec;
+	r->usage[1] = j->usage.ru_utime.tv_usec;
+	r->usage[2] = j->usage.ru_stime.tv_sec;
+	r->usage[3] = j->usage.ru_stime.tv_usec;
+	r->usage[4] = j->usage.ru_maxrss;
+	r->usage[5] = j->usage.ru_minflt;
+	r->usage[6] = j->usage.ru_majflt;
+	r->usage[7] = j->usage.ru_inblock;
+	r->usage[8] = j->usage.ru_oublock;
+	r->usage[9] = j->usage.ru_nvcsw;
+	r->usage[10] = j->usage.ru_nivcsw;
+
+	return 0;
+}
+
+/* Add a job record, deleted jobs are written as a tombstone with no other details */
+static int addJobRecord(struct snapshotWriter *w, struct job *j) {
+	struct snapshotJob r = {0};
+
+	r.jobid = j->jobid;
+	r.revision = j->obj.revision;
+
+	if (j->internal_state &JERS_FLAG_DELETED)
+		r.flags |= SNAPSHOT_JOB_DELETED;
+	else if (fillJobRecord(w, j, &r))
+		return 1;
+
+	return buffAdd(&w->s->records, (char *)&r, sizeof(r));
+}
+
+/* Copy a string referenced by a record in another segment */
+static int copyString(struct snapshotWriter *w, const struct snapshot *src, uint64_t offset, uint64_t *new_offset) {
+	if (offset == 0) {
+		*new_offset = 0;
+		return 0;
+	}
+
+	if (offset >= src->data_size || memchr(src->data + offset, '\0', src->data_size - offset) == NULL)
+		return 1;
+
+	return addString(w, src->data + offset, new_offset);
+}
+
+/* Copy an array referenced by a record in another segment. The first of every
+ * stride references is a string, the rest are copied as they are */
+static int copyArray(struct snapshotWriter *w, const struct snapshot *src, uint64_t offset, int64_t count, int stride, uint64_t *new_offset) {
+	const uint64_t *refs;
+
+	if (count == 0) {
+		*new_offset = 0;
+		return 0;
+	}
+
+	if (count < 0 || offset % sizeof(uint64_t) || offset + count * sizeof(uint64_t) > src->data_size)
+		return 1;
+
+	refs = (const uint64_t *)(src->data + offset);
+	reserveRefs(w, count);
+
+	for (int64_t i = 0; i < count; i++) {
+		if (i % stride)
+			w->refs[i] = refs[i];
+		else if (copyString(w, src, refs[i], &w->refs[i]))
+			return 1;
+	}
+
+	return addArray(w, count, new_offset);
+}
+
+/* Copy a job record from another segment, along with everything it references */
+static int copyJobRecord(struct snapshotWriter *w, const struct snapshot *src, const struct snapshotJob *r) {
+	struct snapshotJob n = {0};
+
+	/* Version 1 records are shorter, leaving env_profile unset */
+	memcpy(&n, r, src->record_size);
+
+	if (copyString(w, src, n.jobname, &n.jobname) || copyString(w, src, n.queue, &n.queue) ||
+		copyString(w, src, n.shell, &n.shell) || copyString(w, src, n.pre_cmd, &n.pre_cmd) ||
+		copyString(w, src, n.post_cmd, &n.post_cmd) || copyString(w, src, n.stdout, &n.stdout) ||
+		copyString(w, src, n.stderr, &n.stderr) || copyString(w, src, n.env_profile, &n.env_profile))
+		return 1;
+
+	if (copyArray(w, src, n.argv, n.argc, 1, &n.argv) || copyArray(w, src, n.envs, n.env_count, 1, &n.envs) ||
+		copyArray(w, src, n.tags, n.tag_count * 2, 1, &n.tags) || copyArray(w, src, n.resources, n.res_count * 2, 2, &n.resources))
+		return 1;
+
+	return buffAdd(&w->s->records, (char *)&n, sizeof(n));
+}
+
+/* Start serializing a snapshot segment into memory. The header is filled in
+ * by encodeFinish() once the size of the data is known */
+static int encodeStart(struct snapshotSegment *s, int64_t seq, int full, int64_t count) {
+	struct snapshotWriter w = {s, 0, NULL, 0};
+	uint64_t unused;
+
+	s->seq = seq;
+	s->full = full;
+
+	if (buffNew(&s->records, sizeof(struct snapshotHeader) + count * sizeof(struct snapshotJob)) || buffNew(&s->data, SNAPSHOT_DATA_SIZE))
+		return 1;
+
+	s->records.used = sizeof(struct snapshotHeader);
+
+	/* Offset 0 in the data section is reserved for NULL references */
+	return addData(&w, "\0\0\0\0\0\0\0", sizeof(uint64_t), &unused);
+}
+
+static int encodeJobs(struct snapshotSegment *s, struct job **jobs, int64_t count) {
+	struct snapshotWriter w = {s, s->data.used, NULL, 0};
+	int rc = 0;
+
+	for (int64_t i = 0; i < count && rc == 0; i++)
+		rc = addJobRecord(&w, jobs[i]);
+
+	free(w.refs);
+
+	return rc;
+}
+
+static void encodeFinish(struct snapshotSegment *s) {
+	struct snapshotHeader h = {0};
+	int64_t count = (s->records.used - sizeof(struct snapshotHeader)) / sizeof(struct snapshotJob);
+
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	h.flags = s->full ? SNAPSHOT_FLAG_FULL : 0;
+	h.record_size = sizeof(struct snapshotJob);
+	h.seq = s->seq;
+	h.save_time = time(NULL);
+	h.job_count = count;
+	h.job_offset = sizeof(struct snapshotHeader);
+	h.data_offset = h.job_offset + count * sizeof(struct snapshotJob);
+	h.data_size = s->data.used;
+	h.file_size = h.data_offset + h.data_size;
+
+	memcpy(s->records.data, &h, sizeof(h));
+}
+
+/* Serialize a snapshot segment containing the provided jobs into memory.
+ * The segment doesn't reference the jobs, so it can be written out while they change */
+
+int snapshotEncode(struct snapshotSegment *s, int64_t seq, int full, struct job **jobs, int64_t count) {
+	if (encodeStart(s, seq, full, count) || encodeJobs(s, jobs, count)) {
+		print_msg(JERS_LOG_WARNING, "Failed to serialize snapshot segment %ld", seq);
+		return 1;
+	}
+
+	encodeFinish(s);
+
+	return 0;
+}
+
+void snapshotFreeSegment(struct snapshotSegment *s) {
+	buffFree(&s->records);
+	buffFree(&s->data);
+
+	if (s->base) {
+		snapshotFreeSegment(s->base);
+		free(s->base);
+		s->base = NULL;
+	}
+}
+
+/* Write a serialized snapshot segment to filename.
+ * The file is only flushed to disk once, after everything has been written. */
+
+int snapshotWriteSegment(const char *filename, struct snapshotSegment *s) {
+	int rc = 1;
+	int fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP);
+
+	if (fd < 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open snapshot file %s: %s", filename, strerror(errno));
+		return 1;
+	}
+
+	/* The header goes last, so a partially written segment is never valid */
+	if (writeAt(fd, s->records.data + sizeof(struct snapshotHeader), s->records.used - sizeof(struct snapshotHeader), sizeof(struct snapshotHeader)) ||
+		writeAt(fd, s->data.data, s->data.used, s->records.used) ||
+		writeAt(fd, s->records.data, sizeof(struct snapshotHeader), 0))
+		goto write_error;
+
+	if (fsync(fd))
+		goto write_error;
+
+	rc = 0;
+
+write_error:
+	if (rc)
+		print_msg(JERS_LOG_WARNING, "Failed to write snapshot file %s: %s", filename, strerror(errno));
+
+	close(fd);
+
+	return rc;
+}
+
+/* Write a snapshot segment containing the provided jobs to filename */
+
+int snapshotWrite(const char *filename, int64_t seq, int full, struct job **jobs, int64_t count) {
+	struct snapshotSegment s = {0};
+	int rc = snapshotEncode(&s, seq, full, jobs, count) || snapshotWriteSegment(filename, &s);
+
+	snapshotFreeSegment(&s);
+
+	return rc;
+}
+
+/* Map a snapshot segment into memory, checking its header is valid */
+
+int snapshotOpen(const char *filename, struct snapshot *s) {
+	struct stat st;
+	const struct snapshotHeader *h;
+	uint32_t record_size;
+
+	memset(s, 0, sizeof(struct snapshot));
+
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to open snapshot file %s: %s", filename, strerror(errno));
+		return 1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to stat snapshot file %s: %s", filename, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct snapshotHeader)) {
+		print_msg(JERS_LOG_WARNING, "Snapshot file %s is truncated", filename);
+		close(fd);
+		return 1;
+	}
+
+	s->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (s->map == MAP_FAILED) {
+		print_msg(JERS_LOG_WARNING, "Failed to map snapshot file %s: %s", filename, strerror(errno));
+		s->map = NULL;
+		return 1;
+	}
+
+	s->map_size = st.st_size;
+	madvise(s->map, s->map_size, MADV_WILLNEED);
+
+	h = s->map;
+
+	/* Segments written by the previous version are still readable */
+	record_size = h->version == 1 ? SNAPSHOT_V1_RECORD_SIZE : sizeof(struct snapshotJob);
+
+	if (h->magic != SNAPSHOT_MAGIC || (h->version != SNAPSHOT_VERSION && h->version != 1) || h->record_size != record_size ||
+		h->file_size != st.st_size || h->job_count < 0 || h->job_offset < (int64_t)sizeof(struct snapshotHeader) ||
+		h->data_offset != h->job_offset + h->job_count * (int64_t)h->record_size ||
+		h->data_offset + h->data_size != h->file_size) {
+		print_msg(JERS_LOG_WARNING, "Snapshot file %s has an invalid header", filename);
+		snapshotClose(s);
+		return 1;
+	}
+
+	s->seq = h->seq;
+	s->full = h->flags &SNAPSHOT_FLAG_FULL;
+	s->count = h->job_count;
+	s->record_size = h->record_size;
+	s->jobs = (char *)s->map + h->job_offset;
+	s->data = (char *)s->map + h->data_offset;
+	s->data_size = h->data_size;
+
+	return 0;
+}
+
+void snapshotClose(struct snapshot *s) {
+	if (s->map)
+		munmap(s->map, s->map_size);
+
+	memset(s, 0, sizeof(struct snapshot));
+}
+
+static const struct snapshotJob *snapshotRecord(const struct snapshot *s, int64_t index) {
+	return (const struct snapshotJob *)((const char *)s->jobs + index * s->record_size);
+}
+
+/* Read a segment serialized in memory as if it had been opened */
+static void snapshotView(const struct snapshotSegment *seg, struct snapshot *s) {
+	memset(s, 0, sizeof(struct snapshot));
+
+	s->seq = seg->seq;
+	s->full = seg->full;
+	s->count = (seg->records.used - sizeof(struct snapshotHeader)) / sizeof(struct snapshotJob);
+	s->record_size = sizeof(struct snapshotJob);
+	s->jobs = seg->records.data + sizeof(struct snapshotHeader);
+	s->data = seg->data.data;
+	s->data_size = seg->data.used;
+}
+
+/* Open the newest full segment in segGlob and the delta segments written after it,
+ * oldest first. Returns the number of segments opened, 0 if there isn't a full
+ * segment, or -1 if one of them couldn't be opened */
+static int64_t openSegments(const glob_t *segGlob, struct snapshot *segs) {
+	int64_t count = 0;
+	size_t base;
+
+	for (base = segGlob->gl_pathc; base > 0; base--) {
+		struct snapshot s;
+
+		if (snapshotOpen(segGlob->gl_pathv[base - 1], &s) != 0)
+			return -1;
+
+		if (s.full) {
+			segs[count++] = s;
+			break;
+		}
+
+		snapshotClose(&s);
+	}
+
+	if (base == 0)
+		return 0;
+
+	for (size_t i = base; i < segGlob->gl_pathc; i++) {
+		if (snapshotOpen(segGlob->gl_pathv[i], &segs[count]) != 0) {
+			while (count)
+				snapshotClose(&segs[--count]);
+
+			return -1;
+		}
+
+		count++;
+	}
+
+	return count;
+}
+
+/* Strings are borrowed from the snapshot, they are only valid until it's closed */
+static char *loadString(const struct snapshot *s, uint64_t offset, jobid_t jobid) {
+	if (offset == 0)
+		return NULL;
+
+	if (offset >= s->data_size || memchr(s->data + offset, '\0', s->data_size - offset) == NULL)
+		error_die("Snapshot string for job %d is out of range", jobid);
+
+	return (char *)s->data + offset;
+}
+
+static const uint64_t *loadArray(const struct snapshot *s, uint64_t offset, int64_t count, jobid_t jobid) {
+	if (offset % sizeof(uint64_t) || offset + count * sizeof(uint64_t) > s->data_size)
+		error_die("Snapshot array for job %d is out of range", jobid);
+
+	return (const uint64_t *)(s->data + offset);
+}
+
+/* Fill in an allocated job from a snapshot record, packing its strings.
+ * This is called from the loader threads. Besides looking up its queue, resources
+ * and environment profile, the only shared state it touches is the intern table,
+ * with its lock taken once per job by packJobCopy(). See jobs.c */
+
+static void loadJobRecord(const struct snapshot *s, const struct snapshotJob *r, struct job *j) {
+	const uint64_t *refs;
+	char *queue;
+
+	j->jobid = r->jobid;
+	j->obj.type = JERS_OBJECT_JOB;
+	j->obj.revision = r->revision;
+
+	queue = loadString(s, r->queue, r->jobid);
+	j->queue = queue ? findQueue(queue) : NULL;
+
+	if (j->queue == NULL)
+		error_die("Error loading jobid %d - Queue '%s' does not exist", j->jobid, queue ? queue : "");
+
+	j->jobname = loadString(s, r->jobname, r->jobid);
+	j->shell = loadString(s, r->shell, r->jobid);
+	j->pre_cmd = loadString(s, r->pre_cmd, r->jobid);
+	j->post_cmd = loadString(s, r->post_cmd, r->jobid);
+	j->stdout = loadString(s, r->stdout, r->jobid);
+	j->stderr = loadString(s, r->stderr, r->jobid);
+
+	if (r->argc) {
+		refs = loadArray(s, r->argv, r->argc, r->jobid);
+		j->argc = r->argc;
+		j->argv = malloc(sizeof(char *) * j->argc);
+
+		for (int i = 0; i < j->argc; i++)
+			j->argv[i] = loadString(s, refs[i], r->jobid);
+	}
+
+	/* Version 1 records don't have a profile, their whole environment is in envs */
+	if (s->record_size > SNAPSHOT_V1_RECORD_SIZE && r->env_profile) {
+		char *hash = loadString(s, r->env_profile, r->jobid);
+
+		if ((j->env_profile = findEnvProfile(hash)) == NULL)
+			error_die("Error loading jobid %d - Environment profile '%s' does not exist", j->jobid, hash);
+
+		holdEnvProfile(j->env_profile);
+	}
+
+	if (r->env_count) {
+		refs = loadArray(s, r->envs, r->env_count, r->jobid);
+		j->env_count = r->env_count;
+		j->envs = malloc(sizeof(char *) * j->env_count);
+
+		for (int i = 0; i < j->env_count; i++)
+			j->envs[i] = loadString(s, refs[i], r->jobid);
+	}
+
+	if (r->tag_count) {
+		refs = loadArray(s, r->tags, r->tag_count * 2, r->jobid);
+		j->tag_count = r->tag_count;
+		j->tags = malloc(sizeof(key_val_t) * j->tag_count);
+
+		for (int i = 0; i < j->tag_count; i++) {
+			j->tags[i].key = loadString(s, refs[i * 2], r->jobid);
+			j->tags[i].value = loadString(s, refs[i * 2 + 1], r->jobid);
+		}
+	}
+
+	if (r->res_count) {
+		refs = loadArray(s, r->resources, r->res_count * 2, r->jobid);
+		j->res_count = r->res_count;
+		j->req_resources = calloc(j->res_count, sizeof(struct jobResource));
+
+		for (int i = 0; i < j->res_count; i++) {
+			char *name = loadString(s, refs[i * 2], r->jobid);
+
+			j->req_resources[i].res = name ? findResource(name) : NULL;
+			j->req_resources[i].needed = refs[i * 2 + 1];
+
+			if (j->req_resources[i].res == NULL)
+				error_die("Invalid resource encountered for job %d\n", j->jobid);
+		}
+	}
+
+	j->uid = r->uid;
+	j->submitter = r->submitter;
+	j->nice = r->nice;
+	j->state = r->state ? r->state : JERS_JOB_PENDING;
+	j->priority = r->priority;
+	j->exitcode = r->exitcode;
+	j->signal = r->signal;
+
+	j->flags = r->job_flags;
+	j->submit_time = r->submit_time;
+	j->defer_time = r->defer_time;
+	j->start_time = r->start_time;
+	j->finish_time = r->finish_time;
+
+	j->usage.ru_utime.tv_sec = r->usage[0];
+	j->usage.ru_utime.tv_usec = r->usage[1];
+	j->usage.ru_stime.tv_sec = r->usage[2];
+	j->usage.ru_stime.tv_usec = r->usage[3];
+	j->usage.ru_maxrss = r->usage[4];
+	j->usage.ru_minflt = r->usage[5];
+	j->usage.ru_majflt = r->usage[6];
+	j->usage.ru_inblock = r->usage[7];
+	j->usage.ru_oublock = r->usage[8];
+	j->usage.ru_nvcsw = r->usage[9];
+	j->usage.ru_nivcsw = r->usage[10];
+
+	/* The strings are borrowed from the snapshot, so only the arrays holding them need freeing */
+	char **argv = j->argv, **envs = j->envs;
+	key_val_t *tags = j->tags;
+	struct jobResource *res = j->req_resources;
+
+	packJobCopy(j);
+
+	free(argv);
+	free(envs);
+	free(tags);
+	free(res);
+}
+
+/* Create a job from the record at index, returning NULL if it is a deleted job */
+
+struct job * snapshotLoadJob(const struct snapshot *s, int64_t index) {
+	const struct snapshotJob *r = snapshotRecord(s, index);
+	struct job *j;
+
+	if (r->flags &SNAPSHOT_JOB_DELETED)
+		return NULL;
+
+	j = allocJob();
+	loadJobRecord(s, r, j);
+
+	return j;
+}
+
+struct loadItem {
+	const struct snapshot *s;
+	int64_t index;
+	struct job *j;
+};
+
+static void loadItem(int64_t index, void *data) {
+	struct loadItem *item = (struct loadItem *)data + index;
+	loadJobRecord(item->s, snapshotRecord(item->s, item->index), item->j);
+}
+
+/* Load the jobs from the newest full snapshot segment and any delta segments
+ * written after it. Segments are scanned newest first, so only the latest
+ * record for each jobid is loaded. The jobs themselves are built in parallel.
+ *
+ * Returns 1 if there is no full snapshot to load from. */
+
+int snapshotLoad(void) {
+	char pattern[PATH_MAX];
+	glob_t segGlob;
+	struct snapshot *segs = NULL;
+	int64_t base = -1, seg_count = 0, record_count = 0, loaded = 0;
+	jobid_t high_jobid = 0;
+	unsigned char *seen = NULL;
+	struct loadItem *items = NULL;
+	int rc;
+
+	sprintf(pattern, "%s/snapshot/jobs.[0-9]*", server.state_dir);
+
+	rc = glob(pattern, 0, NULL, &segGlob);
+
+	if (rc != 0 && rc != GLOB_NOMATCH)
+		error_die("Failed to glob() snapshot files %s : %s\n", pattern, strerror(errno));
+
+	if (rc == GLOB_NOMATCH)
+		segGlob.gl_pathc = 0;
+
+	/* Keep allocating sequence numbers after any segment on disk */
+	for (size_t i = 0; i < segGlob.gl_pathc; i++) {
+		int64_t seq = snapshotSeq(segGlob.gl_pathv[i]);
+
+		if (seq > server.snapshot.seq)
+			server.snapshot.seq = seq;
+	}
+
+	segs = calloc(segGlob.gl_pathc + 1, sizeof(struct snapshot));
+
+	if ((seg_count = openSegments(&segGlob, segs)) < 0)
+		error_die("Failed to load snapshot files from %s/snapshot", server.state_dir);
+
+	if (seg_count == 0) {
+		if (segGlob.gl_pathc)
+			print_msg(JERS_LOG_WARNING, "No full snapshot found, ignoring %ld snapshot files", segGlob.gl_pathc);
+
+		globfree(&segGlob);
+		free(segs);
+		server.snapshot.full = 1;
+		return 1;
+	}
+
+	base = segGlob.gl_pathc - seg_count;
+
+	for (int64_t i = 1; i < seg_count; i++)
+		server.snapshot.delta_jobs += segs[i].count;
+
+	server.snapshot.segments = seg_count - 1;
+
+	print_msg(JERS_LOG_INFO, "Loading jobs from snapshot %s + %ld delta segments", segGlob.gl_pathv[base], seg_count - 1);
+
+	for (int64_t i = 0; i < seg_count; i++) {
+		record_count += segs[i].count;
+
+		for (int64_t k = 0; k < segs[i].count; k++) {
+			if (snapshotRecord(&segs[i], k)->jobid > high_jobid)
+				high_jobid = snapshotRecord(&segs[i], k)->jobid;
+		}
+	}
+
+	/* Pick out the latest record for each job */
+	seen = calloc(high_jobid / 8 + 1, 1);
+	items = malloc(sizeof(struct loadItem) * (record_count + 1));
+
+	if (seen == NULL || items == NULL)
+		error_die("Failed to allocate memory to load snapshot: %s", strerror(errno));
+
+	for (int64_t i = seg_count; i > 0; i--) {
+		struct snapshot *s = &segs[i - 1];
+
+		for (int64_t k = 0; k < s->count; k++) {
+			const struct snapshotJob *r = snapshotRecord(s, k);
+
+			if (seen[r->jobid / 8] & (1 << (r->jobid % 8)))
+				continue;
+
+			seen[r->jobid / 8] |= 1 << (r->jobid % 8);
+
+			if (r->flags &SNAPSHOT_JOB_DELETED)
+				continue;
+
+			/* Jobs can only be allocated on the main thread */
+			items[loaded].s = s;
+			items[loaded].index = k;
+			items[loaded].j = allocJob();
+			loaded++;
+		}
+	}
+
+	/* Build the jobs in parallel, then add them to the job table */
+	loadParallel(loaded, loadItem, items);
+
+	for (int64_t i = 0; i < loaded; i++) {
+		struct job *j = items[i].j;
+
+		/* Keep the saved revision, the journal is replayed against it */
+		int64_t revision = j->obj.revision;
+		addJob(j, 0);
+		j->obj.revision = revision;
+	}
+
+	for (int64_t i = 0; i < seg_count; i++)
+		snapshotClose(&segs[i]);
+
+	print_msg(JERS_LOG_INFO, "Loaded %ld jobs", loaded);
+
+	free(items);
+	free(seen);
+	free(segs);
+	globfree(&segGlob);
+
+	return 0;
+}
+
+/* Called before starting a background save to decide what kind of segment to write.
+ * A full snapshot is written once the delta segments would hold more records than
+ * there are jobs, or there are too many of them. Returns 1 if a segment needs writing. */
+
+int snapshotStartSave(int64_t dirty_jobs) {
+	server.snapshot.saving_full = server.snapshot.full || server.snapshot.segments >= SNAPSHOT_MAX_SEGMENTS ||
+		server.snapshot.delta_jobs + dirty_jobs > (int64_t)server.jobTable.count;
+
+	if (!server.snapshot.saving_full && dirty_jobs == 0)
+		return 0;
+
+	server.snapshot.seq++;
+
+	return 1;
+}
+
+/* Remove the segments superseded by the full snapshot seq */
+static void removeOldSegments(int64_t seq) {
+	char pattern[PATH_MAX];
+	glob_t segGlob;
+
+	sprintf(pattern, "%s/snapshot/jobs.[0-9]*", server.state_dir);
+
+	if (glob(pattern, 0, NULL, &segGlob) != 0)
+		return;
+
+	for (size_t i = 0; i < segGlob.gl_pathc; i++) {
+		if (snapshotSeq(segGlob.gl_pathv[i]) >= seq)
+			continue;
+
+		if (unlink(segGlob.gl_pathv[i]) != 0)
+			print_msg(JERS_LOG_WARNING, "Failed to remove old snapshot file %s: %s", segGlob.gl_pathv[i], strerror(errno));
+	}
+
+	globfree(&segGlob);
+}
+
+/* Move the legacy per-job state files out of the way, once they are in a full snapshot */
+static void removeLegacyJobs(void) {
+	char legacy[PATH_MAX];
+	char migrated[PATH_MAX];
+
+	sprintf(legacy, "%s/jobs", server.state_dir);
+	sprintf(migrated, "%s/jobs.migrated.%ld", server.state_dir, time(NULL));
+
+	if (rename(legacy, migrated) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to move legacy job state files %s to %s: %s", legacy, migrated, strerror(errno));
+		return;
+	}
+
+	print_msg(JERS_LOG_INFO, "Migrated legacy job state files to snapshot, moved to %s", migrated);
+}
+
+/* A full snapshot being built in memory a slice at a time, when there isn't one on disk to compact */
+static struct {
+	struct snapshotSegment *seg;
+	jobid_t cursor;
+} build;
+
+/* Encode the next slice of jobs, in jobid order, into the full snapshot being built.
+ * A job changed after its slice was encoded is dirty again, so it will be in the
+ * delta segment the save thread merges with this. If all is set, every remaining
+ * job is encoded now. Returns 1 until every job has been encoded */
+
+int snapshotBuildFull(int all) {
+	static struct job *slice[SNAPSHOT_SLICE_JOBS];
+
+	if (build.seg == NULL) {
+		build.seg = calloc(1, sizeof(struct snapshotSegment));
+
+		if (build.seg == NULL || encodeStart(build.seg, 0, 1, server.jobTable.count))
+			error_die("Failed to allocate memory for full snapshot: %s", strerror(errno));
+
+		build.cursor = 0;
+		server.snapshot.building = 1;
+	}
+
+	do {
+		int64_t count = 0, scanned = 0;
+
+		while (build.cursor < server.high_jobid && count < SNAPSHOT_SLICE_JOBS && scanned++ < SNAPSHOT_SLICE_IDS) {
+			struct job *j = findJob(++build.cursor);
+
+			/* Deleted jobs stay dirty, so their tombstone is in the delta */
+			if (j == NULL || j->internal_state &JERS_FLAG_DELETED)
+				continue;
+
+			j->obj.dirty = 0;
+			slice[count++] = j;
+		}
+
+		if (encodeJobs(build.seg, slice, count))
+			error_die("Failed to serialize full snapshot: %s", strerror(errno));
+	} while (all && build.cursor < server.high_jobid);
+
+	if (build.cursor < server.high_jobid)
+		return 1;
+
+	encodeFinish(build.seg);
+	server.snapshot.building = 0;
+
+	return 0;
+}
+
+/* Serialize the dirty jobs being flushed for a background save on the main thread.
+ * A full snapshot is made by the save thread, merging them with the previous segments */
+
+int snapshotPrepareSave(struct snapshotSegment *s, struct job **jobs, int64_t count) {
+	int rc = snapshotEncode(s, server.snapshot.seq, 0, jobs, count);
+
+	s->compact = server.snapshot.saving_full;
+	s->migrate = server.snapshot.saving_full && server.snapshot.migrate;
+
+	/* Without a full snapshot on disk, merge with the one built in memory */
+	if (s->compact && server.snapshot.full) {
+		s->base = build.seg;
+		build.seg = NULL;
+	}
+
+	return rc;
+}
+
+/* Merge a delta segment with the segments before it into a full segment, keeping the
+ * latest record for each job and dropping the deleted ones. The previous segments are
+ * read from disk, or it's the full snapshot built in memory if there isn't one there */
+
+static int snapshotMerge(struct snapshotSegment *s, struct snapshotSegment *merged) {
+	char pattern[PATH_MAX];
+	glob_t segGlob = {0};
+	struct snapshot *segs = NULL;
+	struct snapshotWriter w = {merged, 0, NULL, 0};
+	unsigned char *seen = NULL;
+	jobid_t high_jobid = 0;
+	int64_t seg_count = 0;
+	int rc = 1;
+
+	if (s->base == NULL) {
+		sprintf(pattern, "%s/snapshot/jobs.[0-9]*", server.state_dir);
+
+		if (glob(pattern, 0, NULL, &segGlob) != 0)
+			segGlob.gl_pathc = 0;
+	}
+
+	if ((segs = calloc(segGlob.gl_pathc + 2, sizeof(struct snapshot))) == NULL)
+		goto merge_error;
+
+	if (s->base) {
+		snapshotView(s->base, &segs[seg_count++]);
+	} else if ((seg_count = openSegments(&segGlob, segs)) <= 0) {
+		print_msg(JERS_LOG_WARNING, "No full snapshot found to compact segment %ld with", s->seq);
+		seg_count = 0;
+		goto merge_error;
+	}
+
+	snapshotView(s, &segs[seg_count++]);
+
+	for (int64_t i = 0; i < seg_count; i++) {
+		for (int64_t k = 0; k < segs[i].count; k++) {
+			if (snapshotRecord(&segs[i], k)->jobid > high_jobid)
+				high_jobid = snapshotRecord(&segs[i], k)->jobid;
+		}
+	}
+
+	if ((seen = calloc(high_jobid / 8 + 1, 1)) == NULL || encodeStart(merged, s->seq, 1, 0))
+		goto merge_error;
+
+	w.data_size = merged->data.used;
+
+	/* Newest first, so only the latest record for each job is kept */
+	for (int64_t i = seg_count; i > 0; i--) {
+		const struct snapshot *src = &segs[i - 1];
+
+		for (int64_t k = 0; k < src->count; k++) {
+			const struct snapshotJob *r = snapshotRecord(src, k);
+
+			if (seen[r->jobid / 8] & (1 << (r->jobid % 8)))
+				continue;
+
+			seen[r->jobid / 8] |= 1 << (r->jobid % 8);
+
+			if (r->flags &SNAPSHOT_JOB_DELETED)
+				continue;
+
+			if (copyJobRecord(&w, src, r)) {
+				print_msg(JERS_LOG_WARNING, "Failed to compact snapshot record for job %d from segment %ld", r->jobid, src->seq);
+				goto merge_error;
+			}
+		}
+	}
+
+	encodeFinish(merged);
+	merged->migrate = s->migrate;
+	rc = 0;
+
+merge_error:
+	for (int64_t i = 0; i < seg_count; i++)
+		snapshotClose(&segs[i]);
+
+	free(w.refs);
+	free(seen);
+	free(segs);
+	globfree(&segGlob);
+
+	return rc;
+}
+
+/* Write the serialized segment out, compacting it into a full snapshot if requested.
+ * This is called from the save thread, so only uses what was captured in the segment. */
+
+int snapshotSave(struct snapshotSegment *s) {
+	char filename[PATH_MAX];
+	char new_filename[PATH_MAX];
+	struct snapshotSegment merged = {0};
+	int rc = 1;
+
+	if (s->compact) {
+		if (snapshotMerge(s, &merged))
+			goto save_error;
+
+		s = &merged;
+	}
+
+	snapshotName(filename, s->seq);
+	sprintf(new_filename, "%s/snapshot/jobs.new", server.state_dir);
+
+	if (snapshotWriteSegment(new_filename, s))
+		goto save_error;
+
+	if (rename(new_filename, filename) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to rename '%s' to '%s': %s", new_filename, filename, strerror(errno));
+		goto save_error;
+	}
+
+	if (flushDir(filename))
+		goto save_error;
+
+	if (s->full) {
+		removeOldSegments(s->seq);
+
+		if (s->migrate)
+			removeLegacyJobs();
+	}
+
+	rc = 0;
+
+save_error:
+	snapshotFreeSegment(&merged);
+
+	return rc;
+}
+
+/* Update the snapshot state in the main process once a background save has finished */
+void snapshotSaveComplete(int64_t dirty_jobs, int status) {
+	if (status) {
+		/* The dirty jobs will be written again in the next segment */
+	} else if (server.snapshot.saving_full) {
+		server.snapshot.full = 0;
+		server.snapshot.migrate = 0;
+		server.snapshot.segments = 0;
+		server.snapshot.delta_jobs = 0;
+	} else if (dirty_jobs) {
+		server.snapshot.segments++;
+		server.snapshot.delta_jobs += dirty_jobs;
+	}
+
+	server.snapshot.saving_full = 0;
+}
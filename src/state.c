@@ -44,6 +44,9 @@
 #include <time.h>
 #include <glob.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 #ifdef USE_SYSTEMD
 #include <systemd/sd-daemon.h>
@@ -54,6 +57,41 @@ int flushDir(char *path);
 int flushStateDirs(void);
 void createDir(const char *path);
 
+#define STATE_LOAD_MAX_THREADS 16
+#define STATE_LOAD_CHUNK 256 // Objects a load thread claims at a time
+
+#define REPLAY_BATCH_SIZE 256
+#define REPLAY_QUEUE_SIZE 16
+
+/* A queue or resource state file, serialized ready to be written */
+struct stateFile {
+	char *filename;
+	char *new_filename;
+	char *data;
+	size_t len;
+};
+
+/* A background save. The main thread serializes the dirty objects into it,
+ * then the save thread writes it out, so the daemon doesn't need to fork */
+struct stateSave {
+	int failed;           // Serializing the objects failed
+	int64_t seq;          // server.flush.save_seq of this save
+	jobid_t start_jobid;
+
+	struct stateFile *files;
+	int64_t file_count;
+
+	int save_jobs;
+	struct snapshotSegment segment;
+
+	int journal_fd;       // Duplicate of the journal fd, so a rollover can't close it
+	int journal_binary;
+	off_t last_commit;
+
+	char checkpoint[16];  // Journal and offset replay can start from once this save is written
+	off_t checkpoint_offset;
+};
+
 static inline int64_t strtoint64(const char *str, int64_t *result) {
 	/* Given str, read in an int64_t, returning the number of bytes read */
 	*result = 0;
@@ -83,6 +121,51 @@ static inline int64_t strtoint64(const char *str, int64_t *result) {
  *   The state journals (journal.yyyymmdd) are written to when commands are received
  *   These commands are then applied to the job/queue/res files as needed */
 
+/* Find the end of a binary journal, skipping through the records by their length.
+ * A partially written record at the end is cleared, to be overwritten by the next record */
+static off_t findBinaryJournalEnd(int fd, off_t start) {
+	struct stat buf;
+	off_t offset = start;
+	int torn = 0;
+
+	if (fstat(fd, &buf) != 0)
+		error_die("Failed to stat journal: %s", strerror(errno));
+
+	if (buf.st_size <= start)
+		return start;
+
+	char *map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED)
+		error_die("Failed to map journal: %s", strerror(errno));
+
+	while (1) {
+		struct journalRecordInfo r;
+		int rc = journalDecodeRecord(map + offset, buf.st_size - offset, &r);
+
+		if (rc < 0) {
+			print_msg(JERS_LOG_WARNING, "Journal has a partially written record at offset %ld - Clearing it", offset);
+			torn = 1;
+		}
+
+		if (rc <= 0 || r.type == JOURNAL_RECORD_END)
+			break;
+
+		server.journal.record++;
+		offset += r.size;
+	}
+
+	munmap(map, buf.st_size);
+
+	if (torn)
+		journalExtendFile(fd, offset, buf.st_size - offset);
+
+	print_msg(JERS_LOG_DEBUG, "Found end of binary journal at offset %ld", offset);
+	print_msg(JERS_LOG_DEBUG, "Last journal record is: %ld", server.journal.record);
+
+	return offset;
+}
+
 static off_t findJournalEnd(int fd) {
 	char data[8192 + 1];
 	int len;
@@ -126,64 +209,102 @@ static off_t findJournalEnd(int fd) {
  *  go into 'readonly' mode. This second block allows us to write job start/completion messages
  *  which might have a triggered before readonly mode was activated. */
 
-static int extendJournal(void) {
+static void extendJournal(void) {
 	off_t new_size = server.journal.size + server.journal.extend_block_size;
-	ssize_t fill_size = 0;
-	ssize_t written = 0;
 	off_t offset = server.journal.size;
-	static char *data = NULL;
-	static ssize_t data_size = 0;
 
 	if (server.journal.limit == 0)
 		new_size += server.journal.extend_block_size;
 
+	print_msg(JERS_LOG_DEBUG, "Attempting to add %ld bytes to the journal. New size: %ld", new_size - offset, new_size);
+
+	/* The space is allocated by the journal writer. If that fails, it puts us into
+	 * readonly mode and takes the size back to what it managed to allocate */
+	server.journal.size = new_size;
+	server.journal.limit = server.journal.size - server.journal.extend_block_size;
+
 	/* Need to actually write something to the journal to get the new space allocated */
-	fill_size = new_size - server.journal.size;
+	journalExtendFile(server.journal.fd, offset, new_size - offset);
+}
 
-	print_msg(JERS_LOG_DEBUG, "Attempting to add %ld bytes to the journal. New size: %ld", fill_size, new_size);
+/* Order journal files by their date, then part number. The part suffix isn't a
+ * fixed width, so a plain string comparison puts part 1000 ahead of part 999 */
 
-	if (data_size < fill_size) {
-		data = realloc(data, fill_size);
-		memset(data, 0, fill_size);
-	}
+static const char * journalSuffix(const char *path, long *part) {
+	const char *name = strrchr(path, '/');
+	const char *dot;
 
-	while (fill_size) {
-		if ((written = pwrite(server.journal.fd, data, fill_size, offset)) == -1) {
-			if (errno == ENOSPC) {
-				/* No space is left on the device, we need to switch into a read only mode */
-				if (server.readonly == 0) {
-					print_msg(JERS_LOG_CRITICAL, "*********************************************");
-					print_msg(JERS_LOG_CRITICAL, "* Failed to extend journal - Device is full *");
-					print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
-					print_msg(JERS_LOG_CRITICAL, "*********************************************");
-					server.readonly = READONLY_ENOSPACE;
-				}
+	name = name ? name + 1 : path;
 
-				return 1;
-			} else if (errno != EINTR) {
-				/* Another error occurred trying to fill in the file */
-				error_die("Failed to extend journal file: %s", strerror(errno));
-			}
-		}
+	if (strncmp(name, "journal.", 8) == 0)
+		name += 8;
 
-		fill_size -= written;
-		offset += written;
-	}
+	dot = strchr(name, '.');
+	*part = dot ? atol(dot + 1) : 0;
 
-	if (server.readonly == READONLY_ENOSPACE) {
-		print_msg(JERS_LOG_INFO, "Turning off readonly mode - journal extended.");
-		server.readonly = 0;
+	return name;
+}
+
+int cmpJournalName(const char *a, const char *b) {
+	long part_a, part_b;
+	const char *date_a = journalSuffix(a, &part_a);
+	const char *date_b = journalSuffix(b, &part_b);
+	int rc = strncmp(date_a, date_b, 8);
+
+	if (rc)
+		return rc;
+
+	return (part_a > part_b) - (part_a < part_b);
+}
+
+static int cmpJournalPath(const void *a, const void *b) {
+	return cmpJournalName(*(char * const *)a, *(char * const *)b);
+}
+
+/* Glob all the journals in the state directory, oldest first */
+int globJournals(glob_t *journalGlob) {
+	char pattern[PATH_MAX];
+	int rc;
+
+	sprintf(pattern, "%s/journal.*", server.state_dir);
+
+	if ((rc = glob(pattern, 0, NULL, journalGlob)) == 0)
+		qsort(journalGlob->gl_pathv, journalGlob->gl_pathc, sizeof(char *), cmpJournalPath);
+
+	return rc;
+}
+
+/* Journals rolled over due to their size have a part number appended to the date.
+ * Returns the highest part number of the existing journals for the date */
+static int lastJournalPart(const char *date) {
+	char pattern[PATH_MAX];
+	glob_t journalGlob;
+	int part = 0;
+	size_t i;
+
+	sprintf(pattern, "%s/journal.%s*", server.state_dir, date);
+
+	if (glob(pattern, 0, NULL, &journalGlob) != 0)
+		return 0;
+
+	for (i = 0; i < journalGlob.gl_pathc; i++) {
+		char *suffix = strrchr(journalGlob.gl_pathv[i], '/') + strlen("/journal.") + strlen(date);
+
+		if (*suffix == '.' && atoi(suffix + 1) > part)
+			part = atoi(suffix + 1);
 	}
 
-	server.journal.size = new_size;
-	server.journal.limit = server.journal.size - server.journal.extend_block_size;
-	fsync(server.journal.fd);
+	globfree(&journalGlob);
 
-	return 0;
+	return part;
 }
 
-int openStateFile(time_t now) {
+/* Open the journal for the current date.
+ * next_part requests a new journal for the date, as the current one is full */
+
+int openStateFile(time_t now, int next_part) {
 	char * state_file = NULL;
+	char date[9];
 	int fd;
 	int flags = O_CREAT | O_RDWR;
 	int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
@@ -198,8 +319,19 @@ int openStateFile(time_t now) {
 	if (!server.state_dir)
 		error_die("No state directory specified");
 
+	snprintf(date, sizeof(date), "%d%02d%02d", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday);
+
+	if (next_part && strncmp(server.journal.datetime, date, 8) == 0)
+		server.journal.part++;
+	else
+		server.journal.part = lastJournalPart(date);
+
+	if (server.journal.part)
+		snprintf(server.journal.datetime, sizeof(server.journal.datetime), "%s.%03d", date, server.journal.part);
+	else
+		strcpy(server.journal.datetime, date);
+
 	server.journal.record = 0;
-	snprintf(server.journal.datetime, sizeof(server.journal.datetime), "%d%02d%02d", 1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday);
 	asprintf(&state_file, "%s/journal.%s", server.state_dir, server.journal.datetime);
 
 	if (state_file == NULL)
@@ -215,7 +347,12 @@ int openStateFile(time_t now) {
 		if ((fd = open(state_file, flags, mode)) < 0)
 			error_die("Failed to open state file %s: %s", state_file, strerror(errno));
 
-		server.journal.len = findJournalEnd(fd);
+		off_t header_size = journalReadHeader(fd, NULL);
+
+		server.journal.len = header_size ? findBinaryJournalEnd(fd, header_size) : findJournalEnd(fd);
+
+		/* Nothing was written to the journal, treat it as a new one */
+		server.journal.binary = header_size > 0 || (server.journal.len == 0 && server.journal.new_binary);
 
 		if (lseek(fd, server.journal.len, SEEK_SET) != server.journal.len)
 			error_die("Failed to seek to end of journal %s: %s", state_file, strerror(errno));
@@ -236,6 +373,7 @@ int openStateFile(time_t now) {
 			error_die("Failed to flush state directory %s: %s", server.state_dir, strerror(errno));
 	} else {
 		/* Created a new journal file */
+		server.journal.binary = server.journal.new_binary;
 		server.journal.len = 0;
 		server.journal.size = 0;
 		server.journal.limit = 0;
@@ -266,77 +404,110 @@ time_t getRollOver(time_t now) {
   *
  * Note: There is a space at the start of line, this space will have a '*' character written
  *       to this position when these transaction have been commited to disk as the job/queue/resource state files
- *       A '$' will be written to this position as a 'End of journal' marker when rotating the journal files */
+ *       A '$' will be written to this position as a 'End of journal' marker when rotating the journal files
+ *
+ * Binary journals store the same fields in a length prefixed record, see journal.c */
 
 int stateSaveCmd(uid_t uid, char * cmd, char * msg, jobid_t jobid, int64_t revision) {
 	off_t start_offset;
 	struct timespec now;
 	int len = 0;
 	static time_t next_rollover = 0;
-	static char *msg_string = NULL;
-	static int msg_size = 0;
+	char *msg_string = NULL;
+	int msg_size = 256;
 
 	clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-	if (now.tv_sec >= next_rollover) {
+	/* Journals are rolled over daily, or once they reach the configured size */
+	int full = server.journal.fd >= 0 && server.journal.max_size && server.journal.len >= server.journal.max_size;
+
+	if (now.tv_sec >= next_rollover || server.journal.fd < 0 || full) {
 		/* Write the End of journal marker and close the current file */
 		if (server.journal.fd > 0) {
-			write(server.journal.fd, "$\n", 2);
-			fdatasync(server.journal.fd);
-			close(server.journal.fd);
+			size_t marker_len = 2;
+			char *marker = server.journal.binary ?
+				journalEncodeRecord(JOURNAL_RECORD_END, 0, 0, NULL, 0, 0, NULL, &marker_len) : strdup("$\n");
+
+			journalWriteMarker(server.journal.fd, server.journal.len, marker, marker_len);
+			journalSync(server.journal.fd);
+			journalClose(server.journal.fd);
 		}
 
 		/* Work out the next rollover */
 		if ((next_rollover = getRollOver(now.tv_sec)) < 0)
 			error_die("Failed to determine next journal rollover time");
 
-		server.journal.fd = openStateFile(now.tv_sec);
+		server.journal.fd = openStateFile(now.tv_sec, full);
+
+		if (server.journal.size == 0 || server.journal.len >= server.journal.limit)
+			extendJournal();
+
+		/* A new binary journal starts with its file header */
+		if (server.journal.binary && server.journal.len == 0) {
+			size_t header_len;
+			char *header = journalEncodeHeader(&header_len);
 
-		if (server.journal.size == 0 || server.journal.len >= server.journal.limit) {
-			if (extendJournal())
-				return 1;
+			journalWriteMarker(server.journal.fd, 0, header, header_len);
+			server.journal.len = header_len;
 		}
 	}
 
 	/* Save the offset of this new record, so we can write the '*' later if needed */
-	start_offset = lseek(server.journal.fd, 0, SEEK_CUR);
+	start_offset = server.journal.len;
 
-	/* Expand the msg */
-	while (1) {
-		len = snprintf(msg_string, msg_size, " %ld.%03d\t%d\t%s\t%d\t%ld\t%s\n", now.tv_sec, (int)(now.tv_nsec / 1000000), uid, cmd, jobid, revision, msg ? msg :"");
+	if (server.journal.binary) {
+		size_t record_len;
 
-		if (len < msg_size)
-			break;
+		msg_string = journalEncodeRecord(JOURNAL_RECORD_CMD, now.tv_sec * 1000 + now.tv_nsec / 1000000, uid, cmd, jobid, revision, msg, &record_len);
+		len = record_len;
+	}
 
-		msg_size = len + 64;
-		msg_string = realloc(msg_string, msg_size);
+	/* Expand the msg. The journal writer takes ownership of the string */
+	while (msg_string == NULL) {
+		msg_string = malloc(msg_size);
 
 		if (msg_string == NULL)
 			error_die("Failed to allocate memory for journal message: %s", strerror(errno));
-	}
 
-	/* Do we need to extend the journal? */
-	if (server.journal.len + len >= server.journal.limit) {
-		extendJournal();
-		// Even if extendJournal fails, we want to write this message out.
+		len = snprintf(msg_string, msg_size, " %ld.%03d\t%d\t%s\t%d\t%ld\t%s\n", now.tv_sec, (int)(now.tv_nsec / 1000000), uid, cmd, jobid, revision, msg ? msg :"");
+
+		if (len >= msg_size) {
+			msg_size = len + 1;
+			free(msg_string);
+			msg_string = NULL;
+		}
 	}
 
-	len = write(server.journal.fd, msg_string, len);
+	/* Do we need to extend the journal? A large record might need several extends,
+	 * otherwise the next extend would zero fill over the end of this record. */
+	while (server.journal.len + len >= server.journal.limit)
+		extendJournal();
 
-	if (len == -1) {
-		print_msg(JERS_LOG_CRITICAL, "Failed to write to journal file: %s", strerror(errno));
-		return 1;
-	}
+	journalWrite(server.journal.fd, start_offset, msg_string, len);
 
 	server.journal.len += len;
 	server.journal.record++;
 
-	if (server.flush.defer == 0)
-		fdatasync(server.journal.fd);
-	else
-		server.flush.dirty++;
+	/* Binary journals record the offset to replay from, ie. the end of this record */
+	server.journal.last_commit = server.journal.binary ? server.journal.len : start_offset;
+
+	if (server.flush.defer == FLUSH_SYNC) {
+		journalSync(server.journal.fd);
+		return 0;
+	}
+
+	server.flush.dirty++;
+
+	if (server.flush.defer == FLUSH_GROUP) {
+		if (server.flush.pending_since == 0)
+			server.flush.pending_since = getTimeMS();
+
+		server.flush.pending_bytes += len;
+
+		if (server.flush.pending_bytes >= server.flush.group_bytes)
+			flush_journal(0);
+	}
 
-	server.journal.last_commit = start_offset;
 	return 0;
 }
 
@@ -352,6 +523,12 @@ off_t checkForLastCommit(char * journal) {
 	if ((f = fopen(journal, "r")) == NULL)
 		error_die("Failed to open journal %s: %s", journal, strerror(errno));
 
+	/* Binary journals have the last commit in their header */
+	if (journalReadHeader(fileno(f), &last_commit)) {
+		fclose(f);
+		return last_commit ? last_commit : -1;
+	}
+
 	while ((len = getline(&line, &line_size, f)) != -1) {
 		if (line[0] == '*') {
 			last_commit = ftell(f);
@@ -370,9 +547,41 @@ off_t checkForLastCommit(char * journal) {
 	return last_commit;
 }
 
+/* A decoded journal entry waiting to be replayed */
+struct journalEntry {
+	msg_t msg;
+	char *json;     // Buffer the message was loaded from
+	size_t json_len;
+	time_t time;
+	uid_t uid;
+	jobid_t jobid;
+	int64_t revision;
+};
+
+struct replayBatch {
+	int count;
+	struct journalEntry entries[REPLAY_BATCH_SIZE];
+};
+
+/* Journal entries are read and decoded on a separate thread, then handed
+ * to the main thread in batches to be applied */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct replayBatch *batches[REPLAY_QUEUE_SIZE];
+	int head;
+	int count;
+	int done;
+
+	char **journals;
+	size_t journal_count;
+	off_t offset;
+} replay = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
 /* Convert a journal entry into a message that can be used for recovering state */
 
-int convertJournalEntry(msg_t *msg, char *entry) {
+int convertJournalEntry(struct journalEntry *e, char *entry) {
 	time_t timestamp_s;
 	int timestamp_ms;
 	uid_t uid;
@@ -384,7 +593,7 @@ int convertJournalEntry(msg_t *msg, char *entry) {
 	char *json;
 	size_t json_len = 0;
 
-	memset(msg, 0, sizeof(msg_t));
+	memset(e, 0, sizeof(struct journalEntry));
 
 	field_count = sscanf(entry, " %ld.%d\t%d\t%64s\t%u\t%ld\t%n", &timestamp_s, &timestamp_ms, (int *)&uid, command, &jobid, &revision, &msg_offset);
 
@@ -401,51 +610,137 @@ int convertJournalEntry(msg_t *msg, char *entry) {
 	if (*json) {
 		json_len = strlen(json);
 
-		if (load_message(json, msg) != 0)
+		if (load_message(json, &e->msg) != 0)
 			error_die("Failed to load message from journal entry");
 	}
 
-	server.recovery.time = timestamp_s;
-	server.recovery.uid = uid;
-	server.recovery.jobid = jobid;
-	server.recovery.revision = revision;
-	server.recovery.buffer = json;
+	e->time = timestamp_s;
+	e->uid = uid;
+	e->jobid = jobid;
+	e->revision = revision;
+	e->json = json;
+	e->json_len = json_len;
 
 	return json_len;
 }
 
-void replayTransaction(char * line) {
-	msg_t msg;
+/* Convert a binary journal record into a message that can be used for recovering state */
 
-	/* Remove the newline */
-	line[strcspn(line, "\n")] = 0;
+static void convertJournalRecord(struct journalEntry *e, const struct journalRecordInfo *r) {
+	memset(e, 0, sizeof(struct journalEntry));
 
-	/* End of journal marker, nothing to do here */
-	if (line[0] == '$')
-		return;
+	e->json = strndup(r->msg, r->msg_len);
 
-	if (line[0] == 0)
-		return;
+	if (e->json == NULL)
+		error_die("Failed to copy message for replaying: %s\n", strerror(errno));
 
-	/* Load the fields into a msg_t and call the appropriate command handler */
-	if (convertJournalEntry(&msg, line))
-		replayCommand(&msg);
+	if (r->msg_len) {
+		e->json_len = r->msg_len;
 
-	free(server.recovery.buffer);
-	server.recovery.buffer = NULL;
+		if (load_message(e->json, &e->msg) != 0)
+			error_die("Failed to load message from journal record");
+	}
 
-	return;
+	e->time = r->time;
+	e->uid = r->uid;
+	e->jobid = r->jobid;
+	e->revision = r->revision;
+}
+
+static void queueReplayBatch(struct replayBatch *batch) {
+	pthread_mutex_lock(&replay.lock);
+
+	while (replay.count == REPLAY_QUEUE_SIZE)
+		pthread_cond_wait(&replay.cond, &replay.lock);
+
+	replay.batches[(replay.head + replay.count) % REPLAY_QUEUE_SIZE] = batch;
+	replay.count++;
+
+	pthread_cond_broadcast(&replay.cond);
+	pthread_mutex_unlock(&replay.lock);
+}
+
+/* Returns NULL once all the journals have been read */
+static struct replayBatch * nextReplayBatch(void) {
+	struct replayBatch *batch = NULL;
+
+	pthread_mutex_lock(&replay.lock);
+
+	while (replay.count == 0 && !replay.done)
+		pthread_cond_wait(&replay.cond, &replay.lock);
+
+	if (replay.count) {
+		batch = replay.batches[replay.head];
+		replay.head = (replay.head + 1) % REPLAY_QUEUE_SIZE;
+		replay.count--;
+
+		pthread_cond_broadcast(&replay.cond);
+	}
+
+	pthread_mutex_unlock(&replay.lock);
+
+	return batch;
 }
 
-/* Read and replay transactions from the journal.
+/* Read and decode transactions from the journal, queuing them to be replayed.
  * 'Offset' is provided for the first file, subsequent files have the offset passed in as
  * a negative number. - All entries should be replayed for these files */
 
-void replayJournal(char * journal, off_t offset) {
+static struct replayBatch * replayBinaryJournal(int fd, char *journal, off_t offset, off_t header_size, struct replayBatch *batch) {
+	struct stat buf;
+
+	if (fstat(fd, &buf) != 0)
+		error_die("Failed to stat journal %s: %s", journal, strerror(errno));
+
+	if (offset < header_size)
+		offset = header_size;
+
+	if (buf.st_size <= offset)
+		return batch;
+
+	char *map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED)
+		error_die("Failed to map journal %s: %s", journal, strerror(errno));
+
+	madvise(map, buf.st_size, MADV_SEQUENTIAL);
+
+	/* Skip through the records by their length, until we reach
+	 * the zero filled end of the journal or an end of journal marker */
+	while (1) {
+		struct journalRecordInfo r;
+		int rc = journalDecodeRecord(map + offset, buf.st_size - offset, &r);
+
+		if (rc < 0)
+			print_msg(JERS_LOG_WARNING, "Journal %s has a partially written record at offset %ld - Ignoring it", journal, offset);
+
+		if (rc <= 0 || r.type == JOURNAL_RECORD_END)
+			break;
+
+		offset += r.size;
+
+		if (r.type != JOURNAL_RECORD_CMD)
+			continue;
+
+		convertJournalRecord(&batch->entries[batch->count++], &r);
+
+		if (batch->count == REPLAY_BATCH_SIZE) {
+			queueReplayBatch(batch);
+			batch = calloc(1, sizeof(struct replayBatch));
+		}
+	}
+
+	munmap(map, buf.st_size);
+
+	return batch;
+}
+
+static struct replayBatch * replayJournal(char * journal, off_t offset, struct replayBatch *batch) {
 	FILE * f = NULL;
 	char * line = NULL;
 	size_t line_size = 0;
 	ssize_t len = 0;
+	off_t header_size;
 
 	print_msg(JERS_LOG_INFO, "Replaying journal %s", journal);
 
@@ -455,11 +750,31 @@ void replayJournal(char * journal, off_t offset) {
 	if ((f = fopen(journal, "r")) == NULL)
 		error_die("Failed to open journal %s: %s", journal, strerror(errno));
 
+	if ((header_size = journalReadHeader(fileno(f), NULL)) > 0) {
+		batch = replayBinaryJournal(fileno(f), journal, offset, header_size, batch);
+		fclose(f);
+
+		print_msg(JERS_LOG_DEBUG, "Finished reading journal %s", journal);
+		return batch;
+	}
+
 	if (offset >= 0 && fseek(f, offset, SEEK_SET) != 0)
 		error_die("Failed to offset into journal at offset %ld: %s", offset, strerror(errno));
 
 	while ((len = getline(&line, &line_size, f)) != -1) {
-		replayTransaction(line);
+		/* Remove the newline */
+		line[strcspn(line, "\n")] = 0;
+
+		/* End of journal marker, nothing to do here */
+		if (line[0] == '$' || line[0] == 0)
+			continue;
+
+		convertJournalEntry(&batch->entries[batch->count++], line);
+
+		if (batch->count == REPLAY_BATCH_SIZE) {
+			queueReplayBatch(batch);
+			batch = calloc(1, sizeof(struct replayBatch));
+		}
 	}
 
 	if (len == -1 && !feof(f))
@@ -468,9 +783,193 @@ void replayJournal(char * journal, off_t offset) {
 	fclose(f);
 	free(line);
 
-	print_msg(JERS_LOG_DEBUG, "Finished replaying journal %s", journal);
+	print_msg(JERS_LOG_DEBUG, "Finished reading journal %s", journal);
 
-	return;
+	return batch;
+}
+
+static void * replayReader(void *arg) {
+	struct replayBatch *batch = calloc(1, sizeof(struct replayBatch));
+	off_t offset = replay.offset;
+	UNUSED(arg);
+
+	for (size_t i = 0; i < replay.journal_count; i++) {
+		batch = replayJournal(replay.journals[i], offset, batch);
+		offset = -1;
+	}
+
+	if (batch->count)
+		queueReplayBatch(batch);
+	else
+		free(batch);
+
+	pthread_mutex_lock(&replay.lock);
+	replay.done = 1;
+	pthread_cond_broadcast(&replay.cond);
+	pthread_mutex_unlock(&replay.lock);
+
+	return NULL;
+}
+
+/* Apply the decoded journal entries as they are read in by the reader thread.
+ * Returns the number of entries replayed */
+
+static int64_t replayJournals(char **journals, size_t count, off_t offset) {
+	pthread_t reader;
+	struct replayBatch *batch;
+	int64_t replayed = 0;
+	int rc;
+
+	replay.journals = journals;
+	replay.journal_count = count;
+	replay.offset = offset;
+	replay.head = replay.count = replay.done = 0;
+
+	if ((rc = pthread_create(&reader, NULL, replayReader, NULL)) != 0)
+		error_die("Failed to start journal reader thread: %s", strerror(rc));
+
+	while ((batch = nextReplayBatch()) != NULL) {
+		for (int i = 0; i < batch->count; i++) {
+			struct journalEntry *e = &batch->entries[i];
+
+			server.recovery.time = e->time;
+			server.recovery.uid = e->uid;
+			server.recovery.jobid = e->jobid;
+			server.recovery.revision = e->revision;
+			server.recovery.buffer = e->json;
+
+			/* Call the appropriate command handler */
+			if (e->json_len)
+				replayCommand(&e->msg);
+
+			free_message(&e->msg);
+			free(e->json);
+			server.recovery.buffer = NULL;
+		}
+
+		replayed += batch->count;
+		free(batch);
+	}
+
+	pthread_join(reader, NULL);
+
+	return replayed;
+}
+
+/* A checkpoint records the journal and offset recovery needs to replay from.
+ * It's written after a successful background save, replacing the previous one */
+
+static int stateSaveCheckpoint(const char *journal, off_t offset) {
+	char filename[PATH_MAX];
+	char new_filename[PATH_MAX];
+	FILE *f;
+
+	sprintf(filename, "%s/checkpoint", server.state_dir);
+	sprintf(new_filename, "%s/checkpoint.new", server.state_dir);
+
+	if ((f = fopen(new_filename, "w")) == NULL) {
+		print_msg(JERS_LOG_WARNING, "Failed to open checkpoint file for writing '%s' : %s\n", new_filename, strerror(errno));
+		return 1;
+	}
+
+	fprintf(f, "%s %ld\n", journal, offset);
+
+	if (fflush(f) != 0 || fdatasync(fileno(f)) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to write checkpoint file '%s' : %s\n", new_filename, strerror(errno));
+		fclose(f);
+		return 1;
+	}
+
+	fclose(f);
+
+	if (rename(new_filename, filename) != 0) {
+		print_msg(JERS_LOG_WARNING, "Failed to rename checkpoint file '%s' : %s\n", new_filename, strerror(errno));
+		return 1;
+	}
+
+	return flushDir(server.state_dir);
+}
+
+/* Returns 0 if a checkpoint was loaded */
+static int stateLoadCheckpoint(char *journal, off_t *offset) {
+	char filename[PATH_MAX];
+	int rc;
+
+	sprintf(filename, "%s/checkpoint", server.state_dir);
+
+	FILE *f = fopen(filename, "r");
+
+	if (f == NULL) {
+		if (errno != ENOENT)
+			print_msg(JERS_LOG_WARNING, "Failed to open checkpoint file '%s': %s", filename, strerror(errno));
+
+		return 1;
+	}
+
+	rc = fscanf(f, "%15s %ld", journal, offset);
+	fclose(f);
+
+	if (rc != 2 || *offset < 0) {
+		print_msg(JERS_LOG_WARNING, "Invalid checkpoint file '%s'", filename);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* The journals before the checkpoint aren't needed for recovery anymore */
+
+static void cleanupJournals(const char *checkpoint) {
+	char checkpoint_journal[PATH_MAX];
+	glob_t journalGlob;
+	size_t i;
+	int cleaned = 0;
+
+	if (server.journal.cleanup == JOURNAL_CLEANUP_NONE)
+		return;
+
+	sprintf(checkpoint_journal, "%s/journal.%s", server.state_dir, checkpoint);
+
+	if (globJournals(&journalGlob) != 0)
+		return;
+
+	if (server.journal.cleanup == JOURNAL_CLEANUP_ARCHIVE && mkdir(server.journal.archive_dir, S_IRWXU|S_IRGRP|S_IXGRP) != 0 && errno != EEXIST) {
+		print_msg(JERS_LOG_WARNING, "Failed to create journal archive directory %s : %s", server.journal.archive_dir, strerror(errno));
+		globfree(&journalGlob);
+		return;
+	}
+
+	for (i = 0; i < journalGlob.gl_pathc && cmpJournalName(journalGlob.gl_pathv[i], checkpoint_journal) < 0; i++) {
+		char *journal = journalGlob.gl_pathv[i];
+
+		if (server.journal.cleanup == JOURNAL_CLEANUP_DELETE) {
+			if (unlink(journal) != 0) {
+				print_msg(JERS_LOG_WARNING, "Failed to remove journal %s : %s", journal, strerror(errno));
+				continue;
+			}
+		} else {
+			char archived[PATH_MAX];
+			snprintf(archived, sizeof(archived), "%s%s", server.journal.archive_dir, strrchr(journal, '/'));
+
+			if (rename(journal, archived) != 0) {
+				print_msg(JERS_LOG_WARNING, "Failed to archive journal %s to %s : %s", journal, archived, strerror(errno));
+				continue;
+			}
+		}
+
+		cleaned++;
+	}
+
+	globfree(&journalGlob);
+
+	if (cleaned) {
+		print_msg(JERS_LOG_INFO, "%s %d journal(s) before checkpoint %s", server.journal.cleanup == JOURNAL_CLEANUP_DELETE ? "Removed" : "Archived", cleaned, checkpoint);
+
+		flushDir(server.state_dir);
+
+		if (server.journal.cleanup == JOURNAL_CLEANUP_ARCHIVE)
+			flushDir(server.journal.archive_dir);
+	}
 }
 
 /* After loading all the queues/jobs/resources from disk,
@@ -479,7 +978,10 @@ void replayJournal(char * journal, off_t offset) {
  * in the first position corrisponding to the LAST entry we know made it to disk.
  *
  * We need to scan through the journals, newest first, looking for the last '*'
- * and reapplying any commands after that (potentially across journal files) */
+ * and reapplying any commands after that (potentially across journal files)
+ *
+ * A successful save also writes a checkpoint naming the journal and offset to
+ * replay from, which saves the scan and lets the journals before it be cleaned up */
 
 void stateReplayJournal(void) {
 	print_msg(JERS_LOG_INFO, "Recovering state from journal files");
@@ -493,7 +995,7 @@ void stateReplayJournal(void) {
 	sprintf(pattern, "%s/journal.*", server.state_dir);
 	print_msg(JERS_LOG_DEBUG, "Searching: %s", pattern);
 
-	rc = glob(pattern, 0, NULL, &journalGlob);
+	rc = globJournals(&journalGlob);
 
 	if (rc != 0) {
 		if (rc == GLOB_NOMATCH){
@@ -505,7 +1007,27 @@ void stateReplayJournal(void) {
 		error_die("Failed to glob() journal files %s : %s\n", pattern, strerror(errno));
 	}
 
-	if (journalGlob.gl_pathc) {
+	/* Start from the checkpoint written by the last successful save. Without one,
+	 * look for the last commit marker written to the journals */
+	if (stateLoadCheckpoint(server.journal.checkpoint, &offset) == 0) {
+		char checkpoint_journal[PATH_MAX];
+		sprintf(checkpoint_journal, "%s/journal.%s", server.state_dir, server.journal.checkpoint);
+
+		for (i = journalGlob.gl_pathc; i > 0; i--) {
+			if (strcmp(journalGlob.gl_pathv[i - 1], checkpoint_journal) == 0)
+				break;
+		}
+
+		if (i > 0) {
+			print_msg(JERS_LOG_INFO, "Replaying from checkpoint %s offset %ld", checkpoint_journal, offset);
+		} else {
+			print_msg(JERS_LOG_WARNING, "Checkpoint journal %s not found, searching journals for the last commit", checkpoint_journal);
+			server.journal.checkpoint[0] = '\0';
+			offset = -1;
+		}
+	}
+
+	if (offset == -1) {
 		for (i = journalGlob.gl_pathc; i > 0 ; i--) {
 			if ((offset = checkForLastCommit(journalGlob.gl_pathv[i - 1])) >= 0)
 				break;
@@ -520,12 +1042,14 @@ void stateReplayJournal(void) {
 
 	/* We know which journal to start from, start replaying */
 	if (i > 0) {
+		int64_t start = getTimeMS();
+		int64_t replayed;
+
 		server.recovery.in_progress = 1;
 
-		for (; i <= journalGlob.gl_pathc; i++) {
-			replayJournal(journalGlob.gl_pathv[i - 1], offset);
-			offset = -1;
-		}
+		replayed = replayJournals(journalGlob.gl_pathv + i - 1, journalGlob.gl_pathc - i + 1, offset);
+
+		print_msg(JERS_LOG_INFO, "Replayed %ld journal entries in %ldms", replayed, getTimeMS() - start);
 	}
 
 	globfree(&journalGlob);
@@ -544,7 +1068,9 @@ void stateReplayJournal(void) {
 
 	struct job * j;
 
-	for (j = server.jobTable; j; j = j->hh.next) {
+	for (size_t i = 0; i < server.jobTable.count; i++) {
+		j = server.jobTable.jobs[i];
+
 		if (j->state == JERS_JOB_RUNNING || j->internal_state & JERS_FLAG_JOB_STARTED) {
 			changeJobState(j, JERS_JOB_UNKNOWN, NULL, 1);
 			j->internal_state &= ~JERS_FLAG_JOB_STARTED;
@@ -559,17 +1085,8 @@ void stateReplayJournal(void) {
 	stateSaveCmd(getuid(), "REPLAY_COMPLETE", NULL, 0, 0);
 }
 
-int stateDelJob(struct job * j) {
-	char filename[PATH_MAX];
-	int directory = j->jobid / STATE_DIV_FACTOR;
-	sprintf(filename, "%s/jobs/%d/%d.job", server.state_dir, directory, j->jobid);
-
-	if (unlink(filename) != 0)
-		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted job %d: %s", j->jobid, strerror(errno));
-
-	return 0;
-}
-
+/* Write a job to a state file in the legacy one file per job format.
+ * Jobs are now saved in snapshot segments, see snapshot.c */
 int stateSaveJob(struct job * j) {
 	char filename[PATH_MAX];
 	char new_filename[PATH_MAX];
@@ -584,9 +1101,12 @@ int stateSaveJob(struct job * j) {
 
 	if (f == NULL) {
 		if (errno == ENOENT) {
-			/* Try again after attempting to create the sub directory */
+			/* Try again after attempting to create the directories */
 			char create_dir[PATH_MAX];
-			sprintf(create_dir, "%s/jobs/%d", server.state_dir, directory);
+			int len = sprintf(create_dir, "%s/jobs", server.state_dir);
+			createDir(create_dir);
+
+			sprintf(create_dir + len, "/%d", directory);
 			createDir(create_dir);
 
 			f = fopen(new_filename, "w");
@@ -629,6 +1149,9 @@ int stateSaveJob(struct job * j) {
 	if (j->stderr)
 		fprintf(f, "STDERR %s\n", escapeString(j->stderr, NULL));
 
+	if (j->env_profile)
+		fprintf(f, "ENV_PROFILE %s\n", j->env_profile->hash);
+
 	if (j->env_count) {
 		fprintf(f, "ENV_COUNT %d\n", j->env_count);
 
@@ -713,20 +1236,29 @@ int stateSaveJob(struct job * j) {
 	return 0;
 }
 
-int stateSaveQueue(struct queue * q) {
-	char filename[PATH_MAX];
-	char new_filename[PATH_MAX];
-	FILE * f;
+/* Queue, resource and environment profile state files are serialized
+ * on the main thread, then written out by the background save thread */
 
-	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
-	sprintf(new_filename, "%s/queues/%s.new", server.state_dir, q->name);
+static int stateOpenFile(struct stateFile *sf, const char *dir, const char *name, const char *ext, FILE **f) {
+	memset(sf, 0, sizeof(struct stateFile));
 
-	f = fopen(new_filename, "w");
+	if (asprintf(&sf->filename, "%s/%s/%s.%s", server.state_dir, dir, name, ext) < 0 ||
+		asprintf(&sf->new_filename, "%s/%s/%s.new", server.state_dir, dir, name) < 0)
+		error_die("Failed to allocate state file name: %s", strerror(errno));
 
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open queue file %s : %s\n", filename, strerror(errno));
+	if ((*f = open_memstream(&sf->data, &sf->len)) == NULL) {
+		print_msg(JERS_LOG_WARNING, "Failed to serialize state file %s : %s", sf->filename, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int stateEncodeQueue(struct queue * q, struct stateFile *sf) {
+	FILE * f;
+
+	if (stateOpenFile(sf, "queues", q->name, "queue", &f))
 		return 1;
-	}
 
 	fprintf(f, "# QUEUE %s\n", q->name);
 	fprintf(f, "# SAVETIME %ld\n", time(NULL));
@@ -745,26 +1277,92 @@ int stateSaveQueue(struct queue * q) {
 	if (server.defaultQueue == q)
 		fprintf(f, "DEFAULT 1\n");
 
-	if (fflush(f)) {
-		fclose(f);
+	return fclose(f) != 0;
+}
+
+static int stateEncodeResource(struct resource * r, struct stateFile *sf) {
+	FILE * f;
+
+	if (stateOpenFile(sf, "resources", r->name, "resource", &f))
+		return 1;
+
+	fprintf(f, "# RESOURCE %s\n", r->name);
+	fprintf(f, "# SAVETIME %ld\n", time(NULL));
+
+	fprintf(f, "COUNT %d\n", r->count);
+	fprintf(f, "REVISION %ld\n", r->obj.revision);
+
+	return fclose(f) != 0;
+}
+
+static int stateEncodeEnvProfile(struct envProfile *p, struct stateFile *sf) {
+	FILE * f;
+
+	if (stateOpenFile(sf, "envprofiles", p->hash, "env", &f))
+		return 1;
+
+	fprintf(f, "# ENVPROFILE %s\n", p->hash);
+	fprintf(f, "ENV_COUNT %d\n", p->env_count);
+
+	for (int i = 0; i < p->env_count; i++)
+		fprintf(f, "ENV[%d] %s\n", i, escapeString(p->envs[i], NULL));
+
+	return fclose(f) != 0;
+}
+
+static int stateWriteFile(struct stateFile *sf) {
+	int fd = open(sf->new_filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	size_t written = 0;
+
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open state file %s : %s\n", sf->filename, strerror(errno));
 		return 1;
 	}
 
-	if (fsync(fileno(f))) {
-		fclose(f);
+	while (written < sf->len) {
+		ssize_t rc = write(fd, sf->data + written, sf->len - written);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			close(fd);
+			return 1;
+		}
+
+		written += rc;
+	}
+
+	if (fsync(fd)) {
+		close(fd);
 		return 1;
 	}
 
-	fclose(f);
+	close(fd);
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
+	if (rename(sf->new_filename, sf->filename) != 0) {
+		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", sf->new_filename, sf->filename, strerror(errno));
 		return 1;
 	}
 
 	return 0;
 }
 
+static void stateFreeFile(struct stateFile *sf) {
+	free(sf->filename);
+	free(sf->new_filename);
+	free(sf->data);
+}
+
+int stateSaveQueue(struct queue * q) {
+	struct stateFile sf;
+	int rc = stateEncodeQueue(q, &sf) || stateWriteFile(&sf);
+
+	stateFreeFile(&sf);
+
+	return rc;
+}
+
 int stateDelQueue(struct queue * q) {
 	char filename[PATH_MAX];
 	sprintf(filename, "%s/queues/%s.queue", server.state_dir, q->name);
@@ -776,52 +1374,93 @@ int stateDelQueue(struct queue * q) {
 }
 
 int stateSaveResource(struct resource * r) {
-	char filename[PATH_MAX];
-	char new_filename[PATH_MAX];
-	FILE * f;
+	struct stateFile sf;
+	int rc = stateEncodeResource(r, &sf) || stateWriteFile(&sf);
 
+	stateFreeFile(&sf);
+
+	return rc;
+}
+
+int stateDelResource(struct resource * r) {
+	char filename[PATH_MAX];
 	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
-	sprintf(new_filename, "%s/resources/%s.new", server.state_dir, r->name);
 
-	f = fopen(new_filename, "w");
+	if (unlink(filename) != 0)
+		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted resource %s: %s", r->name, strerror(errno));
 
-	if (f == NULL) {
-		fprintf(stderr, "Failed to open resource file %s : %s\n", filename, strerror(errno));
-		return 1;
-	}
+	return 0;
+}
 
-	fprintf(f, "# RESOURCE %s\n", r->name);
-	fprintf(f, "# SAVETIME %ld\n", time(NULL));
+/* Load a profile, returning NULL if it doesn't exist or doesn't match its hash */
+struct envProfile * stateLoadEnvProfile(const char *hash) {
+	char filename[PATH_MAX];
+	char check[ENVPROFILE_HASH_SIZE];
+	struct envProfile *p;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	FILE *f;
 
-	fprintf(f, "COUNT %d\n", r->count);
-	fprintf(f, "REVISION %ld\n", r->obj.revision);
+	sprintf(filename, "%s/envprofiles/%s.env", server.state_dir, hash);
 
-	if (fflush(f)) {
-		fclose(f);
-		return 1;
-	}
+	if ((f = fopen(filename, "r")) == NULL)
+		return NULL;
 
-	if (fsync(fileno(f))) {
-		fclose(f);
-		return 1;
+	if ((p = calloc(1, sizeof(struct envProfile))) == NULL)
+		error_die("Failed to allocate memory for environment profile: %s", strerror(errno));
+
+	strcpy(p->hash, hash);
+
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		char *key, *value;
+		int index = -1;
+
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (loadKeyValue(line, &key, &value, &index))
+			error_die("Failed to parse environment profile: %s", filename);
+
+		if (!key || !value)
+			continue;
+
+		if (strcmp(key, "ENV_COUNT") == 0 && p->envs == NULL) {
+			p->env_count = atoi(value);
+			p->envs = calloc(p->env_count ? p->env_count : 1, sizeof(char *));
+		} else if (strcmp(key, "ENV") == 0 && index >= 0 && index < p->env_count) {
+			free(p->envs[index]);
+			p->envs[index] = strdup(value);
+		}
 	}
 
+	free(line);
 	fclose(f);
 
-	if (rename(new_filename, filename) != 0) {
-		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n", new_filename, filename, strerror(errno));
-		return 1;
+	int missing = p->envs == NULL;
+
+	for (int i = 0; i < p->env_count && !missing; i++)
+		missing = p->envs[i] == NULL;
+
+	if (!missing)
+		envProfileHash(p->env_count, p->envs, check);
+
+	if (missing || strcmp(check, p->hash) != 0) {
+		print_msg(JERS_LOG_WARNING, "Environment profile %s is corrupt", filename);
+		freeStringArray(p->env_count, &p->envs);
+		free(p);
+		return NULL;
 	}
 
-	return 0;
+	return p;
 }
 
-int stateDelResource(struct resource * r) {
+int stateDelEnvProfile(struct envProfile *p) {
 	char filename[PATH_MAX];
-	sprintf(filename, "%s/resources/%s.resource", server.state_dir, r->name);
+	sprintf(filename, "%s/envprofiles/%s.env", server.state_dir, p->hash);
 
 	if (unlink(filename) != 0)
-		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for deleted resource %s: %s", r->name, strerror(errno));
+		print_msg(JERS_LOG_WARNING, "Failed to remove statefile for environment profile %s: %s", p->hash, strerror(errno));
 
 	return 0;
 }
@@ -881,35 +1520,32 @@ jobid_t stateLoadJobID(void) {
 	return jobid;
 }
 
-int stateSaveToDiskChild(struct job ** jobs, struct queue ** queues, struct resource ** resources) {
-	int64_t i;
+static struct {
+	pthread_t thread;
+	struct stateSave *save;
+	atomic_int done;
+	int status;
+} saveThread;
 
-	setproctitle("jersd_state_save");
+static int stateSaveWrite(struct stateSave *save) {
+	int64_t i;
 
-	print_msg(JERS_LOG_DEBUG, "Starting background save. %ld Jobs %ld Queues %ld Resources",
-		server.flush_jobs, server.flush_queues, server.flush_resources);
+	if (save->failed)
+		return 1;
 
 	/* Save the start jobid as a hint when the server starts */
-	stateSaveJobID(server.start_jobid);
-
-	/* Save the queues and resources first, to avoid having to handle
-	 * situations where we might have to recover jobs that reference
-	 * queues and resources that don't exist */
-
-	for (i = 0; i < server.flush_resources; i++) {
-		if (stateSaveResource(resources[i]))
-			return 1;
-	}
+	stateSaveJobID(save->start_jobid);
 
-	for (i = 0; i < server.flush_queues; i++) {
-		if (stateSaveQueue(queues[i]))
+	/* The resources, queues and environment profiles are saved first, to avoid
+	 * having to handle situations where we might have to recover jobs that
+	 * reference queues, resources or profiles that don't exist */
+	for (i = 0; i < save->file_count; i++) {
+		if (stateWriteFile(&save->files[i]))
 			return 1;
 	}
 
-	for (i = 0; i < server.flush_jobs; i++) {
-		if (stateSaveJob(jobs[i]))
-			return 1;
-	}
+	if (save->save_jobs && snapshotSave(&save->segment))
+		return 1;
 
 	/* Flush any directory we might have touched */
 	if (flushStateDirs())
@@ -918,9 +1554,99 @@ int stateSaveToDiskChild(struct job ** jobs, struct queue ** queues, struct reso
 	return 0;
 }
 
+static void * stateSaveThread(void *arg) {
+	struct stateSave *save = arg;
+	int status = stateSaveWrite(save);
+
+	if (status == 0) {
+		/* Now we need to mark the journal that we commited all those transactions to disk.
+		 * There won't be a journal open yet if this is the first snapshot of a new server */
+		if (save->journal_fd >= 0) {
+			int failed = save->journal_binary ? journalMarkCommit(save->journal_fd, save->last_commit) :
+				pwrite(save->journal_fd, "*", 1, save->last_commit) != 1;
+
+			/* This isn't too catastrophic, we might just end up replaying extra transactions if we crash */
+			if (failed)
+				print_msg(JERS_LOG_WARNING, "Background save: Failed to write marker to journal: %s\n", strerror(errno));
+
+			fdatasync(save->journal_fd);
+		}
+
+		/* The checkpoint is written once the marker is on disk, so it's never ahead of it */
+		if (save->checkpoint[0] && stateSaveCheckpoint(save->checkpoint, save->checkpoint_offset))
+			print_msg(JERS_LOG_WARNING, "Background save: Failed to write checkpoint\n");
+	} else {
+		print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
+	}
+
+	saveThread.status = status;
+	atomic_store(&saveThread.done, 1);
+
+	return NULL;
+}
+
+/* Serialize the dirty objects, so the save thread doesn't need to touch them */
+static struct stateSave * stateSavePrepare(struct job ** jobs, struct queue ** queues, struct resource ** resources, struct envProfile ** profiles, int save_jobs) {
+	struct stateSave *save = calloc(1, sizeof(struct stateSave));
+	int64_t i;
+
+	if (save == NULL)
+		error_die("Failed to allocate memory for background save: %s", strerror(errno));
+
+	save->start_jobid = server.start_jobid;
+	save->files = calloc(server.flush_resources + server.flush_queues + server.flush_envprofiles + 1, sizeof(struct stateFile));
+
+	if (save->files == NULL)
+		error_die("Failed to allocate memory for background save: %s", strerror(errno));
+
+	for (i = 0; i < server.flush_resources && !save->failed; i++)
+		save->failed = stateEncodeResource(resources[i], &save->files[save->file_count++]);
+
+	for (i = 0; i < server.flush_queues && !save->failed; i++)
+		save->failed = stateEncodeQueue(queues[i], &save->files[save->file_count++]);
+
+	for (i = 0; i < server.flush_envprofiles && !save->failed; i++)
+		save->failed = stateEncodeEnvProfile(profiles[i], &save->files[save->file_count++]);
+
+	if (save_jobs && !save->failed) {
+		save->save_jobs = 1;
+		save->failed = snapshotPrepareSave(&save->segment, jobs, server.flush_jobs);
+	}
+
+	/* Everything in the journal up to here is covered by this save */
+	save->journal_fd = -1;
+
+	if (server.journal.fd >= 0) {
+		if ((save->journal_fd = dup(server.journal.fd)) < 0)
+			print_msg(JERS_LOG_WARNING, "Background save: Failed to duplicate journal fd: %s", strerror(errno));
+
+		save->journal_binary = server.journal.binary;
+		save->last_commit = server.journal.last_commit;
+
+		strcpy(save->checkpoint, server.journal.datetime);
+		save->checkpoint_offset = server.journal.len;
+	}
+
+	return save;
+}
+
+static void stateSaveFree(struct stateSave *save) {
+	int64_t i;
+
+	for (i = 0; i < save->file_count; i++)
+		stateFreeFile(&save->files[i]);
+
+	if (save->journal_fd >= 0)
+		close(save->journal_fd);
+
+	snapshotFreeSegment(&save->segment);
+	free(save->files);
+	free(save);
+}
+
 /* This function is responsible for commiting dirty objects to disk.
- * - This is done by creating a list of the dirty objects, then
- *   forking off so the writes are done in the background */
+ * - This is done by creating a list of the dirty objects and serializing them,
+ *   then handing them to a thread so the writes are done in the background */
 
 void stateSaveToDisk(int block) {
 	static uint64_t startTime = 0;
@@ -934,43 +1660,36 @@ void stateSaveToDisk(int block) {
 	static struct job ** dirtyJobs = NULL;
 	static struct queue ** dirtyQueues = NULL;
 	static struct resource ** dirtyResources = NULL;
+	static struct envProfile ** dirtyEnvProfiles = NULL;
+	int save_jobs = 0;
+
+	/* If saving is set we kicked off a save previously */
+	if (server.flush.saving) {
+		if (block || atomic_load(&saveThread.done)) {
+			int status;
+			struct stateSave *save = saveThread.save;
+
+			pthread_join(saveThread.thread, NULL);
+			status = saveThread.status;
 
-	/* If pid is populated we kicked off a save previously */
-	if (server.flush.pid) {
-		int rc = 0;
-		pid_t retPid = 0;
-
-		if ((retPid = waitpid(server.flush.pid, &rc, block? 0 : WNOHANG)) > 0) {
-			int status = 0, signo = 0;
-
-			if (WIFEXITED(rc)) {
-				status = WEXITSTATUS(rc);
-				if (status) {
-					print_msg(JERS_LOG_CRITICAL, "Background save failed. ExitCode:%d", status);
-
-					if (server.readonly == 0) {
-						print_msg(JERS_LOG_CRITICAL, "*********************************************");
-						print_msg(JERS_LOG_CRITICAL, "*          Background save failed           *");
-						print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
-						print_msg(JERS_LOG_CRITICAL, "*********************************************");
-						server.readonly = READONLY_BGSAVE;
-					}
-				} else {
-					/* Sucessful save. Clear read only mode if we previously
-					 * entered it due to and issue with a save */
-					if (server.readonly == READONLY_BGSAVE) {
-						server.readonly = 0;
-						print_msg(JERS_LOG_INFO, "Turning off readonly mode - Background save successful.");
-					}
+			if (status) {
+				print_msg(JERS_LOG_CRITICAL, "Background save failed. ExitCode:%d", status);
+
+				if (server.readonly == 0) {
+					print_msg(JERS_LOG_CRITICAL, "*********************************************");
+					print_msg(JERS_LOG_CRITICAL, "*          Background save failed           *");
+					print_msg(JERS_LOG_CRITICAL, "*        Switching to READONLY mode!        *");
+					print_msg(JERS_LOG_CRITICAL, "*********************************************");
+					server.readonly = READONLY_BGSAVE;
 				}
-			}
-			else if (WIFSIGNALED(rc)) {
-				signo = WTERMSIG(rc);
-				error_die("Background save failed. Signaled:%d", signo);
 			} else {
-				error_die("Background save failed - Unknown reason.");
+				/* Sucessful save. Clear read only mode if we previously
+				 * entered it due to and issue with a save */
+				if (server.readonly == READONLY_BGSAVE) {
+					server.readonly = 0;
+					print_msg(JERS_LOG_INFO, "Turning off readonly mode - Background save successful.");
+				}
 			}
-
 			/* Clear the flushing flag on the objects */
 			if (server.flush_jobs) {
 				int64_t i;
@@ -1015,22 +1734,45 @@ void stateSaveToDisk(int block) {
 
 					server.dirty_resources = 1;
 				}
+
+				if (server.flush_envprofiles) {
+					int64_t i;
+					for (i = 0; i < server.flush_envprofiles; i++)
+						dirtyEnvProfiles[i]->dirty = 1;
+
+					server.dirty_envprofiles = 1;
+				}
 			}
 
+			snapshotSaveComplete(server.flush_jobs, status);
+
+			if (status == 0 && save->checkpoint[0]) {
+				strcpy(server.journal.checkpoint, save->checkpoint);
+				cleanupJournals(server.journal.checkpoint);
+			}
+
+			if (status == 0)
+				server.flush.saved_seq = save->seq;
+
+			stateSaveFree(save);
+
 			/* Clear our active flush counts  */
-			server.flush_jobs = server.flush_queues = server.flush_resources = 0;
+			server.flush_jobs = server.flush_queues = server.flush_resources = server.flush_envprofiles = 0;
 
 			free(dirtyJobs);
 			free(dirtyQueues);
 			free(dirtyResources);
+			free(dirtyEnvProfiles);
 
 			print_msg(JERS_LOG_DEBUG, "Background save %s. Took %ldms\n", status ? "FAILED":"complete", now - startTime);
 
-			server.flush.pid = 0;
+			server.flush.saving = 0;
+			saveThread.save = NULL;
 			startTime = 0;
 			dirtyJobs = NULL;
 			dirtyQueues = NULL;
 			dirtyResources = NULL;
+			dirtyEnvProfiles = NULL;
 			return;
 		}
 
@@ -1042,17 +1784,26 @@ void stateSaveToDisk(int block) {
 		return;
 	}
 
-	if (server.dirty_jobs == 0 && server.dirty_queues == 0 && server.dirty_resources == 0)
+	if (server.dirty_jobs == 0 && server.dirty_queues == 0 && server.dirty_resources == 0 && server.dirty_envprofiles == 0 &&
+		server.snapshot.full == 0)
 		return;
 
 	if (server.readonly == READONLY_ENOSPACE) {
 		/* Try extending the journal to see if we can get out of readonly mode */
-		if (extendJournal()) {
+		extendJournal();
+		journalWait(0);
+
+		if (server.readonly == READONLY_ENOSPACE) {
 			print_msg(JERS_LOG_WARNING, "Skipping background save - READONLY mode");
 			return;
 		}
 	}
 
+	/* Without a full snapshot on disk to compact, every job needs encoding into one.
+	 * That's done a slice at a time between other events, then the save is started */
+	if (server.snapshot.full && snapshotBuildFull(block))
+		return;
+
 	print_msg(JERS_LOG_DEBUG, "Starting background save to disk");
 
 	/* Check for dirty objects - saving the references to flush to disk.
@@ -1063,9 +1814,11 @@ void stateSaveToDisk(int block) {
 		int i = 0;
 		struct job * j = NULL;
 
-		dirtyJobs = malloc(sizeof(struct job *) * (HASH_COUNT(server.jobTable) + 1));
+		dirtyJobs = malloc(sizeof(struct job *) * (server.jobTable.count + 1));
+
+		for (size_t k = 0; k < server.jobTable.count; k++) {
+			j = server.jobTable.jobs[k];
 
-		for (j = server.jobTable; j != NULL; j = j->hh.next) {
 			if (j->obj.dirty) {
 				dirtyJobs[i++] = j;
 				j->obj.dirty = 0;
@@ -1113,41 +1866,49 @@ void stateSaveToDisk(int block) {
 		server.flush_resources = i;
 	}
 
-	server.dirty_jobs = server.dirty_queues = server.dirty_resources = 0;
+	/* Profiles can't be cleaned up until a save started after they were created
+	 * has completed, so these stay valid until this save is done. See envprofile.c */
+	if (server.dirty_envprofiles) {
+		int i = 0;
+		struct envProfile * p = NULL;
 
-	startTime = getTimeMS();
+		dirtyEnvProfiles = malloc(sizeof(struct envProfile *) * (HASH_COUNT(server.envProfiles) + 1));
 
-	server.flush.pid = fork();
+		for (p = server.envProfiles; p != NULL; p = p->hh.next) {
+			if (p->dirty) {
+				dirtyEnvProfiles[i++] = p;
+				p->dirty = 0;
+			}
+		}
 
-	if (server.flush.pid == -1) {
-		error_die("stateSaveToDisk: failed to fork background task: %s", strerror(errno));
+		dirtyEnvProfiles[i] = NULL;
+		server.flush_envprofiles = i;
 	}
 
-	if (server.flush.pid == 0) {
-		int status = stateSaveToDiskChild(dirtyJobs, dirtyQueues, dirtyResources);
-		free(dirtyJobs);
-		free(dirtyQueues);
-		free(dirtyResources);
+	server.dirty_jobs = server.dirty_queues = server.dirty_resources = server.dirty_envprofiles = 0;
 
-		if (status == 0) {
-			/* Now we need to mark the journal that we commited all those transactions to disk */
-			if (pwrite(server.journal.fd, "*", 1, server.journal.last_commit) != 1) {
-				/* This isn't too catastrophic, we might just end up replaying extra transactions if we crash */
-				print_msg(JERS_LOG_WARNING, "Background save: Failed to write marker to journal: %s\n", strerror(errno));
-			}
+	save_jobs = snapshotStartSave(server.flush_jobs);
 
-			print_msg(JERS_LOG_DEBUG, "Background save complete. Jobs:%ld Queues:%ld Resources:%ld",
-				server.flush_jobs, server.flush_queues, server.flush_resources);
+	/* The save thread marks the last journal record as committed, make sure it's been written */
+	journalWait(0);
 
-			fdatasync(server.journal.fd);
-		} else {
-			print_msg(JERS_LOG_WARNING, "Background save: Failed.\n");
-		}
-		/* We are the forked child, just exit */
-		_exit(status);
-	}
+	startTime = getTimeMS();
 
-	/* Parent process - All done for now. We'll check on the child later if we aren't told to block */
+	saveThread.save = stateSavePrepare(dirtyJobs, dirtyQueues, dirtyResources, dirtyEnvProfiles, save_jobs);
+	saveThread.save->seq = ++server.flush.save_seq;
+	atomic_store(&saveThread.done, 0);
+
+	int rc = pthread_create(&saveThread.thread, NULL, stateSaveThread, saveThread.save);
+
+	if (rc != 0)
+		error_die("stateSaveToDisk: failed to start background save thread: %s", strerror(rc));
+
+	server.flush.saving = 1;
+
+	print_msg(JERS_LOG_DEBUG, "Background save started. Jobs:%ld Queues:%ld Resources:%ld Profiles:%ld Serialized in %ldms",
+		server.flush_jobs, server.flush_queues, server.flush_resources, server.flush_envprofiles, getTimeMS() - startTime);
+
+	/* All done for now. We'll check on the thread later if we aren't told to block */
 	if (block) {
 		print_msg(JERS_LOG_INFO, "Waiting for background save to complete (blocking)");
 		stateSaveToDisk(1);
@@ -1223,8 +1984,6 @@ int flushDir(char *path) {
 /* Flush all the state directories */
 int flushStateDirs(void) {
 	char tmp[PATH_MAX];
-	int highest_dir = server.max_jobid / STATE_DIV_FACTOR;
-	int i;
 
 	if (flushDir(server.state_dir))
 		return 1;
@@ -1237,15 +1996,13 @@ int flushStateDirs(void) {
 	if (flushDir(tmp))
 		return 1;
 
-	int len = sprintf(tmp, "%s/jobs", server.state_dir);
+	sprintf(tmp, "%s/snapshot", server.state_dir);
 	if (flushDir(tmp))
 		return 1;
 
-	for (i = 0; i <= highest_dir; i++) {
-		sprintf(tmp + len, "/%d", i);
+	sprintf(tmp, "%s/envprofiles", server.state_dir);
 	if (flushDir(tmp))
 		return 1;
-	}
 
 	return 0;
 }
@@ -1257,18 +2014,10 @@ void stateInit(void) {
 
 	print_msg(JERS_LOG_DEBUG, "Initialising state directories");
 
-	/* Job dirs first. */
-	int highest_dir = server.max_jobid / STATE_DIV_FACTOR;
-	int i;
-
-	int len = sprintf(tmp, "%s/jobs", server.state_dir);
+	/* Job snapshot directory */
+	sprintf(tmp, "%s/snapshot", server.state_dir);
 	createDir(tmp);
 
-	for (i = 0; i <= highest_dir; i++) {
-		sprintf(tmp + len, "/%d", i);
-		createDir(tmp);
-	}
-
 	/* Queue directory */
 	sprintf(tmp, "%s/queues", server.state_dir);
 	createDir(tmp);
@@ -1277,16 +2026,80 @@ void stateInit(void) {
 	sprintf(tmp, "%s/resources", server.state_dir);
 	createDir(tmp);
 
+	/* Environment profile directory */
+	sprintf(tmp, "%s/envprofiles", server.state_dir);
+	createDir(tmp);
+
 	flushStateDirs();
 
 	/* Load the 'high' jobid hint */
 	server.start_jobid = stateLoadJobID();
 }
 
+/* Work shared between the threads of a parallel load */
+struct loadWork {
+	int64_t count;
+	atomic_int_fast64_t next;
+	void (*load)(int64_t index, void *data);
+	void *data;
+};
+
+static void * loadWorker(void *arg) {
+	struct loadWork *w = arg;
+	int64_t start;
+
+	while ((start = atomic_fetch_add(&w->next, STATE_LOAD_CHUNK)) < w->count) {
+		int64_t end = start + STATE_LOAD_CHUNK;
+
+		if (end > w->count)
+			end = w->count;
+
+		for (int64_t i = start; i < end; i++)
+			w->load(i, w->data);
+	}
+
+	return NULL;
+}
+
+/* Call load() for each index from 0 to count, spread across a pool of threads.
+ * load() needs to be safe to call concurrently, only reading shared state. */
+
+void loadParallel(int64_t count, void (*load)(int64_t index, void *data), void *data) {
+	pthread_t threads[STATE_LOAD_MAX_THREADS];
+	struct loadWork w = {count, 0, load, data};
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int started = 0;
+
+	if (thread_count > STATE_LOAD_MAX_THREADS)
+		thread_count = STATE_LOAD_MAX_THREADS;
+
+	if (thread_count > count / STATE_LOAD_CHUNK)
+		thread_count = count / STATE_LOAD_CHUNK;
+
+	print_msg(JERS_LOG_DEBUG, "Loading %ld objects using %ld threads", count, thread_count ? thread_count : 1);
+
+	/* This thread does its share of the work as well */
+	for (int i = 1; i < thread_count; i++) {
+		int rc = pthread_create(&threads[started], NULL, loadWorker, &w);
+
+		if (rc != 0) {
+			print_msg(JERS_LOG_WARNING, "Failed to start load thread: %s", strerror(rc));
+			break;
+		}
+
+		started++;
+	}
+
+	loadWorker(&w);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
 /* Read through the current state files converting the commands
  *  to the appropriate job/queue/res files */
 
-struct job * stateLoadJob(const char * fileName) {
+static void loadJobFile(const char * fileName, struct job * j) {
 	FILE * f = NULL;
 	char * line = NULL;
 	size_t line_size = 0;
@@ -1308,7 +2121,6 @@ struct job * stateLoadJob(const char * fileName) {
 
 	jobid = atoi(temp + 1); // + 1 to move past the '/'
 
-	struct job * j = calloc(sizeof(struct job), 1);
 	j->jobid = jobid;
 	j->obj.type = JERS_OBJECT_JOB;
 
@@ -1354,7 +2166,12 @@ struct job * stateLoadJob(const char * fileName) {
 			j->envs = malloc (sizeof(char *) * j->env_count);
 		} else if (strcmp(key, "ENV") == 0) {
 			j->envs[index] = strdup(value);
-		}else if (strcmp(key, "TAG_COUNT") == 0) {
+		} else if (strcmp(key, "ENV_PROFILE") == 0) {
+			if ((j->env_profile = findEnvProfile(value)) == NULL)
+				error_die("Error loading jobid %d - Environment profile '%s' does not exist", jobid, value);
+
+			holdEnvProfile(j->env_profile);
+		} else if (strcmp(key, "TAG_COUNT") == 0) {
 			j->tag_count = atoi(value);
 			j->tags = malloc (sizeof(key_val_t) * j->tag_count);
 		} else if (strcmp(key, "TAG") == 0) {
@@ -1443,24 +2260,41 @@ struct job * stateLoadJob(const char * fileName) {
 	free(line);
 	fclose(f);
 
+	packJob(j);
+}
+
+struct job * stateLoadJob(const char * fileName) {
+	struct job * j = allocJob();
+	loadJobFile(fileName, j);
+
 	return j;
 }
 
-int stateLoadJobs(void) {
+/* Load jobs from the legacy one file per job state files. These are written
+ * to a full snapshot on the next background save */
+
+struct legacyLoad {
+	char **files;
+	struct job **jobs;
+};
+
+static void loadLegacyJob(int64_t index, void *data) {
+	struct legacyLoad *l = data;
+	loadJobFile(l->files[index], l->jobs[index]);
+}
+
+static int stateLoadLegacyJobs(void) {
 	int rc;
 	size_t i;
 	char pattern[PATH_MAX];
 	glob_t jobFiles;
-
-#ifdef USE_SYSTEMD
-	sd_notify(0, "STATUS=Loading jobs...");
-#endif
+	struct legacyLoad load;
 
 	sprintf(pattern, "%s/jobs/*/*.job", server.state_dir);
 
 	print_msg(JERS_LOG_INFO, "Loading jobs from %s\n", pattern);
 
-	rc = glob(pattern, 0, NULL, &jobFiles);
+	rc = glob(pattern, GLOB_NOSORT, NULL, &jobFiles);
 
 	if (rc != 0) {
 		if (rc == GLOB_NOMATCH){
@@ -1474,17 +2308,49 @@ int stateLoadJobs(void) {
 
 	print_msg(JERS_LOG_INFO, "Loading %ld jobs from disk", jobFiles.gl_pathc);
 
+	/* Parse the files in parallel, then add them all to the job table */
+	load.files = jobFiles.gl_pathv;
+	load.jobs = malloc(sizeof(struct job *) * jobFiles.gl_pathc);
+
+	if (load.jobs == NULL)
+		error_die("Failed to allocate memory to load jobs: %s", strerror(errno));
+
+	/* Jobs can only be allocated on the main thread */
+	for (i = 0; i < jobFiles.gl_pathc; i++)
+		load.jobs[i] = allocJob();
+
+	loadParallel(jobFiles.gl_pathc, loadLegacyJob, &load);
+
 	for (i = 0; i < jobFiles.gl_pathc; i++) {
-		struct job * j = stateLoadJob(jobFiles.gl_pathv[i]);
+		struct job * j = load.jobs[i];
+		int64_t revision = j->obj.revision;
+
+		/* Keep the saved revision, the journal is replayed against it */
 		addJob(j, 0);
+		j->obj.revision = revision;
 	}
 
 	print_msg(JERS_LOG_INFO, "Loaded %ld jobs", jobFiles.gl_pathc);
 
+	server.snapshot.migrate = 1;
+
+	free(load.jobs);
 	globfree(&jobFiles);
 	return 0;
 }
 
+int stateLoadJobs(void) {
+#ifdef USE_SYSTEMD
+	sd_notify(0, "STATUS=Loading jobs...");
+#endif
+
+	if (snapshotLoad() == 0)
+		return 0;
+
+	/* No snapshot yet, check for state files from an older version */
+	return stateLoadLegacyJobs();
+}
+
 struct queue * stateLoadQueue(const char * fileName) {
 	FILE * f;
 	char * name = NULL;
@@ -1783,19 +2649,16 @@ static inline void increment_state(struct job *j) {
 		case JERS_JOB_PENDING:
 			server.stats.jobs.pending++;
 			j->queue->stats.pending++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_DEFERRED:
 			server.stats.jobs.deferred++;
 			j->queue->stats.deferred++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_HOLDING:
 			server.stats.jobs.holding++;
 			j->queue->stats.holding++;
-			server.candidate_recalc = 1;
 			break;
 
 		case JERS_JOB_COMPLETED:
@@ -1823,16 +2686,29 @@ static inline void increment_state(struct job *j) {
 
 void changeJobState(struct job *j, int new_state, struct queue *new_queue, int dirty) {
 	if (j->state != new_state || new_queue != NULL) {
+		int old_state = j->state;
+
 		/* Update the job state and appropriate counts */
 		decrement_state(j);
 
+		/* The candidate heap is per queue, so remove it before any queue change */
+		removeCandidate(j);
+
 		if (new_queue != NULL)
 			j->queue = new_queue;
 
 		j->state = new_state;
 		increment_state(j);
+
+		if (new_state == JERS_JOB_PENDING && !(j->internal_state &JERS_FLAG_DELETED))
+			addCandidate(j);
+
+		/* A new candidate, or a job freeing up its slot, might let something start */
+		if (new_state == JERS_JOB_PENDING || old_state == JERS_JOB_RUNNING || j->internal_state &JERS_FLAG_JOB_STARTED)
+			requestSchedule();
 	}
 
+	updateJobHot(j);
 	updateObject(&j->obj, dirty);
 
 	/* Add the email to the pending email list if required */
@@ -1854,11 +2730,31 @@ void updateObject(jers_object * obj, int dirty) {
 	}
 }
 
+/* Flush the journal to disk. The flush is performed by the journal writer,
+ * unless force is set this doesn't wait for it to complete */
 void flush_journal(int force) {
-	if (!force && !server.flush.dirty)
-		return;
+	if ((force || server.flush.dirty) && server.journal.fd >= 0) {
+		journalSync(server.journal.fd);
+		server.flush.lastflush = time(NULL);
+		server.flush.dirty = 0;
+		server.flush.pending_bytes = 0;
+		server.flush.pending_since = 0;
+	}
+
+	if (force)
+		journalWait(1);
+	else if (commitClientList)
+		releaseCommitClients(journalSynced());
+}
 
-	fdatasync(server.journal.fd);
-	server.flush.lastflush = time(NULL);
-	server.flush.dirty = 0;
+/* Group commit - Flush the journal once the oldest pending write has waited
+ * group_ms, or enough has been written. Called from the event loop after
+ * the ready clients and agents have been processed, so with a group_ms of 0
+ * everything received in one pass of the event loop is flushed together */
+void checkJournalCommit(void) {
+	if (server.flush.dirty == 0 ||
+		server.flush.pending_bytes >= server.flush.group_bytes ||
+		getTimeMS() - server.flush.pending_since >= server.flush.group_ms) {
+		flush_journal(0);
+	}
 }
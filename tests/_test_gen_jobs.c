@@ -1,4 +1,4 @@
-/* This code is embedded it test_generateCandidatePool.c
+/* This code is embedded it test_candidateOrder
  * Jobs are compared by:
  *      - queue priority
  *      - job priority
@@ -12,8 +12,7 @@ j->queue = &q[0];
 j->priority = 100;
 j->state = JERS_JOB_PENDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
-server.stats.jobs.pending++;
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 10;
@@ -21,8 +20,7 @@ j->queue = &q[0];
 j->priority = 101;
 j->state = JERS_JOB_PENDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
-server.stats.jobs.pending++;
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 12;
@@ -30,8 +28,7 @@ j->queue = &q[2];
 j->priority = 100;
 j->state = JERS_JOB_PENDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
-server.stats.jobs.pending++;
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 32;
@@ -39,8 +36,7 @@ j->queue = &q[2];
 j->priority = 90;
 j->state = JERS_JOB_PENDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
-server.stats.jobs.pending++;
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 500;
@@ -48,8 +44,7 @@ j->queue = &q[1];
 j->priority = 150;
 j->state = JERS_JOB_PENDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
-server.stats.jobs.pending++;
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 1020;
@@ -57,8 +52,7 @@ j->queue = &q[2];
 j->priority = 100;
 j->state = JERS_JOB_PENDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
-server.stats.jobs.pending++;
+addJob(j, 0);
 
 /* Add some decoy jobs in there as well. (deleted and non pending) */
 j = calloc(1, sizeof (struct job));
@@ -69,7 +63,7 @@ j->state = JERS_JOB_PENDING;
 
 j->internal_state |= JERS_FLAG_DELETED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 86;
@@ -78,7 +72,7 @@ j->priority = 100;
 j->state = JERS_JOB_HOLDING;
 j->internal_state |= JERS_FLAG_DELETED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+addJob(j, 0);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 400;
@@ -86,4 +80,4 @@ j->queue = &q[0];
 j->priority = 100;
 j->state = JERS_JOB_HOLDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+addJob(j, 0);
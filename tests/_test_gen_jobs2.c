@@ -10,7 +10,7 @@ j->queue = &q;
 j->defer_time = __now - 120;
 j->state = JERS_JOB_DEFERRED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 addDeferredJob(j);
 
@@ -20,7 +20,7 @@ j->queue = &q;
 j->defer_time = __now - 120;
 j->state = JERS_JOB_DEFERRED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 addDeferredJob(j);
 
@@ -31,7 +31,7 @@ j->queue = &q;
 j->defer_time = __now + 60;
 j->state = JERS_JOB_DEFERRED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 addDeferredJob(j);
 
@@ -44,7 +44,7 @@ j->state = JERS_JOB_DEFERRED;
 addDeferredJob(j);
 
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 
 j = calloc(1, sizeof (struct job));
@@ -53,7 +53,7 @@ j->queue = &q;
 j->defer_time = __now - 1;
 j->state = JERS_JOB_DEFERRED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 addDeferredJob(j);
 
@@ -64,7 +64,7 @@ j->queue = &q;
 j->defer_time = __now + 100;
 j->state = JERS_JOB_DEFERRED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 addDeferredJob(j);
 
@@ -77,7 +77,7 @@ j->state = JERS_JOB_DEFERRED;
 addDeferredJob(j);
 
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 server.stats.jobs.deferred++;
 
 /* Add some decoy jobs in there as well. (deleted and non pending) */
@@ -88,7 +88,7 @@ j->state = JERS_JOB_PENDING;
 
 j->internal_state |= JERS_FLAG_DELETED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 86;
@@ -96,11 +96,11 @@ j->priority = 100;
 j->state = JERS_JOB_HOLDING;
 j->internal_state |= JERS_FLAG_DELETED;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
 
 j = calloc(1, sizeof (struct job));
 j->jobid = 400;
 j->priority = 100;
 j->state = JERS_JOB_HOLDING;
 
-HASH_ADD_INT(server.jobTable, jobid, j);
+jobTableAdd(j);
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <server.h>
+
+/* Microbenchmark of a full job table filter scan, reading the filtered fields
+ * from each struct job as the scan used to, against reading the dense hot records.
+ * Jobs are allocated in jobid order, then added to the table either in that
+ * order, or shuffled as the dense array becomes after jobs are cleaned up.
+ * Usage: bench_jobscan [job_count...], defaults to 1M and 5M jobs. */
+
+struct jersServer server = {0};
+
+char * server_log = "bench";
+int server_log_mode = JERS_LOG_CRITICAL;
+
+#define QUEUE_COUNT 8
+#define SCAN_PASSES 10
+
+static struct queue queues[QUEUE_COUNT];
+
+static double elapsed(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void report(const char *layout, const char *name, size_t count, double ms) {
+	printf("%-8s %-6s %10zu jobs %10.1fms %8.2fns/job\n", layout, name, count, ms, ms * 1000000.0 / count);
+}
+
+/* The filter a 'jers job show' for one users pending jobs on a queue would use */
+static int64_t scanJobs(struct queue *q, uid_t uid) {
+	int64_t found = 0;
+
+	for (size_t i = 0; i < server.jobTable.count; i++) {
+		struct job *j = server.jobTable.jobs[i];
+
+		if (j->internal_state &JERS_FLAG_DELETED)
+			continue;
+
+		found += j->state == JERS_JOB_PENDING && j->queue == q && j->uid == uid;
+	}
+
+	return found;
+}
+
+static int64_t scanHot(struct queue *q, uid_t uid) {
+	int64_t found = 0;
+
+	for (size_t i = 0; i < server.jobTable.count; i++) {
+		struct jobHot *h = &server.jobTable.hot[i];
+
+		if (h->deleted)
+			continue;
+
+		found += h->state == JERS_JOB_PENDING && h->queue == q && h->uid == uid;
+	}
+
+	return found;
+}
+
+static void bench(const char *layout, size_t count, int shuffle) {
+	struct job **jobs = malloc(sizeof(struct job *) * count);
+	struct timespec start;
+	int64_t found_jobs = 0, found_hot = 0;
+
+	if (jobs == NULL) {
+		fprintf(stderr, "Failed to allocate %zu jobs\n", count);
+		exit(1);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct job *j = allocJob();
+		j->jobid = i + 1;
+		j->queue = &queues[i % QUEUE_COUNT];
+		j->state = i % 3 ? JERS_JOB_COMPLETED : JERS_JOB_PENDING;
+		j->uid = 1000 + i % 16;
+		jobs[i] = j;
+	}
+
+	if (shuffle) {
+		srand(count);
+
+		for (size_t i = count - 1; i > 0; i--) {
+			size_t k = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+			struct job *tmp = jobs[i];
+			jobs[i] = jobs[k];
+			jobs[k] = tmp;
+		}
+	}
+
+	server.max_jobid = count;
+
+	for (size_t i = 0; i < count; i++)
+		jobTableAdd(jobs[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int p = 0; p < SCAN_PASSES; p++)
+		found_jobs += scanJobs(&queues[p % QUEUE_COUNT], 1000 + p);
+
+	report(layout, "job", count * SCAN_PASSES, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int p = 0; p < SCAN_PASSES; p++)
+		found_hot += scanHot(&queues[p % QUEUE_COUNT], 1000 + p);
+
+	report(layout, "hot", count * SCAN_PASSES, elapsed(&start));
+
+	if (found_jobs != found_hot)
+		fprintf(stderr, "%s: scans disagree, %ld vs %ld\n", layout, found_jobs, found_hot);
+
+	for (size_t i = 0; i < server.jobTable.page_count; i++)
+		free(server.jobTable.pages[i]);
+
+	free(server.jobTable.pages);
+	free(server.jobTable.jobs);
+	free(server.jobTable.hot);
+	memset(&server.jobTable, 0, sizeof(struct jobTable));
+
+	freeJobSlabs();
+	free(jobs);
+}
+
+int main(int argc, char *argv[]) {
+	size_t default_counts[] = {1000000, 5000000};
+	int runs = argc > 1 ? argc - 1 : 2;
+
+	for (int r = 0; r < runs; r++) {
+		size_t count = argc > 1 ? strtoul(argv[r + 1], NULL, 10) : default_counts[r];
+
+		if (count == 0)
+			continue;
+
+		bench("ordered", count, 0);
+		bench("shuffled", count, 1);
+		printf("\n");
+	}
+
+	return 0;
+}
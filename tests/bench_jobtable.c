@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <server.h>
+
+/* Microbenchmark comparing the direct-indexed job table against the uthash
+ * table it replaced, with the hash handle embedded in the job as it was.
+ * Usage: bench_jobtable [job_count...], defaults to 1M, 5M and 10M jobs.
+ * Each run holds job_count jobs in memory, around 600 bytes apiece. */
+
+struct jersServer server = {0};
+
+char * server_log = "bench";
+int server_log_mode = JERS_LOG_CRITICAL;
+
+struct hashJob {
+	struct job job;
+	UT_hash_handle hh;
+};
+
+static double elapsed(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void report(const char *name, const char *op, size_t count, double ms) {
+	printf("%-8s %-8s %10zu jobs %10.1fms %8.1fns/job\n", name, op, count, ms, ms * 1000000.0 / count);
+}
+
+/* Visit the jobids in a random order, so lookups aren't helped by allocation order */
+static jobid_t * shuffledIDs(size_t count) {
+	jobid_t *ids = malloc(sizeof(jobid_t) * count);
+
+	for (size_t i = 0; i < count; i++)
+		ids[i] = i + 1;
+
+	srand(count);
+
+	for (size_t i = count - 1; i > 0; i--) {
+		size_t k = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+		jobid_t tmp = ids[i];
+		ids[i] = ids[k];
+		ids[k] = tmp;
+	}
+
+	return ids;
+}
+
+static void benchHash(size_t count, const jobid_t *ids) {
+	struct hashJob *jobs = calloc(count, sizeof(struct hashJob));
+	struct hashJob *table = NULL, *h;
+	struct timespec start;
+	int64_t found = 0;
+
+	if (jobs == NULL) {
+		fprintf(stderr, "Failed to allocate %zu jobs\n", count);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++) {
+		jobs[i].job.jobid = i + 1;
+		jobs[i].job.state = i & 1 ? JERS_JOB_HOLDING : JERS_JOB_COMPLETED;
+		HASH_ADD(hh, table, job.jobid, sizeof(jobid_t), &jobs[i]);
+	}
+
+	report("uthash", "insert", count, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++) {
+		HASH_FIND(hh, table, &ids[i], sizeof(jobid_t), h);
+		found += h != NULL;
+	}
+
+	report("uthash", "find", count, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (h = table; h; h = h->hh.next)
+		found += h->job.state == JERS_JOB_COMPLETED;
+
+	report("uthash", "scan", count, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++) {
+		HASH_FIND(hh, table, &ids[i], sizeof(jobid_t), h);
+		HASH_DEL(table, h);
+	}
+
+	report("uthash", "delete", count, elapsed(&start));
+
+	if (found != (int64_t)(count + count / 2))
+		fprintf(stderr, "uthash: unexpected result %ld\n", found);
+
+	free(jobs);
+}
+
+static void benchTable(size_t count, const jobid_t *ids) {
+	struct job *jobs = calloc(count, sizeof(struct job));
+	struct timespec start;
+	int64_t found = 0;
+
+	if (jobs == NULL) {
+		fprintf(stderr, "Failed to allocate %zu jobs\n", count);
+		exit(1);
+	}
+
+	server.max_jobid = count;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++) {
+		jobs[i].jobid = i + 1;
+		jobs[i].state = i & 1 ? JERS_JOB_HOLDING : JERS_JOB_COMPLETED;
+		jobTableAdd(&jobs[i]);
+	}
+
+	report("jobtable", "insert", count, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++)
+		found += findJob(ids[i]) != NULL;
+
+	report("jobtable", "find", count, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < server.jobTable.count; i++)
+		found += server.jobTable.jobs[i]->state == JERS_JOB_COMPLETED;
+
+	report("jobtable", "scan", count, elapsed(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < count; i++)
+		jobTableDel(findJob(ids[i]));
+
+	report("jobtable", "delete", count, elapsed(&start));
+
+	if (found != (int64_t)(count + count / 2))
+		fprintf(stderr, "jobtable: unexpected result %ld\n", found);
+
+	free(server.jobTable.pages);
+	free(server.jobTable.jobs);
+	free(server.jobTable.hot);
+	memset(&server.jobTable, 0, sizeof(struct jobTable));
+	free(jobs);
+}
+
+int main(int argc, char *argv[]) {
+	size_t default_counts[] = {1000000, 5000000, 10000000};
+	int runs = argc > 1 ? argc - 1 : 3;
+
+	for (int r = 0; r < runs; r++) {
+		size_t count = argc > 1 ? strtoul(argv[r + 1], NULL, 10) : default_counts[r];
+		jobid_t *ids;
+
+		if (count == 0)
+			continue;
+
+		ids = shuffledIDs(count);
+
+		benchHash(count, ids);
+		benchTable(count, ids);
+		printf("\n");
+
+		free(ids);
+	}
+
+	return 0;
+}
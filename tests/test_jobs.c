@@ -6,12 +6,27 @@
 struct jersServer server = {0};
 
 void clear_jobtable(void) {
-	struct job *j, *tmp;
+	for (size_t i = 0; i < server.jobTable.count; i++)
+		free(server.jobTable.jobs[i]);
 
-	HASH_ITER(hh, server.jobTable, j, tmp) {
-		HASH_DEL(server.jobTable, j);
-		free(j);
-	}
+	free(server.jobTable.jobs);
+	free(server.jobTable.hot);
+
+	for (size_t i = 0; i < server.jobTable.page_count; i++)
+		free(server.jobTable.pages[i]);
+
+	free(server.jobTable.pages);
+	memset(&server.jobTable, 0, sizeof(struct jobTable));
+
+	freeJobIDs();
+}
+
+/* Add a job straight to the job table, marking its jobid as in use */
+static void add_test_job(jobid_t jobid) {
+	struct job *j = calloc(1, sizeof(struct job));
+	j->jobid = jobid;
+	jobTableAdd(j);
+	reserveJobID(jobid);
 }
 
 static void test_jobids(void) {
@@ -42,9 +57,7 @@ static void test_jobids(void) {
 			}
 		}
 		
-		struct job *j = calloc(1, sizeof(struct job));
-		j->jobid = newid;
-		HASH_ADD_INT(server.jobTable, jobid, j);
+		add_test_job(newid);
 
 		previd = newid;
 	}
@@ -80,9 +93,7 @@ static void test_jobids(void) {
 			}
 		}
 
-		struct job *j = calloc(1, sizeof(struct job));
-		j->jobid = newid;
-		HASH_ADD_INT(server.jobTable, jobid, j);
+		add_test_job(newid);
 
 		previd = newid;
 	}
@@ -106,9 +117,7 @@ static void test_jobids(void) {
 		struct job *search = findJob(id);
 
 		if (search == NULL) {
-			struct job * j = calloc(1, sizeof(struct job));
-			j->jobid = id;
-			HASH_ADD_INT(server.jobTable, jobid, j);
+			add_test_job(id);
 			used++;
 		}
 	}
@@ -127,9 +136,7 @@ static void test_jobids(void) {
 			}
 		}
 
-		struct job *j = calloc(1, sizeof(struct job));
-		j->jobid = newid;
-		HASH_ADD_INT(server.jobTable, jobid, j);
+		add_test_job(newid);
 	}
 
 	TEST("JobID allocation - fill in", status != 0);
@@ -151,10 +158,329 @@ static void test_jobids(void) {
 
 	TEST("findJob", status != 0);
 	clear_jobtable();
+
+	/* Allocate a batch of jobids, skipping those in use and those excluded */
+	memset(&server, 0, sizeof(struct jersServer));
+	server.start_jobid = 9990;
+	server.max_jobid = 9999;
+
+	jobid_t in_use[] = {9992, 2};
+	jobid_t exclude[] = {1, 9995};
+	jobid_t expected[] = {9991, 9993, 9994, 9996, 9997, 9998, 9999, 3, 4};
+	jobid_t ids[9];
+
+	for (int i = 0; i < 2; i++)
+		add_test_job(in_use[i]);
+
+	if (allocateJobIDs(9, ids, exclude, 2) != 9 || memcmp(ids, expected, sizeof(ids)) != 0 || server.start_jobid != 4) {
+		DEBUG("Batch of jobids not allocated as expected");
+		status = 1;
+	}
+
+	TEST("JobID allocation - batch", status != 0);
+	clear_jobtable();
+
+	/* Find the few free jobids left in a large, nearly full range */
+	memset(&server, 0, sizeof(struct jersServer));
+	server.max_jobid = 9999999;
+
+	for (jobid_t id = 1; id <= server.max_jobid; id++) {
+		if (id != 3 && id != 5000000 && id != 9999999)
+			reserveJobID(id);
+	}
+
+	if (getNextJobID() != 3 || getNextJobID() != 5000000 || getNextJobID() != 9999999)
+		status = 1;
+
+	reserveJobID(3);
+	reserveJobID(5000000);
+	reserveJobID(9999999);
+
+	if (getNextJobID() != 0)
+		status = 1;
+
+	/* A released jobid is reused once the allocator wraps back around to it */
+	releaseJobID(4096);
+
+	if (getNextJobID() != 4096)
+		status = 1;
+
+	TEST("JobID allocation - nearly full range", status != 0);
+	clear_jobtable();
+}
+
+/* Deleted jobs are cleaned up in the order they were deleted, once they have been saved */
+static void test_cleanup(void) {
+	struct queue *q = calloc(1, sizeof(struct queue));
+	struct job *jobs[5];
+	int status = 0;
+
+	memset(&server, 0, sizeof(struct jersServer));
+	server.max_jobid = 9999;
+
+	for (int i = 0; i < 5; i++) {
+		jobs[i] = calloc(1, sizeof(struct job));
+		jobs[i]->jobid = i + 1;
+		jobs[i]->queue = q;
+		jobs[i]->state = JERS_JOB_HOLDING;
+		addJob(jobs[i], 0);
+		deleteJob(jobs[i]);
+	}
+
+	/* Nothing can be cleaned up until the deletions have been saved */
+	if (cleanupJobs(10) != 0)
+		status = 1;
+
+	jobs[0]->obj.dirty = jobs[1]->obj.dirty = jobs[3]->obj.dirty = 0;
+
+	if (cleanupJobs(10) != 2 || server.deleted != 3 || server.deletedJobs != jobs[2] || server.jobTable.count != 3)
+		status = 1;
+
+	jobs[2]->obj.dirty = jobs[4]->obj.dirty = 0;
+
+	if (cleanupJobs(2) != 2 || server.deletedJobs != jobs[4] || cleanupJobs(10) != 1 || server.deletedJobs != NULL || server.jobTable.count != 0)
+		status = 1;
+
+	TEST("Cleanup - Deleted jobs cleaned up in order", status != 0);
+
+	clear_jobtable();
+	free(q);
+}
+
+/* Jobs spread over several pages can be found, and removing one keeps the rest findable */
+static void test_jobtable(void) {
+	jobid_t ids[] = {1, 2, JOBTABLE_PAGE_SIZE - 1, JOBTABLE_PAGE_SIZE, 5 * JOBTABLE_PAGE_SIZE + 7, 9999999};
+	int count = sizeof(ids) / sizeof(ids[0]);
+	int status = 0;
+
+	memset(&server, 0, sizeof(struct jersServer));
+	server.max_jobid = 9999999;
+
+	for (int i = 0; i < count; i++)
+		add_test_job(ids[i]);
+
+	for (int i = 0; i < count; i++) {
+		if (findJob(ids[i]) == NULL || findJob(ids[i])->jobid != ids[i])
+			status = 1;
+	}
+
+	if (findJob(3) || findJob(4 * JOBTABLE_PAGE_SIZE) || findJob(UINT32_MAX))
+		status = 1;
+
+	/* Remove the first job, the last job in the dense array takes its place */
+	struct job *j = findJob(1);
+	jobTableDel(j);
+	free(j);
+
+	if (findJob(1) || server.jobTable.count != (size_t)count - 1 || server.jobTable.jobs[0]->jobid != 9999999 ||
+		findJob(9999999)->table_index != 0)
+		status = 1;
+
+	/* Emptying a page frees it */
+	j = findJob(5 * JOBTABLE_PAGE_SIZE + 7);
+	jobTableDel(j);
+	free(j);
+
+	if (server.jobTable.pages[5] != NULL)
+		status = 1;
+
+	TEST("Job table - Lookup and removal across pages", status != 0);
+	clear_jobtable();
+}
+
+/* Each job's hot record follows it around the dense array */
+static void test_jobhot(void) {
+	int status = 0;
+
+	memset(&server, 0, sizeof(struct jersServer));
+	server.max_jobid = 100;
+
+	for (jobid_t id = 1; id <= 3; id++)
+		add_test_job(id);
+
+	struct job *j = findJob(3);
+	j->state = JERS_JOB_COMPLETED;
+	j->uid = 1000;
+	j->finish_time = 12345;
+	j->internal_state |= JERS_FLAG_DELETED;
+	updateJobHot(j);
+
+	/* Removing the first job moves the last one, and its hot record, into its place */
+	j = findJob(1);
+	jobTableDel(j);
+	free(j);
+
+	struct jobHot *h = &server.jobTable.hot[findJob(3)->table_index];
+
+	if (findJob(3)->table_index != 0 || h->jobid != 3 || h->state != JERS_JOB_COMPLETED ||
+		h->uid != 1000 || h->finish_time != 12345 || h->deleted == 0)
+		status = 1;
+
+	if (server.jobTable.hot[1].jobid != 2 || server.jobTable.hot[1].deleted)
+		status = 1;
+
+	TEST("Job table - Hot records", status != 0);
+	clear_jobtable();
+}
+
+/* A packed job keeps its strings, and strings changed afterwards are freed on their own */
+static void test_pack(void) {
+	struct resource r = {.name = "res"};
+	char *argv[] = {"/bin/echo", "hello", NULL};
+	key_val_t tags[] = {{"key", "value"}, {"empty", NULL}};
+	int status = 0;
+
+	memset(&server, 0, sizeof(struct jersServer));
+
+	struct job *j = allocJob();
+	j->jobid = 1;
+	j->jobname = strdup("packed");
+	j->stdout = strdup("/tmp/packed.out");
+	j->argc = 2;
+	j->argv = malloc(sizeof(char *) * 3);
+	j->argv[0] = strdup(argv[0]);
+	j->argv[1] = strdup(argv[1]);
+	j->tag_count = 2;
+	j->tags = malloc(sizeof(key_val_t) * 2);
+	j->tags[0].key = strdup(tags[0].key);
+	j->tags[0].value = strdup(tags[0].value);
+	j->tags[1].key = strdup(tags[1].key);
+	j->tags[1].value = NULL;
+	j->res_count = 1;
+	j->req_resources = calloc(1, sizeof(struct jobResource));
+	j->req_resources[0].res = &r;
+	j->req_resources[0].needed = 2;
+
+	packJob(j);
+
+	if (j->arena == NULL || !jobArenaOwns(j, j->jobname) || !jobArenaOwns(j, j->argv) || !jobArenaOwns(j, j->tags[0].value))
+		status = 1;
+
+	if (strcmp(j->jobname, "packed") || strcmp(j->stdout, "/tmp/packed.out") || j->shell != NULL ||
+		strcmp(j->argv[0], argv[0]) || strcmp(j->argv[1], argv[1]) ||
+		strcmp(j->tags[0].key, "key") || strcmp(j->tags[0].value, "value") || j->tags[1].value != NULL ||
+		j->req_resources[0].res != &r || j->req_resources[0].needed != 2)
+		status = 1;
+
+	/* Replace a field after packing, it gets freed separately from the arena */
+	freeJobString(j, j->jobname);
+	j->jobname = strdup("renamed");
+
+	if (jobArenaOwns(j, j->jobname))
+		status = 1;
+
+	/* The freed job is reused by the next allocation */
+	freeJob(j);
+
+	if (allocJob() != j || server.stats.memory.job_slabs != 1)
+		status = 1;
+
+	TEST("Job allocation - Packed strings", status != 0);
+
+	freeJobSlabs();
+}
+
+/* Jobs with the same shell and tag keys share a single copy of them */
+static void test_intern(void) {
+	struct job *jobs[2];
+	int status = 0;
+
+	memset(&server, 0, sizeof(struct jersServer));
+
+	for (int i = 0; i < 2; i++) {
+		struct job *j = allocJob();
+		j->jobid = i + 1;
+		j->shell = strdup("/bin/bash");
+		j->stdout = strdup(i ? "/tmp/two.out" : "/tmp/one.out");
+		j->tag_count = 1;
+		j->tags = malloc(sizeof(key_val_t));
+		j->tags[0].key = strdup("key");
+		j->tags[0].value = strdup(i ? "two" : "one");
+
+		packJob(j);
+		jobs[i] = j;
+	}
+
+	if (jobs[0]->shell != jobs[1]->shell || jobs[0]->tags[0].key != jobs[1]->tags[0].key ||
+		jobs[0]->stdout == jobs[1]->stdout || strcmp(jobs[1]->stdout, "/tmp/two.out"))
+		status = 1;
+
+	if (server.stats.memory.interned != 4 || server.stats.memory.intern_refs != 6)
+		status = 1;
+
+	/* The shared strings are only freed with the last job referencing them */
+	freeJob(jobs[0]);
+
+	if (server.stats.memory.interned != 3 || server.stats.memory.intern_refs != 3 || strcmp(jobs[1]->shell, "/bin/bash"))
+		status = 1;
+
+	freeJob(jobs[1]);
+
+	if (server.stats.memory.interned != 0 || server.stats.memory.interned_bytes != 0 || server.stats.memory.intern_refs != 0)
+		status = 1;
+
+	TEST("Job allocation - Interned strings", status != 0);
+
+	freeJobSlabs();
+}
+
+/* Jobs with the same environment share one profile, which is kept until unused */
+static void test_envprofile(void) {
+	char *envs[] = {"A=1", "B=2"};
+	char *copy[] = {"A=1", "B=2"};
+	char *overrides[] = {"B=3", "C=4"};
+	char *merged[4];
+	char hash[ENVPROFILE_HASH_SIZE];
+	struct envProfile *p;
+	int created = 0, status = 0;
+
+	memset(&server, 0, sizeof(struct jersServer));
+	server.nosave = 1;
+
+	p = addEnvProfile(2, envs, &created);
+	envProfileHash(2, envs, hash);
+
+	/* New profiles are left for the next save to write out */
+	if (p == NULL || created != 1 || p->dirty != 1 || server.dirty_envprofiles != 1)
+		status = 1;
+
+	if (addEnvProfile(2, copy, &created) != p || created != 0 || findEnvProfile(hash) != p || strcmp(p->hash, hash))
+		status = 1;
+
+	/* Invalid hashes are never looked up */
+	if (findEnvProfile("../profile") != NULL)
+		status = 1;
+
+	holdEnvProfile(p);
+	holdEnvProfile(p);
+	releaseEnvProfile(p);
+
+	if (p->refs != 1 || server.unusedEnvProfiles != NULL || cleanupEnvProfiles(10) != 0)
+		status = 1;
+
+	/* Overrides replace the profile variable with the same name */
+	if (mergeEnv(p->env_count, p->envs, 2, overrides, merged) != 3 ||
+		strcmp(merged[0], "B=3") || strcmp(merged[1], "C=4") || strcmp(merged[2], "A=1"))
+		status = 1;
+
+	releaseEnvProfile(p);
+
+	if (server.unusedEnvProfiles != p || cleanupEnvProfiles(10) != 1 || findEnvProfile(hash) != NULL)
+		status = 1;
+
+	TEST("Job allocation - Environment profiles", status != 0);
+
+	freeEnvProfiles();
 }
 
 void test_jobs(void) {
 	test_jobids();
+	test_cleanup();
+	test_jobtable();
+	test_jobhot();
+	test_pack();
+	test_intern();
+	test_envprofile();
 
 
 }
\ No newline at end of file
@@ -361,6 +361,38 @@ int test_json5_2(void) {
 	return status;
 }
 
+/* Objects started in an array have to survive the buffer growing underneath them */
+int test_json5_3(void) {
+	int status = 0;
+	buff_t b = {0};
+	buff_t expected = {0};
+
+	buffAdd(&expected, "{\"DATA\":[", 9);
+
+	JSONStart(&b);
+	JSONStartArray(&b, "DATA", 4);
+
+	for (int i = 0; i < 1000; i++) {
+		JSONStartObject(&b, NULL, 0);
+		JSONAddInt(&b, JOBID, i);
+		JSONEndObject(&b);
+
+		char obj[32];
+		int len = sprintf(obj, "%s{\"JOBID\":%d}", i ? "," : "", i);
+		buffAdd(&expected, obj, len);
+	}
+
+	buffAdd(&expected, "]}\n", 4);
+
+	JSONEndArray(&b);
+	JSONEnd(&b);
+
+	status = cmp_json(&b, expected.data, expected.used - 1);
+	buffFree(&b);
+	buffFree(&expected);
+	return status;
+}
+
 int test_json6(void) {
 	int status = 0;
 	buff_t b = {0};
@@ -912,7 +944,8 @@ int test_msg_1(void) {
 	}
 
 	free_message(&loaded);
-	free_message(&expected);
+	free(expected.msg_cpy);
+	free(expected.error);
 
 	return 0;
 }
@@ -943,7 +976,8 @@ int test_msg_2(void) {
 	}
 
 	free_message(&loaded);
-	free_message(&expected);
+	free(expected.msg_cpy);
+	free(expected.error);
 
 	return 0;
 }
@@ -994,6 +1028,125 @@ int test_msg_returncode_2(void) {
 	return 0;
 }
 
+/* Messages reuse their arena, with the strings pointing into the request */
+static int loadArgs(msg_t *m, char *json, int64_t expected) {
+	char *copy = strdup(json);
+	field *f;
+
+	if (load_message(json, m) != 0) {
+		printf("Failed to load message\n");
+		return 1;
+	}
+
+	if (strcmp(m->msg_cpy, copy) != 0) {
+		printf("msg_cpy doesn't match the original request\n");
+		return 1;
+	}
+
+	free(copy);
+
+	if (m->command == NULL || strcmp(m->command, "ADD_JOB") != 0 || m->item_count != 1 || m->items[0].field_count != 2) {
+		printf("Message not loaded as expected\n");
+		return 1;
+	}
+
+	f = &m->items[0].fields[0];
+
+	if (f->number != ARGS || f->value.string_array.count != expected) {
+		printf("Expected %ld args\n", expected);
+		return 1;
+	}
+
+	for (int64_t i = 0; i < expected; i++) {
+		char arg[32];
+		sprintf(arg, "arg%ld", i);
+
+		if (strcmp(f->value.string_array.strings[i], arg) != 0 || f->value.string_array.strings[i] < json || f->value.string_array.strings[i] > json + strlen(m->msg_cpy)) {
+			printf("Arg %ld not loaded in place\n", i);
+			return 1;
+		}
+	}
+
+	f = &m->items[0].fields[1];
+
+	if (f->number != TAGS || f->value.map.count != 1 || strcmp(f->value.map.keys[0].key, "key") != 0 || strcmp(f->value.map.keys[0].value, "value") != 0) {
+		printf("Tags not loaded as expected\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static char * argsMessage(int64_t count) {
+	char *json = malloc(count * 16 + 128);
+	char *pos = json;
+
+	pos += sprintf(pos, "{\"ADD_JOB\":{\"VERSION\":1,\"FIELDS\":{\"ARGS\":[");
+
+	for (int64_t i = 0; i < count; i++)
+		pos += sprintf(pos, "%s\"arg%ld\"", i ? "," : "", i);
+
+	sprintf(pos, "],\"TAGS\":{\"key\":\"value\"}}}}");
+
+	return json;
+}
+
+int test_msg_arena(void) {
+	msg_t m = {0};
+	struct msgArenaBlock *block;
+	char *json;
+
+	json = argsMessage(2);
+
+	if (loadArgs(&m, json, 2))
+		return 1;
+
+	free(json);
+	block = m.arena.head;
+	reset_message(&m);
+
+	if (m.arena.head != block || m.msg_cpy || m.items || m.item_count) {
+		printf("Expected the arena to be kept when the message is reset\n");
+		return 1;
+	}
+
+	/* Loading a larger message spills over into more blocks */
+	json = argsMessage(1000);
+
+	if (loadArgs(&m, json, 1000))
+		return 1;
+
+	if (m.arena.head == block || m.arena.head->next == NULL) {
+		printf("Expected the arena to grow\n");
+		return 1;
+	}
+
+	free(json);
+	reset_message(&m);
+
+	/* Which are replaced by a single block big enough for the next one */
+	json = argsMessage(1000);
+
+	if (loadArgs(&m, json, 1000))
+		return 1;
+
+	free(json);
+
+	if (m.arena.head->next != NULL) {
+		printf("Expected a single block after the arena was reset\n");
+		return 1;
+	}
+
+	free_message(&m);
+
+	if (m.arena.head != NULL) {
+		printf("Expected the arena to be freed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
 void test_json(void) {
 
 	/* Test we can construct a simple JSON object with a few different fields */
@@ -1003,6 +1156,7 @@ void test_json(void) {
 	TEST("Create JSON object with single field", test_json4());
 	TEST("Create JSON object with array", test_json5());
 	TEST("Create JSON object with empty array", test_json5_2());
+	TEST("Create JSON array with many objects", test_json5_3());
 	TEST("Create JSON object with multiple fields", test_json6());
 	TEST("Create JSON object with string field requiring escaping", test_json7());
 	TEST("Create JSON object with string field requiring lots of escaping", test_json8());
@@ -1036,5 +1190,6 @@ void test_json(void) {
 	TEST("Load Error message, unescaping", test_msg_2());
 	TEST("Load returncode response '0'", test_msg_returncode_1());
 	TEST("Load returncode response '1'", test_msg_returncode_2());
+	TEST("Reload message into its arena", test_msg_arena());
 
 }
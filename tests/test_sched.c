@@ -1,15 +1,54 @@
 #include <stdio.h>
+#include <unistd.h>
 
 #include <jers_tests.h>
 #include <server.h>
 
-void generateCandidatePool(void);
 void releaseDeferred(void);
 void clear_jobtable(void);
 
-int test_generateCandidatePool(void) {
+static int check_candidate_order(jobid_t *expected_order, int64_t expected_count, int runnable_only) {
+	int64_t count = 0;
 	int status = 0;
-	/* The expected order of jobs after the pool is generated */
+	struct job *j;
+
+	for (j = firstCandidate(runnable_only); j != NULL; j = nextCandidate()) {
+		if (count >= expected_count || expected_order[count] != j->jobid)
+			status = 1;
+
+		count++;
+	}
+
+	if (count != expected_count)
+		status = 1;
+
+	if (status) {
+		printf("Candidates are not in the expected order. Expected:\n");
+		for (int i = 0; i < expected_count; i++) {
+			printf("[%d] = %d\n", i, expected_order[i]);
+		}
+
+		printf("Got:\n");
+		count = 0;
+		for (j = firstCandidate(runnable_only); j != NULL; j = nextCandidate()) {
+			printf("[%ld] = %d QueuePriority:%d Priority:%d\n", count++,
+				   j->jobid, j->queue->priority, j->priority);
+		}
+	}
+
+	return status;
+}
+
+static void clear_queues(struct queue *q, int count) {
+	for (int i = 0; i < count; i++) {
+		HASH_DEL(server.queueTable, &q[i]);
+		free(q[i].candidates.jobs);
+	}
+}
+
+int test_candidateOrder(void) {
+	int status = 0;
+	/* The expected order of jobs walking the candidate heaps */
 	jobid_t expected_order[] = {500, 12, 1020, 32, 10, 5};
 	int64_t expected_count = 6;
 
@@ -20,39 +59,259 @@ int test_generateCandidatePool(void) {
 		{.name = "test_queue3", .priority = 5, .job_limit = 1}	 // Second
 	};
 
-/* Add a whole bunch of jobs */
+	for (int i = 0; i < 3; i++)
+		HASH_ADD_KEYPTR(hh, server.queueTable, q[i].name, strlen(q[i].name), &q[i]);
+
 #include <_test_gen_jobs.c>
 
-	generateCandidatePool();
+	if (check_candidate_order(expected_order, expected_count, 0)) {
+		status = 1;
+		goto end;
+	}
+
+	/* Bump the priority of a job, then hold another */
+	jobid_t updated_order[] = {500, 12, 1020, 5, 10};
 
-	if (server.candidate_pool_jobs != expected_count) {
-		DEBUG("Incorrect number of jobs in candidate pool. Expected:%ld Got:%ld\n", expected_count, server.candidate_pool_jobs);
+	j = findJob(5);
+	j->priority = 200;
+	updateCandidate(j);
+
+	changeJobState(findJob(32), JERS_JOB_HOLDING, NULL, 0);
+
+	if (check_candidate_order(updated_order, 5, 0)) {
 		status = 1;
 		goto end;
 	}
 
-	for (int i = 0; i < server.candidate_pool_jobs; i++) {
-		if (expected_order[i] != server.candidate_pool[i]->jobid) {
-			printf("Candidate pool is not in the expected order. Expected:\n");
-			for (int j = 0; j < expected_count; j++) {
-				printf("[%d] = %d\n", j, expected_order[j]);
-			}
+end:
+	clear_jobtable();
+	clear_queues(q, 3);
+	memset(&server.stats, 0, sizeof(server.stats));
+	return status;
+}
 
-			printf("Got:\n");
-			for (int j = 0; j < expected_count; j++) {
-				printf("[%d] = %d QueuePriority:%d Priority:%d\n", j,
-					   server.candidate_pool[j]->jobid,
-					   server.candidate_pool[j]->queue->priority,
-					   server.candidate_pool[j]->priority);
-			}
+int test_runnableCandidates(void) {
+	int status = 0;
+	agent a = {.logged_in = 1};
 
-			status = 1;
-			goto end;
-		}
+	/* Only the started queues with an agent have runnable candidates */
+	struct queue q[] = {
+		{.name = "test_queue1", .priority = 1, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a},
+		{.name = "test_queue2", .priority = 10, .job_limit = 5, .state = JERS_QUEUE_FLAG_STARTED},
+		{.name = "test_queue3", .priority = 5, .job_limit = 1}
+	};
+
+	for (int i = 0; i < 3; i++)
+		HASH_ADD_KEYPTR(hh, server.queueTable, q[i].name, strlen(q[i].name), &q[i]);
+
+#include <_test_gen_jobs.c>
+
+	jobid_t expected_order[] = {10, 5};
+
+	if (check_candidate_order(expected_order, 2, 1)) {
+		status = 1;
+		goto end;
+	}
+
+	if (getPendReason(findJob(500)) != JERS_PEND_AGENTDOWN || getPendReason(findJob(12)) != JERS_PEND_QUEUESTOPPED) {
+		printf("Unexpected pend reason\n");
+		status = 1;
+		goto end;
 	}
 
 end:
 	clear_jobtable();
+	clear_queues(q, 3);
+	memset(&server.stats, 0, sizeof(server.stats));
+	return status;
+}
+
+static int64_t count_waiters(struct resource *r) {
+	int64_t count = 0;
+
+	for (struct resWaitList *w = r->waiters; w != NULL; w = w->next)
+		count += w->jobs.count;
+
+	return count;
+}
+
+int test_resourceWaiters(void) {
+	int status = 0;
+	agent a = {.logged_in = 1};
+	struct queue q = {.name = "test_queue", .priority = 1, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a};
+	struct resource r = {.name = "test_res", .count = 2, .in_use = 2};
+	struct jobResource res[3] = {{1, &r}, {1, &r}, {2, &r}};
+	jobid_t ids[3] = {10, 20, 30};
+	int priorities[3] = {100, 50, 200};
+
+	HASH_ADD_KEYPTR(hh, server.queueTable, q.name, strlen(q.name), &q);
+	HASH_ADD_KEYPTR(hh, server.resTable, r.name, strlen(r.name), &r);
+	server.max_run_jobs = UNLIMITED_JOBS;
+
+	for (int i = 0; i < 3; i++) {
+		struct job *j = calloc(1, sizeof(struct job));
+		j->jobid = ids[i];
+		j->queue = &q;
+		j->priority = priorities[i];
+		j->state = JERS_JOB_PENDING;
+		j->res_count = 1;
+		j->req_resources = &res[i];
+		addJob(j, 0);
+	}
+
+	/* None of the jobs can start, so they should all be parked on the resource */
+	checkJobs();
+
+	if (q.candidates.count != 0 || count_waiters(&r) != 3) {
+		printf("Expected 3 jobs waiting on the resource, got %ld (%ld still in queue)\n", count_waiters(&r), q.candidates.count);
+		status = 1;
+		goto end;
+	}
+
+	/* Releasing one unit should only wake the highest priority job that fits */
+	r.in_use = 1;
+	wakeResourceWaiters(&r);
+
+	jobid_t expected_order[] = {10};
+
+	if (count_waiters(&r) != 2 || check_candidate_order(expected_order, 1, 0)) {
+		status = 1;
+		goto end;
+	}
+
+end:
+	for (size_t i = 0; i < server.jobTable.count; i++)
+		server.jobTable.jobs[i]->req_resources = NULL;
+
+	clear_jobtable();
+	clear_queues(&q, 1);
+	HASH_DEL(server.resTable, &r);
+
+	while (r.waiters) {
+		struct resWaitList *next = r.waiters->next;
+		free(r.waiters->jobs.jobs);
+		free(r.waiters);
+		r.waiters = next;
+	}
+	memset(&server.stats, 0, sizeof(server.stats));
+	return status;
+}
+
+/* A job waiting on a resource in a queue that can't start anything shouldn't hold back
+ * a lower priority job waiting on the same resource in a queue that can */
+int test_resourceWaitersBlockedQueue(void) {
+	int status = 0;
+	agent a = {.logged_in = 1};
+	struct queue q[] = {
+		{.name = "test_queue1", .priority = 1, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a},
+		{.name = "test_queue2", .priority = 1, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED, .agent = &a}
+	};
+	struct resource r = {.name = "test_res", .count = 1, .in_use = 1};
+	struct jobResource res[2] = {{1, &r}, {1, &r}};
+	jobid_t ids[2] = {10, 20};
+	int priorities[2] = {200, 100};
+
+	for (int i = 0; i < 2; i++)
+		HASH_ADD_KEYPTR(hh, server.queueTable, q[i].name, strlen(q[i].name), &q[i]);
+
+	HASH_ADD_KEYPTR(hh, server.resTable, r.name, strlen(r.name), &r);
+	server.max_run_jobs = UNLIMITED_JOBS;
+
+	for (int i = 0; i < 2; i++) {
+		struct job *j = calloc(1, sizeof(struct job));
+		j->jobid = ids[i];
+		j->queue = &q[i];
+		j->priority = priorities[i];
+		j->state = JERS_JOB_PENDING;
+		j->res_count = 1;
+		j->req_resources = &res[i];
+		addJob(j, 0);
+	}
+
+	checkJobs();
+
+	if (count_waiters(&r) != 2) {
+		printf("Expected 2 jobs waiting on the resource, got %ld\n", count_waiters(&r));
+		status = 1;
+		goto end;
+	}
+
+	/* Fill the queue of the higher priority job, then release the resource */
+	q[0].stats.running = q[0].job_limit;
+	r.in_use = 0;
+	wakeResourceWaiters(&r);
+
+	jobid_t expected_order[] = {20};
+
+	if (count_waiters(&r) != 0 || check_candidate_order(expected_order, 1, 1)) {
+		printf("Expected both jobs to be woken, with only job 20 runnable. %ld still waiting\n", count_waiters(&r));
+		status = 1;
+		goto end;
+	}
+
+end:
+	for (size_t i = 0; i < server.jobTable.count; i++)
+		server.jobTable.jobs[i]->req_resources = NULL;
+
+	clear_jobtable();
+	clear_queues(q, 2);
+	HASH_DEL(server.resTable, &r);
+
+	while (r.waiters) {
+		struct resWaitList *next = r.waiters->next;
+		free(r.waiters->jobs.jobs);
+		free(r.waiters);
+		r.waiters = next;
+	}
+	memset(&server.stats, 0, sizeof(server.stats));
+	return status;
+}
+
+int test_scheduleRequests(void) {
+	int status = 0;
+	struct queue q = {.name = "test_queue", .priority = 1, .job_limit = 10, .state = JERS_QUEUE_FLAG_STARTED};
+	struct job *j = calloc(1, sizeof(struct job));
+
+	HASH_ADD_KEYPTR(hh, server.queueTable, q.name, strlen(q.name), &q);
+	server.max_run_jobs = UNLIMITED_JOBS;
+	server.sched_pending = 0;
+
+	j->jobid = 10;
+	j->queue = &q;
+	j->state = JERS_JOB_HOLDING;
+	addJob(j, 0);
+
+	/* Releasing the hold should ask for a scheduling pass */
+	changeJobState(j, JERS_JOB_PENDING, NULL, 0);
+
+	if (server.sched_pending != 1) {
+		printf("Releasing a held job did not request a scheduling pass\n");
+		status = 1;
+		goto end;
+	}
+
+	/* A pass covers all the requests made before it */
+	checkJobs();
+
+	if (server.sched_pending != 0) {
+		printf("Scheduling request still pending after a scheduling pass\n");
+		status = 1;
+		goto end;
+	}
+
+	/* Holding a pending job can't let anything else start */
+	changeJobState(j, JERS_JOB_HOLDING, NULL, 0);
+
+	if (server.sched_pending != 0) {
+		printf("Holding a job requested a scheduling pass\n");
+		status = 1;
+		goto end;
+	}
+
+end:
+	clear_jobtable();
+	clear_queues(&q, 1);
+	memset(&server.stats, 0, sizeof(server.stats));
 	return status;
 }
 
@@ -60,90 +319,138 @@ int test_releaseDeferred(void) {
 	int status = 0;
 	jobid_t expected_pend[] = {5, 10, 32, 500};
 	int64_t expected_pend_count = 4;
-
-	jobid_t expected_defer[] = {10, 5, 500, 32, 12, 1020, 1001};
 	int64_t expected_defer_count = 7;
 
-/* Load the jobs */
 #include <_test_gen_jobs2.c>
 
-	int64_t count = 0;
-
-	/* Check the jobs loaded into the deferred linked list in order */
-	for (struct job *j = server.deferred_list; j; j = j->deferred_next)
-	{
-		if (j->deferred_next) {
-			if (j->deferred_next->defer_time < j->defer_time) {
-				printf("Unexpected defer time order:\n");
-				printf("Current - jobid:%u defer_time:%ld\n", j->jobid, j->defer_time);
-				printf("Next    - jobid:%u defer_time:%ld\n", j->deferred_next->jobid, j->deferred_next->defer_time);
-				status = 1;
-				goto end;
-			}
-		}
-
-		count++;
+	if (server.deferred.count != expected_defer_count) {
+		printf("Unexpected number of jobs in deferred wheel, expected %ld, got %ld\n", expected_defer_count, server.deferred.count);
+		status = 1;
+		goto end;
 	}
 
-	if (count != expected_defer_count)
-	{
-		printf("Unexpected number of jobs in deferred list, expected %ld, got %ld\n", expected_pend_count, count);
+	/* Make sure the jobs due this second get released */
+	sleep(1);
+	releaseDeferred();
+
+	if (server.deferred.count != expected_defer_count - expected_pend_count) {
+		printf("Unexpected number of jobs in deferred wheel after release, expected %ld, got %ld\n",
+			expected_defer_count - expected_pend_count, server.deferred.count);
 		status = 1;
 		goto end;
 	}
 
-	releaseDeferred();
+	/* Check the expected jobs are now the only ones pending */
+	for (size_t k = 0; k < server.jobTable.count; k++) {
+		j = server.jobTable.jobs[k];
+
+		if (j->internal_state & JERS_FLAG_DELETED || j->state == JERS_JOB_HOLDING)
+			continue;
+
+		int released = 0;
 
-	/* After releasing the jobs, they should have been removed from the linked list */
-	for (struct job *j = server.deferred_list; j; j = j->deferred_next)
-	{
-		/* Check if it should be in the list at all */
 		for (int i = 0; i < expected_pend_count; i++) {
 			if (expected_pend[i] == j->jobid)
-			{
-				printf("Error - Released job %d was in the deferred list\n", j->jobid);
-				status = 1;
-				goto end;
-			}
+				released = 1;
 		}
 
-		if (j->deferred_next) {
-			if (j->deferred_next->defer_time < j->defer_time) {
-				printf("Unexpected defer time order (after release):\n");
-				printf("Current - jobid:%u defer_time:%ld\n", j->jobid, j->defer_time);
-				printf("Next    - jobid:%u defer_time:%ld\n", j->deferred_next->jobid, j->deferred_next->defer_time);
-				status = 1;
-				goto end;
-			}
+		if (released && (j->state != JERS_JOB_PENDING || j->deferred_slot != NULL)) {
+			printf("Job %d was not released\n", j->jobid);
+			status = 1;
+			goto end;
+		}
+
+		if (!released && (j->state != JERS_JOB_DEFERRED || j->deferred_slot == NULL)) {
+			printf("Job %d was released early\n", j->jobid);
+			status = 1;
+			goto end;
 		}
 	}
 
-	/* Check the expected jobs are now the only ones pending */
-	for (j = server.jobTable; j; j = j->hh.next) {
-		if (j->state != JERS_JOB_PENDING || j->internal_state & JERS_FLAG_DELETED)
-			continue;
+	/* A deleted job should come out of the wheel */
+	j = findJob(12);
+	removeDeferredJob(j);
 
-		int i;
-		for (i = 0; i < expected_defer_count; i++) {
-			if (expected_defer[i] == j->jobid)
-				break;
+	if (server.deferred.count != expected_defer_count - expected_pend_count - 1) {
+		printf("Removed job is still counted in the deferred wheel\n");
+		status = 1;
+		goto end;
+	}
+
+end:
+	clear_jobtable();
+	memset(&server.deferred, 0, sizeof(server.deferred));
+	return status;
+}
+
+int test_deferWheelCascade(void) {
+	int status = 0;
+	struct job jobs[3];
+	time_t now = time(NULL);
+	time_t offsets[3] = {300, 70000, 20000000};
+
+	memset(jobs, 0, sizeof(jobs));
+	memset(&server.deferred, 0, sizeof(server.deferred));
+
+	/* One job in each level of the wheel */
+	for (int i = 0; i < 3; i++) {
+		jobs[i].jobid = i + 1;
+		jobs[i].defer_time = now + offsets[i];
+		addDeferredJob(&jobs[i]);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		if (expireDeferredJobs(now + offsets[i] - 1) != NULL) {
+			printf("Job %d released early\n", jobs[i].jobid);
+			status = 1;
+			break;
 		}
 
-		if (i >= expected_defer_count) {
-			printf("Got unexpected pending job %d\n", j->jobid);
+		struct job *j = expireDeferredJobs(now + offsets[i]);
+
+		if (j != &jobs[i] || j->deferred_next != NULL) {
+			printf("Job %d not released at its defer time\n", jobs[i].jobid);
 			status = 1;
-			goto end;
+			break;
 		}
 	}
 
-	/* Check the queue counts are correct */
+	memset(&server.deferred, 0, sizeof(server.deferred));
+	return status;
+}
+
+/* A job cascaded down the wheel on the second it's due is released on that second */
+int test_deferWheelBoundary(void) {
+	int status = 0;
+	struct job job;
+	time_t now = time(NULL);
+
+	memset(&job, 0, sizeof(job));
+	memset(&server.deferred, 0, sizeof(server.deferred));
 
-end:
-	clear_jobtable();
+	job.jobid = 1;
+	job.defer_time = ((now >> DEFER_WHEEL_BITS) + 2) << DEFER_WHEEL_BITS;
+	addDeferredJob(&job);
+
+	if (expireDeferredJobs(job.defer_time - 1) != NULL) {
+		printf("Job released early\n");
+		status = 1;
+	} else if (expireDeferredJobs(job.defer_time) != &job) {
+		printf("Job not released at its defer time\n");
+		status = 1;
+	}
+
+	memset(&server.deferred, 0, sizeof(server.deferred));
 	return status;
 }
 
 void test_sched(void) {
-	TEST("generateCandidatePool", test_generateCandidatePool());
+	TEST("candidateOrder", test_candidateOrder());
+	TEST("runnableCandidates", test_runnableCandidates());
+	TEST("resourceWaiters", test_resourceWaiters());
+	TEST("resourceWaitersBlockedQueue", test_resourceWaitersBlockedQueue());
+	TEST("scheduleRequests", test_scheduleRequests());
 	TEST("releaseDeferred", test_releaseDeferred());
+	TEST("deferWheelCascade", test_deferWheelCascade());
+	TEST("deferWheelBoundary", test_deferWheelBoundary());
 }
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/epoll.h>
 
 #include <jers_tests.h>
 #include <server.h>
@@ -107,7 +108,6 @@ int cmp_job(const struct job *a, const struct job *b) {
 	}
 
 	CMP_INT(state);
-	CMP_INT(pend_reason);
 	CMP_INT(fail_reason);
 
 	CMP_INT(priority);
@@ -171,6 +171,170 @@ static int test_job_state(struct job *j) {
 	return status;
 }
 
+/* Round trip a job through a snapshot segment */
+static int test_job_snapshot(struct job *j) {
+	struct snapshot s;
+	struct job *new = NULL;
+	char filename[PATH_MAX];
+
+	sprintf(filename, "%s/snapshot/test.snapshot", server.state_dir);
+
+	if (snapshotWrite(filename, 1, 1, &j, 1) != 0) {
+		DEBUG("Failed to write snapshot");
+		return 1;
+	}
+
+	if (snapshotOpen(filename, &s) != 0) {
+		DEBUG("Failed to open snapshot");
+		return 1;
+	}
+
+	if (s.count != 1 || s.seq != 1 || !s.full) {
+		DEBUG("Snapshot header does not match");
+		snapshotClose(&s);
+		return 1;
+	}
+
+	new = snapshotLoadJob(&s, 0);
+	snapshotClose(&s);
+	unlink(filename);
+
+	if (new == NULL) {
+		DEBUG("Failed to load job");
+		return 1;
+	}
+
+	int status = cmp_job(j, new);
+	freeJob(new);
+
+	return status;
+}
+
+/* A deleted job is written as a tombstone */
+static int test_deleted_snapshot(struct job *j) {
+	struct snapshot s;
+	char filename[PATH_MAX];
+	int status;
+
+	sprintf(filename, "%s/snapshot/test.snapshot", server.state_dir);
+
+	j->internal_state |= JERS_FLAG_DELETED;
+	status = snapshotWrite(filename, 2, 0, &j, 1);
+	j->internal_state &= ~JERS_FLAG_DELETED;
+
+	if (status != 0 || snapshotOpen(filename, &s) != 0)
+		return 1;
+
+	status = s.count != 1 || s.full || snapshotLoadJob(&s, 0) != NULL;
+
+	snapshotClose(&s);
+	unlink(filename);
+
+	return status;
+}
+
+/* A serialized segment holds the job as it was, even if it changes before being written */
+static int test_encoded_snapshot(struct job *j) {
+	struct snapshotSegment seg = {0};
+	struct snapshot s;
+	struct job *new = NULL;
+	char filename[PATH_MAX];
+	char *jobname = j->jobname;
+	int status;
+
+	sprintf(filename, "%s/snapshot/test.snapshot", server.state_dir);
+
+	if (snapshotEncode(&seg, 3, 0, &j, 1) != 0)
+		return 1;
+
+	j->jobname = "Changed after encoding";
+	j->obj.revision++;
+
+	status = snapshotWriteSegment(filename, &seg);
+	snapshotFreeSegment(&seg);
+
+	j->jobname = jobname;
+	j->obj.revision--;
+
+	if (status != 0 || snapshotOpen(filename, &s) != 0)
+		return 1;
+
+	new = s.count == 1 && s.seq == 3 ? snapshotLoadJob(&s, 0) : NULL;
+	snapshotClose(&s);
+	unlink(filename);
+
+	if (new == NULL)
+		return 1;
+
+	status = cmp_job(j, new);
+	freeJob(new);
+
+	return status;
+}
+
+/* A compacting save merges its delta with the segments on disk into one full segment,
+ * keeping only the latest record for each job */
+static int test_compact_snapshot(struct job *j) {
+	struct snapshotSegment seg = {0};
+	struct snapshot s;
+	struct job deleted = *j;
+	struct job added = *j;
+	struct job *delta[2] = {&deleted, &added};
+	struct job *new = NULL;
+	char filename[PATH_MAX];
+	jobid_t jobid = j->jobid;
+	int status = 0;
+
+	deleted.internal_state |= JERS_FLAG_DELETED;
+	added.jobid = jobid + 2;
+
+	/* The job is deleted in the delta, leaving the one from the previous delta and the one added */
+	sprintf(filename, "%s/snapshot/jobs.%012d", server.state_dir, 10);
+	if (snapshotWrite(filename, 10, 1, &j, 1) != 0)
+		return 1;
+
+	j->jobid = jobid + 1;
+	sprintf(filename, "%s/snapshot/jobs.%012d", server.state_dir, 11);
+	status = snapshotWrite(filename, 11, 0, &j, 1);
+	j->jobid = jobid;
+
+	if (status != 0 || snapshotEncode(&seg, 12, 0, delta, 2) != 0)
+		return 1;
+
+	seg.compact = 1;
+	status = snapshotSave(&seg);
+	snapshotFreeSegment(&seg);
+
+	sprintf(filename, "%s/snapshot/jobs.%012d", server.state_dir, 10);
+	if (status != 0 || access(filename, F_OK) == 0)
+		return 1;
+
+	sprintf(filename, "%s/snapshot/jobs.%012d", server.state_dir, 12);
+	if (snapshotOpen(filename, &s) != 0)
+		return 1;
+
+	if (s.count != 2 || !s.full || s.seq != 12)
+		status = 1;
+
+	for (int64_t i = 0; i < s.count && status == 0; i++) {
+		if ((new = snapshotLoadJob(&s, i)) == NULL)
+			return 1;
+
+		if (new->jobid != jobid + 1 && new->jobid != jobid + 2)
+			status = 1;
+
+		j->jobid = new->jobid;
+		status |= cmp_job(j, new);
+		j->jobid = jobid;
+		freeJob(new);
+	}
+
+	snapshotClose(&s);
+	unlink(filename);
+
+	return status;
+}
+
 static void test_job_states(void) {
 	struct job j = {0};
 	char *args[20];
@@ -194,6 +358,9 @@ static void test_job_states(void) {
 	j.queue = q;
 
 	TEST("State{Save/load}Job - Minimal test", test_job_state(&j) != 0);
+	TEST("Snapshot{Write/Load}Job - Minimal test", test_job_snapshot(&j) != 0);
+	TEST("Snapshot{Write/Load}Job - Deleted job", test_deleted_snapshot(&j) != 0);
+	TEST("Snapshot{Write/Load}Job - Serialized before write", test_encoded_snapshot(&j) != 0);
 
 	/* Most fields populated */
 	memset(&j, 0, sizeof(struct job));
@@ -231,6 +398,7 @@ static void test_job_states(void) {
 	j.priority = 5;
 
 	TEST("State{Save/load}Job - Deferred test", test_job_state(&j) != 0);
+	TEST("Snapshot{Write/Load}Job - Deferred test", test_job_snapshot(&j) != 0);
 
 	memset(&j, 0, sizeof(struct job));
 	j.jobid = 9999;
@@ -263,6 +431,7 @@ static void test_job_states(void) {
 	j.priority = 5;
 
 	TEST("State{Save/load}Job - Exited job", test_job_state(&j) != 0);
+	TEST("Snapshot{Write/Load}Job - Exited job", test_job_snapshot(&j) != 0);
 
 
 	/* Large int64_t fields populated */
@@ -301,6 +470,36 @@ static void test_job_states(void) {
 	j.priority = 5;
 
 	TEST("State{Save/load}Job - times > 2038 test", test_job_state(&j) != 0);
+	TEST("Snapshot{Write/Load}Job - times > 2038 test", test_job_snapshot(&j) != 0);
+
+	/* Tags, resources and usage */
+	struct resource *r = calloc(1, sizeof(struct resource));
+	r->name = "test_resource_1";
+	r->count = 10;
+	HASH_ADD_STR(server.resTable, name, r);
+
+	key_val_t tags[2] = {{"tag1", "value1"}, {"tag2", ""}};
+	struct jobResource res[1];
+
+	memset(res, 0, sizeof(res));
+	res[0].needed = 2;
+	res[0].res = r;
+
+	j.tag_count = 2;
+	j.tags = tags;
+	j.res_count = 1;
+	j.req_resources = res;
+	j.state = JERS_JOB_COMPLETED;
+	j.finish_time = time(NULL);
+	j.usage.ru_utime.tv_sec = 12;
+	j.usage.ru_maxrss = 123456;
+
+	TEST("Snapshot{Write/Load}Job - Tags and resources", test_job_snapshot(&j) != 0);
+	TEST("Snapshot compaction - Merged with the segments on disk", test_compact_snapshot(&j) != 0);
+
+	HASH_DEL(server.resTable, r);
+	free(r);
+	server.resTable = NULL;
 
 
 
@@ -414,6 +613,281 @@ void test_resource_states(void) {
 	TEST("state{Save/Load}Resource", test_resource_state(&r));
 }
 
+/* Write journal records via the journal writer thread, checking
+ * they are all written out in order once the journal is flushed */
+static int test_journal_writer(int count) {
+	char filename[PATH_MAX];
+	char *line = NULL;
+	size_t line_size = 0;
+	int found = 0;
+	int status = 0;
+
+	if (journalWriterStart() != 0)
+		return 1;
+
+	for (int i = 0; i < count; i++) {
+		char msg[64];
+		sprintf(msg, "{\"RECORD\":%d}", i);
+		stateSaveCmd(0, "TEST_RECORD", msg, i, i);
+	}
+
+	flush_journal(1);
+
+	if (journalSynced() != journalQueued())
+		status = 1;
+
+	journalWriterStop();
+
+	sprintf(filename, "%s/journal.%s", server.state_dir, server.journal.datetime);
+	FILE *f = fopen(filename, "r");
+
+	if (f == NULL)
+		return 1;
+
+	while (getline(&line, &line_size, f) > 0 && line[0] == ' ') {
+		char expected[64];
+		sprintf(expected, "\tTEST_RECORD\t%d\t%d\t{\"RECORD\":%d}\n", found, found, found);
+
+		if (strstr(line, expected) == NULL) {
+			printf("Record %d out of order: %s", found, line);
+			status = 1;
+			break;
+		}
+
+		found++;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (found != count) {
+		printf("Found %d records, expected %d\n", found, count);
+		status = 1;
+	}
+
+	return status;
+}
+
+/* Encode a binary journal record, check it decodes back to the same fields,
+ * then that a torn copy of it is detected */
+static int test_journal_record(void) {
+	struct journalRecordInfo r;
+	size_t len;
+	const char *msg = "{\"JOB_MOD\":{\"VERSION\":1}}";
+	char *record = journalEncodeRecord(JOURNAL_RECORD_CMD, 1234567890123, 1001, "JOB_MOD", 42, 7, msg, &len);
+	int status = 0;
+
+	if (len % 8 != 0 || journalDecodeRecord(record, len, &r) != 1)
+		status = 1;
+	else if (r.type != JOURNAL_RECORD_CMD || r.time != 1234567890 || r.time_ms != 123 || r.uid != 1001 ||
+			r.jobid != 42 || r.revision != 7 || r.size != len ||
+			r.cmd_len != 7 || strncmp(r.cmd, "JOB_MOD", 7) != 0 ||
+			r.msg_len != strlen(msg) || strncmp(r.msg, msg, r.msg_len) != 0)
+		status = 1;
+
+	/* Only part of the record is available */
+	if (journalDecodeRecord(record, len / 2, &r) != -1)
+		status = 1;
+
+	/* The end of the message was never written */
+	memset(record + len - 8, 0, 8);
+	if (journalDecodeRecord(record, len, &r) != -1)
+		status = 1;
+
+	/* Zero filled space at the end of the journal */
+	memset(record, 0, len);
+	if (journalDecodeRecord(record, len, &r) != 0)
+		status = 1;
+
+	free(record);
+	return status;
+}
+
+/* Binary journal version of the above, reading the records back by their length */
+static int test_binary_journal_writer(int count) {
+	char filename[PATH_MAX];
+	char *record = NULL;
+	size_t record_size = 0;
+	struct journalRecordInfo r;
+	int found = 0;
+	int status = 0;
+
+	/* Start a new journal */
+	sprintf(filename, "%s/journal.%s", server.state_dir, server.journal.datetime);
+	unlink(filename);
+	server.journal.size = server.journal.len = server.journal.limit = 0;
+
+	if (journalWriterStart() != 0)
+		return 1;
+
+	for (int i = 0; i < count; i++) {
+		char msg[64];
+		sprintf(msg, "{\"RECORD\":%d}", i);
+		stateSaveCmd(0, "TEST_RECORD", msg, i, i);
+	}
+
+	flush_journal(1);
+	journalWriterStop();
+
+	if (!server.journal.binary)
+		return 1;
+
+	FILE *f = fopen(filename, "r");
+
+	if (f == NULL)
+		return 1;
+
+	fseek(f, journalReadHeader(fileno(f), NULL), SEEK_SET);
+
+	while (journalReadRecord(f, &record, &record_size, &r) > 0) {
+		char expected[64];
+		int expected_len = sprintf(expected, "{\"RECORD\":%d}", found);
+
+		if (r.jobid != (jobid_t)found || r.revision != found || (int)r.msg_len != expected_len || strncmp(r.msg, expected, r.msg_len) != 0) {
+			printf("Record %d out of order: %.*s\n", found, (int)r.msg_len, r.msg);
+			status = 1;
+			break;
+		}
+
+		found++;
+	}
+
+	free(record);
+	fclose(f);
+
+	if (found != count) {
+		printf("Found %d records, expected %d\n", found, count);
+		status = 1;
+	}
+
+	return status;
+}
+
+/* Fill the journal past journal_max_size a few times, checking each
+ * part is created and that reopening carries on from the last part */
+static int test_journal_rollover(int count) {
+	char filename[PATH_MAX];
+	char date[9];
+	struct stat buf;
+	int parts;
+
+	server.journal.max_size = 4096;
+
+	for (int i = 0; i < count; i++) {
+		char msg[64];
+		sprintf(msg, "{\"RECORD\":%d}", i);
+		stateSaveCmd(0, "TEST_RECORD", msg, i, i);
+	}
+
+	flush_journal(1);
+
+	parts = server.journal.part;
+	snprintf(date, sizeof(date), "%.8s", server.journal.datetime);
+
+	if (parts < 2)
+		return 1;
+
+	for (int i = 1; i <= parts; i++) {
+		sprintf(filename, "%s/journal.%s.%03d", server.state_dir, date, i);
+
+		if (stat(filename, &buf) != 0) {
+			printf("Missing journal %s\n", filename);
+			return 1;
+		}
+	}
+
+	journalClose(server.journal.fd);
+	server.journal.fd = -1;
+
+	stateSaveCmd(0, "TEST_RECORD", NULL, 0, 0);
+	server.journal.max_size = 0;
+
+	return server.journal.part != parts;
+}
+
+/* Journals are replayed in name order, which has to account for the part number */
+static int test_journal_order(void) {
+	const char *ordered[] = {
+		"/state/journal.20181231.002",
+		"/state/journal.20190101",
+		"/state/journal.20190101.001",
+		"/state/journal.20190101.999",
+		"/state/journal.20190101.1000",
+		"/state/journal.20190101.1001",
+		"/state/journal.20190102"
+	};
+	int count = sizeof(ordered) / sizeof(ordered[0]);
+
+	for (int i = 0; i < count; i++) {
+		for (int k = 0; k < count; k++) {
+			int rc = cmpJournalName(ordered[i], ordered[k]);
+
+			if ((i < k && rc >= 0) || (i == k && rc != 0) || (i > k && rc <= 0)) {
+				printf("%s and %s compared out of order\n", ordered[i], ordered[k]);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* A journal write that fails shouldn't be reported as synced, and
+ * should switch us into readonly mode */
+static int test_journal_write_error(void) {
+	char filename[PATH_MAX];
+	int status = 0;
+
+	sprintf(filename, "%s/journal.readonly", server.state_dir);
+	close(open(filename, O_CREAT | O_WRONLY, 0600));
+
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0 || journalWriterStart() != 0)
+		return 1;
+
+	int64_t synced = journalSynced();
+	journalWrite(fd, 0, strdup("{}\n"), 3);
+	journalSync(fd);
+	journalWait(1);
+
+	if (journalSynced() != synced || server.readonly != READONLY_JOURNAL)
+		status = 1;
+
+	journalWriterStop();
+	close(fd);
+	server.readonly = 0;
+
+	return status;
+}
+
+static void test_journal_states(void) {
+	TEST("crc32c - Check value", crc32c(0, "123456789", 9) != 0xE3069283);
+	TEST("crc32c - Incremental", crc32c(crc32c(0, "1234", 4), "56789", 5) != 0xE3069283);
+	TEST("Journal record - Encode/decode", test_journal_record());
+
+	server.event_fd = epoll_create1(0);
+	server.journal.fd = -1;
+	server.journal.extend_block_size = JOURNAL_EXTEND_DEFAULT;
+	server.flush.defer = FLUSH_GROUP;
+	server.flush.group_bytes = DEFAULT_CONFIG_FLUSHGROUPBYTES;
+
+	TEST("Journal writer - Records written in order", test_journal_writer(20000));
+
+	close(server.journal.fd);
+	server.journal.fd = -1;
+	server.journal.new_binary = 1;
+
+	TEST("Journal writer - Binary records written in order", test_binary_journal_writer(20000));
+	TEST("Journal rollover - Rolled over by size", test_journal_rollover(500));
+	TEST("Journal rollover - Parts ordered numerically", test_journal_order());
+	TEST("Journal writer - Failed write isn't synced", test_journal_write_error());
+
+	close(server.journal.fd);
+	close(server.event_fd);
+	server.journal.fd = -1;
+}
+
 /* Test the saving and loading of state files */
 
 void test_state(void) {
@@ -433,4 +907,5 @@ void test_state(void) {
 	test_job_states();
 	test_queue_states();
 	test_resource_states();
+	test_journal_states();
 }